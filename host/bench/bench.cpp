@@ -0,0 +1,833 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "aligner.h"
+#include "audio.h"
+#include "budget.h"
+#include "descriptions.h"
+#include "dsp.h"
+#include "dlna.h"
+#include "i2s_interface.h"
+#include "json.h"
+#include "rate_detector.h"
+#include "snapcast.h"
+#include "trace.h"
+#include "upnp.h"
+#include "upnp_control.h"
+#include "upnp_renderer.h"
+#include "wav.h"
+
+// Microbenchmarks of the per-block audio path and the protocol builders and
+// parsers. Inputs are fixed so runs are comparable, and every benchmark
+// reports heap allocations per iteration alongside its time
+
+static std::atomic<uint64_t> allocation_count(0);
+
+void* operator new(size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t size) noexcept
+{
+  free(p);
+}
+
+// Reports allocations per iteration when the benchmark finishes
+class AllocationCounter
+{
+  public:
+    AllocationCounter(benchmark::State& state) : state(state), start(allocation_count.load()) {}
+
+    ~AllocationCounter()
+    {
+      state.counters["allocs"] = benchmark::Counter(allocation_count.load() - start, benchmark::Counter::kAvgIterations);
+    }
+
+  private:
+    benchmark::State& state;
+    const uint64_t start;
+};
+
+/**
+  @brief  Read the cycle counter, the TSC on x86. 0 elsewhere
+
+  @param  none
+  @retval uint64_t
+*/
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Blocks of every format the pipeline is built for
+template <typename F>
+using Block = Audio::Block<F, I2S::BUFFER_SAMPLE_COUNT>;
+
+/**
+  @brief  Build a block of a full scale sweep so it is never silent
+
+  @param  none
+  @retval B
+*/
+template <typename B = I2S::block_t>
+static B make_block()
+{
+  B block = {};
+  block.frames = B::max_frames;
+  block.bits_per_sample = B::format_t::bits_per_sample;
+  for (size_t i = 0; i < block.samples.size(); i++)
+    block.samples[i] = Audio::rescale<typename B::sample_t>((int16_t) (i * 97));
+
+  block.samples.front() = 1;
+  block.samples.back() = 1;
+  return block;
+}
+
+static void BM_BlockCopy(benchmark::State& state)
+{
+  const I2S::block_t source = make_block();
+  I2S::block_t destination;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    destination = source;
+    benchmark::DoNotOptimize(destination);
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * sizeof(source.samples));
+}
+BENCHMARK(BM_BlockCopy);
+
+// Copy a block into each client queue and drain it as the stream handler
+// does, mirroring HTTP::queue_samples
+static void BM_BlockFanOut(benchmark::State& state)
+{
+  const size_t clients = state.range(0);
+  const I2S::block_t block = make_block();
+
+  std::vector<QueueHandle_t> queues;
+  for (size_t i = 0; i < clients; i++)
+    queues.push_back(xQueueCreate(8, I2S::block_t::size(block.frames)));
+
+  I2S::block_t received;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    for (QueueHandle_t queue : queues)
+      xQueueSendToBack(queue, &block, 0);
+
+    for (QueueHandle_t queue : queues)
+      xQueueReceive(queue, &received, 0);
+
+    benchmark::DoNotOptimize(received);
+  }
+
+  state.SetBytesProcessed(state.iterations() * clients * sizeof(block.samples));
+
+  for (QueueHandle_t queue : queues)
+    vQueueDelete(queue);
+}
+BENCHMARK(BM_BlockFanOut)->Arg(1)->Arg(4)->Arg(8);
+
+// Encode a 32 bit block to packed 24 bit for each client queue, either once
+// per client or once shared by every client as HTTP::queue_samples does
+static void BM_EncodedFanOut(benchmark::State& state)
+{
+  typedef Block<Audio::S32Stereo> block32_t;
+
+  const size_t clients = state.range(0);
+  const bool shared = state.range(1);
+  const block32_t block = make_block<block32_t>();
+  const size_t count = block.frames * Audio::S32Stereo::channels;
+
+  struct Encoded
+  {
+    uint32_t length;
+    alignas(4) uint8_t data[block32_t::max_frames * Audio::S32Stereo::channels * 3];
+  };
+
+  std::vector<QueueHandle_t> queues;
+  for (size_t i = 0; i < clients; i++)
+    queues.push_back(xQueueCreate(8, sizeof(Encoded)));
+
+  Encoded encoded;
+  Encoded received;
+  encoded.length = count * 3;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    if (shared)
+      Audio::pack24<Audio::S32Stereo, false>(block.samples.data(), encoded.data, count);
+
+    for (QueueHandle_t queue : queues)
+    {
+      if (!shared)
+        Audio::pack24<Audio::S32Stereo, false>(block.samples.data(), encoded.data, count);
+
+      xQueueSendToBack(queue, &encoded, 0);
+    }
+
+    for (QueueHandle_t queue : queues)
+      xQueueReceive(queue, &received, 0);
+
+    benchmark::DoNotOptimize(received);
+  }
+
+  state.SetBytesProcessed(state.iterations() * clients * encoded.length);
+
+  for (QueueHandle_t queue : queues)
+    vQueueDelete(queue);
+}
+BENCHMARK(BM_EncodedFanOut)->ArgNames({"clients", "shared"})->ArgsProduct({{1, 4, 8}, {0, 1}});
+
+template <typename F>
+static void BM_ActivityDetection(benchmark::State& state)
+{
+  const Block<F> active = make_block<Block<F>>();
+  Block<F> silence = {};
+  silence.frames = Block<F>::max_frames;
+  silence.bits_per_sample = F::bits_per_sample;
+  const Block<F>* block = state.range(0) ? &active : &silence;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(block);
+    bool silent = Audio::is_silent(*block);
+    benchmark::DoNotOptimize(silent);
+  }
+
+  state.SetBytesProcessed(state.iterations() * sizeof(block->samples));
+}
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S16Mono)->ArgName("active")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S16Stereo)->ArgName("active")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S24Mono)->ArgName("active")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S24Stereo)->ArgName("active")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S32Mono)->ArgName("active")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ActivityDetection, Audio::S32Stereo)->ArgName("active")->Arg(0)->Arg(1);
+
+// Gap concealment over a whole block
+template <typename F>
+static void BM_Crossfade(benchmark::State& state)
+{
+  Block<F> block = make_block<Block<F>>();
+  const typename F::sample_t held[F::channels] = {};
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Audio::crossfade<F>(held, block.samples.data(), block.frames);
+    benchmark::DoNotOptimize(block);
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * block.bytes());
+}
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S16Mono);
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S16Stereo);
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S24Mono);
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S24Stereo);
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S32Mono);
+BENCHMARK_TEMPLATE(BM_Crossfade, Audio::S32Stereo);
+
+template <typename From, typename To>
+static void BM_Convert(benchmark::State& state)
+{
+  const Block<From> source = make_block<Block<From>>();
+  Block<To> destination;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Audio::convert<From, To>(source.samples.data(), destination.samples.data(), source.frames);
+    benchmark::DoNotOptimize(destination);
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * source.bytes());
+}
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S16Mono, Audio::S32Mono);
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S16Stereo, Audio::S32Stereo);
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S24Mono, Audio::S16Mono);
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S24Stereo, Audio::S16Stereo);
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S32Mono, Audio::S24Mono);
+BENCHMARK_TEMPLATE(BM_Convert, Audio::S32Stereo, Audio::S24Stereo);
+
+// Repack left justified samples into packed 24 bit little (WAV) or big
+// (L24) endian words
+template <typename F, bool BigEndian>
+static void BM_Pack24(benchmark::State& state)
+{
+  const Block<F> source = make_block<Block<F>>();
+  std::vector<uint8_t> destination(source.frames * F::channels * 3);
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Audio::pack24<F, BigEndian>(source.samples.data(), destination.data(), source.frames * F::channels);
+    benchmark::DoNotOptimize(destination.data());
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * source.bytes());
+}
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S16Stereo, false);
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S16Stereo, true);
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S24Stereo, false);
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S24Stereo, true);
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S32Stereo, false);
+BENCHMARK_TEMPLATE(BM_Pack24, Audio::S32Stereo, true);
+
+// Derive one mono channel from a stereo block, by averaging both channels
+// (arg 0) or keeping the left one (arg 1)
+template <typename F>
+static void BM_Mix(benchmark::State& state)
+{
+  typedef Audio::MonoOf<F> mono_t;
+
+  const Block<F> source = make_block<Block<F>>();
+  Block<mono_t> destination;
+  const Audio::Mix mix = state.range(0) ? Audio::Mix::Left : Audio::Mix::Downmix;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Audio::mix<F>(source.samples.data(), destination.samples.data(), source.frames, mix);
+    benchmark::DoNotOptimize(destination.samples.data());
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * source.bytes());
+}
+BENCHMARK_TEMPLATE(BM_Mix, Audio::S16Stereo)->ArgName("select")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_Mix, Audio::S24Stereo)->ArgName("select")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_Mix, Audio::S32Stereo)->ArgName("select")->Arg(0)->Arg(1);
+
+// Sum the blocks of two inputs with saturation, at unity (arg 0) or with
+// the second ramping down as when ducked (arg 1)
+template <typename F>
+static void BM_SumInputs(benchmark::State& state)
+{
+  const Block<F> first = make_block<Block<F>>();
+  const Block<F> second = make_block<Block<F>>();
+  Block<F> destination;
+  const bool ramped = state.range(0);
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    if (ramped)
+      Audio::sum_ramped<F>(first.samples.data(), second.samples.data(), destination.samples.data(), first.frames, Audio::GAIN_UNITY, Audio::GAIN_UNITY / 10);
+    else
+      Audio::sum<F>(first.samples.data(), second.samples.data(), destination.samples.data(), first.frames);
+
+    benchmark::DoNotOptimize(destination.samples.data());
+    benchmark::ClobberMemory();
+  }
+
+  state.SetBytesProcessed(state.iterations() * 2 * first.bytes());
+}
+BENCHMARK_TEMPLATE(BM_SumInputs, Audio::S16Stereo)->ArgName("ramped")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_SumInputs, Audio::S32Stereo)->ArgName("ramped")->Arg(0)->Arg(1);
+
+// Run a full block of Q4.27 samples through a number of EQ sections.
+// Reports TSC cycles per block per section
+static void BM_Biquad(benchmark::State& state)
+{
+  const size_t sections = state.range(0);
+  const I2S::block_t block = make_block();
+
+  std::vector<int32_t> samples(block.samples.size());
+  DSP::to_fixed<I2S::format32_t>(block.samples.data(), samples.data(), samples.size());
+
+  std::vector<DSP::Coefficients> coefficients;
+  for (size_t i = 0; i < sections; i++)
+    coefficients.push_back(DSP::design({DSP::FilterType::Peaking, 100.0f * (i + 1), 3, 1}, 48000));
+
+  std::vector<std::array<DSP::BiquadState, I2S::CHANNELS>> states(sections);
+  DSP::BiquadState (*state_arrays)[I2S::CHANNELS] = reinterpret_cast<DSP::BiquadState (*)[I2S::CHANNELS]>(states.data());
+
+  uint64_t elapsed = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    const uint64_t start = cycles();
+    for (size_t i = 0; i < sections; i++)
+      DSP::biquad<I2S::CHANNELS>(coefficients[i], state_arrays[i], samples.data(), block.frames);
+    elapsed += cycles() - start;
+
+    benchmark::DoNotOptimize(samples.data());
+    benchmark::ClobberMemory();
+  }
+
+  if (elapsed != 0)
+    state.counters["cycles_per_section"] = benchmark::Counter((double) elapsed / sections, benchmark::Counter::kAvgIterations);
+
+  state.SetBytesProcessed(state.iterations() * block.bytes());
+}
+BENCHMARK(BM_Biquad)->ArgName("sections")->Arg(1)->Arg(4)->Arg(8);
+
+// Process a captured block through the whole DSP chain, converting to and
+// from Q4.27, with 4 EQ sections and gain. The limiter is disabled (arg 0)
+// or limiting every block (arg 1)
+template <typename F>
+static void BM_DspChain(benchmark::State& state)
+{
+  const Block<F> source = make_block<Block<F>>();
+  Block<F> block = source;
+
+  DSP::Settings settings;
+  settings.enabled = true;
+  settings.gain_db = 6;
+  settings.section_count = 4;
+  settings.sections[0] = {DSP::FilterType::HighPass, 40, 0, 0.707f};
+  settings.sections[1] = {DSP::FilterType::LowShelf, 120, 3, 0.707f};
+  settings.sections[2] = {DSP::FilterType::Peaking, 2500, -4, 2};
+  settings.sections[3] = {DSP::FilterType::HighShelf, 8000, 2, 0.707f};
+  settings.limiter = {state.range(0) != 0, -6, 2, 50};
+
+  static DSP::Chain chain;
+  chain.configure(settings, 48000);
+
+  uint64_t elapsed = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    block.samples = source.samples;
+
+    const uint64_t start = cycles();
+    chain.process<F>(block.samples.data(), block.frames);
+    elapsed += cycles() - start;
+
+    benchmark::DoNotOptimize(block.samples.data());
+    benchmark::ClobberMemory();
+  }
+
+  if (elapsed != 0)
+    state.counters["cycles_per_block"] = benchmark::Counter(elapsed, benchmark::Counter::kAvgIterations);
+
+  state.SetBytesProcessed(state.iterations() * source.bytes());
+}
+BENCHMARK_TEMPLATE(BM_DspChain, Audio::S16Stereo)->ArgName("limiter")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_DspChain, Audio::S24Stereo)->ArgName("limiter")->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_DspChain, Audio::S32Stereo)->ArgName("limiter")->Arg(0)->Arg(1);
+
+// Check a whole block for equal channels. Mono blocks are the worst case
+template <typename F>
+static void BM_MonoDetection(benchmark::State& state)
+{
+  Block<F> block = make_block<Block<F>>();
+  for (uint32_t i = 0; i < block.frames; i++)
+    block.samples[2 * i + 1] = block.samples[2 * i];
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(block);
+    benchmark::DoNotOptimize(Audio::is_mono<F>(block.samples.data(), block.frames));
+  }
+
+  state.SetBytesProcessed(state.iterations() * block.bytes());
+}
+BENCHMARK_TEMPLATE(BM_MonoDetection, Audio::S16Stereo);
+BENCHMARK_TEMPLATE(BM_MonoDetection, Audio::S32Stereo);
+
+template <typename F>
+static void BM_WavHeader(benchmark::State& state)
+{
+  uint32_t sample_rate = 48000;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    benchmark::DoNotOptimize(sample_rate);
+    WAV::Header<F> header(sample_rate);
+    benchmark::DoNotOptimize(header);
+  }
+}
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S16Mono);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S16Stereo);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S24Mono);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S24Stereo);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S32Mono);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::S32Stereo);
+BENCHMARK_TEMPLATE(BM_WavHeader, Audio::P24Stereo);
+
+// Replay a synthetic DMA timing trace through the rate detector. Buffers
+// of block frames complete at the source rate and are counted by reads
+// every interval plus up to 2 ms of scheduling jitter, or as each buffer
+// completes when the interval is 0. Reports how long detection took
+static void BM_RateDetection(benchmark::State& state)
+{
+  const uint32_t rate = state.range(0);
+  const uint32_t block_frames = state.range(1);
+  const int64_t interval_us = state.range(2);
+
+  struct Update
+  {
+    int64_t timestamp;
+    uint32_t frames;
+  };
+
+  // 3 s of updates from a fixed seed
+  std::vector<Update> trace;
+  srand(1);
+
+  int64_t counted = 0;
+  for (int64_t timestamp = 0; timestamp < 3000000; )
+  {
+    const int64_t jitter = rand() % 2000;
+    timestamp = (interval_us > 0) ? timestamp + interval_us + jitter : (counted + 1) * block_frames * 1000000ll / rate + jitter;
+
+    const int64_t completed = timestamp * rate / 1000000 / block_frames;
+    trace.push_back({timestamp, (uint32_t) ((completed - counted) * block_frames)});
+    counted = completed;
+  }
+
+  int64_t detected_at = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    I2S::RateDetector detector;
+    detected_at = 0;
+
+    for (const Update& update : trace)
+    {
+      if (detector.update(update.timestamp, update.frames))
+      {
+        detected_at = update.timestamp;
+        break;
+      }
+    }
+
+    benchmark::DoNotOptimize(detector);
+  }
+
+  I2S::RateDetector detector;
+  for (const Update& update : trace)
+    detector.update(update.timestamp, update.frames);
+
+  if (detector.rate() != rate)
+    state.SkipWithError("Wrong rate detected.");
+
+  state.counters["detect_ms"] = detected_at / 1000;
+  state.counters["updates"] = trace.size();
+}
+BENCHMARK(BM_RateDetection)->ArgNames({"rate", "block", "interval_us"})
+  ->Args({44100, 480, 0})->Args({48000, 480, 0})->Args({48000, 120, 0})->Args({96000, 480, 0})
+  ->Args({44100, 480, 250000})->Args({48000, 120, 250000})->Args({32000, 480, 250000});
+
+// Replay two inputs through the aligner. Buffers of 480 frames of a frame
+// counter complete on the first input's clock, and on the second's offset
+// by a phase in frames and running fast or slow by some ppm. Blocks of the
+// first are read just after completing. Reports how far behind the first
+// the second's frames came out, and the frames slipped to keep it there
+static void BM_Alignment(benchmark::State& state)
+{
+  const uint32_t frames = 480;
+  const double phase = state.range(0);
+  const double period = 1 + state.range(1) * 1e-6; // Of the second's frames
+  const bool shared = state.range(2);
+
+  std::vector<uint32_t> buffer(frames);
+  std::vector<uint32_t> output(frames);
+
+  int64_t min_lag = INT64_MAX;
+  int64_t max_lag = INT64_MIN;
+  I2S::Aligner aligner;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    aligner.reset(sizeof(uint32_t), shared ? 0 : frames);
+    min_lag = INT64_MAX;
+    max_lag = INT64_MIN;
+
+    // 60 s of blocks
+    uint32_t completed = 0;
+    for (uint32_t block = 0; block < 6000; block++)
+    {
+      const double now = (block + 1.0) * frames + 1;
+      for (; phase + (completed + 1.0) * frames * period <= now; completed++)
+      {
+        for (uint32_t i = 0; i < frames; i++)
+          buffer[i] = completed * frames + i;
+
+        aligner.push(buffer.data(), frames);
+      }
+
+      aligner.pull(output.data(), frames);
+
+      // Lag of the capture time of each end of the block once settled
+      if (block < 100)
+        continue;
+
+      for (uint32_t i : {0u, frames - 1})
+      {
+        const int64_t lag = llround(block * frames + i - (phase + output[i] * period));
+        min_lag = std::min(min_lag, lag);
+        max_lag = std::max(max_lag, lag);
+      }
+    }
+
+    benchmark::DoNotOptimize(output.data());
+  }
+
+  if (shared && state.range(1) == 0 && (min_lag != 0 || max_lag != 0))
+    state.SkipWithError("Shared clocks misaligned.");
+
+  const I2S::Aligner::Stats& stats = aligner.stats();
+  state.counters["min_lag"] = min_lag;
+  state.counters["max_lag"] = max_lag;
+  state.counters["slips"] = benchmark::Counter(stats.dropped + stats.repeated, benchmark::Counter::kAvgIterations);
+  state.counters["resyncs"] = benchmark::Counter(stats.resyncs, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_Alignment)->ArgNames({"phase", "ppm", "shared"})
+  ->Args({0, 0, 1})->Args({0, 0, 0})->Args({240, 0, 0})
+  ->Args({240, 100, 0})->Args({240, -100, 0})->Args({0, 500, 0})->Args({0, -500, 0});
+
+// Replay capture timestamps of 480 frame blocks through the Snapcast
+// timeline. The I2S clock runs fast or slow of the system clock by some
+// ppm, and each block is stamped up to a jitter late with a five times
+// later stall every 500 blocks. Reports the largest deviation between
+// consecutive chunk starts and a block's duration, which clients would
+// see as the chunks not following on
+static void BM_SnapcastTimeline(benchmark::State& state)
+{
+  const uint32_t frames = 480;
+  const int64_t jitter_us = state.range(0);
+  const double period_us = frames * 1e6 / 48000 * (1 + state.range(1) * 1e-6);
+
+  // 60 s of timestamps from a fixed seed
+  std::vector<int64_t> timestamps;
+  srand(1);
+  for (uint32_t block = 0; block < 6000; block++)
+  {
+    const int64_t late = (jitter_us > 0) ? rand() % jitter_us + ((block % 500 == 0) ? 5 * jitter_us : 0) : 0;
+    timestamps.push_back(llround((block + 1) * period_us) + late);
+  }
+
+  int64_t max_step = 0;
+  uint32_t resyncs = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Snapcast::Timeline timeline;
+    int64_t previous = 0;
+    max_step = 0;
+
+    for (uint32_t block = 0; block < timestamps.size(); block++)
+    {
+      const int64_t start = timeline.update(timestamps[block], frames, 0, 48000);
+
+      // Once settled
+      if (block > 500)
+        max_step = std::max<int64_t>(max_step, std::abs(start - previous - 10000));
+
+      previous = start;
+    }
+
+    resyncs = timeline.resyncs();
+    benchmark::DoNotOptimize(previous);
+  }
+
+  if (resyncs != 1)
+    state.SkipWithError("Timeline restarted.");
+
+  state.counters["max_step_us"] = max_step;
+}
+BENCHMARK(BM_SnapcastTimeline)->ArgNames({"jitter_us", "ppm"})
+  ->Args({0, 0})->Args({2000, 0})->Args({2000, 100})->Args({2000, -100})->Args({3000, 500});
+
+// Replays two minutes of 1536 kbit/s stream clients asking to join once a
+// second over a link that carries at most link_kbps. The link delivers
+// what it can, shared evenly, and every client drops blocks beyond it.
+// Overcommitting closes the client just admitted, as the HTTP task does
+// while it's on probation.
+// Reports the clients admitted at the end and the windows in which
+// admitted clients dropped blocks
+static void BM_StreamBudget(benchmark::State& state)
+{
+  const uint32_t limit = state.range(0) * 1000;
+  const uint32_t link = state.range(1) * 1000;
+  const uint32_t bitrate = 1536000;
+
+  uint32_t admitted = 0;
+  uint32_t overloaded = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    HTTP::Budget budget(limit, 32);
+    std::vector<HTTP::Budget::Traffic> traffic;
+    traffic.reserve(32);
+    overloaded = 0;
+
+    budget.update(0, traffic);
+    for (int64_t second = 1; second <= 120; second++)
+    {
+      budget.admit(bitrate);
+
+      const uint32_t delivered = std::min(budget.committed(), link);
+      const bool dropped = delivered < budget.committed();
+      if (dropped)
+        overloaded++;
+
+      traffic.assign(budget.clients(), {delivered / 8 / std::max(budget.clients(), 1u), dropped ? 1u : 0u, bitrate, false});
+
+      budget.update(second * HTTP::Budget::WINDOW_US, traffic);
+      if (budget.overcommitted())
+        budget.release(bitrate);
+    }
+
+    admitted = budget.clients();
+    benchmark::DoNotOptimize(traffic.data());
+  }
+
+  state.counters["admitted"] = admitted;
+  state.counters["overloaded_windows"] = overloaded;
+}
+BENCHMARK(BM_StreamBudget)->ArgNames({"limit_kbps", "link_kbps"})
+  ->Args({12000, 20000})->Args({12000, 8000})->Args({12000, 3000});
+
+// Cost of a trace scope around a block of work, with tracing off and on.
+// On, each scope records a begin and end event into the core's ring
+static void BM_TraceScope(benchmark::State& state)
+{
+  const bool enabled = state.range(0);
+  if (enabled && !Trace::enable(true))
+  {
+    state.SkipWithError("Failed to allocate trace rings.");
+    return;
+  }
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    Trace::Scope scope("bench");
+    benchmark::ClobberMemory();
+  }
+
+  Trace::enable(false);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TraceScope)->ArgName("enabled")->Arg(0)->Arg(1);
+
+static void BM_SetUriActionBody(benchmark::State& state)
+{
+  const std::string uri = "http://192.168.1.10/stream.wav";
+  const std::string metadata = DLNA::didl_lite("I2S UPnP Bridge", uri, DLNA::protocol_info("audio/wav"));
+  const UPNP::SetAvTransportUriAction action(uri, metadata);
+
+  size_t bytes = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    std::string body = action.body();
+    bytes += body.length();
+    benchmark::DoNotOptimize(body);
+  }
+
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_SetUriActionBody);
+
+static void BM_PlayActionBody(benchmark::State& state)
+{
+  const UPNP::PlayAction action;
+
+  size_t bytes = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    std::string body = action.body();
+    bytes += body.length();
+    benchmark::DoNotOptimize(body);
+  }
+
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_PlayActionBody);
+
+static void BM_ParseDescription(benchmark::State& state, const char* description)
+{
+  const std::string desc(description);
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    UPNP::Renderer renderer = SSDP::parse_description("192.168.1.42:1400", desc);
+    benchmark::DoNotOptimize(renderer.control_url);
+  }
+
+  state.SetBytesProcessed(state.iterations() * desc.length());
+}
+BENCHMARK_CAPTURE(BM_ParseDescription, simple, Descriptions::SIMPLE);
+BENCHMARK_CAPTURE(BM_ParseDescription, embedded, Descriptions::EMBEDDED);
+
+static void BM_GetRenderers(benchmark::State& state)
+{
+  UpnpControl::renderer_map_t renderers;
+  for (int64_t i = 0; i < state.range(0); i++)
+  {
+    std::string uuid = "RINCON_000E58A1B2C3" + std::to_string(1400 + i);
+    UPNP::Renderer renderer(uuid, "Speaker " + std::to_string(i), "http://192.168.1." + std::to_string(i % 250) + ":1400/MediaRenderer/AVTransport/Control");
+    renderer.icon_url = "http://192.168.1." + std::to_string(i % 250) + ":1400/img/icon-S18.png";
+    renderer.selected = (i % 2) == 0;
+    renderers.emplace(uuid, renderer);
+  }
+
+  size_t bytes = 0;
+
+  AllocationCounter allocations(state);
+  for (auto _ : state)
+  {
+    std::string json = JSON::get_renderers(renderers);
+    bytes += json.length();
+    benchmark::DoNotOptimize(json);
+  }
+
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_GetRenderers)->Arg(1)->Arg(16)->Arg(128);
+
+BENCHMARK_MAIN();
\ No newline at end of file
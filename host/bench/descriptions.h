@@ -0,0 +1,271 @@
+#ifndef __DESCRIPTIONS_H__
+#define __DESCRIPTIONS_H__
+
+// Device descriptions in the shape of those served by common renderers.
+// Identifiers are made up
+
+namespace Descriptions
+{
+  // Open source renderer with a flat device and three services
+  constexpr const char* SIMPLE = R"(<?xml version="1.0" encoding="utf-8"?>
+<root xmlns="urn:schemas-upnp-org:device-1-0">
+  <specVersion>
+    <major>1</major>
+    <minor>0</minor>
+  </specVersion>
+  <device>
+    <deviceType>urn:schemas-upnp-org:device:MediaRenderer:1</deviceType>
+    <friendlyName>Living Room</friendlyName>
+    <manufacturer>gmrender-resurrect</manufacturer>
+    <manufacturerURL>http://github.com/hzeller/gmrender-resurrect</manufacturerURL>
+    <modelDescription>GStreamer Media Renderer</modelDescription>
+    <modelName>gmediarender</modelName>
+    <modelNumber>0.0.9</modelNumber>
+    <modelURL>http://github.com/hzeller/gmrender-resurrect</modelURL>
+    <UDN>uuid:2a2b9d6c-5e1f-4d3a-8f2b-1c9e0d7a4b61</UDN>
+    <iconList>
+      <icon>
+        <mimetype>image/png</mimetype>
+        <width>64</width>
+        <height>64</height>
+        <depth>24</depth>
+        <url>/upnp/grender-64x64.png</url>
+      </icon>
+      <icon>
+        <mimetype>image/png</mimetype>
+        <width>128</width>
+        <height>128</height>
+        <depth>24</depth>
+        <url>/upnp/grender-128x128.png</url>
+      </icon>
+    </iconList>
+    <serviceList>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:ConnectionManager:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:ConnectionManager</serviceId>
+        <SCPDURL>/upnp/renderconnmgrSCPD.xml</SCPDURL>
+        <controlURL>/upnp/control/renderconnmgr1</controlURL>
+        <eventSubURL>/upnp/event/renderconnmgr1</eventSubURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:AVTransport:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:AVTransport</serviceId>
+        <SCPDURL>/upnp/rendertransportSCPD.xml</SCPDURL>
+        <controlURL>/upnp/control/rendertransport1</controlURL>
+        <eventSubURL>/upnp/event/rendertransport1</eventSubURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:RenderingControl:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:RenderingControl</serviceId>
+        <SCPDURL>/upnp/rendercontrolSCPD.xml</SCPDURL>
+        <controlURL>/upnp/control/rendercontrol1</controlURL>
+        <eventSubURL>/upnp/event/rendercontrol1</eventSubURL>
+      </service>
+    </serviceList>
+  </device>
+</root>)";
+
+  // Commercial speaker nesting the renderer two levels below a zone player
+  // root device, with vendor extensions and several embedded devices
+  constexpr const char* EMBEDDED = R"(<?xml version="1.0" encoding="utf-8" ?>
+<root xmlns="urn:schemas-upnp-org:device-1-0">
+  <specVersion>
+    <major>1</major>
+    <minor>0</minor>
+  </specVersion>
+  <device>
+    <deviceType>urn:schemas-upnp-org:device:ZonePlayer:1</deviceType>
+    <friendlyName>192.168.1.42 - Kitchen Speaker - RINCON_000E58A1B2C301400</friendlyName>
+    <manufacturer>Example Audio</manufacturer>
+    <manufacturerURL>http://www.example.com</manufacturerURL>
+    <modelNumber>S18</modelNumber>
+    <modelDescription>Example Speaker One</modelDescription>
+    <modelName>Speaker One</modelName>
+    <modelURL>http://www.example.com/products/one</modelURL>
+    <softwareVersion>62.1-86220</softwareVersion>
+    <swGen>1</swGen>
+    <hardwareVersion>1.20.1.6-2.1</hardwareVersion>
+    <serialNum>00-0E-58-A1-B2-C3:9</serialNum>
+    <MACAddress>00:0E:58:A1:B2:C3</MACAddress>
+    <UDN>uuid:RINCON_000E58A1B2C301400</UDN>
+    <iconList>
+      <icon>
+        <id>0</id>
+        <mimetype>image/png</mimetype>
+        <width>48</width>
+        <height>48</height>
+        <depth>24</depth>
+        <url>/img/icon-S18.png</url>
+      </icon>
+    </iconList>
+    <minCompatibleVersion>61.0-00000</minCompatibleVersion>
+    <legacyCompatibleVersion>36.0-00000</legacyCompatibleVersion>
+    <apiVersion>1.30.0</apiVersion>
+    <minApiVersion>1.1.0</minApiVersion>
+    <displayVersion>14.4</displayVersion>
+    <extraVersion></extraVersion>
+    <roomName>Kitchen</roomName>
+    <displayName>One</displayName>
+    <zoneType>18</zoneType>
+    <feature1>0x00000000</feature1>
+    <feature2>0x00403332</feature2>
+    <feature3>0x0003020e</feature3>
+    <seriesid>A200</seriesid>
+    <variant>1</variant>
+    <internalSpeakerSize>3</internalSpeakerSize>
+    <bassExtension>75.000</bassExtension>
+    <satGainOffset>6.000</satGainOffset>
+    <memory>1024</memory>
+    <flash>512</flash>
+    <flashRepartitioned>1</flashRepartitioned>
+    <ampOnTime>10</ampOnTime>
+    <retailMode>0</retailMode>
+    <serviceList>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:AlarmClock:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:AlarmClock</serviceId>
+        <controlURL>/AlarmClock/Control</controlURL>
+        <eventSubURL>/AlarmClock/Event</eventSubURL>
+        <SCPDURL>/xml/AlarmClock1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:MusicServices:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:MusicServices</serviceId>
+        <controlURL>/MusicServices/Control</controlURL>
+        <eventSubURL>/MusicServices/Event</eventSubURL>
+        <SCPDURL>/xml/MusicServices1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:DeviceProperties:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:DeviceProperties</serviceId>
+        <controlURL>/DeviceProperties/Control</controlURL>
+        <eventSubURL>/DeviceProperties/Event</eventSubURL>
+        <SCPDURL>/xml/DeviceProperties1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:SystemProperties:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:SystemProperties</serviceId>
+        <controlURL>/SystemProperties/Control</controlURL>
+        <eventSubURL>/SystemProperties/Event</eventSubURL>
+        <SCPDURL>/xml/SystemProperties1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:ZoneGroupTopology:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:ZoneGroupTopology</serviceId>
+        <controlURL>/ZoneGroupTopology/Control</controlURL>
+        <eventSubURL>/ZoneGroupTopology/Event</eventSubURL>
+        <SCPDURL>/xml/ZoneGroupTopology1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-upnp-org:service:GroupManagement:1</serviceType>
+        <serviceId>urn:upnp-org:serviceId:GroupManagement</serviceId>
+        <controlURL>/GroupManagement/Control</controlURL>
+        <eventSubURL>/GroupManagement/Event</eventSubURL>
+        <SCPDURL>/xml/GroupManagement1.xml</SCPDURL>
+      </service>
+      <service>
+        <serviceType>urn:schemas-tencent-com:service:QPlay:1</serviceType>
+        <serviceId>urn:tencent-com:serviceId:QPlay</serviceId>
+        <controlURL>/QPlay/Control</controlURL>
+        <eventSubURL>/QPlay/Event</eventSubURL>
+        <SCPDURL>/xml/QPlay1.xml</SCPDURL>
+      </service>
+    </serviceList>
+    <deviceList>
+      <device>
+        <deviceType>urn:schemas-upnp-org:device:MediaServer:1</deviceType>
+        <friendlyName>192.168.1.42 - Kitchen Speaker Media Server - RINCON_000E58A1B2C301400</friendlyName>
+        <manufacturer>Example Audio</manufacturer>
+        <manufacturerURL>http://www.example.com</manufacturerURL>
+        <modelNumber>S18</modelNumber>
+        <modelDescription>Example Speaker One Media Server</modelDescription>
+        <modelName>Speaker One</modelName>
+        <modelURL>http://www.example.com/products/one</modelURL>
+        <UDN>uuid:RINCON_000E58A1B2C301400_MS</UDN>
+        <serviceList>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:ContentDirectory:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:ContentDirectory</serviceId>
+            <controlURL>/MediaServer/ContentDirectory/Control</controlURL>
+            <eventSubURL>/MediaServer/ContentDirectory/Event</eventSubURL>
+            <SCPDURL>/xml/ContentDirectory1.xml</SCPDURL>
+          </service>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:ConnectionManager:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:ConnectionManager</serviceId>
+            <controlURL>/MediaServer/ConnectionManager/Control</controlURL>
+            <eventSubURL>/MediaServer/ConnectionManager/Event</eventSubURL>
+            <SCPDURL>/xml/ConnectionManager1.xml</SCPDURL>
+          </service>
+        </serviceList>
+      </device>
+      <device>
+        <deviceType>urn:schemas-upnp-org:device:MediaRenderer:1</deviceType>
+        <friendlyName>Kitchen - Speaker One Media Renderer</friendlyName>
+        <manufacturer>Example Audio</manufacturer>
+        <manufacturerURL>http://www.example.com</manufacturerURL>
+        <modelNumber>S18</modelNumber>
+        <modelDescription>Example Speaker One Media Renderer</modelDescription>
+        <modelName>Speaker One</modelName>
+        <modelURL>http://www.example.com/products/one</modelURL>
+        <UDN>uuid:RINCON_000E58A1B2C301400_MR</UDN>
+        <serviceList>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:RenderingControl:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:RenderingControl</serviceId>
+            <controlURL>/MediaRenderer/RenderingControl/Control</controlURL>
+            <eventSubURL>/MediaRenderer/RenderingControl/Event</eventSubURL>
+            <SCPDURL>/xml/RenderingControl1.xml</SCPDURL>
+          </service>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:ConnectionManager:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:ConnectionManager</serviceId>
+            <controlURL>/MediaRenderer/ConnectionManager/Control</controlURL>
+            <eventSubURL>/MediaRenderer/ConnectionManager/Event</eventSubURL>
+            <SCPDURL>/xml/ConnectionManager1.xml</SCPDURL>
+          </service>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:AVTransport:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:AVTransport</serviceId>
+            <controlURL>/MediaRenderer/AVTransport/Control</controlURL>
+            <eventSubURL>/MediaRenderer/AVTransport/Event</eventSubURL>
+            <SCPDURL>/xml/AVTransport1.xml</SCPDURL>
+          </service>
+          <service>
+            <serviceType>urn:schemas-example-com:service:Queue:1</serviceType>
+            <serviceId>urn:example-com:serviceId:Queue</serviceId>
+            <controlURL>/MediaRenderer/Queue/Control</controlURL>
+            <eventSubURL>/MediaRenderer/Queue/Event</eventSubURL>
+            <SCPDURL>/xml/Queue1.xml</SCPDURL>
+          </service>
+          <service>
+            <serviceType>urn:schemas-upnp-org:service:GroupRenderingControl:1</serviceType>
+            <serviceId>urn:upnp-org:serviceId:GroupRenderingControl</serviceId>
+            <controlURL>/MediaRenderer/GroupRenderingControl/Control</controlURL>
+            <eventSubURL>/MediaRenderer/GroupRenderingControl/Event</eventSubURL>
+            <SCPDURL>/xml/GroupRenderingControl1.xml</SCPDURL>
+          </service>
+        </serviceList>
+        <X_Rhapsody-Extension xmlns="http://www.real.com/rhapsody/xmlns/upnp-1-0">
+          <deviceID>urn:rhapsody-real-com:device-id-1-0:example_1:RINCON_000E58A1B2C301400</deviceID>
+          <deviceCapabilities>
+            <interactionPattern type="real-rhapsody-upnp-1-0"></interactionPattern>
+          </deviceCapabilities>
+        </X_Rhapsody-Extension>
+        <qq:X_QPlay_SoftwareCapability xmlns:qq="http://www.tencent.com">QPlay:2</qq:X_QPlay_SoftwareCapability>
+        <iconList>
+          <icon>
+            <mimetype>image/png</mimetype>
+            <width>48</width>
+            <height>48</height>
+            <depth>24</depth>
+            <url>/img/icon-S18.png</url>
+          </icon>
+        </iconList>
+      </device>
+    </deviceList>
+  </device>
+</root>)";
+}
+
+#endif
\ No newline at end of file
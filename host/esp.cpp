@@ -0,0 +1,290 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/igmp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "host.h"
+
+#define TAG "Host"
+
+using Clock = std::chrono::steady_clock;
+
+static const Clock::time_point start_time = Clock::now();
+
+// Filled in from the command line by main
+Host::Options Host::options;
+
+static std::mutex log_mutex;
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+static std::atomic<uint32_t> minimum_free_heap(UINT32_MAX);
+
+/**
+  @brief  Get the microseconds since the simulation started
+
+  @param  none
+  @retval int64_t
+*/
+int64_t esp_timer_get_time()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start_time).count();
+}
+
+uint32_t esp_log_timestamp()
+{
+  return esp_timer_get_time() / 1000;
+}
+
+/**
+  @brief  Set the log level. Levels are global on the host
+
+  @param  tag Ignored
+  @param  level Most verbose level to print
+  @retval none
+*/
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+  log_level = level;
+}
+
+/**
+  @brief  Write a formatted log line to stderr
+
+  @param  level Level of the message
+  @param  tag Ignored. Included in the format by the log macros
+  @param  format printf format string
+  @retval none
+*/
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+  if (level > log_level)
+    return;
+
+  std::lock_guard<std::mutex> lock(log_mutex);
+
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+/**
+  @brief  Get the name of an error code
+
+  @param  code Error code
+  @retval const char*
+*/
+const char* esp_err_to_name(esp_err_t code)
+{
+  switch (code)
+  {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_INITIALIZED: return "ESP_ERR_NVS_NOT_INITIALIZED";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH: return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_KEY_TOO_LONG: return "ESP_ERR_NVS_KEY_TOO_LONG";
+    case ESP_ERR_NVS_INVALID_NAME: return "ESP_ERR_NVS_INVALID_NAME";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+    default: return "UNKNOWN ERROR";
+  }
+}
+
+/**
+  @brief  Get the bytes the allocator holds free. The host heap grows on
+          demand so this only tracks fragmentation and leaks
+
+  @param  none
+  @retval uint32_t
+*/
+uint32_t esp_get_free_heap_size()
+{
+  struct mallinfo2 info = mallinfo2();
+  uint32_t free = std::min<size_t>(info.fordblks, UINT32_MAX);
+
+  uint32_t previous = minimum_free_heap.load();
+  while (free < previous && !minimum_free_heap.compare_exchange_weak(previous, free));
+
+  return free;
+}
+
+/**
+  @brief  Get the lowest free heap observed so far
+
+  @param  none
+  @retval uint32_t
+*/
+uint32_t esp_get_minimum_free_heap_size()
+{
+  esp_get_free_heap_size();
+  return minimum_free_heap.load();
+}
+
+void esp_restart()
+{
+  ESP_LOGW(TAG, "Restart requested. Exiting.");
+
+  // Tasks are still running so skip static destructors
+  fflush(stdout);
+  _exit(0);
+}
+
+/**
+  @brief  Find the address handed to renderers. Uses the configured
+          address or the first non-loopback IPv4 interface
+
+  @param  none
+  @retval uint32_t - Address in network order
+*/
+static uint32_t host_address()
+{
+  if (!Host::options.address.empty())
+    return inet_addr(Host::options.address.c_str());
+
+  uint32_t address = htonl(INADDR_LOOPBACK);
+
+  struct ifaddrs* interfaces = nullptr;
+  if (getifaddrs(&interfaces) != 0)
+    return address;
+
+  for (struct ifaddrs* i = interfaces; i != nullptr; i = i->ifa_next)
+  {
+    if (i->ifa_addr == nullptr || i->ifa_addr->sa_family != AF_INET)
+      continue;
+
+    uint32_t candidate = ((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr;
+    if (candidate == htonl(INADDR_LOOPBACK))
+      continue;
+
+    address = candidate;
+    break;
+  }
+
+  freeifaddrs(interfaces);
+  return address;
+}
+
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char* key)
+{
+  // Any non-null handle. There is a single host interface
+  return (esp_netif_t*) &Host::options;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t* netif, esp_netif_ip_info_t* info)
+{
+  if (netif == nullptr || info == nullptr)
+    return ESP_ERR_INVALID_ARG;
+
+  memset(info, 0, sizeof(esp_netif_ip_info_t));
+  info->ip.addr = host_address();
+
+  return ESP_OK;
+}
+
+char* esp_ip4addr_ntoa(const esp_ip4_addr_t* addr, char* buffer, int length)
+{
+  struct in_addr in = { .s_addr = addr->addr };
+  return (char*) inet_ntop(AF_INET, &in, buffer, length);
+}
+
+/**
+  @brief  Join a multicast group on every open UDP socket bound to the
+          group's address
+
+  @param  interface_addr Interface to join on
+  @param  group_addr Multicast group
+  @retval esp_err_t
+*/
+esp_err_t igmp_joingroup(const ip4_addr_t* interface_addr, const ip4_addr_t* group_addr)
+{
+  struct ip_mreq request;
+  request.imr_multiaddr.s_addr = group_addr->addr;
+  request.imr_interface.s_addr = interface_addr->addr;
+
+  int joined = 0;
+  for (int fd = 0; fd < sysconf(_SC_OPEN_MAX) && fd < 1024; fd++)
+  {
+    int type = 0;
+    socklen_t type_length = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_length) != 0 || type != SOCK_DGRAM)
+      continue;
+
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*) &address, &address_length) != 0 || address.sin_family != AF_INET)
+      continue;
+
+    if (address.sin_addr.s_addr != group_addr->addr)
+      continue;
+
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) == 0)
+      joined++;
+  }
+
+  return (joined > 0) ? ESP_OK : ESP_FAIL;
+}
+
+// Single factory partition so OTA finds no update target
+static const esp_partition_t factory_partition = {ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, 0x10000, 0x100000, "factory"};
+
+const esp_partition_t* esp_ota_get_boot_partition()
+{
+  return &factory_partition;
+}
+
+const esp_partition_t* esp_ota_get_running_partition()
+{
+  return &factory_partition;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start)
+{
+  return nullptr;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* handle)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
\ No newline at end of file
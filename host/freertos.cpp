@@ -0,0 +1,746 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define TAG "FreeRTOS"
+
+using Clock = std::chrono::steady_clock;
+
+static const Clock::time_point start_time = Clock::now();
+
+// Byte painted over task stacks to find the high water mark
+static constexpr uint8_t STACK_FILL = 0xa5;
+
+struct Task
+{
+  std::string name;
+  TaskFunction_t function;
+  void* parameters;
+
+  uint8_t* stack = nullptr;
+  size_t stack_size = 0;
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  uint32_t notify_value = 0;
+  bool notified = false;
+};
+
+struct Queue
+{
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+  std::vector<uint8_t> storage;
+  size_t item_size;
+  size_t length;
+  size_t head = 0;
+  size_t count = 0;
+};
+
+struct Semaphore
+{
+  std::mutex mutex;
+  std::condition_variable available;
+  UBaseType_t count;
+  UBaseType_t max_count;
+};
+
+struct Timer
+{
+  std::string name;
+  TickType_t period;
+  bool auto_reload;
+  void* id;
+  TimerCallbackFunction_t callback;
+
+  bool active = false;
+  bool deleted = false;
+  Clock::time_point expiry;
+};
+
+static thread_local Task* current_task = nullptr;
+
+/**
+  @brief  Wait on a condition for up to the provided ticks
+
+  @param  condition Condition variable to wait on
+  @param  lock Lock held on the condition's mutex
+  @param  ticks Ticks to wait. portMAX_DELAY waits forever
+  @param  predicate Condition to wait for
+  @retval bool - Predicate was satisfied
+*/
+template<typename Predicate>
+static bool wait_ticks(std::condition_variable& condition, std::unique_lock<std::mutex>& lock, TickType_t ticks, Predicate predicate)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    condition.wait(lock, predicate);
+    return true;
+  }
+
+  return condition.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), predicate);
+}
+
+/**
+  @brief  Enter a critical section
+
+  @param  mux Lock of the section
+  @retval none
+*/
+void vPortEnterCritical(portMUX_TYPE* mux)
+{
+  pthread_mutex_lock(&mux->mutex);
+}
+
+/**
+  @brief  Exit a critical section
+
+  @param  mux Lock of the section
+  @retval none
+*/
+void vPortExitCritical(portMUX_TYPE* mux)
+{
+  pthread_mutex_unlock(&mux->mutex);
+}
+
+/**
+  @brief  Map the calling thread to a simulated core
+
+  @param  none
+  @retval BaseType_t
+*/
+BaseType_t xPortGetCoreID()
+{
+  int cpu = sched_getcpu();
+  return (cpu < 0) ? 0 : cpu % portNUM_PROCESSORS;
+}
+
+/**
+  @brief  Entry point of every task thread
+
+  @param  argument Task to run
+  @retval void*
+*/
+static void* task_entry(void* argument)
+{
+  current_task = (Task*) argument;
+  pthread_setname_np(pthread_self(), current_task->name.substr(0, 15).c_str());
+
+  current_task->function(current_task->parameters);
+
+  // Tasks must delete themselves rather than return
+  ESP_LOGE(TAG, "Task '%s' returned.", current_task->name.c_str());
+  return nullptr;
+}
+
+/**
+  @brief  Create a task on its own thread with a painted stack
+
+  @param  function Task function
+  @param  name Task name
+  @param  stack_depth Stack size in bytes before scaling
+  @param  parameters Argument to the task function
+  @param  priority Ignored. Scheduling is left to the host
+  @param  handle Returned task handle. May be null
+  @retval BaseType_t
+*/
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameters, UBaseType_t priority, TaskHandle_t* handle)
+{
+  Task* task = new Task();
+  task->name = name;
+  task->function = function;
+  task->parameters = parameters;
+  task->stack_size = std::max<size_t>(stack_depth * HOST_STACK_SCALE, PTHREAD_STACK_MIN);
+
+  void* stack = mmap(nullptr, task->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+  {
+    delete task;
+    return pdFAIL;
+  }
+
+  task->stack = (uint8_t*) stack;
+  memset(task->stack, STACK_FILL, task->stack_size);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstack(&attributes, task->stack, task->stack_size);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+  pthread_t thread;
+  int result = pthread_create(&thread, &attributes, task_entry, task);
+  pthread_attr_destroy(&attributes);
+
+  if (result != 0)
+  {
+    munmap(task->stack, task->stack_size);
+    delete task;
+    return pdFAIL;
+  }
+
+  if (handle != nullptr)
+    *handle = task;
+
+  return pdPASS;
+}
+
+/**
+  @brief  Create a task. Cores are not pinned on the host
+
+  @param  function Task function
+  @param  name Task name
+  @param  stack_depth Stack size in bytes before scaling
+  @param  parameters Argument to the task function
+  @param  priority Ignored. Scheduling is left to the host
+  @param  handle Returned task handle. May be null
+  @param  core Ignored
+  @retval BaseType_t
+*/
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameters, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core)
+{
+  return xTaskCreate(function, name, stack_depth, parameters, priority, handle);
+}
+
+/**
+  @brief  Delete a task. Only self deletion is supported. The task object
+          and stack are leaked since the thread is still running on them
+
+  @param  task Task to delete. Null for the calling task
+  @retval none
+*/
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task != nullptr && task != current_task)
+  {
+    ESP_LOGE(TAG, "Deleting other tasks is not supported.");
+    return;
+  }
+
+  pthread_exit(nullptr);
+}
+
+/**
+  @brief  Block the calling task
+
+  @param  ticks Ticks to delay
+  @retval none
+*/
+void vTaskDelay(TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+/**
+  @brief  Get the calling task. Threads not created by xTaskCreate are
+          adopted on first use
+
+  @param  none
+  @retval TaskHandle_t
+*/
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  if (current_task == nullptr)
+  {
+    current_task = new Task();
+
+    char name[16] = {0};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    current_task->name = name;
+  }
+
+  return current_task;
+}
+
+/**
+  @brief  Get the ticks since the simulation started
+
+  @param  none
+  @retval TickType_t
+*/
+TickType_t xTaskGetTickCount()
+{
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
+  return elapsed.count() / portTICK_PERIOD_MS;
+}
+
+/**
+  @brief  Get the name of a task
+
+  @param  handle Task handle. Null for the calling task
+  @retval char*
+*/
+char* pcTaskGetTaskName(TaskHandle_t handle)
+{
+  Task* task = (Task*) ((handle != nullptr) ? handle : xTaskGetCurrentTaskHandle());
+
+  return (char*) task->name.c_str();
+}
+
+/**
+  @brief  Find the minimum unused stack of a task by scanning for the
+          fill pattern from the end the stack grows towards
+
+  @param  handle Task handle. Null for the calling task
+  @retval UBaseType_t - Unused bytes of host stack
+*/
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle)
+{
+  Task* task = (Task*) ((handle != nullptr) ? handle : xTaskGetCurrentTaskHandle());
+
+  size_t unused = 0;
+  while (unused < task->stack_size && task->stack[unused] == STACK_FILL)
+    unused++;
+
+  return unused;
+}
+
+/**
+  @brief  Notify a task
+
+  @param  handle Task to notify
+  @param  value Notification value
+  @param  action How the value updates the task's notification value
+  @retval BaseType_t
+*/
+BaseType_t xTaskNotify(TaskHandle_t handle, uint32_t value, eNotifyAction action)
+{
+  Task* task = (Task*) handle;
+  if (task == nullptr)
+    return pdFAIL;
+
+  std::lock_guard<std::mutex> lock(task->mutex);
+
+  switch (action)
+  {
+    case eSetBits:
+      task->notify_value |= value;
+      break;
+
+    case eIncrement:
+      task->notify_value++;
+      break;
+
+    case eSetValueWithOverwrite:
+      task->notify_value = value;
+      break;
+
+    case eSetValueWithoutOverwrite:
+      if (task->notified)
+        return pdFAIL;
+
+      task->notify_value = value;
+      break;
+
+    case eNoAction:
+      break;
+  }
+
+  task->notified = true;
+  task->condition.notify_all();
+
+  return pdPASS;
+}
+
+/**
+  @brief  Wait for a notification to the calling task
+
+  @param  clear_on_entry Bits cleared on entry if no notification is pending
+  @param  clear_on_exit Bits cleared once a notification is received
+  @param  value Notification value at the time of receipt. May be null
+  @param  ticks Ticks to wait
+  @retval BaseType_t - Notification was received
+*/
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t* value, TickType_t ticks)
+{
+  Task* task = (Task*) xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock(task->mutex);
+
+  if (!task->notified)
+    task->notify_value &= ~clear_on_entry;
+
+  if (!wait_ticks(task->condition, lock, ticks, [task]{ return task->notified; }))
+    return pdFALSE;
+
+  if (value != nullptr)
+    *value = task->notify_value;
+
+  task->notify_value &= ~clear_on_exit;
+  task->notified = false;
+
+  return pdTRUE;
+}
+
+/**
+  @brief  Create a queue of fixed size items
+
+  @param  length Maximum number of items
+  @param  item_size Size of each item in bytes
+  @retval QueueHandle_t
+*/
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  Queue* queue = new Queue();
+  queue->storage.resize(length * item_size);
+  queue->item_size = item_size;
+  queue->length = length;
+
+  return queue;
+}
+
+/**
+  @brief  Delete a queue
+
+  @param  queue Queue to delete
+  @retval none
+*/
+void vQueueDelete(QueueHandle_t queue)
+{
+  delete queue;
+}
+
+/**
+  @brief  Copy an item into a queue
+
+  @param  queue Queue to send to
+  @param  item Item to copy
+  @param  ticks Ticks to wait for space
+  @param  front Send to the front of the queue
+  @retval BaseType_t
+*/
+static BaseType_t queue_send(QueueHandle_t queue, const void* item, TickType_t ticks, bool front)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  if (!wait_ticks(queue->not_full, lock, ticks, [queue]{ return queue->count < queue->length; }))
+    return pdFAIL;
+
+  size_t index;
+  if (front)
+  {
+    queue->head = (queue->head + queue->length - 1) % queue->length;
+    index = queue->head;
+  }
+  else
+    index = (queue->head + queue->count) % queue->length;
+
+  memcpy(&queue->storage[index * queue->item_size], item, queue->item_size);
+  queue->count++;
+
+  queue->not_empty.notify_one();
+
+  return pdPASS;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t ticks)
+{
+  return queue_send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void* item, TickType_t ticks)
+{
+  return queue_send(queue, item, ticks, true);
+}
+
+/**
+  @brief  Copy an item out of a queue
+
+  @param  queue Queue to receive from
+  @param  item Buffer to copy the item to
+  @param  ticks Ticks to wait for an item
+  @retval BaseType_t
+*/
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  if (!wait_ticks(queue->not_empty, lock, ticks, [queue]{ return queue->count > 0; }))
+    return pdFAIL;
+
+  memcpy(item, &queue->storage[queue->head * queue->item_size], queue->item_size);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+
+  queue->not_full.notify_one();
+
+  return pdPASS;
+}
+
+/**
+  @brief  Empty a queue
+
+  @param  queue Queue to reset
+  @retval BaseType_t
+*/
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> lock(queue->mutex);
+
+  queue->head = 0;
+  queue->count = 0;
+  queue->not_full.notify_all();
+
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->count;
+}
+
+/**
+  @brief  Create a semaphore. Mutexes are binary semaphores that start
+          available. Priority inheritance is not simulated
+
+  @param  max_count Maximum count
+  @param  initial_count Initial count
+  @retval SemaphoreHandle_t
+*/
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+  Semaphore* semaphore = new Semaphore();
+  semaphore->count = initial_count;
+  semaphore->max_count = max_count;
+
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  delete semaphore;
+}
+
+/**
+  @brief  Take a semaphore
+
+  @param  semaphore Semaphore to take
+  @param  ticks Ticks to wait
+  @retval BaseType_t
+*/
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+
+  if (!wait_ticks(semaphore->available, lock, ticks, [semaphore]{ return semaphore->count > 0; }))
+    return pdFAIL;
+
+  semaphore->count--;
+  return pdPASS;
+}
+
+/**
+  @brief  Give a semaphore
+
+  @param  semaphore Semaphore to give
+  @retval BaseType_t
+*/
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+
+  if (semaphore->count >= semaphore->max_count)
+    return pdFAIL;
+
+  semaphore->count++;
+  semaphore->available.notify_one();
+
+  return pdPASS;
+}
+
+// Software timers run on a single service thread like the FreeRTOS timer
+// task. Never destroyed since the detached service outlives static destruction
+static struct TimerService
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::list<Timer*> timers;
+  bool started = false;
+}& timer_service = *new TimerService();
+
+/**
+  @brief  Timer service loop. Fires expired timers outside the lock so
+          callbacks may use the timer API
+
+  @param  none
+  @retval none
+*/
+static void timer_service_task()
+{
+  std::unique_lock<std::mutex> lock(timer_service.mutex);
+
+  while (true)
+  {
+    // Free deleted timers and find the next expiry
+    Timer* next = nullptr;
+    for (auto it = timer_service.timers.begin(); it != timer_service.timers.end();)
+    {
+      Timer* timer = *it;
+      if (timer->deleted)
+      {
+        it = timer_service.timers.erase(it);
+        delete timer;
+        continue;
+      }
+
+      if (timer->active && (next == nullptr || timer->expiry < next->expiry))
+        next = timer;
+
+      it++;
+    }
+
+    if (next == nullptr)
+    {
+      timer_service.changed.wait(lock);
+      continue;
+    }
+
+    if (timer_service.changed.wait_until(lock, next->expiry) != std::cv_status::timeout)
+      continue;
+
+    // Timer may have been changed while waiting
+    if (!next->active || next->deleted || next->expiry > Clock::now())
+      continue;
+
+    if (next->auto_reload)
+      next->expiry += std::chrono::milliseconds(next->period * portTICK_PERIOD_MS);
+    else
+      next->active = false;
+
+    TimerCallbackFunction_t callback = next->callback;
+
+    lock.unlock();
+    callback(next);
+    lock.lock();
+  }
+}
+
+/**
+  @brief  Create a software timer
+
+  @param  name Timer name
+  @param  period Period in ticks
+  @param  auto_reload Restart the timer after it fires
+  @param  id Timer ID
+  @param  callback Function called on expiry
+  @retval TimerHandle_t
+*/
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, UBaseType_t auto_reload, void* id, TimerCallbackFunction_t callback)
+{
+  Timer* timer = new Timer();
+  timer->name = name;
+  timer->period = period;
+  timer->auto_reload = auto_reload;
+  timer->id = id;
+  timer->callback = callback;
+
+  std::lock_guard<std::mutex> lock(timer_service.mutex);
+
+  // Start the service on first use
+  if (!timer_service.started)
+  {
+    std::thread thread(timer_service_task);
+    pthread_setname_np(thread.native_handle(), "Tmr Svc");
+    thread.detach();
+
+    timer_service.started = true;
+  }
+
+  timer_service.timers.push_back(timer);
+
+  return timer;
+}
+
+/**
+  @brief  Start or restart a timer from now
+
+  @param  timer Timer to start
+  @param  ticks Ignored. Commands never block
+  @retval BaseType_t
+*/
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks)
+{
+  std::lock_guard<std::mutex> lock(timer_service.mutex);
+
+  timer->active = true;
+  timer->expiry = Clock::now() + std::chrono::milliseconds(timer->period * portTICK_PERIOD_MS);
+  timer_service.changed.notify_one();
+
+  return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks)
+{
+  return xTimerStart(timer, ticks);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks)
+{
+  std::lock_guard<std::mutex> lock(timer_service.mutex);
+
+  timer->active = false;
+  timer_service.changed.notify_one();
+
+  return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks)
+{
+  {
+    std::lock_guard<std::mutex> lock(timer_service.mutex);
+    timer->period = period;
+  }
+
+  return xTimerStart(timer, ticks);
+}
+
+/**
+  @brief  Delete a timer. It is freed by the service thread
+
+  @param  timer Timer to delete
+  @param  ticks Ignored. Commands never block
+  @retval BaseType_t
+*/
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks)
+{
+  std::lock_guard<std::mutex> lock(timer_service.mutex);
+
+  timer->active = false;
+  timer->deleted = true;
+  timer_service.changed.notify_one();
+
+  return pdPASS;
+}
+
+void* pvTimerGetTimerID(TimerHandle_t timer)
+{
+  return timer->id;
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <string>
+#include <vector>
+
+namespace Host
+{
+  // Command line options of the simulation
+  struct Options
+  {
+    std::string wav_path;          // WAV file looped as I2S input
+    std::string wav2_path;         // WAV file looped as the second I2S input. A tone a fifth above when empty
+    uint32_t tone_frequency = 440; // Generated tone when no WAV file is given. 0 for silence
+    bool counter = false;          // Generate a frame counter for continuity checks
+    std::vector<uint32_t> source_rates; // Rates of the source's clocks. Stepped through every rate_period seconds
+    uint32_t rate_period = 30;
+    std::string nvs_path = "nvs.txt";
+    std::string address;           // Address handed to renderers. Detected when empty
+  };
+
+  extern Options options;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/i2s.h"
+#include "esp_log.h"
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "host.h"
+
+#define TAG "I2S"
+
+using Clock = std::chrono::steady_clock;
+
+// Audio fed to the driver as stereo frames of left justified 32 bit samples
+struct Source
+{
+  std::vector<int32_t> samples; // Interleaved stereo. Empty generates a tone
+  size_t position = 0;
+  double phase = 0;
+  uint32_t counter = 0;
+  uint32_t file_rate = 0; // Rate of the loaded WAV file
+  uint32_t tone_frequency = 0;
+
+  void load(const std::string& path, uint32_t tone_frequency);
+  uint32_t clock_rate(uint32_t configured);
+  void next(int32_t& left, int32_t& right, uint32_t sample_rate);
+};
+
+struct Port
+{
+  bool installed = false;
+  i2s_config_t config;
+  QueueHandle_t event_queue = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable available;
+  bool running = false;
+  bool exit = false;
+  bool exited = false;
+
+  // Completed DMA buffers waiting to be read
+  std::vector<std::vector<uint8_t>> buffers;
+  size_t head = 0;
+  size_t count = 0;
+  size_t offset = 0; // Bytes already read from the head buffer
+
+  Source source;
+};
+
+// Never destroyed since the detached producers outlive static destruction
+static Port* const ports = new Port[I2S_NUM_MAX];
+
+/**
+  @brief  Load a WAV file. PCM data of any common width and one or two
+          channels is converted to stereo frames
+
+  @param  path WAV file to load. Empty generates a tone
+  @param  tone_frequency Frequency of the tone generated otherwise
+  @retval none
+*/
+void Source::load(const std::string& path, uint32_t tone_frequency)
+{
+  this->tone_frequency = tone_frequency;
+  if (path.empty())
+    return;
+
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (data.size() < 12 || memcmp(&data[0], "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0)
+  {
+    ESP_LOGE(TAG, "'%s' is not a WAV file. Using tone.", path.c_str());
+    return;
+  }
+
+  uint16_t channels = 0;
+  uint16_t bits_per_sample = 0;
+  uint32_t sample_rate = 0;
+
+  // Walk the chunks for the format and data
+  size_t index = 12;
+  while (index + 8 <= data.size())
+  {
+    uint32_t length;
+    memcpy(&length, &data[index + 4], sizeof(length));
+
+    const uint8_t* chunk = &data[index + 8];
+    length = std::min<size_t>(length, data.size() - index - 8);
+
+    if (memcmp(&data[index], "fmt ", 4) == 0 && length >= 16)
+    {
+      memcpy(&channels, chunk + 2, sizeof(channels));
+      memcpy(&sample_rate, chunk + 4, sizeof(sample_rate));
+      memcpy(&bits_per_sample, chunk + 14, sizeof(bits_per_sample));
+    }
+    else if (memcmp(&data[index], "data", 4) == 0 && channels > 0 && bits_per_sample % 8 == 0 && bits_per_sample >= 16)
+    {
+      const size_t width = bits_per_sample / 8;
+      for (size_t i = 0; i + width * channels <= length; i += width * channels)
+      {
+        for (size_t c = 0; c < 2; c++)
+        {
+          // Duplicate mono, drop extra channels
+          const uint8_t* sample = chunk + i + width * std::min<size_t>(c, channels - 1);
+
+          int32_t value = 0;
+          for (size_t b = 0; b < width; b++)
+            value |= (uint32_t) sample[b] << (8 * (4 - width + b));
+
+          samples.push_back(value);
+        }
+      }
+    }
+
+    index += 8 + length + (length & 1);
+  }
+
+  if (samples.empty())
+  {
+    ESP_LOGE(TAG, "No PCM data in '%s'. Using tone.", path.c_str());
+    return;
+  }
+
+  file_rate = sample_rate;
+  ESP_LOGI(TAG, "Looping '%s'. %u Hz, %u bit, %u channel(s).", path.c_str(), sample_rate, bits_per_sample, channels);
+}
+
+/**
+  @brief  Get the rate the source clocks the bus at. As a slave the
+          peripheral follows it whatever rate the driver is configured for
+
+  @param  configured Sample rate the driver is configured for
+  @retval uint32_t
+*/
+uint32_t Source::clock_rate(uint32_t configured)
+{
+  const std::vector<uint32_t>& rates = Host::options.source_rates;
+  if (!rates.empty())
+  {
+    static const Clock::time_point start = Clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - start).count();
+    return rates[(elapsed / Host::options.rate_period) % rates.size()];
+  }
+
+  return (file_rate != 0) ? file_rate : configured;
+}
+
+/**
+  @brief  Produce the next stereo frame
+
+  @param  left Left sample
+  @param  right Right sample
+  @param  sample_rate Sample rate the source is clocked at
+  @retval none
+*/
+void Source::next(int32_t& left, int32_t& right, uint32_t sample_rate)
+{
+  if (!samples.empty())
+  {
+    left = samples[position];
+    right = samples[position + 1];
+    position = (position + 2) % samples.size();
+    return;
+  }
+
+  if (Host::options.counter)
+  {
+    // Right leads on the wire, so a 16 bit stereo frame read as a little
+    // endian 32 bit word is the frame count
+    right = (counter & 0xffff) << 16;
+    left = (counter & 0xffff0000);
+    counter++;
+    return;
+  }
+
+  // Half scale tone, or silence
+  left = right = (int32_t) (sin(phase) * (INT32_MAX / 2));
+  phase = fmod(phase + 2 * M_PI * tone_frequency / sample_rate, 2 * M_PI);
+}
+
+/**
+  @brief  Get the number of channels and bytes per sample of a port
+
+  @param  config Port configuration
+  @param  channels Returned channel count
+  @param  width Returned bytes per sample
+  @retval none
+*/
+static void frame_format(const i2s_config_t& config, size_t& channels, size_t& width)
+{
+  channels = (config.channel_format == I2S_CHANNEL_FMT_ONLY_LEFT || config.channel_format == I2S_CHANNEL_FMT_ONLY_RIGHT) ? 1 : 2;
+  width = (config.bits_per_sample <= 16) ? 2 : 4;
+}
+
+/**
+  @brief  Fill a DMA buffer from the port's source
+
+  @param  port Port to fill for
+  @param  buffer Buffer to fill
+  @param  rate Rate the source is clocked at
+  @retval none
+*/
+static void fill_buffer(Port& port, std::vector<uint8_t>& buffer, uint32_t rate)
+{
+  size_t channels, width;
+  frame_format(port.config, channels, width);
+
+  buffer.resize(port.config.dma_buf_len * channels * width);
+
+  uint8_t* output = buffer.data();
+  for (int i = 0; i < port.config.dma_buf_len; i++)
+  {
+    int32_t frame[2];
+    port.source.next(frame[0], frame[1], rate);
+
+    // Mono formats carry the selected channel. Right comes first on the wire
+    int32_t ordered[2] = {frame[1], frame[0]};
+    if (port.config.channel_format == I2S_CHANNEL_FMT_ONLY_LEFT || port.config.channel_format == I2S_CHANNEL_FMT_ALL_LEFT)
+      ordered[0] = ordered[1] = frame[0];
+    else if (port.config.channel_format == I2S_CHANNEL_FMT_ONLY_RIGHT || port.config.channel_format == I2S_CHANNEL_FMT_ALL_RIGHT)
+      ordered[0] = ordered[1] = frame[1];
+
+    for (size_t c = 0; c < channels; c++)
+    {
+      int32_t sample = ordered[c];
+      if (width == 2)
+      {
+        int16_t narrow = sample >> 16;
+        memcpy(output, &narrow, sizeof(narrow));
+      }
+      else
+      {
+        // 24 bit data is left justified in 32 bit slots
+        if (port.config.bits_per_sample == I2S_BITS_PER_SAMPLE_24BIT)
+          sample &= 0xffffff00;
+
+        memcpy(output, &sample, sizeof(sample));
+      }
+
+      output += width;
+    }
+  }
+}
+
+/**
+  @brief  Find the next buffer boundary of a bus clock running since the
+          first port started. Every port is on the same bus clock, so
+          ports started together fill their buffers with the same frames
+          as when they share BCK and WS
+
+  @param  frames Frames per buffer
+  @param  rate Rate of the bus clock
+  @param  index Returned frame count of the clock at the boundary
+  @retval Clock::time_point
+*/
+static Clock::time_point next_boundary(uint32_t frames, uint32_t rate, uint64_t& index)
+{
+  static const Clock::time_point epoch = Clock::now();
+
+  const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+  const uint64_t period = (uint64_t) frames * 1000000000 / rate;
+  const uint64_t buffers = (elapsed + period - 1) / period;
+
+  index = buffers * frames;
+  return epoch + std::chrono::nanoseconds(buffers * period);
+}
+
+/**
+  @brief  Produce DMA buffers at the source's clock rate. The deadline is
+          absolute so pacing doesn't drift with scheduling jitter
+
+  @param  port Port to produce for
+  @retval none
+*/
+static void producer_task(Port* port)
+{
+  std::unique_lock<std::mutex> lock(port->mutex);
+
+  // The second port plays its own file, or a tone a fifth above the first's
+  if (port == &ports[I2S_NUM_0])
+    port->source.load(Host::options.wav_path, Host::options.tone_frequency);
+  else
+    port->source.load(Host::options.wav2_path, Host::options.tone_frequency * 3 / 2);
+
+  Clock::time_point deadline = Clock::now();
+  std::vector<uint8_t> buffer;
+  uint32_t rate = 0;
+  bool started = false;
+
+  while (!port->exit)
+  {
+    if (!port->running)
+    {
+      port->available.wait(lock);
+      started = false;
+      continue;
+    }
+
+    if (!started)
+    {
+      // Start on the bus clock. Counters count its frames so ports capture alike
+      uint64_t index;
+      deadline = next_boundary(port->config.dma_buf_len, port->source.clock_rate(port->config.sample_rate), index);
+      port->source.counter = index;
+      started = true;
+    }
+
+    uint32_t clock_rate = port->source.clock_rate(port->config.sample_rate);
+    if (clock_rate != rate)
+    {
+      ESP_LOGI(TAG, "Source clocked at %u Hz. Driver configured for %u Hz.", clock_rate, port->config.sample_rate);
+      rate = clock_rate;
+    }
+
+    deadline += std::chrono::nanoseconds((uint64_t) port->config.dma_buf_len * 1000000000 / rate);
+
+    fill_buffer(*port, buffer, rate);
+
+    lock.unlock();
+    std::this_thread::sleep_until(deadline);
+    lock.lock();
+
+    if (!port->running)
+      continue;
+
+    // One buffer is always being filled so one less is queued, as on the ESP32
+    const size_t capacity = std::max(port->config.dma_buf_count - 1, 1);
+    port->buffers.resize(capacity);
+
+    if (port->count == capacity)
+    {
+      // Overrun. Drop the oldest buffer
+      port->head = (port->head + 1) % capacity;
+      port->count--;
+      port->offset = 0;
+    }
+
+    const size_t length = buffer.size();
+    port->buffers[(port->head + port->count) % capacity].swap(buffer);
+    port->count++;
+
+    if (port->event_queue != nullptr)
+    {
+      // Dropped when the queue is full, as from the ISR
+      i2s_event_t event = {I2S_EVENT_RX_DONE, length};
+      xQueueSendToBack(port->event_queue, &event, 0);
+    }
+
+    port->available.notify_all();
+  }
+
+  port->exited = true;
+  port->available.notify_all();
+}
+
+esp_err_t i2s_driver_install(i2s_port_t port_num, const i2s_config_t* config, int queue_size, void* queue)
+{
+  if (port_num >= I2S_NUM_MAX || config == nullptr || config->sample_rate == 0 || config->dma_buf_len <= 0)
+    return ESP_ERR_INVALID_ARG;
+
+  Port& port = ports[port_num];
+  if (port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  port.config = *config;
+  port.installed = true;
+  port.running = true;
+  port.exit = false;
+  port.exited = false;
+
+  if (queue != nullptr && queue_size > 0)
+  {
+    port.event_queue = xQueueCreate(queue_size, sizeof(i2s_event_t));
+    *(QueueHandle_t*) queue = port.event_queue;
+  }
+
+  // Detached so the process can exit with the driver installed
+  std::thread producer(producer_task, &port);
+  pthread_setname_np(producer.native_handle(), "I2S DMA");
+  producer.detach();
+
+  size_t channels, width;
+  frame_format(port.config, channels, width);
+  ESP_LOGI(TAG, "Simulated I2S%d. %u Hz, %u bit, %u channel(s), %d x %d frame DMA buffers.", port_num, port.config.sample_rate, port.config.bits_per_sample, channels, port.config.dma_buf_count, port.config.dma_buf_len);
+
+  return ESP_OK;
+}
+
+esp_err_t i2s_driver_uninstall(i2s_port_t port_num)
+{
+  Port& port = ports[port_num];
+  if (!port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  {
+    std::unique_lock<std::mutex> lock(port.mutex);
+    port.exit = true;
+    port.available.notify_all();
+    port.available.wait(lock, [&port]{ return port.exited; });
+  }
+
+  if (port.event_queue != nullptr)
+    vQueueDelete(port.event_queue);
+
+  port.event_queue = nullptr;
+  port.installed = false;
+  port.head = 0;
+  port.count = 0;
+  port.offset = 0;
+
+  return ESP_OK;
+}
+
+esp_err_t i2s_set_pin(i2s_port_t port_num, const i2s_pin_config_t* pins)
+{
+  return ports[port_num].installed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+/**
+  @brief  Change the format of a port. Queued data is discarded
+
+  @param  port_num Port to configure
+  @param  rate Sample rate
+  @param  bits Bits per sample
+  @param  channels Mono or stereo
+  @retval esp_err_t
+*/
+esp_err_t i2s_set_clk(i2s_port_t port_num, uint32_t rate, i2s_bits_per_sample_t bits, i2s_channel_t channels)
+{
+  Port& port = ports[port_num];
+  if (!port.installed || rate == 0)
+    return ESP_ERR_INVALID_ARG;
+
+  std::lock_guard<std::mutex> lock(port.mutex);
+
+  port.config.sample_rate = rate;
+  port.config.bits_per_sample = bits;
+  port.config.channel_format = (channels == I2S_CHANNEL_MONO) ? I2S_CHANNEL_FMT_ONLY_RIGHT : I2S_CHANNEL_FMT_RIGHT_LEFT;
+  port.count = 0;
+  port.offset = 0;
+
+  return ESP_OK;
+}
+
+esp_err_t i2s_set_sample_rates(i2s_port_t port_num, uint32_t rate)
+{
+  Port& port = ports[port_num];
+  i2s_channel_t channels = (port.config.channel_format == I2S_CHANNEL_FMT_ONLY_LEFT || port.config.channel_format == I2S_CHANNEL_FMT_ONLY_RIGHT) ? I2S_CHANNEL_MONO : I2S_CHANNEL_STEREO;
+
+  return i2s_set_clk(port_num, rate, port.config.bits_per_sample, channels);
+}
+
+esp_err_t i2s_start(i2s_port_t port_num)
+{
+  Port& port = ports[port_num];
+  if (!port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  std::lock_guard<std::mutex> lock(port.mutex);
+  port.running = true;
+  port.available.notify_all();
+
+  return ESP_OK;
+}
+
+esp_err_t i2s_stop(i2s_port_t port_num)
+{
+  Port& port = ports[port_num];
+  if (!port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  std::lock_guard<std::mutex> lock(port.mutex);
+  port.running = false;
+
+  return ESP_OK;
+}
+
+esp_err_t i2s_zero_dma_buffer(i2s_port_t port_num)
+{
+  Port& port = ports[port_num];
+  if (!port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  std::lock_guard<std::mutex> lock(port.mutex);
+  port.count = 0;
+  port.offset = 0;
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Read from the DMA buffers. Waits up to ticks for each buffer
+          and returns what was read on timeout, as the ESP-IDF driver does
+
+  @param  port_num Port to read from
+  @param  dest Destination buffer
+  @param  size Bytes to read
+  @param  bytes_read Returned bytes read
+  @param  ticks Ticks to wait for each DMA buffer
+  @retval esp_err_t
+*/
+esp_err_t i2s_read(i2s_port_t port_num, void* dest, size_t size, size_t* bytes_read, TickType_t ticks)
+{
+  Port& port = ports[port_num];
+  *bytes_read = 0;
+
+  if (!port.installed)
+    return ESP_ERR_INVALID_STATE;
+
+  std::unique_lock<std::mutex> lock(port.mutex);
+
+  uint8_t* output = (uint8_t*) dest;
+  while (*bytes_read < size)
+  {
+    auto ready = [&port]{ return port.count > 0; };
+    if (ticks == portMAX_DELAY)
+      port.available.wait(lock, ready);
+    else if (!port.available.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready))
+      break;
+
+    std::vector<uint8_t>& buffer = port.buffers[port.head];
+    size_t length = std::min(size - *bytes_read, buffer.size() - port.offset);
+
+    memcpy(output + *bytes_read, buffer.data() + port.offset, length);
+    *bytes_read += length;
+    port.offset += length;
+
+    if (port.offset == buffer.size())
+    {
+      port.head = (port.head + 1) % port.buffers.size();
+      port.count--;
+      port.offset = 0;
+    }
+  }
+
+  return ESP_OK;
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#ifndef __ESP_IDF_VERSION_H__
+#define __ESP_IDF_VERSION_H__
+
+// The host shims follow the ESP-IDF 4.2 API
+#define ESP_IDF_VERSION_VAL(major, minor, patch) ((major << 16) | (minor << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(4, 2, 0)
+
+#endif
\ No newline at end of file
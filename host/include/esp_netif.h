@@ -0,0 +1,28 @@
+#ifndef __ESP_NETIF_H__
+#define __ESP_NETIF_H__
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lwip/igmp.h"
+
+typedef struct
+{
+  uint32_t addr;
+} esp_ip4_addr_t;
+
+typedef struct
+{
+  esp_ip4_addr_t ip;
+  esp_ip4_addr_t netmask;
+  esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct esp_netif_obj esp_netif_t;
+
+// All interface keys resolve to the host address chosen at startup
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char* key);
+esp_err_t esp_netif_get_ip_info(esp_netif_t* netif, esp_netif_ip_info_t* info);
+char* esp_ip4addr_ntoa(const esp_ip4_addr_t* addr, char* buffer, int length);
+
+#endif
\ No newline at end of file
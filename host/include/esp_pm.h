@@ -0,0 +1,9 @@
+#ifndef __ESP_PM_H__
+#define __ESP_PM_H__
+
+#include "esp_err.h"
+
+// Power management is not simulated. CONFIG_ENABLE_AUTOMATIC_LIGHT_SLEEP
+// is never set on the host
+
+#endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef __ESP_SYSTEM_H__
+#define __ESP_SYSTEM_H__
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Heap sizes are reported from the host allocator
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+
+void esp_restart(void) __attribute__((noreturn));
+
+#endif
\ No newline at end of file
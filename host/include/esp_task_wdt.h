@@ -0,0 +1,8 @@
+#ifndef __ESP_TASK_WDT_H__
+#define __ESP_TASK_WDT_H__
+
+#include "esp_err.h"
+
+// The task watchdog is not simulated
+
+#endif
\ No newline at end of file
@@ -0,0 +1,9 @@
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include <stdint.h>
+
+// Microseconds since the simulation started
+int64_t esp_timer_get_time(void);
+
+#endif
\ No newline at end of file
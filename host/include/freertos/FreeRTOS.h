@@ -0,0 +1,50 @@
+#ifndef __FREERTOS_H__
+#define __FREERTOS_H__
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+// FreeRTOS API subset backed by pthreads. One tick is one millisecond
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t) 0xffffffff)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+// Match the ESP32 so per-core structures keep their layout
+#define portNUM_PROCESSORS 2
+
+BaseType_t xPortGetCoreID(void);
+
+// Critical sections are spinlocks that also mask the core's interrupts on
+// the ESP32. Threads share simulated cores, so a mutex stands in for both
+typedef struct
+{
+  pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {PTHREAD_MUTEX_INITIALIZER}
+
+void vPortEnterCritical(portMUX_TYPE* mux);
+void vPortExitCritical(portMUX_TYPE* mux);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+// ESP-IDF headers make these available transitively
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#endif
\ No newline at end of file
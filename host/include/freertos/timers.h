@@ -0,0 +1,17 @@
+#ifndef __FREERTOS_TIMERS_H__
+#define __FREERTOS_TIMERS_H__
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct Timer* TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(const char* name, TickType_t period, UBaseType_t auto_reload, void* id, TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks);
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks);
+void* pvTimerGetTimerID(TimerHandle_t timer);
+
+#endif
\ No newline at end of file
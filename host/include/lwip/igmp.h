@@ -0,0 +1,20 @@
+#ifndef __LWIP_IGMP_H__
+#define __LWIP_IGMP_H__
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "esp_err.h"
+
+typedef struct
+{
+  uint32_t addr;
+} ip4_addr_t;
+
+#define IPADDR_ANY ((uint32_t) 0x00000000UL)
+
+// lwIP joins groups per interface but Linux joins per socket, so this
+// joins the group on every open UDP socket bound to the group address
+esp_err_t igmp_joingroup(const ip4_addr_t* interface_addr, const ip4_addr_t* group_addr);
+
+#endif
\ No newline at end of file
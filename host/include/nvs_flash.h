@@ -0,0 +1,81 @@
+#ifndef __NVS_FLASH_H__
+#define __NVS_FLASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// NVS backed by a file on the host. The file is loaded by nvs_flash_init
+// and rewritten on every commit
+#define NVS_DEFAULT_PART_NAME "nvs"
+#define NVS_KEY_NAME_MAX_SIZE 16
+
+typedef uint32_t nvs_handle_t;
+typedef struct nvs_opaque_iterator_t* nvs_iterator_t;
+
+typedef enum
+{
+  NVS_READONLY,
+  NVS_READWRITE,
+} nvs_open_mode_t;
+
+typedef enum
+{
+  NVS_TYPE_U8 = 0x01,
+  NVS_TYPE_I8 = 0x11,
+  NVS_TYPE_U16 = 0x02,
+  NVS_TYPE_I16 = 0x12,
+  NVS_TYPE_U32 = 0x04,
+  NVS_TYPE_I32 = 0x14,
+  NVS_TYPE_U64 = 0x08,
+  NVS_TYPE_I64 = 0x18,
+  NVS_TYPE_STR = 0x21,
+  NVS_TYPE_BLOB = 0x42,
+  NVS_TYPE_ANY = 0xff,
+} nvs_type_t;
+
+typedef struct
+{
+  char namespace_name[NVS_KEY_NAME_MAX_SIZE];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_type_t type;
+} nvs_entry_info_t;
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle);
+void nvs_close(nvs_handle_t handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key);
+esp_err_t nvs_erase_all(nvs_handle_t handle);
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value);
+esp_err_t nvs_set_i8(nvs_handle_t handle, const char* key, int8_t value);
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char* key, uint16_t value);
+esp_err_t nvs_set_i16(nvs_handle_t handle, const char* key, int16_t value);
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value);
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value);
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char* key, uint64_t value);
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char* key, int64_t value);
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length);
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* value);
+esp_err_t nvs_get_i8(nvs_handle_t handle, const char* key, int8_t* value);
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char* key, uint16_t* value);
+esp_err_t nvs_get_i16(nvs_handle_t handle, const char* key, int16_t* value);
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* value);
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* value);
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char* key, uint64_t* value);
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char* key, int64_t* value);
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* value, size_t* length);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length);
+
+nvs_iterator_t nvs_entry_find(const char* partition, const char* name, nvs_type_t type);
+nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator);
+void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t* info);
+void nvs_release_iterator(nvs_iterator_t iterator);
+
+#endif
\ No newline at end of file
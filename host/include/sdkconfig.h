@@ -0,0 +1,26 @@
+#ifndef __SDKCONFIG_H__
+#define __SDKCONFIG_H__
+
+// Project configuration for the host simulation build. Mirrors the
+// defaults of Kconfig.projbuild and sdkconfig.defaults
+#define CONFIG_LWIP_LOCAL_HOSTNAME "I2S Bridge"
+#define CONFIG_WIFI_SSID "host"
+#define CONFIG_WIFI_PASSWORD ""
+#define CONFIG_WARM_STANDBY_TIMEOUT 0
+#define CONFIG_I2S_CONCEALMENT_MS 5
+#define CONFIG_HTTP_PORT 8080
+#define CONFIG_HTTP_CONTROL_PORT 8081
+#define CONFIG_STREAM_BUDGET_KBPS 100000
+#define CONFIG_STREAM_MAX_CLIENTS 32
+#define CONFIG_SNAPCAST_SERVER 1 // Enabled so snapclient can be run against the simulation
+#define CONFIG_SNAPCAST_PORT 1704
+#define CONFIG_SNAPCAST_BUFFER_MS 1000
+#define CONFIG_I2S_SECOND_INPUT 1 // Enabled so both inputs can be fed from files
+#define CONFIG_I2S_SECOND_SHARED_CLOCK 1
+#define CONFIG_I2S_SECOND_BCK_GPIO 14
+#define CONFIG_I2S_SECOND_WS_GPIO 26
+#define CONFIG_I2S_SECOND_DATA_GPIO 35
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 240
+
+#endif
\ No newline at end of file
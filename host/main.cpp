@@ -0,0 +1,95 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+#include "host.h"
+
+#define TAG "Host"
+
+extern "C" void app_main(void);
+
+/**
+  @brief  Print command line usage
+
+  @param  name Program name
+  @retval none
+*/
+static void usage(const char* name)
+{
+  fprintf(stderr, "Usage: %s [options]\n", name);
+  fprintf(stderr, "  --wav FILE      Loop a WAV file as I2S input\n");
+  fprintf(stderr, "  --wav2 FILE     Loop a WAV file as the second I2S input\n");
+  fprintf(stderr, "  --tone HZ       Generate a tone when no WAV file is given. 0 for silence. Default 440\n");
+  fprintf(stderr, "  --counter       Generate a frame counter instead of audio for continuity checks\n");
+  fprintf(stderr, "  --source-rate HZ[,HZ...]  Clock the bus at these rates in turn. Default the WAV file's rate, else the driver's\n");
+  fprintf(stderr, "  --rate-period S Seconds at each source rate. Default 30\n");
+  fprintf(stderr, "  --nvs FILE      File backing NVS. Default nvs.txt\n");
+  fprintf(stderr, "  --address IP    Address handed to renderers. Default first non-loopback interface\n");
+  fprintf(stderr, "  --verbose       Enable debug logging\n");
+}
+
+/**
+  @brief  Entry point of the host simulation. Runs the firmware's
+          app_main then parks the main thread like the ESP-IDF main task
+
+  @param  argc Argument count
+  @param  argv Arguments
+  @retval int
+*/
+int main(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string option = argv[i];
+    const bool has_value = i + 1 < argc;
+
+    if (option == "--wav" && has_value)
+      Host::options.wav_path = argv[++i];
+    else if (option == "--wav2" && has_value)
+      Host::options.wav2_path = argv[++i];
+    else if (option == "--tone" && has_value)
+      Host::options.tone_frequency = strtoul(argv[++i], nullptr, 10);
+    else if (option == "--counter")
+      Host::options.counter = true;
+    else if (option == "--source-rate" && has_value)
+    {
+      // Comma separated list
+      for (char* rate = strtok(argv[++i], ","); rate != nullptr; rate = strtok(nullptr, ","))
+        Host::options.source_rates.push_back(strtoul(rate, nullptr, 10));
+    }
+    else if (option == "--rate-period" && has_value)
+      Host::options.rate_period = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+    else if (option == "--nvs" && has_value)
+      Host::options.nvs_path = argv[++i];
+    else if (option == "--address" && has_value)
+      Host::options.address = argv[++i];
+    else if (option == "--verbose")
+      esp_log_level_set("*", ESP_LOG_DEBUG);
+    else
+    {
+      usage(argv[0]);
+      return (option == "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  // Writes to closed client sockets must not kill the process
+  signal(SIGPIPE, SIG_IGN);
+
+  ESP_LOGI(TAG, "Starting host simulation.");
+
+  app_main();
+
+  while (true)
+    pause();
+
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,360 @@
+#include "nvs_flash.h"
+#include "esp_log.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+#define TAG "NVS"
+
+struct Entry
+{
+  nvs_type_t type;
+  std::vector<uint8_t> data;
+};
+
+typedef std::map<std::string, Entry> namespace_t;
+
+struct nvs_opaque_iterator_t
+{
+  std::vector<nvs_entry_info_t> entries;
+  size_t index = 0;
+};
+
+static std::mutex nvs_mutex;
+static std::map<std::string, namespace_t> namespaces;
+static std::vector<std::string> handles; // Handle N refers to namespace handles[N - 1]
+static bool initialized = false;
+
+/**
+  @brief  Write every namespace to the NVS file. One entry per line as
+          namespace, key, type and hex encoded data separated by tabs.
+          NVS mutex must be held
+
+  @param  none
+  @retval esp_err_t
+*/
+static esp_err_t save()
+{
+  const std::string temporary = Host::options.nvs_path + ".tmp";
+
+  std::ofstream file(temporary, std::ios::trunc);
+  if (!file)
+    return ESP_FAIL;
+
+  for (const auto& n : namespaces)
+  {
+    for (const auto& e : n.second)
+    {
+      file << n.first << '\t' << e.first << '\t' << (int) e.second.type << '\t';
+
+      char hex[3];
+      for (uint8_t byte : e.second.data)
+      {
+        snprintf(hex, sizeof(hex), "%02x", byte);
+        file << hex;
+      }
+
+      file << '\n';
+    }
+  }
+
+  file.close();
+  if (!file || rename(temporary.c_str(), Host::options.nvs_path.c_str()) != 0)
+    return ESP_FAIL;
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Load the NVS file. A missing file is an empty NVS
+
+  @param  none
+  @retval esp_err_t
+*/
+esp_err_t nvs_flash_init()
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespaces.clear();
+  initialized = true;
+
+  std::ifstream file(Host::options.nvs_path);
+  if (!file)
+  {
+    ESP_LOGI(TAG, "Starting with empty NVS at '%s'.", Host::options.nvs_path.c_str());
+    return ESP_OK;
+  }
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream fields(line);
+
+    std::string name, key, hex;
+    int type = 0;
+    if (!std::getline(fields, name, '\t') || !std::getline(fields, key, '\t') || !(fields >> type))
+    {
+      ESP_LOGW(TAG, "Skipping malformed NVS line '%s'.", line.c_str());
+      continue;
+    }
+
+    fields.ignore(1);
+    std::getline(fields, hex);
+
+    Entry& entry = namespaces[name][key];
+    entry.type = (nvs_type_t) type;
+
+    for (size_t i = 0; i + 1 < hex.length(); i += 2)
+      entry.data.push_back(strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase()
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespaces.clear();
+  return save();
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  if (!initialized)
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+
+  if (strlen(name) >= NVS_KEY_NAME_MAX_SIZE)
+    return ESP_ERR_NVS_INVALID_NAME;
+
+  handles.push_back(name);
+  *handle = handles.size();
+
+  return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+  // Handles are never reused so there is nothing to free
+}
+
+/**
+  @brief  Find the namespace of a handle. NVS mutex must be held
+
+  @param  handle NVS handle
+  @retval namespace_t* - nullptr if the handle is invalid
+*/
+static namespace_t* find_namespace(nvs_handle_t handle)
+{
+  if (handle == 0 || handle > handles.size())
+    return nullptr;
+
+  return &namespaces[handles[handle - 1]];
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  if (find_namespace(handle) == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  return save();
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespace_t* entries = find_namespace(handle);
+  if (entries == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  return entries->erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespace_t* entries = find_namespace(handle);
+  if (entries == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  entries->clear();
+  return ESP_OK;
+}
+
+/**
+  @brief  Store a value of any type
+
+  @param  handle NVS handle
+  @param  key Entry key
+  @param  type NVS type of the value
+  @param  data Value data
+  @param  length Length of the data in bytes
+  @retval esp_err_t
+*/
+static esp_err_t set_entry(nvs_handle_t handle, const char* key, nvs_type_t type, const void* data, size_t length)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespace_t* entries = find_namespace(handle);
+  if (entries == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+
+  Entry& entry = (*entries)[key];
+  entry.type = type;
+  entry.data.assign((const uint8_t*) data, (const uint8_t*) data + length);
+
+  return ESP_OK;
+}
+
+/**
+  @brief  Fetch a value of any type. Entries of another type are not found
+          as on the ESP32. On success length holds the stored length
+
+  @param  handle NVS handle
+  @param  key Entry key
+  @param  type NVS type of the value
+  @param  data Buffer for the value. May be null to query the length
+  @param  length Size of the buffer in bytes
+  @retval esp_err_t
+*/
+static esp_err_t get_entry(nvs_handle_t handle, const char* key, nvs_type_t type, void* data, size_t* length)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  namespace_t* entries = find_namespace(handle);
+  if (entries == nullptr)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+
+  auto it = entries->find(key);
+  if (it == entries->end() || it->second.type != type)
+    return ESP_ERR_NVS_NOT_FOUND;
+
+  const std::vector<uint8_t>& stored = it->second.data;
+  if (data != nullptr)
+  {
+    if (*length < stored.size())
+      return ESP_ERR_NVS_INVALID_LENGTH;
+
+    memcpy(data, stored.data(), stored.size());
+  }
+
+  *length = stored.size();
+  return ESP_OK;
+}
+
+#define NVS_INTEGER(type, suffix, nvs_type)                                   \
+  esp_err_t nvs_set_##suffix(nvs_handle_t handle, const char* key, type value) \
+  {                                                                           \
+    return set_entry(handle, key, nvs_type, &value, sizeof(value));           \
+  }                                                                           \
+                                                                              \
+  esp_err_t nvs_get_##suffix(nvs_handle_t handle, const char* key, type* value) \
+  {                                                                           \
+    size_t length = sizeof(type);                                             \
+    return get_entry(handle, key, nvs_type, value, &length);                  \
+  }
+
+NVS_INTEGER(uint8_t, u8, NVS_TYPE_U8)
+NVS_INTEGER(int8_t, i8, NVS_TYPE_I8)
+NVS_INTEGER(uint16_t, u16, NVS_TYPE_U16)
+NVS_INTEGER(int16_t, i16, NVS_TYPE_I16)
+NVS_INTEGER(uint32_t, u32, NVS_TYPE_U32)
+NVS_INTEGER(int32_t, i32, NVS_TYPE_I32)
+NVS_INTEGER(uint64_t, u64, NVS_TYPE_U64)
+NVS_INTEGER(int64_t, i64, NVS_TYPE_I64)
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value)
+{
+  // Strings are stored with their terminator
+  return set_entry(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* value, size_t* length)
+{
+  return get_entry(handle, key, NVS_TYPE_STR, value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+  return set_entry(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* value, size_t* length)
+{
+  return get_entry(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+/**
+  @brief  Start iterating the entries of a namespace. The entries are
+          captured up front so later writes don't disturb the iteration
+
+  @param  partition Ignored. There is a single partition
+  @param  name Namespace name
+  @param  type Entry type to find or NVS_TYPE_ANY
+  @retval nvs_iterator_t - nullptr if there are no entries
+*/
+nvs_iterator_t nvs_entry_find(const char* partition, const char* name, nvs_type_t type)
+{
+  std::lock_guard<std::mutex> lock(nvs_mutex);
+
+  auto n = namespaces.find(name);
+  if (n == namespaces.end())
+    return nullptr;
+
+  nvs_iterator_t iterator = new nvs_opaque_iterator_t();
+  for (const auto& e : n->second)
+  {
+    if (type != NVS_TYPE_ANY && e.second.type != type)
+      continue;
+
+    nvs_entry_info_t info = {};
+    strncpy(info.namespace_name, name, NVS_KEY_NAME_MAX_SIZE - 1);
+    strncpy(info.key, e.first.c_str(), NVS_KEY_NAME_MAX_SIZE - 1);
+    info.type = e.second.type;
+
+    iterator->entries.push_back(info);
+  }
+
+  if (iterator->entries.empty())
+  {
+    delete iterator;
+    return nullptr;
+  }
+
+  return iterator;
+}
+
+nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator)
+{
+  if (++iterator->index < iterator->entries.size())
+    return iterator;
+
+  delete iterator;
+  return nullptr;
+}
+
+void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t* info)
+{
+  *info = iterator->entries[iterator->index];
+}
+
+void nvs_release_iterator(nvs_iterator_t iterator)
+{
+  delete iterator;
+}
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "aligner.h"
+#include "mixer.h"
+#include "nvs_interface.h"
+
+#include "check.h"
+
+// Checks the second input path: two sources of frame counters with a
+// known phase offset and drift replayed through the aligner, and the
+// saturating sum of the aligned inputs
+
+// The mixer is tested alone, so its mode is never saved
+void NVS::set_mix_mode(const std::string& mode) {}
+std::string NVS::get_mix_mode() { return ""; }
+
+static const uint32_t FRAMES = 480;
+
+// Two inputs of FRAMES frame buffers. The first input's buffers complete
+// on its clock and are read just after completing. The second's complete
+// offset by a phase and running slow by some ppm, or fast if negative.
+// Each frame holds its index in the second input's source
+class Replay
+{
+  public:
+    Replay(double phase, double ppm, bool shared) : phase(phase), period(1 + ppm * 1e-6), buffer(FRAMES), output(FRAMES)
+    {
+      aligner.reset(sizeof(uint32_t), shared ? 0 : FRAMES);
+    }
+
+    /**
+      @brief  Replay blocks of the first input
+
+      @param  count Blocks to replay
+      @param  pulled Read the first input's blocks. Unread blocks model
+                     those lost to a first input overrun
+      @retval none
+    */
+    void run(uint32_t count, bool pulled = true)
+    {
+      for (uint32_t end = block + count; block < end; block++)
+      {
+        const double now = (block + 1.0) * FRAMES + 1;
+        for (; phase + (completed + 1.0) * FRAMES * period <= now; completed++)
+        {
+          for (uint32_t i = 0; i < FRAMES; i++)
+            buffer[i] = completed * FRAMES + i;
+
+          aligner.push(buffer.data(), FRAMES);
+          pushed += FRAMES;
+        }
+
+        if (!pulled)
+          continue;
+
+        aligner.pull(output.data(), FRAMES);
+        pulled_frames += FRAMES;
+
+        // Lag of the capture time of each end of the block
+        min_lag = INT64_MAX;
+        max_lag = INT64_MIN;
+        for (uint32_t i : {0u, FRAMES - 1})
+        {
+          const int64_t lag = llround(block * FRAMES + i - (phase + output[i] * period));
+          min_lag = std::min(min_lag, lag);
+          max_lag = std::max(max_lag, lag);
+        }
+
+        lowest_lag = std::min(lowest_lag, min_lag);
+        highest_lag = std::max(highest_lag, max_lag);
+      }
+    }
+
+    // Start tracking the range of lags afresh
+    void settle(void)
+    {
+      lowest_lag = INT64_MAX;
+      highest_lag = INT64_MIN;
+    }
+
+    /**
+      @brief  Test that every frame pushed was pulled, dropped or is held,
+              with repeats making up the rest of the pulled frames
+
+      @param  none
+      @retval bool
+    */
+    bool accounted(void) const
+    {
+      const I2S::Aligner::Stats& stats = aligner.stats();
+      return (int64_t) pushed - stats.dropped + stats.repeated == (int64_t) pulled_frames + aligner.level();
+    }
+
+    I2S::Aligner aligner;
+    int64_t min_lag = 0; // Lags of the last block pulled
+    int64_t max_lag = 0;
+    int64_t lowest_lag = INT64_MAX; // Lags since settling
+    int64_t highest_lag = INT64_MIN;
+
+  private:
+    const double phase;
+    const double period; // Of the second's frames
+    uint32_t block = 0;
+    uint32_t completed = 0; // Buffers of the second input
+    uint64_t pushed = 0;
+    uint64_t pulled_frames = 0;
+    std::vector<uint32_t> buffer;
+    std::vector<uint32_t> output;
+};
+
+static void test_shared_clocks()
+{
+  // Buffers complete together, so frames line up exactly from the start
+  Replay replay(0, 0, true);
+  replay.run(6000);
+
+  const I2S::Aligner::Stats& stats = replay.aligner.stats();
+  CHECK_EQ(stats.dropped, 0u);
+  CHECK_EQ(stats.repeated, 0u);
+  CHECK_EQ(stats.resyncs, 0u);
+  CHECK_EQ(replay.lowest_lag, 0);
+  CHECK_EQ(replay.highest_lag, 0);
+  CHECK(replay.accounted());
+}
+
+static void test_phase_offset()
+{
+  // Half a block behind. The first pull finds no frames and jumps to a
+  // block beyond the first input's, plus the phase
+  Replay replay(240, 0, false);
+  replay.run(2);
+  replay.settle();
+  replay.run(5998);
+
+  const I2S::Aligner::Stats& stats = replay.aligner.stats();
+  CHECK_EQ(stats.resyncs, 1u);
+  CHECK_EQ(stats.repeated, 2 * FRAMES);
+  CHECK_EQ(stats.dropped, 0u);
+  CHECK_EQ(replay.lowest_lag, 720);
+  CHECK_EQ(replay.highest_lag, 720);
+  CHECK(replay.accounted());
+}
+
+static void test_drift(double phase, double ppm)
+{
+  Replay replay(phase, ppm, false);
+  replay.run(100);
+  const I2S::Aligner::Stats initial = replay.aligner.stats();
+  CHECK_EQ(initial.resyncs, 1u);
+
+  // 60 s of drift is crawled back a frame at a time without jumping
+  replay.settle();
+  replay.run(6000);
+
+  const I2S::Aligner::Stats& stats = replay.aligner.stats();
+  CHECK_EQ(stats.resyncs, 1u);
+
+  // A slow second input is repeated and a fast one dropped, by the frames
+  // it drifted to within a block, as buffer completions cross a block at a time
+  const int64_t slipped = (int64_t) (stats.repeated - initial.repeated) - (int64_t) (stats.dropped - initial.dropped);
+  const int64_t drift = llround(6000.0 * FRAMES * ppm * 1e-6);
+  CHECK(std::abs(slipped - drift) <= (int64_t) FRAMES);
+  CHECK((ppm > 0) ? stats.repeated > initial.repeated : stats.dropped > initial.dropped);
+
+  // Held within a block either side of the target, plus the few frames
+  // drifted while a window of pulls finds the level
+  const int64_t target = phase + FRAMES;
+  CHECK(replay.lowest_lag >= target - (int64_t) (FRAMES + FRAMES / 20));
+  CHECK(replay.highest_lag <= target + (int64_t) (FRAMES + FRAMES / 20));
+  CHECK(replay.accounted());
+}
+
+static void test_overrun()
+{
+  // Two blocks of the first input lost to an overrun leave the FIFO two
+  // blocks deep on shared clocks. Too far to crawl, so the aligner jumps
+  // back once a whole window has seen the excess
+  Replay replay(0, 0, true);
+  replay.run(100);
+  replay.run(2, false);
+  replay.run(1);
+  CHECK_EQ(replay.min_lag, (int64_t) (2 * FRAMES));
+
+  replay.run(2 * I2S::Aligner::WINDOW);
+  replay.settle();
+  replay.run(100);
+
+  const I2S::Aligner::Stats& stats = replay.aligner.stats();
+  CHECK_EQ(stats.resyncs, 1u);
+  CHECK_EQ(stats.dropped, 2 * FRAMES);
+  CHECK_EQ(stats.repeated, 0u);
+  CHECK_EQ(replay.lowest_lag, 0);
+  CHECK_EQ(replay.highest_lag, 0);
+  CHECK(replay.accounted());
+
+  // A single lost block is crawled back a frame per pull
+  Replay crawled(0, 0, true);
+  crawled.run(100);
+  crawled.run(1, false);
+  crawled.run(FRAMES + 2 * I2S::Aligner::WINDOW);
+  crawled.settle();
+  crawled.run(100);
+
+  CHECK_EQ(crawled.aligner.stats().resyncs, 0u);
+  CHECK_EQ(crawled.aligner.stats().dropped, FRAMES);
+  CHECK_EQ(crawled.lowest_lag, 0);
+  CHECK_EQ(crawled.highest_lag, 0);
+  CHECK(crawled.accounted());
+}
+
+static void test_restart()
+{
+  // Restarting the inputs realigns from scratch with one jump
+  Replay replay(0, 0, false);
+  replay.run(100);
+  replay.aligner.reset(sizeof(uint32_t), FRAMES);
+  replay.run(2);
+  replay.settle();
+  replay.run(100);
+
+  const I2S::Aligner::Stats& stats = replay.aligner.stats();
+  CHECK_EQ(stats.resyncs, 2u);
+  CHECK_EQ(stats.repeated, 2 * FRAMES);
+  CHECK_EQ(replay.lowest_lag, (int64_t) FRAMES);
+  CHECK_EQ(replay.highest_lag, (int64_t) FRAMES);
+}
+
+/**
+  @brief  Fill a block of both channels with a sample
+
+  @param  block Block to fill
+  @param  sample Sample in the container of F
+  @retval none
+*/
+template <typename F>
+static void fill(I2S::block_t& block, typename F::sample_t sample)
+{
+  block.frames = FRAMES;
+  block.sample_rate = 48000;
+  block.bits_per_sample = F::bits_per_sample;
+  std::fill(block.data<F>(), block.data<F>() + 2 * FRAMES, sample);
+}
+
+template <typename F>
+static void test_mix(const char* mode)
+{
+  typedef typename F::sample_t sample_t;
+
+  const sample_t max = std::numeric_limits<sample_t>::max();
+  const sample_t min = std::numeric_limits<sample_t>::min();
+
+  CHECK(Mixer::set_mode(mode));
+  Mixer::reset();
+
+  // Full scale of the same sign saturates rather than wrapping. Ducking
+  // lowers the second input, so the first input at full scale still clips
+  static I2S::block_t first;
+  static I2S::block_t second;
+  std::vector<std::array<sample_t, 3>> cases = {
+    {max, max, max},
+    {min, min, min},
+    {max, 1, max},
+    {min, -1, min},
+  };
+
+  // Only an unscaled sum of opposite full scales cancels
+  if (strcmp(mode, "sum") == 0)
+    cases.push_back({max, min, -1});
+
+  for (const auto& c : cases)
+  {
+    fill<F>(first, c[0]);
+    fill<F>(second, c[1]);
+
+    const I2S::block_t& program = Mixer::process(first, second);
+    CHECK_EQ(program.frames, FRAMES);
+
+    const sample_t* samples = program.data<F>();
+    CHECK(std::all_of(samples, samples + 2 * FRAMES, [&](sample_t s) { return s == c[2]; }));
+  }
+}
+
+int main()
+{
+  test_shared_clocks();
+  test_phase_offset();
+  test_drift(240, 100);
+  test_drift(240, -100);
+  test_drift(0, 500);
+  test_drift(0, -500);
+  test_overrun();
+  test_restart();
+
+  test_mix<I2S::format16_t>("sum");
+  test_mix<I2S::format16_t>("duck");
+  test_mix<I2S::format32_t>("sum");
+  test_mix<I2S::format32_t>("duck");
+
+  return Check::result("alignment");
+}
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include <cstdint>
+
+#include "audio_monitor.h"
+
+#include "check.h"
+
+// Checks the audio state machine that starts and stops renderers: the
+// hysteresis on either side of silence, warm standby expiring into a stop
+// and audio resuming from standby with and without renderers streaming
+
+using System::AudioMonitor;
+using System::AudioState;
+
+static const int32_t SILENT_TIMEOUT = 20;
+static const int32_t ACTIVE_TIMEOUT = 60;
+static const int32_t STANDBY_TIMEOUT = 40;
+static const int64_t CHECK_US = 250000;
+
+static bool streaming = false;
+static int streaming_calls = 0;
+
+static bool renderers_streaming(void)
+{
+  streaming_calls++;
+  return streaming;
+}
+
+// Checks of the audio state every 250 ms, as the system task makes them
+class Checks
+{
+  public:
+    explicit Checks(AudioMonitor& monitor) : monitor(monitor) {}
+
+    /**
+      @brief  Run checks of one kind of audio
+
+      @param  silent Audio is silent
+      @param  count Checks to run
+      @param  action Receives the first action other than None
+      @retval int - Checks run until that action, or count if none
+    */
+    int run(bool silent, int count, AudioMonitor::Action& action)
+    {
+      action = AudioMonitor::Action::None;
+      for (int i = 0; i < count; i++)
+      {
+        time += CHECK_US;
+        AudioMonitor::Action result = monitor.update(silent, time, renderers_streaming);
+        if (result != AudioMonitor::Action::None && action == AudioMonitor::Action::None)
+        {
+          action = result;
+          return i + 1;
+        }
+      }
+
+      return count;
+    }
+
+  private:
+    AudioMonitor& monitor;
+    int64_t time = 0;
+};
+
+// Activate a monitor with its first audio
+static void activate(AudioMonitor& monitor, Checks& checks)
+{
+  AudioMonitor::Action action;
+  checks.run(false, SILENT_TIMEOUT + 1, action);
+  CHECK(action == AudioMonitor::Action::Enable);
+  CHECK(monitor.state() == AudioState::Active);
+}
+
+static void test_hysteresis()
+{
+  AudioMonitor monitor(SILENT_TIMEOUT, ACTIVE_TIMEOUT, 0);
+  Checks checks(monitor);
+  AudioMonitor::Action action;
+
+  // Silence at start changes nothing
+  CHECK_EQ(checks.run(true, 100, action), 100);
+  CHECK(action == AudioMonitor::Action::None);
+
+  // Audio enables control after the silent timeout
+  CHECK_EQ(checks.run(false, 100, action), SILENT_TIMEOUT + 1);
+  CHECK(action == AudioMonitor::Action::Enable);
+  CHECK(monitor.state() == AudioState::Active);
+
+  // Short silences are bridged and refill the timeout
+  CHECK_EQ(checks.run(true, ACTIVE_TIMEOUT - 1, action), ACTIVE_TIMEOUT - 1);
+  CHECK(action == AudioMonitor::Action::None);
+  checks.run(false, ACTIVE_TIMEOUT, action);
+  CHECK(action == AudioMonitor::Action::None);
+
+  // Without standby, silence disables control after the active timeout
+  CHECK_EQ(checks.run(true, 200, action), ACTIVE_TIMEOUT + 1);
+  CHECK(action == AudioMonitor::Action::Disable);
+  CHECK(monitor.state() == AudioState::Silent);
+}
+
+static void test_standby_expiry()
+{
+  AudioMonitor monitor(SILENT_TIMEOUT, ACTIVE_TIMEOUT, STANDBY_TIMEOUT);
+  Checks checks(monitor);
+  AudioMonitor::Action action;
+  activate(monitor, checks);
+
+  // Standby follows the active timeout and lasts its own before control stops
+  CHECK_EQ(checks.run(true, ACTIVE_TIMEOUT + 1, action), ACTIVE_TIMEOUT + 1);
+  CHECK(action == AudioMonitor::Action::None);
+  CHECK(monitor.state() == AudioState::Standby);
+  CHECK_EQ(checks.run(true, 200, action), STANDBY_TIMEOUT + 1);
+  CHECK(action == AudioMonitor::Action::Disable);
+  CHECK(monitor.state() == AudioState::Silent);
+
+  // Audio after standby expired needs the silent timeout again
+  CHECK_EQ(checks.run(false, 100, action), SILENT_TIMEOUT + 1);
+  CHECK(action == AudioMonitor::Action::Enable);
+}
+
+static void test_standby_resume()
+{
+  // Renderers still streaming need nothing
+  {
+    AudioMonitor monitor(SILENT_TIMEOUT, ACTIVE_TIMEOUT, STANDBY_TIMEOUT);
+    Checks checks(monitor);
+    AudioMonitor::Action action;
+    activate(monitor, checks);
+    checks.run(true, ACTIVE_TIMEOUT + 10, action);
+    CHECK(monitor.state() == AudioState::Standby);
+
+    streaming = true;
+    streaming_calls = 0;
+    CHECK_EQ(checks.run(false, 1, action), 1);
+    CHECK(action == AudioMonitor::Action::None);
+    CHECK(monitor.state() == AudioState::Active);
+    CHECK_EQ(streaming_calls, 1);
+
+    // Back in active with its full timeout, so standby follows it again
+    CHECK_EQ(checks.run(true, ACTIVE_TIMEOUT + 1, action), ACTIVE_TIMEOUT + 1);
+    CHECK(action == AudioMonitor::Action::None);
+    CHECK(monitor.state() == AudioState::Standby);
+  }
+
+  // Renderers that dropped during standby are restarted by the first audible
+  // check, without the silent timeout, and the state is active at once
+  {
+    AudioMonitor monitor(SILENT_TIMEOUT, ACTIVE_TIMEOUT, STANDBY_TIMEOUT);
+    Checks checks(monitor);
+    AudioMonitor::Action action;
+    activate(monitor, checks);
+    checks.run(true, ACTIVE_TIMEOUT + 10, action);
+    CHECK(monitor.state() == AudioState::Standby);
+
+    streaming = false;
+    streaming_calls = 0;
+    CHECK_EQ(checks.run(false, 1, action), 1);
+    CHECK(action == AudioMonitor::Action::Restart);
+    CHECK(monitor.state() == AudioState::Active);
+    CHECK_EQ(streaming_calls, 1);
+
+    // Further audio takes no more actions
+    CHECK_EQ(checks.run(false, 200, action), 200);
+    CHECK(action == AudioMonitor::Action::None);
+
+    // And standby still expires into a stop after the restart
+    checks.run(true, ACTIVE_TIMEOUT + 1, action);
+    CHECK(monitor.state() == AudioState::Standby);
+    checks.run(true, 200, action);
+    CHECK(action == AudioMonitor::Action::Disable);
+  }
+}
+
+int main()
+{
+  test_hysteresis();
+  test_standby_expiry();
+  test_standby_resume();
+
+  return Check::result("audio_monitor");
+}
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include <cstdint>
+#include <vector>
+
+#include "budget.h"
+
+#include "check.h"
+
+// Checks which traffic cuts the stream budget: a slow client beside a
+// healthy one, a stalled reader and a pending probe leave it alone, while
+// every reading client dropping cuts it to what the link delivered
+
+static const uint32_t LIMIT = 12000000;
+static const uint32_t BITRATE = 1536000;
+static const int64_t WINDOW = HTTP::Budget::WINDOW_US;
+
+// Traffic of a client that delivered a share of its bitrate in a window
+static HTTP::Budget::Traffic traffic(double share, uint32_t drops, bool stalled = false)
+{
+  return {(uint64_t) (BITRATE * share / 8), drops, BITRATE, stalled};
+}
+
+static void test_slow_client()
+{
+  HTTP::Budget budget(LIMIT, 8);
+  CHECK(budget.admit(BITRATE));
+  CHECK(budget.admit(BITRATE));
+
+  // The slow client takes half its stream and drops, the healthy one keeps up
+  budget.update(0, {});
+  for (int64_t window = 1; window <= 5; window++)
+  {
+    budget.update(window * WINDOW, {traffic(0.5, 20), traffic(1, 0)});
+    CHECK_EQ(budget.capacity(), LIMIT);
+    CHECK(!budget.overcommitted());
+  }
+
+  CHECK_EQ(budget.throughput(), BITRATE * 3 / 2);
+
+  // So newcomers are still admitted
+  CHECK(budget.admit(BITRATE));
+}
+
+static void test_stalled_client()
+{
+  HTTP::Budget budget(LIMIT, 8);
+  CHECK(budget.admit(BITRATE));
+  CHECK(budget.admit(BITRATE));
+
+  // A reader that stopped drops everything, but says nothing about the link
+  budget.update(0, {});
+  budget.update(WINDOW, {traffic(0, 50, true), traffic(1, 0)});
+  CHECK_EQ(budget.capacity(), LIMIT);
+  CHECK_EQ(budget.throughput(), BITRATE);
+
+  // Even when it's the only streaming client
+  budget.update(2 * WINDOW, {traffic(0, 50, true)});
+  CHECK_EQ(budget.capacity(), LIMIT);
+}
+
+static void test_pending_probe()
+{
+  HTTP::Budget budget(8 * BITRATE, 8);
+  CHECK(budget.admit(BITRATE));
+  CHECK(budget.admit(BITRATE));
+
+  // A probe reserves its bitrate but isn't streaming yet
+  CHECK(budget.admit(BITRATE));
+
+  // Both streaming clients drop at 0.9 of their stream, so the link is
+  // full. The cut measures them alone and keeps the probe's reservation,
+  // rather than counting the probe as a client the link carried nothing of
+  budget.update(0, {});
+  budget.update(WINDOW, {traffic(0.9, 3), traffic(0.9, 3)});
+  CHECK_EQ(budget.throughput(), (uint32_t) (BITRATE * 1.8));
+  CHECK_EQ(budget.capacity(), (uint32_t) (BITRATE * 2.8));
+}
+
+static void test_full_link()
+{
+  HTTP::Budget budget(LIMIT, 8);
+  for (int i = 0; i < 4; i++)
+    CHECK(budget.admit(BITRATE));
+
+  // Every reading client drops, so the budget is cut to what was delivered
+  // and held there for the holdoff before recovering
+  budget.update(0, {});
+  const std::vector<HTTP::Budget::Traffic> full = {traffic(0.75, 5), traffic(0.75, 5), traffic(0.75, 5), traffic(0.75, 5)};
+  budget.update(WINDOW, full);
+  CHECK_EQ(budget.capacity(), 3 * BITRATE);
+  CHECK(budget.overcommitted());
+
+  budget.release(BITRATE);
+  const std::vector<HTTP::Budget::Traffic> clean = {traffic(1, 0), traffic(1, 0), traffic(1, 0)};
+  for (uint32_t window = 0; window < HTTP::Budget::MIN_HOLDOFF; window++)
+    budget.update((2 + window) * WINDOW, clean);
+
+  CHECK_EQ(budget.capacity(), 3 * BITRATE);
+  budget.update((2 + HTTP::Budget::MIN_HOLDOFF) * WINDOW, clean);
+  CHECK_EQ(budget.capacity(), 3 * BITRATE + LIMIT * HTTP::Budget::RECOVERY_PERMILLE / 1000);
+}
+
+int main()
+{
+  test_slow_client();
+  test_stalled_client();
+  test_pending_probe();
+  test_full_link();
+
+  return Check::result("budget");
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "audio.h"
+
+#include "check.h"
+
+// Checks the mono stream variants: downmix rounding and behaviour at full
+// scale, and that left and right select the right channel
+
+template <typename T>
+struct Case
+{
+  T left;
+  T right;
+  T downmix;
+};
+
+/**
+  @brief  Hand computed downmixes. The mean rounds toward negative
+          infinity and full scale inputs must not wrap
+
+  @param  none
+  @retval std::vector<Case<T>>
+*/
+template <typename T>
+static std::vector<Case<T>> cases()
+{
+  const T max = std::numeric_limits<T>::max();
+  const T min = std::numeric_limits<T>::min();
+
+  return {
+    {0, 0, 0},
+    {1, 2, 1},
+    {2, 1, 1},
+    {-1, -2, -2},
+    {1, -2, -1},
+    {-1, 0, -1},
+    {-1, 1, 0},
+    {3, 4, 3},
+    {-3, -4, -4},
+    {max, max, max},
+    {min, min, min},
+    {max, min, -1},
+    {min, max, -1},
+    {max, (T) (max - 1), (T) (max - 1)},
+    {min, (T) (min + 1), min},
+    {max, 0, (T) (max / 2)},
+    {min, 0, (T) (min / 2)},
+    {min, -1, (T) (min / 2 - 1)},
+  };
+}
+
+template <typename F>
+static void test_cases()
+{
+  typedef typename F::sample_t sample_t;
+
+  const std::vector<Case<sample_t>> table = cases<sample_t>();
+  const uint32_t frames = table.size();
+
+  std::vector<sample_t> stereo;
+  for (const Case<sample_t>& c : table)
+  {
+    stereo.push_back(c.left);
+    stereo.push_back(c.right);
+  }
+
+  std::vector<sample_t> mono(frames);
+  Audio::mix<F>(stereo.data(), mono.data(), frames, Audio::Mix::Downmix);
+  for (uint32_t i = 0; i < frames; i++)
+    CHECK_EQ(mono[i], table[i].downmix);
+
+  Audio::mix<F>(stereo.data(), mono.data(), frames, Audio::Mix::Left);
+  for (uint32_t i = 0; i < frames; i++)
+    CHECK_EQ(mono[i], table[i].left);
+
+  Audio::mix<F>(stereo.data(), mono.data(), frames, Audio::Mix::Right);
+  for (uint32_t i = 0; i < frames; i++)
+    CHECK_EQ(mono[i], table[i].right);
+}
+
+template <typename F>
+static void test_sweep()
+{
+  typedef typename F::sample_t sample_t;
+
+  // Pseudo random pairs, checked against the mean formed in 64 bits
+  const uint32_t frames = 4096;
+  std::vector<sample_t> stereo(2 * frames);
+  uint32_t state = 12345;
+  for (sample_t& sample : stereo)
+  {
+    state = state * 1664525 + 1013904223;
+    sample = (sample_t) (state >> (32 - F::container_bits));
+  }
+
+  std::vector<sample_t> mono(frames);
+  Audio::downmix<F>(stereo.data(), mono.data(), frames);
+
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    const int64_t sum = (int64_t) stereo[2 * i] + stereo[2 * i + 1];
+    const int64_t floor = (sum >= 0) ? sum / 2 : (sum - 1) / 2;
+    CHECK_EQ((int64_t) mono[i], floor);
+  }
+
+  // Left and right are the first and second samples of each frame
+  std::vector<sample_t> left(frames);
+  std::vector<sample_t> right(frames);
+  Audio::mix<F>(stereo.data(), left.data(), frames, Audio::Mix::Left);
+  Audio::mix<F>(stereo.data(), right.data(), frames, Audio::Mix::Right);
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    CHECK_EQ(left[i], stereo[2 * i]);
+    CHECK_EQ(right[i], stereo[2 * i + 1]);
+  }
+}
+
+int main()
+{
+  test_cases<Audio::S16Stereo>();
+  test_cases<Audio::S32Stereo>();
+
+  test_sweep<Audio::S16Stereo>();
+  test_sweep<Audio::S24Stereo>();
+  test_sweep<Audio::S32Stereo>();
+
+  return Check::result("channel_mix");
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <cmath>
+#include <cstdio>
+
+// Assertions of the host tests. A failed check is reported and counted
+// rather than aborting, so one run lists every mismatch
+namespace Check
+{
+  inline int failures = 0;
+
+  inline bool check(bool condition, const char* expression, const char* file, int line)
+  {
+    if (!condition)
+    {
+      printf("%s:%d: CHECK(%s) failed\n", file, line, expression);
+      failures++;
+    }
+
+    return condition;
+  }
+
+  template <typename A, typename B>
+  bool equal(const A& a, const B& b, const char* expression_a, const char* expression_b, const char* file, int line)
+  {
+    if (a != b)
+    {
+      printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", file, line, expression_a, expression_b, (long long) a, (long long) b);
+      failures++;
+      return false;
+    }
+
+    return true;
+  }
+
+  inline bool near(double a, double b, double tolerance, const char* expression_a, const char* expression_b, const char* file, int line)
+  {
+    if (!(std::fabs(a - b) <= tolerance))
+    {
+      printf("%s:%d: CHECK_NEAR(%s, %s) failed: %g != %g within %g\n", file, line, expression_a, expression_b, a, b, tolerance);
+      failures++;
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+    @brief  Report the result of a test run
+
+    @param  name Name of the test
+    @retval int - Exit code. Non-zero if any check failed
+  */
+  inline int result(const char* name)
+  {
+    if (failures)
+      printf("%s: %d checks failed\n", name, failures);
+    else
+      printf("%s: passed\n", name);
+
+    return failures ? 1 : 0;
+  }
+}
+
+#define CHECK(condition) Check::check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_EQ(a, b) Check::equal((a), (b), #a, #b, __FILE__, __LINE__)
+#define CHECK_NEAR(a, b, tolerance) Check::near((a), (b), (tolerance), #a, #b, __FILE__, __LINE__)
+
+#endif
\ No newline at end of file
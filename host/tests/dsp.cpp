@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "dsp.h"
+#include "nvs_interface.h"
+
+#include "check.h"
+
+// Checks the fixed point DSP chain: biquad sections against a double
+// precision reference, the limiter's ceiling on full scale steps, and
+// that digital silence passes the bypass bit exact
+
+// The chain is tested alone, so settings are never saved
+void NVS::set_dsp(const DSP::Settings& settings) {}
+bool NVS::get_dsp(DSP::Settings& settings) { return false; }
+
+static const uint32_t SAMPLE_RATE = 48000;
+static const uint32_t FRAMES = I2S::BUFFER_SAMPLE_COUNT;
+static const double Q27 = 1 << 27;
+static const double Q28 = 1 << 28;
+
+/**
+  @brief  Reference biquad in double precision, direct form I as the
+          fixed point sections are
+
+  @param  c Quantized coefficients, taken exactly
+  @param  x Input
+  @retval std::vector<double>
+*/
+static std::vector<double> reference_biquad(const DSP::Coefficients& c, const std::vector<double>& x)
+{
+  const double b0 = c.b0 / Q28, b1 = c.b1 / Q28, b2 = c.b2 / Q28, a1 = c.a1 / Q28, a2 = c.a2 / Q28;
+
+  std::vector<double> y(x.size());
+  double x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+  for (size_t i = 0; i < x.size(); i++)
+  {
+    y[i] = b0 * x[i] + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+    x2 = x1;
+    x1 = x[i];
+    y2 = y1;
+    y1 = y[i];
+  }
+
+  return y;
+}
+
+/**
+  @brief  Reference cookbook design in double precision
+
+  @param  filter Filter to design
+  @param  sample_rate Sample rate
+  @param  c Normalized b0, b1, b2, a1 and a2 to write
+  @retval none
+*/
+static void reference_design(const DSP::Filter& filter, uint32_t sample_rate, double (&c)[5])
+{
+  const double A = pow(10, filter.gain_db / 40.0);
+  const double w0 = 2 * M_PI * filter.frequency / sample_rate;
+  const double alpha = sin(w0) / (2 * filter.q);
+  const double cos_w0 = cos(w0);
+  const double sqrt_A = sqrt(A);
+
+  double b0, b1, b2, a0, a1, a2;
+  switch (filter.type)
+  {
+    default:
+    case DSP::FilterType::Peaking:
+      b0 = 1 + alpha * A; b1 = -2 * cos_w0; b2 = 1 - alpha * A;
+      a0 = 1 + alpha / A; a1 = -2 * cos_w0; a2 = 1 - alpha / A;
+      break;
+
+    case DSP::FilterType::LowShelf:
+      b0 = A * ((A + 1) - (A - 1) * cos_w0 + 2 * sqrt_A * alpha);
+      b1 = 2 * A * ((A - 1) - (A + 1) * cos_w0);
+      b2 = A * ((A + 1) - (A - 1) * cos_w0 - 2 * sqrt_A * alpha);
+      a0 = (A + 1) + (A - 1) * cos_w0 + 2 * sqrt_A * alpha;
+      a1 = -2 * ((A - 1) + (A + 1) * cos_w0);
+      a2 = (A + 1) + (A - 1) * cos_w0 - 2 * sqrt_A * alpha;
+      break;
+
+    case DSP::FilterType::HighShelf:
+      b0 = A * ((A + 1) + (A - 1) * cos_w0 + 2 * sqrt_A * alpha);
+      b1 = -2 * A * ((A - 1) + (A + 1) * cos_w0);
+      b2 = A * ((A + 1) + (A - 1) * cos_w0 - 2 * sqrt_A * alpha);
+      a0 = (A + 1) - (A - 1) * cos_w0 + 2 * sqrt_A * alpha;
+      a1 = 2 * ((A - 1) - (A + 1) * cos_w0);
+      a2 = (A + 1) - (A - 1) * cos_w0 - 2 * sqrt_A * alpha;
+      break;
+
+    case DSP::FilterType::LowPass:
+      b0 = (1 - cos_w0) / 2; b1 = 1 - cos_w0; b2 = (1 - cos_w0) / 2;
+      a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+      break;
+
+    case DSP::FilterType::HighPass:
+      b0 = (1 + cos_w0) / 2; b1 = -(1 + cos_w0); b2 = (1 + cos_w0) / 2;
+      a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+      break;
+  }
+
+  c[0] = b0 / a0;
+  c[1] = b1 / a0;
+  c[2] = b2 / a0;
+  c[3] = a1 / a0;
+  c[4] = a2 / a0;
+}
+
+static const DSP::Filter FILTERS[] = {
+  {DSP::FilterType::Peaking, 1000, 6, 1},
+  {DSP::FilterType::Peaking, 60, -12, 4},
+  {DSP::FilterType::LowShelf, 40, 12, 0.7},
+  {DSP::FilterType::HighShelf, 8000, -6, 0.7},
+  {DSP::FilterType::LowPass, 200, 0, 0.707},
+  {DSP::FilterType::HighPass, 20, 0, 0.5},
+};
+
+static void test_biquad()
+{
+  // Two tones and a low level of noise at -12 dBFS, different per channel
+  const uint32_t frames = 20 * FRAMES;
+  std::vector<int32_t> input(2 * frames);
+  uint32_t state = 1;
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    for (uint32_t ch = 0; ch < 2; ch++)
+    {
+      state = state * 1664525 + 1013904223;
+      const double noise = ((int32_t) state / 2147483648.0) * 0.01;
+      const double tone = 0.2 * sin(2 * M_PI * (50 + 50 * ch) * i / SAMPLE_RATE) + 0.05 * sin(2 * M_PI * 3000 * i / SAMPLE_RATE);
+      input[2 * i + ch] = (int32_t) lround((tone + noise) * Q27);
+    }
+  }
+
+  for (const DSP::Filter& filter : FILTERS)
+  {
+    // Quantized coefficients match the double precision design
+    const DSP::Coefficients c = DSP::design(filter, SAMPLE_RATE);
+    double expected[5];
+    reference_design(filter, SAMPLE_RATE, expected);
+    CHECK_NEAR(c.b0 / Q28, expected[0], 1e-5);
+    CHECK_NEAR(c.b1 / Q28, expected[1], 1e-5);
+    CHECK_NEAR(c.b2 / Q28, expected[2], 1e-5);
+    CHECK_NEAR(c.a1 / Q28, expected[3], 1e-5);
+    CHECK_NEAR(c.a2 / Q28, expected[4], 1e-5);
+
+    // Filter block by block as the chain does
+    std::vector<int32_t> output = input;
+    DSP::BiquadState biquad_state[2] = {};
+    for (uint32_t i = 0; i < frames; i += FRAMES)
+      DSP::biquad<2>(c, biquad_state, output.data() + 2 * i, FRAMES);
+
+    for (uint32_t ch = 0; ch < 2; ch++)
+    {
+      std::vector<double> x(frames);
+      for (uint32_t i = 0; i < frames; i++)
+        x[i] = input[2 * i + ch] / Q27;
+
+      const std::vector<double> y = reference_biquad(c, x);
+
+      // Requantization noise stays below -120 dBFS even for poles close to
+      // the unit circle, where it is amplified most
+      double error = 0;
+      for (uint32_t i = 0; i < frames; i++)
+        error = fmax(error, fabs(output[2 * i + ch] / Q27 - y[i]));
+
+      CHECK_NEAR(error, 0, 1e-6);
+    }
+  }
+}
+
+/**
+  @brief  Settings of a chain with the limiter at -1 dBFS
+
+  @param  gain_db Gain before the limiter
+  @retval DSP::Settings
+*/
+static DSP::Settings limiter_settings(float gain_db)
+{
+  DSP::Settings settings;
+  settings.enabled = true;
+  settings.gain_db = gain_db;
+  settings.limiter = {true, -1, 2, 50};
+  return settings;
+}
+
+template <typename F>
+static void test_limiter_step(float gain_db, typename F::sample_t step)
+{
+  typedef typename F::sample_t sample_t;
+
+  DSP::Chain chain;
+  chain.configure(limiter_settings(gain_db), SAMPLE_RATE);
+
+  // Ceiling in the container of F, rounded as the chain rounds its output
+  const int64_t threshold = DSP::gain(-1, 31 - DSP::HEADROOM_BITS);
+  const int64_t shift = 32 - F::bits_per_sample;
+  const int64_t ceiling = ((threshold * (1 << DSP::HEADROOM_BITS) + ((int64_t) 1 << shift >> 1)) >> shift) << (F::container_bits - F::bits_per_sample);
+
+  std::vector<sample_t> block(2 * FRAMES);
+  bool limited = false;
+  int64_t peak = 0;
+  for (int i = 0; i < 50; i++)
+  {
+    // A block of silence, then a full scale step held
+    std::fill(block.begin(), block.end(), (i == 0) ? 0 : step);
+    limited |= chain.process<F>(block.data(), FRAMES);
+
+    for (sample_t sample : block)
+      peak = std::max(peak, std::abs((int64_t) sample));
+  }
+
+  CHECK(limited);
+  CHECK(peak <= ceiling);
+
+  // Gain settles on the ceiling rather than below it
+  CHECK(std::abs((int64_t) block.back()) >= ceiling * 99 / 100);
+}
+
+static void test_limiter()
+{
+  test_limiter_step<Audio::S16Stereo>(0, INT16_MAX);
+  test_limiter_step<Audio::S16Stereo>(0, INT16_MIN);
+  test_limiter_step<Audio::S16Stereo>(12, INT16_MIN);
+  test_limiter_step<Audio::S24Stereo>(0, 0x7FFFFF00);
+  test_limiter_step<Audio::S24Stereo>(18, INT32_MIN);
+  test_limiter_step<Audio::S32Stereo>(0, INT32_MAX);
+  test_limiter_step<Audio::S32Stereo>(0, INT32_MIN);
+  test_limiter_step<Audio::S32Stereo>(18, INT32_MAX);
+}
+
+static DSP::Settings eq_settings()
+{
+  DSP::Settings settings = limiter_settings(6);
+  settings.section_count = 2;
+  settings.sections[0] = {DSP::FilterType::LowShelf, 40, 12, 0.7};
+  settings.sections[1] = {DSP::FilterType::Peaking, 1000, 6, 1};
+  return settings;
+}
+
+static std::vector<int32_t> tone_block(uint32_t offset)
+{
+  std::vector<int32_t> block(2 * FRAMES);
+  for (uint32_t i = 0; i < FRAMES; i++)
+    block[2 * i] = block[2 * i + 1] = (int32_t) lround(0.25 * INT32_MAX * sin(2 * M_PI * 440 * (offset + i) / SAMPLE_RATE));
+
+  return block;
+}
+
+static void test_silence_bypass()
+{
+  const std::vector<int32_t> silence(2 * FRAMES, 0);
+
+  // Silence from rest is exactly silence, processed or bypassed
+  DSP::Chain chain;
+  chain.configure(eq_settings(), SAMPLE_RATE);
+  for (int i = 0; i < 10; i++)
+  {
+    std::vector<int32_t> block = silence;
+    CHECK(!chain.process<Audio::S32Stereo>(block.data(), FRAMES));
+    CHECK(block == silence);
+  }
+
+  // Audio, then silence. Once silence has lasted the bypass time blocks
+  // pass untouched
+  for (int i = 0; i < 10; i++)
+  {
+    std::vector<int32_t> block = tone_block(i * FRAMES);
+    chain.process<Audio::S32Stereo>(block.data(), FRAMES);
+  }
+
+  const uint32_t bypass_blocks = (20 * SAMPLE_RATE / 1000 + FRAMES - 1) / FRAMES;
+  for (uint32_t i = 0; i < 10; i++)
+  {
+    std::vector<int32_t> block = silence;
+    chain.process<Audio::S32Stereo>(block.data(), FRAMES);
+    if (i + 1 >= bypass_blocks)
+      CHECK(block == silence);
+  }
+
+  // Audio resuming after the bypass is processed from rest, bit exact
+  // with a chain that never saw audio
+  DSP::Chain fresh;
+  fresh.configure(eq_settings(), SAMPLE_RATE);
+  for (int i = 0; i < 3; i++)
+  {
+    std::vector<int32_t> resumed = tone_block(i * FRAMES);
+    std::vector<int32_t> expected = resumed;
+    chain.process<Audio::S32Stereo>(resumed.data(), FRAMES);
+    fresh.process<Audio::S32Stereo>(expected.data(), FRAMES);
+    CHECK(resumed == expected);
+  }
+}
+
+int main()
+{
+  test_biquad();
+  test_limiter();
+  test_silence_bypass();
+
+  return Check::result("dsp");
+}
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "audio.h"
+#include "wav.h"
+
+#include "check.h"
+
+// Checks the format conversions and WAV headers of every format the
+// pipeline is built for against references computed independently of
+// the kernels
+
+// Edge samples of each container. Narrow formats use only their valid bits
+static const std::vector<int64_t> SAMPLES16 = {0, 1, -1, 0x1234, -0x1234, 0x00FF, INT16_MAX, INT16_MIN};
+static const std::vector<int64_t> SAMPLES32 = {0, 1, -1, 0xFF, 0xFFFFFF, 0x12345678, -0x12345678, 0x7FFFFF00, INT32_MAX, INT32_MIN};
+
+template <typename F>
+static std::vector<typename F::sample_t> samples()
+{
+  const std::vector<int64_t>& edges = (F::container_bits == 16) ? SAMPLES16 : SAMPLES32;
+  const int64_t padding = (int64_t) 1 << (F::container_bits - F::bits_per_sample);
+
+  // Every edge in every channel, paired with a different edge in the other
+  std::vector<typename F::sample_t> result;
+  for (size_t i = 0; i < edges.size(); i++)
+  {
+    for (uint8_t c = 0; c < F::channels; c++)
+    {
+      int64_t sample = edges[(i + c * 3) % edges.size()];
+      result.push_back((typename F::sample_t) (sample - (sample % padding + padding) % padding));
+    }
+  }
+
+  return result;
+}
+
+/**
+  @brief  Reference conversion. Left justifies the sample in 64 bits,
+          clears the bits the destination can't carry and shifts back
+
+  @param  sample Sample of From
+  @retval int64_t - Sample of To
+*/
+template <typename From, typename To>
+static int64_t reference_convert(int64_t sample)
+{
+  int64_t wide = sample * ((int64_t) 1 << (64 - From::container_bits));
+  wide &= ~(((int64_t) 1 << (64 - To::bits_per_sample)) - 1);
+  return wide / ((int64_t) 1 << (64 - To::container_bits));
+}
+
+template <typename From, typename To>
+static void test_convert()
+{
+  const std::vector<typename From::sample_t> source = samples<From>();
+  const uint32_t frames = source.size() / From::channels;
+
+  std::vector<typename To::sample_t> destination(source.size());
+  Audio::convert<From, To>(source.data(), destination.data(), frames);
+
+  for (size_t i = 0; i < source.size(); i++)
+    CHECK_EQ((int64_t) destination[i], (reference_convert<From, To>(source[i])));
+}
+
+static void test_convert_values()
+{
+  // Hand computed values of the conversions the encoders use
+  const int32_t s32[] = {0x12345678, -1, INT32_MIN, 0x0000FFFF, INT32_MAX};
+  int16_t s16[5];
+  Audio::convert<Audio::S32Mono, Audio::S16Mono>(s32, s16, 5);
+  CHECK_EQ(s16[0], 0x1234);
+  CHECK_EQ(s16[1], -1);
+  CHECK_EQ(s16[2], INT16_MIN);
+  CHECK_EQ(s16[3], 0);
+  CHECK_EQ(s16[4], INT16_MAX);
+
+  int32_t s24[5];
+  Audio::convert<Audio::S32Mono, Audio::S24Mono>(s32, s24, 5);
+  CHECK_EQ(s24[0], 0x12345600);
+  CHECK_EQ(s24[1], -256);
+  CHECK_EQ(s24[2], INT32_MIN);
+  CHECK_EQ(s24[3], 0x0000FF00);
+  CHECK_EQ(s24[4], 0x7FFFFF00);
+
+  const int16_t narrow[] = {0x1234, -1, INT16_MIN, INT16_MAX};
+  int32_t wide[4];
+  Audio::convert<Audio::S16Stereo, Audio::S32Stereo>(narrow, wide, 2);
+  CHECK_EQ(wide[0], 0x12340000);
+  CHECK_EQ(wide[1], -65536);
+  CHECK_EQ(wide[2], INT32_MIN);
+  CHECK_EQ(wide[3], 0x7FFF0000);
+}
+
+/**
+  @brief  Reference downmix. Floor of the mean formed in 64 bits
+
+  @param  a First channel
+  @param  b Second channel
+  @retval int64_t
+*/
+static int64_t reference_downmix(int64_t a, int64_t b)
+{
+  int64_t sum = a + b;
+  return (sum >= 0) ? sum / 2 : -((-sum + 1) / 2);
+}
+
+template <typename F>
+static void test_downmix_select()
+{
+  const std::vector<typename F::sample_t> source = samples<F>();
+  const uint32_t frames = source.size() / 2;
+
+  std::vector<typename F::sample_t> mono(frames);
+  Audio::downmix<F>(source.data(), mono.data(), frames);
+  for (uint32_t i = 0; i < frames; i++)
+    CHECK_EQ((int64_t) mono[i], reference_downmix(source[2 * i], source[2 * i + 1]));
+
+  for (uint8_t channel = 0; channel < 2; channel++)
+  {
+    Audio::select<F>(source.data(), mono.data(), frames, channel);
+    for (uint32_t i = 0; i < frames; i++)
+      CHECK_EQ(mono[i], source[2 * i + channel]);
+  }
+}
+
+static void append16(std::vector<uint8_t>& bytes, uint16_t value)
+{
+  bytes.push_back(value);
+  bytes.push_back(value >> 8);
+}
+
+static void append32(std::vector<uint8_t>& bytes, uint32_t value)
+{
+  append16(bytes, value);
+  append16(bytes, value >> 16);
+}
+
+static void append(std::vector<uint8_t>& bytes, const char* tag)
+{
+  bytes.insert(bytes.end(), tag, tag + 4);
+}
+
+/**
+  @brief  Reference WAV header of an endless stream, written field by
+          field as little endian bytes
+
+  @param  channels Channel count
+  @param  container_bits Bits of each sample's container
+  @param  valid_bits Valid bits of each sample
+  @param  sample_rate Sample rate
+  @retval std::vector<uint8_t>
+*/
+static std::vector<uint8_t> reference_header(uint16_t channels, uint16_t container_bits, uint16_t valid_bits, uint32_t sample_rate)
+{
+  const bool extensible = container_bits > 16 || valid_bits != container_bits;
+  const uint16_t block_align = channels * container_bits / 8;
+
+  std::vector<uint8_t> bytes;
+  append(bytes, "RIFF");
+  append32(bytes, 0xFFFFFFFF);
+  append(bytes, "WAVE");
+
+  append(bytes, "fmt ");
+  append32(bytes, extensible ? 40 : 16);
+  append16(bytes, extensible ? 0xFFFE : 1);
+  append16(bytes, channels);
+  append32(bytes, sample_rate);
+  append32(bytes, sample_rate * block_align);
+  append16(bytes, block_align);
+  append16(bytes, container_bits);
+
+  if (extensible)
+  {
+    append16(bytes, 22);
+    append16(bytes, valid_bits);
+    append32(bytes, (channels == 1) ? 0x4 : 0x3);
+
+    // KSDATAFORMAT_SUBTYPE_PCM, 00000001-0000-0010-8000-00AA00389B71
+    const uint8_t guid[] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+    bytes.insert(bytes.end(), guid, guid + sizeof(guid));
+  }
+
+  append(bytes, "data");
+  append32(bytes, 0xFFFFFFFF);
+
+  return bytes;
+}
+
+template <typename F>
+static void test_header()
+{
+  for (uint32_t sample_rate : {32000, 44100, 48000, 96000})
+  {
+    const WAV::Header<F> header(sample_rate);
+    const std::vector<uint8_t> expected = reference_header(F::channels, F::container_bits, F::bits_per_sample, sample_rate);
+
+    if (CHECK_EQ(sizeof(header), expected.size()))
+      CHECK(memcmp(&header, expected.data(), expected.size()) == 0);
+  }
+}
+
+int main()
+{
+  test_convert_values();
+
+  test_convert<Audio::S16Mono, Audio::S24Mono>();
+  test_convert<Audio::S16Mono, Audio::S32Mono>();
+  test_convert<Audio::S24Mono, Audio::S16Mono>();
+  test_convert<Audio::S24Mono, Audio::S32Mono>();
+  test_convert<Audio::S32Mono, Audio::S16Mono>();
+  test_convert<Audio::S32Mono, Audio::S24Mono>();
+  test_convert<Audio::S16Stereo, Audio::S24Stereo>();
+  test_convert<Audio::S16Stereo, Audio::S32Stereo>();
+  test_convert<Audio::S24Stereo, Audio::S16Stereo>();
+  test_convert<Audio::S24Stereo, Audio::S32Stereo>();
+  test_convert<Audio::S32Stereo, Audio::S16Stereo>();
+  test_convert<Audio::S32Stereo, Audio::S24Stereo>();
+
+  test_downmix_select<Audio::S16Stereo>();
+  test_downmix_select<Audio::S24Stereo>();
+  test_downmix_select<Audio::S32Stereo>();
+
+  test_header<Audio::S16Mono>();
+  test_header<Audio::S16Stereo>();
+  test_header<Audio::S24Mono>();
+  test_header<Audio::S24Stereo>();
+  test_header<Audio::S32Mono>();
+  test_header<Audio::S32Stereo>();
+  test_header<Audio::P24Mono>();
+  test_header<Audio::P24Stereo>();
+
+  return Check::result("formats");
+}
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+#include "check.h"
+
+// Checks the 64 bit metric totals: sums past 2^32, and concurrent adds
+// never reading backwards or losing counts
+
+static const uint32_t HALF = 0x80000000;
+
+static void test_carry()
+{
+  Metrics::Total total;
+  CHECK_EQ(total.load(), 0u);
+
+  // Step over 2^31 and 2^32
+  uint64_t expected = 0;
+  const uint32_t steps[] = {HALF - 1, 1, HALF - 1, 2, 12345, HALF, HALF - 3, UINT32_MAX, HALF + 1, 7};
+  for (uint32_t step : steps)
+  {
+    total.add(step);
+    expected += step;
+    CHECK_EQ(total.load(), expected);
+  }
+
+  CHECK(expected > UINT32_MAX);
+}
+
+static void test_counter()
+{
+  Metrics::Counter counter("test_bytes_total", "Bytes counted by the test.");
+
+  for (int i = 0; i < 5; i++)
+    counter.increment(1000000000);
+
+  CHECK_EQ(counter.value(), 5000000000ull);
+}
+
+static void test_histogram_sum()
+{
+  Metrics::Histogram histogram("test_latency", "Latency observed by the test.", {10, 100}, nullptr, false);
+
+  for (int i = 0; i < 3; i++)
+    histogram.observe(2000000000);
+  histogram.observe(5);
+  histogram.observe(UINT32_MAX);
+
+  const Metrics::Histogram::Snapshot snapshot = histogram.snapshot();
+  CHECK_EQ(snapshot.sum, 6000000005ull + UINT32_MAX);
+  CHECK_EQ(snapshot.counts[0], 1u);
+  CHECK_EQ(snapshot.counts[2], 5u);
+}
+
+static void test_concurrent()
+{
+  static const int WRITERS = 4;
+  static const int ADDS = 200000;
+  static const uint32_t STEP = 100003;
+
+  Metrics::Total total;
+  std::atomic<bool> done = {false};
+  std::atomic<int> backwards = {0};
+
+  // Adds pass 2^32 while a reader watches for a lost carry
+  std::thread reader([&]()
+  {
+    uint64_t previous = 0;
+    while (!done)
+    {
+      uint64_t value = total.load();
+      if (value < previous)
+        backwards++;
+
+      previous = value;
+    }
+  });
+
+  std::vector<std::thread> writers;
+  for (int i = 0; i < WRITERS; i++)
+  {
+    writers.emplace_back([&]()
+    {
+      for (int j = 0; j < ADDS; j++)
+        total.add(STEP);
+    });
+  }
+
+  for (std::thread& writer : writers)
+    writer.join();
+
+  done = true;
+  reader.join();
+
+  CHECK_EQ(backwards.load(), 0);
+  CHECK_EQ(total.load(), (uint64_t) WRITERS * ADDS * STEP);
+}
+
+int main()
+{
+  test_carry();
+  test_counter();
+  test_histogram_sum();
+  test_concurrent();
+
+  return Check::result("metrics");
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "audio.h"
+
+#include "check.h"
+
+// Checks 24 bit packing in both byte orders against a byte by byte
+// reference, across the four sample fast path and the single sample tail
+
+static const uint8_t GUARD = 0xA5;
+
+/**
+  @brief  Reference packing. Takes the top three bytes of the sample left
+          justified in 32 bits, one byte at a time
+
+  @param  sample Sample of F
+  @param  big_endian Byte order of the wire format
+  @param  destination 3 bytes to write
+  @retval none
+*/
+template <typename F>
+static void reference_pack(typename F::sample_t sample, bool big_endian, uint8_t* destination)
+{
+  const uint32_t word = (uint32_t) (int32_t) sample << (32 - F::container_bits);
+  const uint8_t high = word >> 24;
+  const uint8_t middle = word >> 16;
+  const uint8_t low = word >> 8;
+
+  destination[0] = big_endian ? high : low;
+  destination[1] = middle;
+  destination[2] = big_endian ? low : high;
+}
+
+template <typename F>
+static std::vector<typename F::sample_t> samples()
+{
+  typedef typename F::sample_t sample_t;
+
+  // Full scale of both signs, near zero and patterns distinct in every byte
+  std::vector<sample_t> result = {std::numeric_limits<sample_t>::min(), std::numeric_limits<sample_t>::max(), -1, 0, 1, (sample_t) -2, std::numeric_limits<sample_t>::min() + 1};
+  if (F::container_bits == 16)
+    result.insert(result.end(), {(sample_t) 0x1234, (sample_t) -0x1234, (sample_t) 0x80, (sample_t) 0x7F00});
+  else
+    result.insert(result.end(), {(sample_t) 0x123456FF, (sample_t) -0x12345678, (sample_t) 0x000000FF, (sample_t) 0x00800000});
+
+  // Repeat so every sample lands in each lane of the four sample path
+  std::vector<sample_t> repeated;
+  for (int i = 0; i < 4; i++)
+    repeated.insert(repeated.end(), result.begin() + i, result.end());
+
+  return repeated;
+}
+
+template <typename F, bool BigEndian>
+static void test_pack24()
+{
+  const std::vector<typename F::sample_t> source = samples<F>();
+
+  for (size_t count = 0; count <= source.size(); count++)
+  {
+    // Word aligned as pack24 requires, with guard bytes after the output
+    std::vector<uint32_t> buffer(source.size() + 2);
+    uint8_t* destination = reinterpret_cast<uint8_t*>(buffer.data());
+    memset(destination, GUARD, buffer.size() * sizeof(uint32_t));
+
+    Audio::pack24<F, BigEndian>(source.data(), destination, count);
+
+    uint8_t expected[3];
+    for (size_t i = 0; i < count; i++)
+    {
+      reference_pack<F>(source[i], BigEndian, expected);
+      for (int b = 0; b < 3; b++)
+        CHECK_EQ(destination[3 * i + b], expected[b]);
+    }
+
+    for (size_t i = 3 * count; i < buffer.size() * sizeof(uint32_t); i++)
+      CHECK_EQ(destination[i], GUARD);
+  }
+}
+
+static void test_pack24_values()
+{
+  // Full scale negative samples of both containers
+  const int16_t s16[] = {INT16_MIN, -1, 0x1234, INT16_MAX};
+  const int32_t s32[] = {INT32_MIN, -1, 0x12345678, INT32_MAX};
+  alignas(4) uint8_t output[12];
+
+  const uint8_t s16_little[] = {0x00, 0x00, 0x80, 0x00, 0xFF, 0xFF, 0x00, 0x34, 0x12, 0x00, 0xFF, 0x7F};
+  Audio::pack24<Audio::S16Mono, false>(s16, output, 4);
+  CHECK(memcmp(output, s16_little, sizeof(output)) == 0);
+
+  const uint8_t s16_big[] = {0x80, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x12, 0x34, 0x00, 0x7F, 0xFF, 0x00};
+  Audio::pack24<Audio::S16Mono, true>(s16, output, 4);
+  CHECK(memcmp(output, s16_big, sizeof(output)) == 0);
+
+  const uint8_t s32_little[] = {0x00, 0x00, 0x80, 0xFF, 0xFF, 0xFF, 0x56, 0x34, 0x12, 0xFF, 0xFF, 0x7F};
+  Audio::pack24<Audio::S32Mono, false>(s32, output, 4);
+  CHECK(memcmp(output, s32_little, sizeof(output)) == 0);
+
+  const uint8_t s32_big[] = {0x80, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x12, 0x34, 0x56, 0x7F, 0xFF, 0xFF};
+  Audio::pack24<Audio::S32Mono, true>(s32, output, 4);
+  CHECK(memcmp(output, s32_big, sizeof(output)) == 0);
+}
+
+int main()
+{
+  test_pack24_values();
+
+  test_pack24<Audio::S16Mono, false>();
+  test_pack24<Audio::S16Mono, true>();
+  test_pack24<Audio::S16Stereo, false>();
+  test_pack24<Audio::S16Stereo, true>();
+  test_pack24<Audio::S24Stereo, false>();
+  test_pack24<Audio::S24Stereo, true>();
+  test_pack24<Audio::S32Mono, false>();
+  test_pack24<Audio::S32Mono, true>();
+  test_pack24<Audio::S32Stereo, false>();
+  test_pack24<Audio::S32Stereo, true>();
+
+  return Check::result("pack24");
+}
\ No newline at end of file
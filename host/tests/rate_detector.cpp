@@ -0,0 +1,170 @@
+#include <cstdint>
+
+#include "rate_detector.h"
+
+#include "check.h"
+
+// Checks rate detection on synthetic DMA timing: snapping to standard
+// rates within 2%, confirmation over consecutive windows, and recovery
+// through reset() after frames went uncounted
+
+static const uint32_t BLOCK_FRAMES = 240;
+static const int64_t TICK_US = 10000;
+
+// DMA buffers filled by a source clocked at a rate. Completed buffers are
+// counted every tick, as the driver counts them per batch of events
+class Source
+{
+  public:
+    explicit Source(I2S::RateDetector& detector) : detector(detector)
+    {
+      // Open the first window at time 0 so runs of whole seconds span whole windows
+      detector.update(0, 0);
+    }
+
+    /**
+      @brief  Clock the source at a rate for a while
+
+      @param  rate Source rate in frames per second. May be fractional
+      @param  duration_us Time to run for. A multiple of TICK_US
+      @param  counted Count the completed buffers. Uncounted buffers model
+                      those lost to an event queue overflow
+      @retval uint32_t - Rates confirmed while running
+    */
+    uint32_t run(double rate, int64_t duration_us, bool counted = true)
+    {
+      uint32_t events = 0;
+      for (int64_t end = time + duration_us; time < end; )
+      {
+        time += TICK_US;
+        position += rate * TICK_US / 1e6;
+
+        const uint64_t completed = position / BLOCK_FRAMES;
+        const uint32_t frames = (completed - delivered) * BLOCK_FRAMES;
+        delivered = completed;
+
+        if (counted && detector.update(time, frames))
+          events++;
+      }
+
+      return events;
+    }
+
+  private:
+    I2S::RateDetector& detector;
+    int64_t time = 0;
+    double position = 0; // Frames clocked
+    uint64_t delivered = 0; // Buffers completed
+};
+
+static void test_snap()
+{
+  // 2% either side of a standard rate snaps to it, inclusive
+  CHECK_EQ(I2S::RateDetector::nearest_rate(48000), 48000u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(48960), 48000u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(47040), 48000u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(48961), 0u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(47039), 0u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(44982), 44100u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(44983), 0u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(31360), 32000u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(97920), 96000u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(86436), 88200u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(0), 0u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(64000), 0u);
+
+  // A source 1.5% fast is confirmed as the standard rate
+  I2S::RateDetector detector;
+  Source source(detector);
+  CHECK_EQ(source.run(48000 * 1.015, 3500000), 1u);
+  CHECK_EQ(detector.rate(), 48000u);
+
+  // One 3% fast is never confirmed
+  detector.reset();
+  CHECK_EQ(source.run(48000 * 1.03, 5500000), 0u);
+  CHECK_EQ(detector.rate(), 0u);
+}
+
+static void test_confirmation()
+{
+  I2S::RateDetector detector;
+  Source source(detector);
+
+  // Nothing is confirmed after the first window
+  CHECK_EQ(source.run(44100, 1000000), 0u);
+  CHECK_EQ(detector.rate(), 0u);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(detector.measured_rate()), 44100u);
+
+  // The second agreeing window confirms the rate, once
+  CHECK_EQ(source.run(44100, 1000000), 1u);
+  CHECK_EQ(detector.rate(), 44100u);
+  CHECK_EQ(source.run(44100, 5000000), 0u);
+  CHECK_EQ(detector.rate(), 44100u);
+
+  // A change keeps the old rate until two windows agree on the new one
+  CHECK_EQ(source.run(96000, 1000000), 0u);
+  CHECK_EQ(detector.rate(), 44100u);
+  CHECK_EQ(source.run(96000, 1000000), 1u);
+  CHECK_EQ(detector.rate(), 96000u);
+
+  // Alternating windows never agree
+  for (int i = 0; i < 4; i++)
+  {
+    CHECK_EQ(source.run(32000, 1000000), 0u);
+    CHECK_EQ(source.run(88200, 1000000), 0u);
+  }
+  CHECK_EQ(detector.rate(), 96000u);
+
+  // An unrecognised window breaks a run of agreeing ones
+  CHECK_EQ(source.run(48000, 1000000), 0u);
+  CHECK_EQ(source.run(64000, 1000000), 0u);
+  CHECK_EQ(source.run(48000, 1000000), 0u);
+  CHECK_EQ(detector.rate(), 96000u);
+  CHECK_EQ(source.run(48000, 1000000), 1u);
+  CHECK_EQ(detector.rate(), 48000u);
+}
+
+static void test_overflow_reset()
+{
+  I2S::RateDetector detector;
+  Source source(detector);
+
+  CHECK_EQ(source.run(48000, 3000000), 1u);
+  CHECK_EQ(detector.rate(), 48000u);
+
+  // Half a second of buffers lost to an event queue overflow. Without a
+  // reset the window spanning the loss measures far below the true rate
+  I2S::RateDetector unreset;
+  Source lost(unreset);
+  lost.run(48000, 3000000);
+  lost.run(48000, 500000, false);
+  lost.run(48000, 500000);
+  CHECK_EQ(I2S::RateDetector::nearest_rate(unreset.measured_rate()), 0u);
+
+  // After the overflow the driver resets, which clears the confirmed rate
+  // and starts a fresh window at the next counted buffer
+  source.run(48000, 500000, false);
+  detector.reset();
+  CHECK_EQ(detector.rate(), 0u);
+
+  // Two whole windows of counted buffers confirm the rate again
+  CHECK_EQ(source.run(48000, 1100000), 0u);
+  CHECK_EQ(detector.rate(), 0u);
+  CHECK_EQ(source.run(48000, 1000000), 1u);
+  CHECK_EQ(detector.rate(), 48000u);
+  CHECK_EQ(detector.measured_rate(), 48000u);
+
+  // A reset followed by a different source rate confirms only the new rate
+  detector.reset();
+  CHECK_EQ(source.run(44100, 3100000), 1u);
+  CHECK_EQ(detector.rate(), 44100u);
+}
+
+int main()
+{
+  test_snap();
+  test_confirmation();
+  test_overflow_reset();
+
+  return Check::result("rate_detector");
+}
\ No newline at end of file
@@ -0,0 +1,866 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nlohmann/json.hpp"
+
+// Simulates a farm of UPnP MediaRenderers for discovery and control scale
+// testing. Every device answers M-SEARCH, advertises itself with NOTIFY,
+// serves a description and accepts AVTransport and ConnectionManager SOAP
+// actions with configurable latency and failures. All devices share one
+// HTTP port and are told apart by path.
+
+using Clock = std::chrono::steady_clock;
+using json = nlohmann::ordered_json;
+
+struct Options
+{
+  uint32_t devices = 100;
+  std::string address;            // Address advertised in LOCATION. Default first non-loopback
+  uint16_t port = 49200;
+  double duration = 0;            // Seconds to run. 0 until interrupted
+  uint32_t description_size = 4096; // Approximate size each description is padded to
+  double embedded_rate = 0.25;    // Fraction of devices nesting the renderer in a root device
+  double notify_interval = 30;    // Seconds between NOTIFY rounds. 0 to disable
+  uint32_t latency = 20;          // Milliseconds before each SOAP reply
+  uint32_t jitter = 30;           // Additional uniform random milliseconds
+  double failure_rate = 0;        // Fraction of actions answered with a SOAP fault
+  double hang_rate = 0;           // Fraction of actions never answered
+  uint32_t hang_time = 30;        // Seconds a hung action holds its connection
+  std::string output;
+};
+
+enum ActionType
+{
+  SET_URI,
+  PLAY,
+  STOP,
+  GET_PROTOCOL_INFO,
+  OTHER,
+  ACTION_TYPE_MAX,
+};
+
+static const char* const action_names[ACTION_TYPE_MAX] = {"SetAVTransportURI", "Play", "Stop", "GetProtocolInfo", "Other"};
+
+struct ActionStats
+{
+  std::atomic<uint32_t> requests = {0};
+  std::atomic<uint32_t> failures = {0};
+  std::atomic<uint32_t> hangs = {0};
+  std::vector<double> arrivals_ms; // Guarded by stats_mutex
+};
+
+struct Device
+{
+  std::string uuid;
+  std::string name;
+  std::string description;
+  std::atomic<bool> described = {false};
+  std::atomic<bool> playing = {false};
+};
+
+static Options options;
+static std::vector<Device> devices;
+static std::atomic<bool> running(true);
+
+static const Clock::time_point start_time = Clock::now();
+static std::atomic<int64_t> first_search_ms(-1);
+static std::atomic<int64_t> all_described_ms(-1);
+static std::atomic<uint32_t> described_count(0);
+static std::atomic<uint32_t> searches(0);
+static std::atomic<uint32_t> search_responses(0);
+static std::atomic<uint32_t> notifies(0);
+static std::atomic<uint32_t> descriptions_served(0);
+static std::atomic<uint32_t> connections(0);
+static std::atomic<uint32_t> peak_connections(0);
+static std::atomic<uint32_t> open_connections(0);
+
+static std::mutex stats_mutex;
+static ActionStats action_stats[ACTION_TYPE_MAX];
+
+static constexpr const char* RENDERER_TYPE = "urn:schemas-upnp-org:device:MediaRenderer:1";
+static constexpr const char* SSDP_ADDRESS = "239.255.255.250";
+static constexpr uint16_t SSDP_PORT = 1900;
+static constexpr uint32_t MAX_AGE = 1800;
+
+static const char* SINK_PROTOCOLS =
+  "http-get:*:audio/L16;rate=44100;channels=2:*,"
+  "http-get:*:audio/L16;rate=48000;channels=2:*,"
+  "http-get:*:audio/wav:*,"
+  "http-get:*:audio/x-wav:*,"
+  "http-get:*:audio/mpeg:*,"
+  "http-get:*:audio/mp4:*,"
+  "http-get:*:audio/flac:*,"
+  "http-get:*:audio/x-flac:*,"
+  "http-get:*:audio/ogg:*";
+
+/**
+  @brief  Milliseconds since the farm started
+
+  @param  none
+  @retval double
+*/
+static double now_ms()
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start_time).count();
+}
+
+/**
+  @brief  Find the first non-loopback IPv4 address of the host
+
+  @param  none
+  @retval std::string
+*/
+static std::string default_address()
+{
+  std::string address = "127.0.0.1";
+
+  struct ifaddrs* interfaces = nullptr;
+  if (getifaddrs(&interfaces) != 0)
+    return address;
+
+  for (struct ifaddrs* i = interfaces; i != nullptr; i = i->ifa_next)
+  {
+    if (i->ifa_addr == nullptr || i->ifa_addr->sa_family != AF_INET || (i->ifa_flags & IFF_LOOPBACK))
+      continue;
+
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &((struct sockaddr_in*) i->ifa_addr)->sin_addr, buffer, sizeof(buffer));
+    address = buffer;
+    break;
+  }
+
+  freeifaddrs(interfaces);
+  return address;
+}
+
+/**
+  @brief  Base URL of a device's HTTP resources
+
+  @param  index Device index
+  @retval std::string
+*/
+static std::string device_url(uint32_t index)
+{
+  return "http://" + options.address + ":" + std::to_string(options.port) + "/device/" + std::to_string(index);
+}
+
+/**
+  @brief  Build a description document shaped like those of commercial
+          speakers. Some nest the renderer inside a root device
+
+  @param  index Device index
+  @param  embedded Nest the renderer in an embedded device
+  @retval std::string
+*/
+static std::string build_description(uint32_t index, bool embedded)
+{
+  const Device& device = devices[index];
+
+  auto service = [](const char* name) {
+    std::string service = "<service>";
+    service += std::string("<serviceType>urn:schemas-upnp-org:service:") + name + ":1</serviceType>";
+    service += std::string("<serviceId>urn:upnp-org:serviceId:") + name + "</serviceId>";
+    service += std::string("<SCPDURL>") + name + "/scpd.xml</SCPDURL>";
+    service += std::string("<controlURL>") + name + "/control</controlURL>";
+    service += std::string("<eventSubURL>") + name + "/event</eventSubURL>";
+    service += "</service>";
+    return service;
+  };
+
+  std::string renderer = "<device>";
+  renderer += std::string("<deviceType>") + RENDERER_TYPE + "</deviceType>";
+  renderer += "<friendlyName>" + device.name + "</friendlyName>";
+  renderer += "<manufacturer>Farm Audio</manufacturer>";
+  renderer += "<manufacturerURL>http://example.com</manufacturerURL>";
+  renderer += "<modelDescription>Simulated network speaker</modelDescription>";
+  renderer += "<modelName>Farm Speaker</modelName>";
+  renderer += "<modelNumber>FS-" + std::to_string(100 + index % 4) + "</modelNumber>";
+  renderer += "<serialNumber>" + std::to_string(100000 + index) + "</serialNumber>";
+  renderer += "<UDN>uuid:" + device.uuid + (embedded ? "_MR" : "") + "</UDN>";
+  renderer += "<dlna:X_DLNADOC xmlns:dlna=\"urn:schemas-dlna-org:device-1-0\">DMR-1.50</dlna:X_DLNADOC>";
+  renderer += "<iconList>";
+  for (uint32_t size : {48, 120, 256})
+  {
+    renderer += "<icon><mimetype>image/png</mimetype><width>" + std::to_string(size) + "</width><height>" + std::to_string(size) + "</height><depth>24</depth>";
+    renderer += "<url>icon" + std::to_string(size) + ".png</url></icon>";
+  }
+  renderer += "<icon><mimetype>image/jpeg</mimetype><width>120</width><height>120</height><depth>24</depth><url>icon.jpg</url></icon>";
+  renderer += "</iconList>";
+  renderer += "<serviceList>" + service("RenderingControl") + service("ConnectionManager") + service("AVTransport") + "</serviceList>";
+  renderer += "</device>";
+
+  std::string body;
+  if (embedded)
+  {
+    body += "<device>";
+    body += "<deviceType>urn:schemas-upnp-org:device:ZonePlayer:1</deviceType>";
+    body += "<friendlyName>" + device.name + " Zone</friendlyName>";
+    body += "<manufacturer>Farm Audio</manufacturer>";
+    body += "<modelName>Farm Zone</modelName>";
+    body += "<UDN>uuid:" + device.uuid + "</UDN>";
+    body += "<serviceList>" + service("DeviceProperties") + service("ZoneGroupTopology") + "</serviceList>";
+    body += "<deviceList>" + renderer + "</deviceList>";
+    body += "</device>";
+  }
+  else
+    body = renderer;
+
+  std::string description = "<?xml version=\"1.0\" encoding=\"utf-8\"?>";
+  description += "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">";
+  description += "<specVersion><major>1</major><minor>0</minor></specVersion>";
+  description += "<URLBase>" + device_url(index) + "/</URLBase>";
+  description += body;
+
+  // Vendor extensions make up the bulk of real descriptions
+  uint32_t extension = 0;
+  while (description.length() + 16 < options.description_size)
+  {
+    description += "<X_Vendor" + std::to_string(extension) + ">";
+    description += std::string(std::min<size_t>(200, options.description_size - description.length()), 'x');
+    description += "</X_Vendor" + std::to_string(extension++) + ">";
+  }
+
+  description += "</root>";
+
+  return description;
+}
+
+/**
+  @brief  Build a SOAP response envelope
+
+  @param  body Contents of the Body element
+  @retval std::string
+*/
+static std::string soap_envelope(const std::string& body)
+{
+  std::string envelope = R"(<?xml version="1.0" encoding="utf-8"?>)";
+  envelope += R"(<s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/">)";
+  envelope += "<s:Body>" + body + "</s:Body></s:Envelope>";
+  return envelope;
+}
+
+/**
+  @brief  Build a SOAP fault carrying a UPnP error
+
+  @param  code UPnP error code
+  @param  description Error description
+  @retval std::string
+*/
+static std::string soap_fault(uint32_t code, const std::string& description)
+{
+  std::string fault = "<s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>";
+  fault += "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>" + std::to_string(code) + "</errorCode>";
+  fault += "<errorDescription>" + description + "</errorDescription></UPnPError></detail></s:Fault>";
+  return soap_envelope(fault);
+}
+
+/**
+  @brief  Write a complete HTTP response
+
+  @param  sock Client socket
+  @param  status Status line e.g. 200 OK
+  @param  content_type MIME type of the body
+  @param  body Response body
+  @retval none
+*/
+static void send_response(int sock, const char* status, const char* content_type, const std::string& body)
+{
+  std::string response = std::string("HTTP/1.1 ") + status + "\r\n";
+  response += std::string("Content-Type: ") + content_type + "\r\n";
+  response += "Content-Length: " + std::to_string(body.length()) + "\r\n";
+  response += "Server: Linux/5.0 UPnP/1.0 renderer-farm/1.0\r\n";
+  response += "Connection: close\r\n\r\n";
+  response += body;
+
+  send(sock, response.data(), response.length(), MSG_NOSIGNAL);
+}
+
+/**
+  @brief  Case insensitively find a header value in a request
+
+  @param  headers Request headers
+  @param  name Header name
+  @retval std::string
+*/
+static std::string find_header(const std::string& headers, const std::string& name)
+{
+  size_t line = 0;
+  while ((line = headers.find("\r\n", line)) != std::string::npos)
+  {
+    line += 2;
+    if (strncasecmp(headers.c_str() + line, name.c_str(), name.length()) != 0 || headers[line + name.length()] != ':')
+      continue;
+
+    size_t start = headers.find_first_not_of(' ', line + name.length() + 1);
+    size_t end = headers.find("\r\n", start);
+    return headers.substr(start, end - start);
+  }
+
+  return std::string();
+}
+
+/**
+  @brief  Simulate handling of a SOAP action by a device
+
+  @param  sock Client socket
+  @param  index Device index
+  @param  soap_action SOAPAction header value
+  @retval none
+*/
+static void handle_action(int sock, uint32_t index, const std::string& soap_action)
+{
+  thread_local std::mt19937 random(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::uniform_real_distribution<double> chance(0, 1);
+
+  // SOAPAction is "service#action"
+  std::string name = soap_action.substr(soap_action.find('#') + 1);
+  name.erase(std::remove(name.begin(), name.end(), '"'), name.end());
+
+  ActionType type = OTHER;
+  for (uint32_t i = 0; i < OTHER; i++)
+  {
+    if (name == action_names[i])
+      type = (ActionType) i;
+  }
+
+  ActionStats& stats = action_stats[type];
+  stats.requests++;
+
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.arrivals_ms.push_back(now_ms());
+  }
+
+  // Hold the connection without ever replying
+  if (chance(random) < options.hang_rate)
+  {
+    stats.hangs++;
+    for (uint32_t i = 0; i < options.hang_time * 10 && running; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    return;
+  }
+
+  uint32_t delay = options.latency + (options.jitter ? random() % options.jitter : 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+  if (type == OTHER)
+  {
+    stats.failures++;
+    send_response(sock, "500 Internal Server Error", "text/xml; charset=\"utf-8\"", soap_fault(401, "Invalid Action"));
+    return;
+  }
+
+  if (chance(random) < options.failure_rate)
+  {
+    stats.failures++;
+    send_response(sock, "500 Internal Server Error", "text/xml; charset=\"utf-8\"", soap_fault(501, "Action Failed"));
+    return;
+  }
+
+  if (type == PLAY || type == STOP)
+    devices[index].playing = (type == PLAY);
+
+  std::string body;
+  if (type == GET_PROTOCOL_INFO)
+  {
+    body = R"(<u:GetProtocolInfoResponse xmlns:u="urn:schemas-upnp-org:service:ConnectionManager:1"><Source></Source><Sink>)";
+    body += SINK_PROTOCOLS;
+    body += "</Sink></u:GetProtocolInfoResponse>";
+  }
+  else
+    body = "<u:" + name + "Response xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\"></u:" + name + "Response>";
+
+  send_response(sock, "200 OK", "text/xml; charset=\"utf-8\"", soap_envelope(body));
+}
+
+/**
+  @brief  Serve a single HTTP request then close the connection
+
+  @param  sock Client socket
+  @retval none
+*/
+static void connection_task(int sock)
+{
+  struct timeval timeout = {5, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Read headers and any body
+  std::string request;
+  char buffer[2048];
+  size_t header_end;
+  while ((header_end = request.find("\r\n\r\n")) == std::string::npos)
+  {
+    ssize_t length = recv(sock, buffer, sizeof(buffer), 0);
+    if (length <= 0)
+      break;
+
+    request.append(buffer, length);
+  }
+
+  if (header_end != std::string::npos)
+  {
+    size_t content_length = strtoul(find_header(request, "Content-Length").c_str(), nullptr, 10);
+    while (request.length() < header_end + 4 + content_length)
+    {
+      ssize_t length = recv(sock, buffer, sizeof(buffer), 0);
+      if (length <= 0)
+        break;
+
+      request.append(buffer, length);
+    }
+
+    char method[16] = {0};
+    char path[256] = {0};
+    uint32_t index = 0;
+    char resource[128] = {0};
+    sscanf(request.c_str(), "%15s %255s", method, path);
+
+    if (sscanf(path, "/device/%u/%127s", &index, resource) != 2 || index >= devices.size())
+      send_response(sock, "404 Not Found", "text/plain", "Not Found");
+    else if (strcmp(resource, "description.xml") == 0)
+    {
+      descriptions_served++;
+      send_response(sock, "200 OK", "text/xml; charset=\"utf-8\"", devices[index].description);
+
+      // Discovery is complete once every device was described
+      if (!devices[index].described.exchange(true) && ++described_count == devices.size())
+        all_described_ms = now_ms();
+    }
+    else if (strcmp(method, "POST") == 0 && strstr(resource, "/control") != nullptr)
+      handle_action(sock, index, find_header(request, "SOAPAction"));
+    else
+      send_response(sock, "404 Not Found", "text/plain", "Not Found");
+  }
+
+  close(sock);
+  open_connections--;
+}
+
+/**
+  @brief  Accept HTTP connections for all devices
+
+  @param  listener Listening socket
+  @retval none
+*/
+static void http_task(int listener)
+{
+  while (running)
+  {
+    int sock = accept(listener, nullptr, nullptr);
+    if (sock < 0)
+      continue;
+
+    connections++;
+    uint32_t open = ++open_connections;
+    uint32_t peak = peak_connections.load();
+    while (open > peak && !peak_connections.compare_exchange_weak(peak, open));
+
+    std::thread(connection_task, sock).detach();
+  }
+}
+
+/**
+  @brief  Send an SSDP message to the multicast group
+
+  @param  sock UDP socket
+  @param  message Message to send
+  @retval none
+*/
+static void send_multicast(int sock, const std::string& message)
+{
+  struct sockaddr_in group = {};
+  group.sin_family = AF_INET;
+  group.sin_port = htons(SSDP_PORT);
+  group.sin_addr.s_addr = inet_addr(SSDP_ADDRESS);
+
+  sendto(sock, message.data(), message.length(), 0, (struct sockaddr*) &group, sizeof(group));
+}
+
+/**
+  @brief  Build an SSDP NOTIFY for a device
+
+  @param  index Device index
+  @param  nts ssdp:alive or ssdp:byebye
+  @retval std::string
+*/
+static std::string build_notify(uint32_t index, const char* nts)
+{
+  std::string notify = "NOTIFY * HTTP/1.1\r\n";
+  notify += "HOST: 239.255.255.250:1900\r\n";
+  notify += "CACHE-CONTROL: max-age=" + std::to_string(MAX_AGE) + "\r\n";
+  notify += "LOCATION: " + device_url(index) + "/description.xml\r\n";
+  notify += std::string("NT: ") + RENDERER_TYPE + "\r\n";
+  notify += std::string("NTS: ") + nts + "\r\n";
+  notify += "SERVER: Linux/5.0 UPnP/1.0 renderer-farm/1.0\r\n";
+  notify += "USN: uuid:" + devices[index].uuid + "::" + RENDERER_TYPE + "\r\n";
+  notify += "\r\n";
+  return notify;
+}
+
+/**
+  @brief  Answer an M-SEARCH from every device, spreading the responses over
+          the MX window as real devices do
+
+  @param  sock UDP socket to respond from
+  @param  from Address of the searcher
+  @param  search_target ST of the search
+  @param  mx MX of the search
+  @retval none
+*/
+static void respond_search(int sock, struct sockaddr_in from, std::string search_target, uint32_t mx)
+{
+  std::mt19937 random(from.sin_port);
+  std::uniform_real_distribution<double> window(0, std::min<uint32_t>(std::max<uint32_t>(mx, 1), 5));
+
+  std::vector<std::pair<double, uint32_t>> schedule;
+  for (uint32_t i = 0; i < devices.size(); i++)
+    schedule.emplace_back(window(random), i);
+
+  std::sort(schedule.begin(), schedule.end());
+
+  const std::string st = (search_target == "ssdp:all") ? std::string(RENDERER_TYPE) : search_target;
+  const Clock::time_point start = Clock::now();
+  for (const auto& entry : schedule)
+  {
+    std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(entry.first)));
+    if (!running)
+      return;
+
+    const uint32_t index = entry.second;
+
+    std::string response = "HTTP/1.1 200 OK\r\n";
+    response += "CACHE-CONTROL: max-age=" + std::to_string(MAX_AGE) + "\r\n";
+    response += "EXT:\r\n";
+    response += "LOCATION: " + device_url(index) + "/description.xml\r\n";
+    response += "SERVER: Linux/5.0 UPnP/1.0 renderer-farm/1.0\r\n";
+    response += "ST: " + st + "\r\n";
+    response += "USN: uuid:" + devices[index].uuid + "::" + st + "\r\n";
+    response += "\r\n";
+
+    sendto(sock, response.data(), response.length(), 0, (struct sockaddr*) &from, sizeof(from));
+    search_responses++;
+  }
+}
+
+/**
+  @brief  Receive SSDP traffic and answer renderer searches
+
+  @param  sock UDP socket bound to the SSDP port
+  @param  reply_sock UDP socket to respond from
+  @retval none
+*/
+static void ssdp_task(int sock, int reply_sock)
+{
+  char buffer[2048];
+  while (running)
+  {
+    struct sockaddr_in from = {};
+    socklen_t from_length = sizeof(from);
+    ssize_t length = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*) &from, &from_length);
+    if (length <= 0)
+      continue;
+
+    const std::string message(buffer, length);
+    if (message.compare(0, 8, "M-SEARCH") != 0)
+      continue;
+
+    const std::string st = find_header(message, "ST");
+    if (st != RENDERER_TYPE && st != "ssdp:all" && st != "upnp:rootdevice")
+      continue;
+
+    searches++;
+    int64_t expected = -1;
+    first_search_ms.compare_exchange_strong(expected, (int64_t) now_ms());
+
+    std::thread(respond_search, reply_sock, from, st, (uint32_t) atoi(find_header(message, "MX").c_str())).detach();
+  }
+}
+
+/**
+  @brief  Group action arrivals into bursts separated by a second of silence
+          and report the spread of each
+
+  @param  arrivals Sorted arrival times in milliseconds
+  @retval json
+*/
+static json summarize_bursts(const std::vector<double>& arrivals)
+{
+  json bursts = json::array();
+
+  size_t first = 0;
+  for (size_t i = 1; i <= arrivals.size(); i++)
+  {
+    if (i < arrivals.size() && arrivals[i] - arrivals[i - 1] < 1000)
+      continue;
+
+    if (first < arrivals.size())
+    {
+      bursts.push_back({
+        {"start_ms", arrivals[first]},
+        {"count", i - first},
+        {"spread_ms", arrivals[i - 1] - arrivals[first]},
+        {"p50_ms", arrivals[first + (i - first) / 2] - arrivals[first]},
+      });
+    }
+
+    first = i;
+  }
+
+  return bursts;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr, "Usage: %s [options]\n", name);
+  fprintf(stderr, "  --devices N           Renderers to simulate. Default 100\n");
+  fprintf(stderr, "  --address ADDR        Address to advertise and multicast from. Default first non-loopback\n");
+  fprintf(stderr, "  --port PORT           HTTP port shared by all devices. Default 49200\n");
+  fprintf(stderr, "  --duration S          Seconds to run. Default until interrupted\n");
+  fprintf(stderr, "  --description-size B  Approximate description size. Default 4096\n");
+  fprintf(stderr, "  --embedded-rate F     Fraction of renderers nested in a root device. Default 0.25\n");
+  fprintf(stderr, "  --notify-interval S   Seconds between NOTIFY rounds. 0 to disable. Default 30\n");
+  fprintf(stderr, "  --latency MS          Delay before each SOAP reply. Default 20\n");
+  fprintf(stderr, "  --jitter MS           Additional random SOAP delay. Default 30\n");
+  fprintf(stderr, "  --failure-rate F      Fraction of actions answered with a fault. Default 0\n");
+  fprintf(stderr, "  --hang-rate F         Fraction of actions never answered. Default 0\n");
+  fprintf(stderr, "  --hang-time S         Seconds a hung action holds its connection. Default 30\n");
+  fprintf(stderr, "  --output FILE         Write JSON results to FILE instead of stdout\n");
+}
+
+static void signal_handler(int signal)
+{
+  running = false;
+}
+
+int main(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; i += 2)
+  {
+    const std::string option = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if (value == nullptr)
+    {
+      usage(argv[0]);
+      return (option == "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (option == "--devices")
+      options.devices = atoi(value);
+    else if (option == "--address")
+      options.address = value;
+    else if (option == "--port")
+      options.port = atoi(value);
+    else if (option == "--duration")
+      options.duration = atof(value);
+    else if (option == "--description-size")
+      options.description_size = atoi(value);
+    else if (option == "--embedded-rate")
+      options.embedded_rate = atof(value);
+    else if (option == "--notify-interval")
+      options.notify_interval = atof(value);
+    else if (option == "--latency")
+      options.latency = atoi(value);
+    else if (option == "--jitter")
+      options.jitter = atoi(value);
+    else if (option == "--failure-rate")
+      options.failure_rate = atof(value);
+    else if (option == "--hang-rate")
+      options.hang_rate = atof(value);
+    else if (option == "--hang-time")
+      options.hang_time = atoi(value);
+    else if (option == "--output")
+      options.output = value;
+    else
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (options.address.empty())
+    options.address = default_address();
+
+  // Create the devices
+  std::mt19937 random(1);
+  std::uniform_real_distribution<double> chance(0, 1);
+  devices = std::vector<Device>(options.devices);
+  for (uint32_t i = 0; i < options.devices; i++)
+  {
+    char uuid[64];
+    snprintf(uuid, sizeof(uuid), "5f9ec1b3-ed59-79bb-4530-%012x", i);
+    devices[i].uuid = uuid;
+    devices[i].name = "Farm Speaker " + std::to_string(i);
+  }
+
+  for (uint32_t i = 0; i < options.devices; i++)
+    devices[i].description = build_description(i, chance(random) < options.embedded_rate);
+
+  // HTTP listener shared by every device
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int enable = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+  struct sockaddr_in http_address = {};
+  http_address.sin_family = AF_INET;
+  http_address.sin_port = htons(options.port);
+  http_address.sin_addr.s_addr = inet_addr(options.address.c_str());
+  if (bind(listener, (struct sockaddr*) &http_address, sizeof(http_address)) != 0 || listen(listener, 1024) != 0)
+  {
+    fprintf(stderr, "Failed to listen on %s:%d. %s\n", options.address.c_str(), options.port, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // SSDP socket shares the port with any bridge on the same host
+  int ssdp = socket(AF_INET, SOCK_DGRAM, 0);
+  setsockopt(ssdp, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  setsockopt(ssdp, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+  struct sockaddr_in ssdp_address = {};
+  ssdp_address.sin_family = AF_INET;
+  ssdp_address.sin_port = htons(SSDP_PORT);
+  ssdp_address.sin_addr.s_addr = inet_addr(SSDP_ADDRESS);
+  if (bind(ssdp, (struct sockaddr*) &ssdp_address, sizeof(ssdp_address)) != 0)
+  {
+    fprintf(stderr, "Failed to bind SSDP port. %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct ip_mreq membership = {};
+  membership.imr_multiaddr.s_addr = inet_addr(SSDP_ADDRESS);
+  membership.imr_interface.s_addr = inet_addr(options.address.c_str());
+  if (setsockopt(ssdp, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+  {
+    fprintf(stderr, "Failed to join SSDP group on %s. %s\n", options.address.c_str(), strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct timeval timeout = {0, 250000};
+  setsockopt(ssdp, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Outbound socket for NOTIFY and search responses. Loop multicast back so
+  // a bridge on the same host hears it
+  int reply = socket(AF_INET, SOCK_DGRAM, 0);
+  struct in_addr interface = {};
+  interface.s_addr = inet_addr(options.address.c_str());
+  uint8_t ttl = 4;
+  uint8_t loop = 1;
+  setsockopt(reply, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface));
+  setsockopt(reply, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  setsockopt(reply, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::thread(http_task, listener).detach();
+  std::thread ssdp_thread(ssdp_task, ssdp, reply);
+
+  fprintf(stderr, "Simulating %u renderers at http://%s:%d/device/N/description.xml\n", options.devices, options.address.c_str(), options.port);
+
+  // Advertise periodically until stopped
+  Clock::time_point next_notify = Clock::now();
+  while (running && (options.duration == 0 || now_ms() < options.duration * 1000))
+  {
+    if (options.notify_interval > 0 && Clock::now() >= next_notify)
+    {
+      for (uint32_t i = 0; i < devices.size(); i++)
+      {
+        send_multicast(reply, build_notify(i, "ssdp:alive"));
+        notifies++;
+      }
+
+      next_notify += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.notify_interval));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  running = false;
+  ssdp_thread.join();
+
+  for (uint32_t i = 0; i < devices.size(); i++)
+    send_multicast(reply, build_notify(i, "ssdp:byebye"));
+
+  // Report
+  json actions;
+  for (uint32_t i = 0; i < ACTION_TYPE_MAX; i++)
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    std::vector<double>& arrivals = action_stats[i].arrivals_ms;
+    std::sort(arrivals.begin(), arrivals.end());
+
+    actions[action_names[i]] = {
+      {"requests", action_stats[i].requests.load()},
+      {"failures", action_stats[i].failures.load()},
+      {"hangs", action_stats[i].hangs.load()},
+      {"bursts", summarize_bursts(arrivals)},
+    };
+  }
+
+  uint32_t playing = 0;
+  for (const Device& device : devices)
+    playing += device.playing;
+
+  json result;
+  result["config"] = {
+    {"devices", options.devices},
+    {"address", options.address},
+    {"port", options.port},
+    {"description_size", options.description_size},
+    {"embedded_rate", options.embedded_rate},
+    {"latency_ms", options.latency},
+    {"jitter_ms", options.jitter},
+    {"failure_rate", options.failure_rate},
+    {"hang_rate", options.hang_rate},
+  };
+
+  // Discovery time runs from the first search to the last device described
+  const int64_t first_search = first_search_ms.load();
+  const int64_t all_described = all_described_ms.load();
+
+  result["discovery"] = {
+    {"searches", searches.load()},
+    {"search_responses", search_responses.load()},
+    {"notifies", notifies.load()},
+    {"descriptions_served", descriptions_served.load()},
+    {"devices_described", described_count.load()},
+    {"discovery_ms", (first_search >= 0 && all_described >= 0) ? json(all_described - first_search) : json(nullptr)},
+  };
+
+  result["http"] = {
+    {"connections", connections.load()},
+    {"peak_open_connections", peak_connections.load()},
+  };
+
+  result["actions"] = actions;
+  result["devices_playing"] = playing;
+
+  const std::string text = result.dump(2);
+  if (options.output.empty())
+    printf("%s\n", text.c_str());
+  else
+    std::ofstream(options.output) << text << "\n";
+
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,688 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nlohmann/json.hpp"
+
+// Load generator for the bridge's audio streams. Opens concurrent stream
+// clients with configurable read rates, stalls and reconnect churn, checks
+// continuity against the host build's counter source and reports the
+// results together with the bridge's own metrics as JSON.
+
+using Clock = std::chrono::steady_clock;
+using json = nlohmann::ordered_json;
+
+struct Options
+{
+  std::string host = "127.0.0.1";
+  uint16_t port = 8080;
+  uint16_t control_port = 8081; // Port metrics are fetched from
+  std::string path = "/stream.wav";
+  uint32_t clients = 4;
+  double duration = 30;
+  uint32_t slow_clients = 0;   // Clients limited to slow_rate
+  double slow_rate = 0.9;      // Fraction of the stream bitrate slow clients read at
+  double stall_every = 0;      // Seconds between read stalls. 0 to disable
+  double stall_for = 0;        // Seconds each stall lasts
+  double churn = 0;            // Mean seconds between reconnects. 0 to disable
+  bool verify = false;         // Check the counter pattern
+  int pid = 0;                 // Bridge process to sample CPU of. Host builds only
+  std::string output;
+};
+
+struct ClientStats
+{
+  uint64_t bytes = 0;
+  uint32_t connects = 0;
+  uint32_t connect_failures = 0;
+  uint32_t discontinuities = 0;
+  uint64_t frames_lost = 0;
+  uint32_t stalls = 0;
+  uint32_t evictions = 0;      // Connections the bridge closed before the client did
+  double max_gap_ms = 0;       // Longest wait for data outside stalls
+  std::vector<double> first_byte_ms;
+};
+
+static Options options;
+static std::atomic<bool> running(true);
+static std::string local_address; // Address the bridge sees the clients at
+
+/**
+  @brief  Open a TCP connection to the bridge
+
+  @param  port Port to connect to
+  @retval int - Socket or -1 on failure
+*/
+static int connect_bridge(uint16_t port)
+{
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* result = nullptr;
+  if (getaddrinfo(options.host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+    return -1;
+
+  int sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (sock >= 0 && connect(sock, result->ai_addr, result->ai_addrlen) != 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+
+  freeaddrinfo(result);
+
+  if (sock >= 0)
+  {
+    // Wake periodically so the run can end while the bridge is silent
+    struct timeval timeout = {0, 250000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+
+  return sock;
+}
+
+/**
+  @brief  Perform a GET and read the reply to the end of the headers
+
+  @param  sock Connected socket
+  @param  path Request path
+  @param  body Returned bytes received after the headers
+  @retval int - HTTP status or -1 on failure
+*/
+static int http_get(int sock, const std::string& path, std::string& body)
+{
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + options.host + "\r\nUser-Agent: stream-load\r\nConnection: close\r\n\r\n";
+  if (send(sock, request.data(), request.length(), MSG_NOSIGNAL) != (ssize_t) request.length())
+    return -1;
+
+  std::string reply;
+  char buffer[1024];
+  size_t end;
+  while ((end = reply.find("\r\n\r\n")) == std::string::npos)
+  {
+    ssize_t length = recv(sock, buffer, sizeof(buffer), 0);
+    if (length <= 0)
+    {
+      if (length < 0 && errno == EAGAIN && running)
+        continue;
+
+      return -1;
+    }
+
+    reply.append(buffer, length);
+  }
+
+  body = reply.substr(end + 4);
+
+  int status = -1;
+  sscanf(reply.c_str(), "HTTP/%*s %d", &status);
+  return status;
+}
+
+/**
+  @brief  Fetch a complete page from the control server of the bridge
+
+  @param  path Request path
+  @param  page Returned body
+  @retval bool
+*/
+static bool fetch(const std::string& path, std::string& page)
+{
+  int sock = connect_bridge(options.control_port);
+  if (sock < 0)
+    return false;
+
+  // Clients connect from the same address as this socket
+  struct sockaddr_in addr;
+  socklen_t addr_length = sizeof(addr);
+  char text[INET_ADDRSTRLEN];
+  if (getsockname(sock, (struct sockaddr*) &addr, &addr_length) == 0 && inet_ntop(AF_INET, &addr.sin_addr, text, sizeof(text)) != nullptr)
+    local_address = text;
+
+  int status = http_get(sock, path, page);
+
+  char buffer[4096];
+  ssize_t length;
+  while (status == 200 && ((length = recv(sock, buffer, sizeof(buffer), 0)) > 0 || (length < 0 && errno == EAGAIN)))
+  {
+    if (length > 0)
+      page.append(buffer, length);
+  }
+
+  close(sock);
+  return status == 200;
+}
+
+/**
+  @brief  Parse Prometheus text into a map of series to value
+
+  @param  text Metrics page
+  @retval std::map<std::string, double>
+*/
+static std::map<std::string, double> parse_metrics(const std::string& text)
+{
+  std::map<std::string, double> metrics;
+
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    size_t space = line.rfind(' ');
+    if (space == std::string::npos)
+      continue;
+
+    metrics[line.substr(0, space)] = strtod(line.c_str() + space + 1, nullptr);
+  }
+
+  return metrics;
+}
+
+/**
+  @brief  Tracks continuity of the counter pattern across reads
+
+  Each 16 bit stereo frame read as a little endian 32 bit word is the
+  frame count. Bytes are carried over between reads to keep alignment.
+*/
+class ContinuityChecker
+{
+  public:
+    void reset(void)
+    {
+      pending = 0;
+      started = false;
+    }
+
+    void consume(const uint8_t* data, size_t length, ClientStats& stats)
+    {
+      while (length > 0)
+      {
+        size_t take = std::min(length, sizeof(frame) - pending);
+        memcpy(frame + pending, data, take);
+        pending += take;
+        data += take;
+        length -= take;
+
+        if (pending < sizeof(frame))
+          break;
+
+        pending = 0;
+
+        uint32_t count;
+        memcpy(&count, frame, sizeof(count));
+
+        if (started && count != expected)
+        {
+          stats.discontinuities++;
+          stats.frames_lost += (uint32_t) (count - expected);
+        }
+
+        started = true;
+        expected = count + 1;
+      }
+    }
+
+  private:
+    uint8_t frame[4];
+    size_t pending = 0;
+    bool started = false;
+    uint32_t expected = 0;
+};
+
+/**
+  @brief  Run one stream client until the test ends
+
+  @param  index Client index. The first slow_clients are rate limited
+  @param  bitrate Stream bitrate in bytes per second
+  @param  stats Statistics to record to
+  @retval none
+*/
+static void client_task(uint32_t index, double bitrate, ClientStats& stats)
+{
+  std::mt19937 random(index);
+  std::exponential_distribution<double> lifetime(options.churn > 0 ? 1.0 / options.churn : 1.0);
+
+  const double rate = (index < options.slow_clients) ? bitrate * options.slow_rate : 0;
+
+  while (running)
+  {
+    int sock = connect_bridge(options.port);
+    if (sock < 0)
+    {
+      stats.connect_failures++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      continue;
+    }
+
+    stats.connects++;
+
+    const Clock::time_point connected = Clock::now();
+    const Clock::time_point disconnect = (options.churn > 0) ? connected + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(lifetime(random))) : Clock::time_point::max();
+
+    std::string body;
+    if (http_get(sock, options.path, body) != 200)
+    {
+      stats.connect_failures++;
+      close(sock);
+      std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      continue;
+    }
+
+    // Skip the WAV header
+    size_t skip = (options.path.find(".wav") != std::string::npos) ? 44 : 0;
+
+    ContinuityChecker checker;
+    bool first = true;
+    uint64_t connection_bytes = 0;
+    Clock::time_point last_data = connected;
+    Clock::time_point next_stall = connected + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.stall_every));
+
+    auto consume = [&](const uint8_t* data, size_t length)
+    {
+      Clock::time_point now = Clock::now();
+      if (first && length > 0)
+      {
+        stats.first_byte_ms.push_back(std::chrono::duration<double, std::milli>(now - connected).count());
+        first = false;
+      }
+      else
+        stats.max_gap_ms = std::max(stats.max_gap_ms, std::chrono::duration<double, std::milli>(now - last_data).count());
+
+      last_data = now;
+      stats.bytes += length;
+      connection_bytes += length;
+
+      size_t skipped = std::min(skip, length);
+      skip -= skipped;
+
+      if (options.verify)
+        checker.consume(data + skipped, length - skipped, stats);
+    };
+
+    consume((const uint8_t*) body.data(), body.length());
+
+    uint8_t buffer[8192];
+    while (running && Clock::now() < disconnect)
+    {
+      // Stop reading entirely for a while
+      if (options.stall_every > 0 && Clock::now() >= next_stall)
+      {
+        stats.stalls++;
+        std::this_thread::sleep_for(std::chrono::duration<double>(options.stall_for));
+        next_stall = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.stall_every));
+        last_data = Clock::now();
+      }
+
+      // Read no faster than the rate limit allows
+      if (rate > 0)
+      {
+        Clock::time_point due = connected + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(connection_bytes / rate));
+        if (due > Clock::now())
+          std::this_thread::sleep_until(due);
+      }
+
+      size_t chunk = (rate > 0) ? std::min<size_t>(sizeof(buffer), rate / 100 + 1) : sizeof(buffer);
+      ssize_t length = recv(sock, buffer, chunk, 0);
+      if (length < 0 && errno == EAGAIN)
+        continue;
+
+      if (length <= 0)
+      {
+        stats.evictions++;
+        break;
+      }
+
+      consume(buffer, length);
+    }
+
+    close(sock);
+  }
+}
+
+/**
+  @brief  Sample the CPU time of each thread of a process
+
+  @param  pid Process ID
+  @retval std::map<std::string, double> - Thread name to CPU seconds
+*/
+static std::map<std::string, double> sample_cpu(int pid)
+{
+  std::map<std::string, double> cpu;
+
+  const std::string directory = "/proc/" + std::to_string(pid) + "/task";
+  DIR* tasks = opendir(directory.c_str());
+  if (tasks == nullptr)
+    return cpu;
+
+  const double ticks = sysconf(_SC_CLK_TCK);
+
+  struct dirent* entry;
+  while ((entry = readdir(tasks)) != nullptr)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    std::ifstream file(directory + "/" + entry->d_name + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // Name is in parentheses and may contain spaces
+    size_t open = stat.find('(');
+    size_t close = stat.rfind(')');
+    if (open == std::string::npos || close == std::string::npos)
+      continue;
+
+    std::istringstream fields(stat.substr(close + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++)
+    {
+      if (i == 14)
+        utime = strtoul(field.c_str(), nullptr, 10);
+      else if (i == 15)
+        stime = strtoul(field.c_str(), nullptr, 10);
+    }
+
+    cpu[stat.substr(open + 1, close - open - 1)] += (utime + stime) / ticks;
+  }
+
+  closedir(tasks);
+  return cpu;
+}
+
+/**
+  @brief  Estimate a quantile from cumulative Prometheus buckets
+
+  @param  buckets Upper bound to cumulative count. +Inf as infinity
+  @param  quantile Quantile to estimate
+  @retval double - Upper bound of the bucket holding the quantile
+*/
+static double bucket_quantile(const std::map<double, double>& buckets, double quantile)
+{
+  if (buckets.empty() || buckets.rbegin()->second == 0)
+    return 0;
+
+  const double target = quantile * buckets.rbegin()->second;
+  for (const auto& bucket : buckets)
+  {
+    if (bucket.second >= target)
+      return bucket.first;
+  }
+
+  return buckets.rbegin()->first;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr, "Usage: %s [options]\n", name);
+  fprintf(stderr, "  --host HOST         Bridge address. Default 127.0.0.1\n");
+  fprintf(stderr, "  --port PORT         Bridge stream port. Default 8080\n");
+  fprintf(stderr, "  --control-port PORT Bridge control port for metrics. Default 8081\n");
+  fprintf(stderr, "  --path PATH         Stream path. Default /stream.wav\n");
+  fprintf(stderr, "  --clients N         Concurrent clients. Default 4\n");
+  fprintf(stderr, "  --duration S        Test length in seconds. Default 30\n");
+  fprintf(stderr, "  --slow-clients N    Clients reading below the stream rate. Default 0\n");
+  fprintf(stderr, "  --slow-rate F       Fraction of the stream rate slow clients read at. Default 0.9\n");
+  fprintf(stderr, "  --stall-every S     Stop reading every S seconds\n");
+  fprintf(stderr, "  --stall-for S       Length of each stall in seconds\n");
+  fprintf(stderr, "  --churn S           Reconnect after a random lifetime averaging S seconds\n");
+  fprintf(stderr, "  --verify            Check continuity. Requires a host build run with --counter\n");
+  fprintf(stderr, "  --pid PID           Sample CPU of a host build's tasks\n");
+  fprintf(stderr, "  --output FILE       Write JSON results to FILE instead of stdout\n");
+}
+
+int main(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string option = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+    if (option == "--verify")
+    {
+      options.verify = true;
+      continue;
+    }
+
+    if (value == nullptr)
+    {
+      usage(argv[0]);
+      return (option == "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (option == "--host")
+      options.host = value;
+    else if (option == "--port")
+      options.port = atoi(value);
+    else if (option == "--control-port")
+      options.control_port = atoi(value);
+    else if (option == "--path")
+      options.path = value;
+    else if (option == "--clients")
+      options.clients = atoi(value);
+    else if (option == "--duration")
+      options.duration = atof(value);
+    else if (option == "--slow-clients")
+      options.slow_clients = atoi(value);
+    else if (option == "--slow-rate")
+      options.slow_rate = atof(value);
+    else if (option == "--stall-every")
+      options.stall_every = atof(value);
+    else if (option == "--stall-for")
+      options.stall_for = atof(value);
+    else if (option == "--churn")
+      options.churn = atof(value);
+    else if (option == "--pid")
+      options.pid = atoi(value);
+    else if (option == "--output")
+      options.output = value;
+    else
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    i++;
+  }
+
+  // Only 16 bit stereo at 48 kHz is streamed today
+  const double bitrate = 48000 * 2 * 2;
+
+  std::string page;
+  std::map<std::string, double> metrics_before;
+  if (fetch("/metrics", page))
+    metrics_before = parse_metrics(page);
+  else
+    fprintf(stderr, "Failed to fetch /metrics. Bridge metrics are not reported.\n");
+
+  std::map<std::string, double> cpu_before = (options.pid > 0) ? sample_cpu(options.pid) : std::map<std::string, double>();
+
+  std::vector<ClientStats> stats(options.clients);
+  std::vector<std::thread> threads;
+
+  const Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < options.clients; i++)
+    threads.emplace_back(client_task, i, bitrate, std::ref(stats[i]));
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+
+  // Scrape while clients are still connected so their histograms exist
+  std::map<std::string, double> metrics_after;
+  if (!metrics_before.empty() && fetch("/metrics", page))
+    metrics_after = parse_metrics(page);
+
+  std::map<std::string, double> cpu_after = (options.pid > 0) ? sample_cpu(options.pid) : std::map<std::string, double>();
+  const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  running = false;
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // Aggregate client results
+  json clients = json::array();
+  ClientStats total;
+  std::vector<double> first_byte_ms;
+  for (uint32_t i = 0; i < options.clients; i++)
+  {
+    const ClientStats& s = stats[i];
+    clients.push_back({
+      {"slow", i < options.slow_clients},
+      {"bytes", s.bytes},
+      {"throughput_ratio", s.bytes / elapsed / bitrate},
+      {"connects", s.connects},
+      {"connect_failures", s.connect_failures},
+      {"stalls", s.stalls},
+      {"evictions", s.evictions},
+      {"discontinuities", s.discontinuities},
+      {"frames_lost", s.frames_lost},
+      {"max_gap_ms", s.max_gap_ms},
+    });
+
+    total.bytes += s.bytes;
+    total.connects += s.connects;
+    total.connect_failures += s.connect_failures;
+    total.evictions += s.evictions;
+    total.discontinuities += s.discontinuities;
+    total.frames_lost += s.frames_lost;
+    total.max_gap_ms = std::max(total.max_gap_ms, s.max_gap_ms);
+    first_byte_ms.insert(first_byte_ms.end(), s.first_byte_ms.begin(), s.first_byte_ms.end());
+  }
+
+  std::sort(first_byte_ms.begin(), first_byte_ms.end());
+
+  json result;
+  result["config"] = {
+    {"host", options.host},
+    {"port", options.port},
+    {"control_port", options.control_port},
+    {"path", options.path},
+    {"clients", options.clients},
+    {"duration_s", options.duration},
+    {"slow_clients", options.slow_clients},
+    {"slow_rate", options.slow_rate},
+    {"stall_every_s", options.stall_every},
+    {"stall_for_s", options.stall_for},
+    {"churn_s", options.churn},
+    {"verify", options.verify},
+  };
+
+  result["summary"] = {
+    {"elapsed_s", elapsed},
+    {"bytes", total.bytes},
+    {"throughput_bytes_per_s", total.bytes / elapsed},
+    {"throughput_ratio", total.bytes / elapsed / bitrate / std::max<uint32_t>(options.clients, 1)},
+    {"connects", total.connects},
+    {"connect_failures", total.connect_failures},
+    {"evictions", total.evictions},
+    {"discontinuities", total.discontinuities},
+    {"frames_lost", total.frames_lost},
+    {"max_gap_ms", total.max_gap_ms},
+    {"first_byte_ms_p50", first_byte_ms.empty() ? 0 : first_byte_ms[first_byte_ms.size() / 2]},
+    {"first_byte_ms_max", first_byte_ms.empty() ? 0 : first_byte_ms.back()},
+  };
+
+  result["clients"] = clients;
+
+  if (!metrics_after.empty())
+  {
+    auto delta = [&](const std::string& series) { return metrics_after[series] - metrics_before[series]; };
+
+    // Sum capture to socket latency buckets over all clients
+    std::map<double, double> buckets;
+    for (const auto& m : metrics_after)
+    {
+      if (m.first.rfind("http_client_latency_ms_bucket{", 0) != 0)
+        continue;
+
+      size_t le = m.first.find("le=\"");
+      if (le == std::string::npos)
+        continue;
+
+      std::string bound = m.first.substr(le + 4, m.first.find('"', le + 4) - le - 4);
+      buckets[(bound == "+Inf") ? INFINITY : strtod(bound.c_str(), nullptr)] += m.second;
+    }
+
+    result["bridge"] = {
+      {"dropped_blocks", delta("http_stream_dropped_blocks_total")},
+      {"bytes_sent", delta("http_stream_bytes_sent_total")},
+      {"i2s_short_reads", delta("i2s_short_reads_total")},
+      {"i2s_resets", delta("i2s_resets_total")},
+      {"probes", delta("http_stream_requests_total{type=\"probe\"}")},
+      {"handovers", delta("http_stream_requests_total{type=\"handover\"}")},
+      {"latency_ms_p50", bucket_quantile(buckets, 0.5)},
+      {"latency_ms_p99", bucket_quantile(buckets, 0.99)},
+      {"heap_minimum_free_bytes", metrics_after["heap_minimum_free_bytes"]},
+    };
+  }
+
+  if (!cpu_after.empty())
+  {
+    json cpu;
+    for (const auto& c : cpu_after)
+      cpu[c.first] = (c.second - cpu_before[c.first]) / elapsed * 100;
+
+    result["cpu_percent"] = cpu;
+  }
+
+  // Clients the bridge streamed to from this address when scraped
+  int bridge_clients = -1;
+  if (!metrics_after.empty())
+  {
+    const std::string prefix = "http_client_bytes_sent_total{client=\"" + local_address + ":";
+
+    bridge_clients = 0;
+    for (const auto& m : metrics_after)
+      bridge_clients += (m.first.rfind(prefix, 0) == 0);
+
+    result["bridge"]["clients"] = bridge_clients;
+  }
+
+  const std::string text = result.dump(2);
+  if (options.output.empty())
+    printf("%s\n", text.c_str());
+  else
+    std::ofstream(options.output) << text << "\n";
+
+  // Fail the run when continuity was checked and broken
+  if (options.verify && total.discontinuities > 0)
+    return 2;
+
+  // Every client shares one address. Each must keep streaming alongside
+  // the others instead of replacing them
+  if (total.evictions > 0)
+  {
+    fprintf(stderr, "%u connections were closed by the bridge.\n", total.evictions);
+    return 3;
+  }
+
+  // Without churn every client is connected when metrics are scraped
+  if (options.churn == 0 && bridge_clients >= 0 && bridge_clients != (int) options.clients)
+  {
+    fprintf(stderr, "Bridge reports %d clients from %s, expected %u.\n", bridge_clients, local_address.c_str(), options.clients);
+    return 3;
+  }
+
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
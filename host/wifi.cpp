@@ -0,0 +1,16 @@
+#include "esp_log.h"
+
+#include "wifi.h"
+
+#define TAG "WiFi"
+
+/**
+  @brief  The host is already on the network. Nothing to connect
+
+  @param  none
+  @retval none
+*/
+void WiFi::init_station()
+{
+  ESP_LOGI(TAG, "Using host network.");
+}
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cstring>
+
+#include "aligner.h"
+
+constexpr uint32_t I2S::Aligner::CAPACITY_FRAMES;
+constexpr size_t I2S::Aligner::MAX_FRAME_SIZE;
+
+/**
+  @brief  Empty the FIFO and align afresh at the next pull. Must be called
+          whenever either input restarts
+
+  @param  frame_size Bytes of each frame. At most MAX_FRAME_SIZE
+  @param  target Frames to hold beyond a block at each pull. 0 when both
+                 inputs share clocks, so their buffers complete together.
+                 Otherwise a block, so the second input's buffers may
+                 complete either side of the first's
+  @retval none
+*/
+void I2S::Aligner::reset(size_t frame_size, uint32_t target)
+{
+  this->frame_size = std::min(frame_size, MAX_FRAME_SIZE);
+  this->target = target;
+
+  head = 0;
+  held = 0;
+  aligned = false;
+  window_min = INT32_MAX;
+  window_pulls = 0;
+  correction = 0;
+  pending_repeats = 0;
+  memset(last_frame, 0, sizeof(last_frame));
+}
+
+/**
+  @brief  Drop the oldest frames
+
+  @param  count Number of frames
+  @retval none
+*/
+void I2S::Aligner::discard(uint32_t count)
+{
+  count = std::min(count, held);
+  head = (head + count) % CAPACITY_FRAMES;
+  held -= count;
+}
+
+/**
+  @brief  Add frames captured by the second input. The oldest frames are
+          dropped when full
+
+  @param  frames Frames to add
+  @param  count Number of frames
+  @retval uint32_t - Frames dropped to make room
+*/
+uint32_t I2S::Aligner::push(const void* frames, uint32_t count)
+{
+  const uint8_t* source = (const uint8_t*) frames;
+
+  uint32_t overflow = 0;
+  if (count > CAPACITY_FRAMES)
+  {
+    overflow = count - CAPACITY_FRAMES;
+    source += overflow * frame_size;
+    count = CAPACITY_FRAMES;
+  }
+
+  if (held + count > CAPACITY_FRAMES)
+  {
+    overflow += held + count - CAPACITY_FRAMES;
+    discard(held + count - CAPACITY_FRAMES);
+  }
+
+  totals.dropped += overflow;
+
+  // Copy in up to two parts around the end of the ring
+  const uint32_t tail = (head + held) % CAPACITY_FRAMES;
+  const uint32_t first = std::min(count, CAPACITY_FRAMES - tail);
+  memcpy(buffer + tail * frame_size, source, first * frame_size);
+  memcpy(buffer, source + first * frame_size, (count - first) * frame_size);
+
+  held += count;
+  return overflow;
+}
+
+/**
+  @brief  Pull the frames lining up with a block of the first input.
+          Frames missing from the FIFO are filled by repeating the last
+          frame pulled
+
+  @param  destination Buffer to write frames to
+  @param  count Frames in the first input's block
+  @retval none
+*/
+void I2S::Aligner::pull(void* destination, uint32_t count)
+{
+  uint8_t* output = (uint8_t*) destination;
+
+  // Frames left over after this pull, counting repeats still to be made.
+  // A shortfall is repeated below, which leaves none for later pulls
+  const int32_t surplus = (int32_t) (held + pending_repeats) - (int32_t) count;
+  window_min = std::min(window_min, std::max(surplus, 0));
+
+  if (!aligned || ++window_pulls >= WINDOW)
+  {
+    // The lowest level of the window is the margin the second input's
+    // buffers arrive with. Drift moves it a block at a time as buffer
+    // completions cross, which is crawled back. Jump only when first
+    // aligning or when further out, as after an uneven overrun
+    const int32_t error = (aligned ? window_min : surplus) - (int32_t) target;
+    if (!aligned || error >= 2 * (int32_t) count || -error >= 2 * (int32_t) count)
+    {
+      if (error > 0)
+      {
+        discard(error);
+        totals.dropped += error;
+      }
+      else
+      {
+        pending_repeats += -error;
+        totals.repeated += -error;
+      }
+
+      if (error != 0)
+        totals.resyncs++;
+
+      correction = 0;
+    }
+    else
+      correction = error;
+
+    aligned = true;
+    window_min = INT32_MAX;
+    window_pulls = 0;
+  }
+
+  // Close small differences a frame per pull
+  if (correction > 0)
+  {
+    discard(1);
+    correction--;
+    totals.dropped++;
+  }
+  else if (correction < 0)
+  {
+    pending_repeats++;
+    correction++;
+    totals.repeated++;
+  }
+
+  uint32_t written = std::min(pending_repeats, count);
+  for (uint32_t i = 0; i < written; i++)
+    memcpy(output + i * frame_size, last_frame, frame_size);
+
+  pending_repeats -= written;
+
+  // Copy out in up to two parts around the end of the ring
+  const uint32_t available = std::min(held, count - written);
+  const uint32_t first = std::min(available, CAPACITY_FRAMES - head);
+  memcpy(output + written * frame_size, buffer + head * frame_size, first * frame_size);
+  memcpy(output + (written + first) * frame_size, buffer, (available - first) * frame_size);
+  discard(available);
+  written += available;
+
+  if (written > 0)
+    memcpy(last_frame, output + (written - 1) * frame_size, frame_size);
+
+  // Underrun. Hold the last frame for what's missing
+  totals.repeated += count - written;
+  for (; written < count; written++)
+    memcpy(output + written * frame_size, last_frame, frame_size);
+}
\ No newline at end of file
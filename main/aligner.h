@@ -0,0 +1,61 @@
+#ifndef __ALIGNER_H__
+#define __ALIGNER_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace I2S
+{
+  // Lines the frames of a second capture up with the blocks of the first.
+  // Frames are held in a FIFO and pulled a block at a time as the first
+  // input's blocks arrive. The level found at each pull is compared to a
+  // target over a window of pulls, and single frames are dropped or
+  // repeated to close any difference, so a second input on its own clock
+  // is followed without drifting away. Free of driver dependencies so it
+  // can be fed synthetic timing on the host
+  class Aligner
+  {
+    public:
+      static constexpr uint32_t CAPACITY_FRAMES = 3 * 480; // Three of the largest blocks
+      static constexpr size_t MAX_FRAME_SIZE = 8; // Stereo 32 bit
+      static constexpr uint32_t WINDOW = 32; // Pulls the lowest level is taken over
+
+      // Frames dropped or repeated since construction. Resyncs are jumps of
+      // a block or more, made when the inputs restart or overrun unevenly
+      struct Stats
+      {
+        uint32_t dropped = 0;
+        uint32_t repeated = 0;
+        uint32_t resyncs = 0;
+      };
+
+      void reset(size_t frame_size, uint32_t target);
+      uint32_t push(const void* frames, uint32_t count);
+      void pull(void* destination, uint32_t count);
+
+      // Frames held
+      uint32_t level(void) const { return held; }
+
+      const Stats& stats(void) const { return totals; }
+
+    private:
+      void discard(uint32_t count);
+
+      uint8_t buffer[CAPACITY_FRAMES * MAX_FRAME_SIZE];
+      uint8_t last_frame[MAX_FRAME_SIZE] = {};
+      size_t frame_size = MAX_FRAME_SIZE;
+      uint32_t head = 0; // Oldest frame
+      uint32_t held = 0;
+
+      uint32_t target = 0; // Frames to hold beyond a block at each pull
+      bool aligned = false; // Level corrected since the last reset
+      int32_t window_min = INT32_MAX;
+      uint32_t window_pulls = 0;
+      int32_t correction = 0; // Frames still to drop, or repeat if negative
+      uint32_t pending_repeats = 0; // Repeats of the last frame to output before held frames
+
+      Stats totals;
+  };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,511 @@
+#ifndef __AUDIO_H__
+#define __AUDIO_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace Audio
+{
+  // Packed little endian 24 bit sample. Only used to describe wire formats
+  struct int24_t
+  {
+    uint8_t bytes[3];
+  };
+
+  // Interleaved PCM format. Samples narrower than their container are left
+  // justified, as I2S delivers 24 bit samples in 32 bit slots
+  template <typename T, uint8_t Channels, uint8_t Bits = 8 * sizeof(T)>
+  struct Format
+  {
+    static_assert(std::is_same<T, int16_t>::value || std::is_same<T, int24_t>::value || std::is_same<T, int32_t>::value, "Samples must be int16_t, int24_t or int32_t.");
+    static_assert(Bits % 8 == 0 && Bits > 4 * sizeof(T) && Bits <= 8 * sizeof(T), "Bits must be whole bytes filling more than half the container.");
+    static_assert(Channels == 1 || Channels == 2, "Only mono and stereo are supported.");
+
+    typedef T sample_t;
+
+    // Wide enough to hold a sample multiplied by a frame count
+    typedef typename std::conditional<sizeof(T) == 2, int32_t, int64_t>::type accumulator_t;
+
+    static constexpr uint8_t channels = Channels;
+    static constexpr uint8_t bits_per_sample = Bits; // Valid bits of each sample
+    static constexpr uint8_t container_bits = 8 * sizeof(T);
+    static constexpr size_t frame_size = Channels * sizeof(T); // Bytes of a frame in memory
+  };
+
+  // Formats the pipeline is built for
+  typedef Format<int16_t, 1> S16Mono;
+  typedef Format<int16_t, 2> S16Stereo;
+  typedef Format<int32_t, 1, 24> S24Mono;
+  typedef Format<int32_t, 2, 24> S24Stereo;
+  typedef Format<int32_t, 1> S32Mono;
+  typedef Format<int32_t, 2> S32Stereo;
+
+  // Packed 24 bit wire formats
+  typedef Format<int24_t, 1> P24Mono;
+  typedef Format<int24_t, 2> P24Stereo;
+
+  // Single channel format of the same samples
+  template <typename F>
+  using MonoOf = Format<typename F::sample_t, 1, F::bits_per_sample>;
+
+  // Channels of a stereo source carried by a stream. Left and right are the
+  // first and second channel of the interleaved frames
+  enum class Mix : uint8_t
+  {
+    Stereo,
+    Downmix,
+    Left,
+    Right,
+  };
+  constexpr size_t MIX_COUNT = 4;
+
+  constexpr uint8_t channels(Mix mix)
+  {
+    return (mix == Mix::Stereo) ? 2 : 1;
+  }
+
+  /**
+    @brief  Bytes of the container holding samples of the provided depth.
+            16 bit samples are held as int16_t and wider as int32_t
+
+    @param  bits_per_sample Valid bits of each sample
+    @retval size_t
+  */
+  constexpr size_t container_size(uint8_t bits_per_sample)
+  {
+    return (bits_per_sample <= 16) ? sizeof(int16_t) : sizeof(int32_t);
+  }
+
+  // Sample buffer of up to MaxFrames frames tagged with when and in what
+  // order it was captured. Holds samples of F or of any narrower depth with
+  // the same channel count, packed from the start of samples
+  template <typename F, uint32_t MaxFrames>
+  struct Block
+  {
+    typedef F format_t;
+    typedef typename F::sample_t sample_t;
+    typedef std::array<sample_t, F::channels * MaxFrames> buffer_t;
+
+    static constexpr uint32_t max_frames = MaxFrames;
+
+    int64_t timestamp; // esp_timer time the block was read out of DMA
+    uint32_t sequence; // Skips the blocks lost in a gap
+    uint32_t gap_frames; // Frames lost immediately before this block
+    uint32_t frames; // Frames of samples that are valid
+    uint32_t sample_rate; // Rate the samples were captured at
+    uint8_t bits_per_sample; // Valid bits of each sample. Selects the container
+    buffer_t samples;
+
+    /**
+      @brief  Access the samples as held in the container of G
+
+      @param  none
+      @retval const G::sample_t*
+    */
+    template <typename G>
+    const typename G::sample_t* data() const
+    {
+      static_assert(G::channels == F::channels && sizeof(typename G::sample_t) <= sizeof(sample_t), "Format must fit the block.");
+      return reinterpret_cast<const typename G::sample_t*>(samples.data());
+    }
+
+    template <typename G>
+    typename G::sample_t* data()
+    {
+      static_assert(G::channels == F::channels && sizeof(typename G::sample_t) <= sizeof(sample_t), "Format must fit the block.");
+      return reinterpret_cast<typename G::sample_t*>(samples.data());
+    }
+
+    /**
+      @brief  Bytes of valid sample data
+
+      @param  none
+      @retval size_t
+    */
+    size_t bytes() const
+    {
+      return frames * F::channels * container_size(bits_per_sample);
+    }
+
+    /**
+      @brief  Size of the leading part of a block that holds the provided
+              number of frames. Queues of smaller blocks copy only this much
+
+      @param  frames Frames per block
+      @param  bits_per_sample Valid bits of each sample
+      @retval size_t
+    */
+    static constexpr size_t size(uint32_t frames, uint8_t bits_per_sample = F::bits_per_sample)
+    {
+      return offsetof(Block, samples) + frames * F::channels * container_size(bits_per_sample);
+    }
+  };
+
+  /**
+    @brief  Test if samples hold silence. Only the first and last samples
+            are checked so the test is cheap enough to run on every block
+
+    @param  samples Interleaved samples
+    @param  frames Number of frames. Must be non-zero
+    @retval bool
+  */
+  template <typename F>
+  inline bool is_silent(const typename F::sample_t* samples, uint32_t frames)
+  {
+    return samples[0] == 0 && samples[F::channels * frames - 1] == 0;
+  }
+
+  template <typename B>
+  inline bool is_silent(const B& block)
+  {
+    typedef Format<int16_t, B::format_t::channels> narrow_t;
+    typedef Format<typename B::sample_t, B::format_t::channels> wide_t;
+
+    if (block.bits_per_sample <= 16)
+      return is_silent<narrow_t>(block.template data<narrow_t>(), block.frames);
+
+    return is_silent<wide_t>(block.template data<wide_t>(), block.frames);
+  }
+
+  /**
+    @brief  Test if stereo samples are mono i.e. both channels are equal in
+            every frame
+
+    @param  samples Interleaved samples
+    @param  frames Number of frames
+    @retval bool
+  */
+  template <typename F>
+  bool is_mono(const typename F::sample_t* samples, uint32_t frames)
+  {
+    static_assert(F::channels == 2, "Samples must be stereo.");
+
+    // Accumulate differences rather than exit early so the loop stays branch free
+    typename F::sample_t difference = 0;
+    for (uint32_t i = 0; i < frames; i++)
+      difference |= samples[2 * i] ^ samples[2 * i + 1];
+
+    return difference == 0;
+  }
+
+  template <typename B>
+  inline bool is_mono(const B& block)
+  {
+    typedef Format<int16_t, 2> narrow_t;
+    typedef Format<typename B::sample_t, 2> wide_t;
+
+    if (block.bits_per_sample <= 16)
+      return is_mono<narrow_t>(block.template data<narrow_t>(), block.frames);
+
+    return is_mono<wide_t>(block.template data<wide_t>(), block.frames);
+  }
+
+  /**
+    @brief  Mix stereo samples down to mono. The average is formed without
+            widening, so 32 bit samples need no 64 bit arithmetic
+
+    @param  source Interleaved stereo samples
+    @param  destination Mono samples to write
+    @param  frames Number of frames
+    @retval none
+  */
+  template <typename F>
+  void downmix(const typename F::sample_t* source, typename F::sample_t* destination, uint32_t frames)
+  {
+    static_assert(F::channels == 2, "Source must be stereo.");
+
+    for (uint32_t i = 0; i < frames; i++)
+    {
+      typename F::sample_t a = source[2 * i];
+      typename F::sample_t b = source[2 * i + 1];
+
+      // Floor of (a + b) / 2 without overflow
+      destination[i] = (a & b) + ((a ^ b) >> 1);
+    }
+  }
+
+  /**
+    @brief  Deinterleave one channel of stereo samples
+
+    @param  source Interleaved stereo samples
+    @param  destination Mono samples to write
+    @param  frames Number of frames
+    @param  channel Channel to keep. 0 or 1
+    @retval none
+  */
+  template <typename F>
+  void select(const typename F::sample_t* source, typename F::sample_t* destination, uint32_t frames, uint8_t channel)
+  {
+    static_assert(F::channels == 2, "Source must be stereo.");
+
+    source += channel;
+    for (uint32_t i = 0; i < frames; i++)
+      destination[i] = source[2 * i];
+  }
+
+  /**
+    @brief  Derive mono samples from stereo samples
+
+    @param  source Interleaved stereo samples
+    @param  destination Mono samples to write
+    @param  frames Number of frames
+    @param  mix Downmix, Left or Right
+    @retval none
+  */
+  template <typename F>
+  void mix(const typename F::sample_t* source, typename F::sample_t* destination, uint32_t frames, Mix mix)
+  {
+    if (mix == Mix::Downmix)
+      downmix<F>(source, destination, frames);
+    else
+      select<F>(source, destination, frames, (mix == Mix::Right) ? 1 : 0);
+  }
+
+  /**
+    @brief  Crossfade linearly from a held frame into the samples
+
+    @param  held Frame to fade from
+    @param  samples Interleaved samples to fade into
+    @param  frames Length of the fade
+    @retval none
+  */
+  template <typename F>
+  void crossfade(const typename F::sample_t (&held)[F::channels], typename F::sample_t* samples, uint32_t frames)
+  {
+    typedef typename F::accumulator_t accumulator_t;
+
+    const accumulator_t length = frames;
+    for (accumulator_t i = 0; i < length; i++)
+    {
+      for (uint32_t c = 0; c < F::channels; c++)
+      {
+        accumulator_t sample = samples[F::channels * i + c];
+        samples[F::channels * i + c] = (held[c] * (length - i) + sample * i) / length;
+      }
+    }
+  }
+
+  // Unity of the Q1.15 gains applied while mixing
+  constexpr int32_t GAIN_UNITY = 1 << 15;
+
+  /**
+    @brief  Add two samples, saturating at the limits of the container.
+            Branch free so loops of it vectorize
+
+    @param  a First sample
+    @param  b Second sample
+    @retval Saturated sum
+  */
+  inline int16_t saturating_add(int16_t a, int16_t b)
+  {
+    int32_t sum = (int32_t) a + b;
+    sum = (sum > INT16_MAX) ? INT16_MAX : sum;
+    return (sum < INT16_MIN) ? INT16_MIN : sum;
+  }
+
+  inline int32_t saturating_add(int32_t a, int32_t b)
+  {
+    uint32_t sum = (uint32_t) a + (uint32_t) b;
+
+    // All ones when both operands' signs differ from the sum's, and the limit on the side of a's sign
+    int32_t overflow = (int32_t) (((uint32_t) a ^ sum) & ((uint32_t) b ^ sum)) >> 31;
+    int32_t limit = (int32_t) (((uint32_t) a >> 31) + (uint32_t) INT32_MAX);
+
+    return (limit & overflow) | ((int32_t) sum & ~overflow);
+  }
+
+  /**
+    @brief  Sum two blocks of samples with saturation
+
+    @param  a Interleaved samples
+    @param  b Interleaved samples to add
+    @param  destination Interleaved samples to write. May alias a or b
+    @param  frames Number of frames
+    @retval none
+  */
+  template <typename F>
+  void sum(const typename F::sample_t* a, const typename F::sample_t* b, typename F::sample_t* destination, uint32_t frames)
+  {
+    for (uint32_t i = 0; i < frames * F::channels; i++)
+      destination[i] = saturating_add(a[i], b[i]);
+  }
+
+  /**
+    @brief  Sum two blocks of samples with saturation, ramping the gain of
+            the second linearly across the block
+
+    @param  a Interleaved samples
+    @param  b Interleaved samples to scale and add
+    @param  destination Interleaved samples to write. May alias a or b
+    @param  frames Number of frames. Non-zero
+    @param  from Q1.15 gain of b at the first frame. At most GAIN_UNITY
+    @param  to Q1.15 gain of b reached after the last frame. At most GAIN_UNITY
+    @retval none
+  */
+  template <typename F>
+  void sum_ramped(const typename F::sample_t* a, const typename F::sample_t* b, typename F::sample_t* destination, uint32_t frames, int32_t from, int32_t to)
+  {
+    typedef typename F::accumulator_t accumulator_t;
+
+    // Gain with 15 more fractional bits so short ramps still arrive
+    int32_t position = from * (1 << 15);
+    const int32_t step = (to - from) * (1 << 15) / (int32_t) frames;
+
+    for (uint32_t i = 0; i < frames; i++, position += step)
+    {
+      const accumulator_t gain = position >> 15;
+      for (uint32_t c = 0; c < F::channels; c++)
+      {
+        const uint32_t n = F::channels * i + c;
+        destination[n] = saturating_add(a[n], (typename F::sample_t) ((b[n] * gain) >> 15));
+      }
+    }
+  }
+
+  /**
+    @brief  Find the peak magnitude of samples. Negative samples are taken
+            as their ones' complement so the most negative needs no wider
+            type
+
+    @param  samples Interleaved samples
+    @param  frames Number of frames
+    @retval sample_t - Peak in the container's scale
+  */
+  template <typename F>
+  typename F::sample_t peak(const typename F::sample_t* samples, uint32_t frames)
+  {
+    typename F::sample_t peak = 0;
+    for (uint32_t i = 0; i < frames * F::channels; i++)
+    {
+      typename F::sample_t magnitude = samples[i] ^ (samples[i] >> (F::container_bits - 1));
+      peak = (magnitude > peak) ? magnitude : peak;
+    }
+
+    return peak;
+  }
+
+  /**
+    @brief  Move a sample between container widths keeping it left justified
+
+    @param  sample Sample to rescale
+    @retval To
+  */
+  template <typename To, typename From>
+  inline typename std::enable_if<(sizeof(To) >= sizeof(From)), To>::type rescale(From sample)
+  {
+    return (To) sample * ((To) 1 << (8 * (sizeof(To) - sizeof(From))));
+  }
+
+  template <typename To, typename From>
+  inline typename std::enable_if<(sizeof(To) < sizeof(From)), To>::type rescale(From sample)
+  {
+    return (To) (sample >> (8 * (sizeof(From) - sizeof(To))));
+  }
+
+  /**
+    @brief  Convert samples between formats of equal channel count. Bits
+            beyond the destination's precision are truncated
+
+    @param  source Interleaved samples to convert
+    @param  destination Interleaved samples to write. May alias source only
+                        when the containers are equal
+    @param  frames Number of frames
+    @retval none
+  */
+  template <typename From, typename To>
+  void convert(const typename From::sample_t* source, typename To::sample_t* destination, uint32_t frames)
+  {
+    static_assert(From::channels == To::channels, "Channel count must match.");
+
+    // Clear the bits the destination can't carry
+    constexpr typename To::sample_t mask = ~(typename To::sample_t) ((1ll << (To::container_bits - To::bits_per_sample)) - 1);
+
+    for (uint32_t i = 0; i < frames * From::channels; i++)
+      destination[i] = rescale<typename To::sample_t>(source[i]) & mask;
+  }
+
+  /**
+    @brief  Store a 32 bit word to a word aligned byte buffer. The Xtensa
+            core has no unaligned stores so alignment must be known
+
+    @param  destination 4 byte aligned address to store to
+    @param  word Word to store
+    @retval none
+  */
+  inline void store32(uint8_t* destination, uint32_t word)
+  {
+    memcpy(__builtin_assume_aligned(destination, 4), &word, sizeof(word));
+  }
+
+  // Stores 24 bit words in the byte order of the wire format
+  template <bool BigEndian>
+  struct Packer;
+
+  template <>
+  struct Packer<false>
+  {
+    // Four left justified samples a, b, c and d as a0 a1 a2 b0 b1 b2 ...
+    static void pack4(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint8_t* destination)
+    {
+      store32(destination, (a >> 8) | (b << 16 & 0xFF000000));
+      store32(destination + 4, (b >> 16) | (c << 8 & 0xFFFF0000));
+      store32(destination + 8, (c >> 24) | (d & 0xFFFFFF00));
+    }
+
+    static void pack1(uint32_t a, uint8_t* destination)
+    {
+      destination[0] = a >> 8;
+      destination[1] = a >> 16;
+      destination[2] = a >> 24;
+    }
+  };
+
+  template <>
+  struct Packer<true>
+  {
+    // Four left justified samples a, b, c and d as a2 a1 a0 b2 b1 b0 ...
+    static void pack4(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint8_t* destination)
+    {
+      store32(destination, __builtin_bswap32((a & 0xFFFFFF00) | (b >> 24)));
+      store32(destination + 4, __builtin_bswap32((b << 8 & 0xFFFF0000) | (c >> 16)));
+      store32(destination + 8, __builtin_bswap32((c << 16 & 0xFF000000) | (d >> 8)));
+    }
+
+    static void pack1(uint32_t a, uint8_t* destination)
+    {
+      destination[0] = a >> 24;
+      destination[1] = a >> 16;
+      destination[2] = a >> 8;
+    }
+  };
+
+  /**
+    @brief  Pack samples into 24 bit words. Every four samples are written
+            as three 32 bit words without per sample branches. Bits below
+            the top 24 are truncated
+
+    @param  source Interleaved samples to pack
+    @param  destination 4 byte aligned buffer of at least 3 bytes per sample
+    @param  count Number of samples
+    @retval none
+  */
+  template <typename F, bool BigEndian>
+  void pack24(const typename F::sample_t* source, uint8_t* destination, size_t count)
+  {
+    typedef Packer<BigEndian> packer_t;
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4, destination += 12)
+    {
+      packer_t::pack4(rescale<int32_t>(source[i]), rescale<int32_t>(source[i + 1]), rescale<int32_t>(source[i + 2]), rescale<int32_t>(source[i + 3]), destination);
+    }
+
+    for (; i < count; i++, destination += 3)
+      packer_t::pack1(rescale<int32_t>(source[i]), destination);
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "esp_log.h"
+
+#include "audio_monitor.h"
+
+#define TAG "System"
+
+/**
+  @brief  Account one check of the captured audio
+
+  @param  silent The latest block was silent
+  @param  now Time of the check in microseconds
+  @param  renderers_streaming Tests if the selected renderers still have
+                              streams. Only called when audio resumes
+                              from warm standby
+  @retval Action - Control action to take
+*/
+System::AudioMonitor::Action System::AudioMonitor::update(bool silent, int64_t now, bool (*renderers_streaming)(void))
+{
+  if (silent)
+  {
+    if (timeout > 0)
+    {
+      timeout--;
+      return Action::None;
+    }
+
+    if (current == AudioState::Active && standby_timeout > 0)
+    {
+      ESP_LOGI(TAG, "Audio off. Entering warm standby.");
+
+      // Leave renderers streaming silence until standby expires
+      current = AudioState::Standby;
+      timeout = standby_timeout;
+      standby_start = now;
+      return Action::None;
+    }
+
+    if (current == AudioState::Silent)
+      return Action::None;
+
+    ESP_LOGI(TAG, "Audio off.");
+    current = AudioState::Silent;
+    return Action::Disable;
+  }
+
+  if (current == AudioState::Standby)
+  {
+    // Control is still enabled, so renderers are already playing or need
+    // only their streams set again. Either way without the silent timeout
+    current = AudioState::Active;
+    timeout = active_timeout;
+
+    if (renderers_streaming())
+    {
+      ESP_LOGI(TAG, "Audio resumed from warm standby after %lld s. No control actions needed.", (now - standby_start) / 1000000);
+      return Action::None;
+    }
+
+    ESP_LOGI(TAG, "Audio resumed from warm standby after %lld s. Renderers disconnected, restarting them.", (now - standby_start) / 1000000);
+    return Action::Restart;
+  }
+
+  if (timeout < ((current == AudioState::Silent) ? silent_timeout : active_timeout))
+  {
+    timeout++;
+    return Action::None;
+  }
+
+  if (current == AudioState::Silent)
+  {
+    ESP_LOGI(TAG, "Audio On.");
+
+    // Increase timeout in active state
+    current = AudioState::Active;
+    timeout = active_timeout;
+    return Action::Enable;
+  }
+
+  return Action::None;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef __AUDIO_MONITOR_H__
+#define __AUDIO_MONITOR_H__
+
+#include <cstdint>
+
+#include "system.h"
+
+namespace System
+{
+  // Follows whether the source is playing from the silence of its blocks,
+  // checked every 250 ms. Renderers are started once audio has lasted the
+  // silent timeout and stopped once silence has lasted the active timeout,
+  // optionally after a warm standby that keeps them streaming silence.
+  // Free of driver dependencies so it can be fed on the host
+  class AudioMonitor
+  {
+    public:
+      // Control action an update calls for
+      enum class Action
+      {
+        None,
+        Enable,
+        Disable,
+        Restart, // Start renderers that dropped their streams again
+      };
+
+      AudioMonitor(int32_t silent_timeout = AUDIO_SILENT_TIMEOUT, int32_t active_timeout = AUDIO_ACTIVE_TIMEOUT, int32_t standby_timeout = AUDIO_STANDBY_TIMEOUT) :
+        silent_timeout(silent_timeout), active_timeout(active_timeout), standby_timeout(standby_timeout) {}
+
+      Action update(bool silent, int64_t now, bool (*renderers_streaming)(void));
+
+      AudioState state(void) const { return current; }
+
+    private:
+      const int32_t silent_timeout; // Checks
+      const int32_t active_timeout;
+      const int32_t standby_timeout;
+
+      int32_t timeout = 0;
+      AudioState current = AudioState::Silent;
+      int64_t standby_start = 0;
+  };
+}
+
+#endif
\ No newline at end of file
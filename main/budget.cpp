@@ -0,0 +1,115 @@
+#include <algorithm>
+
+#include "budget.h"
+
+constexpr int64_t HTTP::Budget::WINDOW_US;
+constexpr uint32_t HTTP::Budget::RECOVERY_PERMILLE;
+constexpr uint32_t HTTP::Budget::MIN_HOLDOFF;
+constexpr uint32_t HTTP::Budget::MAX_HOLDOFF;
+
+/**
+  @brief  Check if a client would be admitted
+
+  @param  bitrate Bits per second of the client's stream
+  @retval bool
+*/
+bool HTTP::Budget::fits(uint32_t bitrate) const
+{
+  return count < _max_clients && (uint64_t) reserved + bitrate <= capacity();
+}
+
+/**
+  @brief  Admit a client and reserve its bitrate if it fits the budget
+
+  @param  bitrate Bits per second of the client's stream
+  @retval bool - Client was admitted
+*/
+bool HTTP::Budget::admit(uint32_t bitrate)
+{
+  if (!fits(bitrate))
+  {
+    rejected++;
+    return false;
+  }
+
+  reserved += bitrate;
+  count++;
+  return true;
+}
+
+/**
+  @brief  Release the reservation of an admitted client
+
+  @param  bitrate Bits per second the client was admitted with
+  @retval none
+*/
+void HTTP::Budget::release(uint32_t bitrate)
+{
+  reserved -= std::min(bitrate, reserved);
+  if (count > 0)
+    count--;
+}
+
+/**
+  @brief  Measure the throughput of the link from the bytes written to
+          the sockets of clients still reading. Drops from every one of
+          them mean the link carried no more than what was delivered.
+          Called once per window
+
+  @param  timestamp Time in microseconds
+  @param  traffic Traffic of each streaming client since the last update.
+                  Pending clients are left out
+  @retval none
+*/
+void HTTP::Budget::update(int64_t timestamp, const std::vector<Traffic>& traffic)
+{
+  if (window_start < 0)
+  {
+    window_start = timestamp;
+    return;
+  }
+
+  const int64_t elapsed = timestamp - window_start;
+  if (elapsed <= 0)
+    return;
+
+  // Stalled readers drop whatever the link carries, and pending clients
+  // send nothing yet. Both keep their reservations out of the measurement
+  uint64_t bytes_sent = 0;
+  uint64_t reading_bitrate = 0;
+  size_t reading = 0;
+  size_t dropping = 0;
+  for (const Traffic& client : traffic)
+  {
+    if (client.stalled)
+      continue;
+
+    bytes_sent += client.bytes_sent;
+    reading_bitrate += client.bitrate;
+    reading++;
+
+    if (client.drops > 0)
+      dropping++;
+  }
+
+  measured = std::min<uint64_t>(bytes_sent * 8 * 1000000 / elapsed, UINT32_MAX);
+  const uint32_t idle_bitrate = reserved - std::min<uint64_t>(reading_bitrate, reserved);
+
+  // A client dropping while others keep up is a slow reader, not a full link
+  if (dropping > 0 && dropping == reading)
+  {
+    estimate = std::min<uint64_t>((uint64_t) measured + idle_bitrate, UINT32_MAX);
+    holdoff = std::min(std::max(holdoff * 2, MIN_HOLDOFF), MAX_HOLDOFF);
+    held = holdoff;
+  }
+  else if (held > 0)
+    held--;
+  else
+  {
+    estimate = std::min<uint64_t>((uint64_t) estimate + (uint64_t) _limit * RECOVERY_PERMILLE / 1000, _limit);
+    if (estimate == _limit)
+      holdoff = 0;
+  }
+
+  window_start = timestamp;
+}
\ No newline at end of file
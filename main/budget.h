@@ -0,0 +1,67 @@
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <cstdint>
+#include <vector>
+
+namespace HTTP
+{
+  // Admission control for stream clients. Each client reserves its
+  // stream's bitrate and new clients are only admitted while reservations
+  // fit the budget. The budget is the configured limit, cut to the
+  // throughput actually delivered whenever every reading client drops
+  // blocks. It is held there for a holdoff that doubles with each cut in
+  // a row, then recovered slowly, so a link at its limit isn't probed
+  // again and again. Free of mongoose so it can be fed synthetic traffic
+  // on the host
+  class Budget
+  {
+    public:
+      static constexpr int64_t WINDOW_US = 1000000; // Throughput measurement window
+      static constexpr uint32_t RECOVERY_PERMILLE = 20; // Share of the limit regained per window without drops
+      static constexpr uint32_t MIN_HOLDOFF = 10; // Windows the budget is held after the first cut
+      static constexpr uint32_t MAX_HOLDOFF = 300;
+
+      // Traffic of one streaming client since the last update
+      struct Traffic
+      {
+        uint64_t bytes_sent;
+        uint32_t drops;
+        uint32_t bitrate; // Reserved for the client
+        bool stalled; // Took nothing from its socket, so it says nothing about the link
+      };
+
+      Budget(uint32_t limit, uint32_t max_clients) : _limit(limit), _max_clients(max_clients), estimate(limit) {}
+
+      bool fits(uint32_t bitrate) const;
+      bool admit(uint32_t bitrate);
+      void release(uint32_t bitrate);
+      void update(int64_t timestamp, const std::vector<Traffic>& traffic);
+
+      // Bits per second
+      uint32_t limit(void) const { return _limit; }
+      uint32_t capacity(void) const { return (estimate < _limit) ? estimate : _limit; }
+      uint32_t committed(void) const { return reserved; }
+      uint32_t throughput(void) const { return measured; }
+      bool overcommitted(void) const { return reserved > capacity(); }
+
+      uint32_t clients(void) const { return count; }
+      uint32_t max_clients(void) const { return _max_clients; }
+      uint32_t rejections(void) const { return rejected; }
+
+    private:
+      uint32_t _limit;
+      uint32_t _max_clients;
+      uint32_t estimate; // Capacity of the link found from drops
+      uint32_t reserved = 0;
+      uint32_t count = 0;
+      uint32_t rejected = 0;
+
+      int64_t window_start = -1;
+      uint32_t measured = 0; // Throughput of reading clients
+      uint32_t holdoff = 0; // Windows to hold after the next cut. 0 once recovered
+      uint32_t held = 0; // Windows still to hold
+  };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef __DLNA_H__
+#define __DLNA_H__
+
+#include <string>
+
+#include "upnp.h"
+
+namespace DLNA
+{
+  // DLNA.ORG_FLAGS for a live stream: streaming transfer mode, background transfer mode,
+  // connection stall allowed and DLNA v1.5. No seek flags since the stream can't be seeked
+  constexpr const char* LIVE_STREAM_FLAGS = "01700000000000000000000000000000";
+
+  // UPnP class for a live audio stream
+  constexpr const char* AUDIO_BROADCAST_CLASS = "object.item.audioItem.audioBroadcast";
+
+  /**
+    @brief  Build the DLNA 4th field of the protocolInfo for a live stream
+
+    @param  profile DLNA.ORG_PN profile name. Omitted if empty
+    @retval std::string
+  */
+  inline std::string content_features(const std::string& profile = "")
+  {
+    std::string features;
+    if (!profile.empty())
+      features += "DLNA.ORG_PN=" + profile + ";";
+
+    // No seek operations, not converted content
+    features += "DLNA.ORG_OP=00;DLNA.ORG_CI=0;";
+    features += "DLNA.ORG_FLAGS=" + std::string(LIVE_STREAM_FLAGS);
+    return features;
+  }
+
+  /**
+    @brief  Build a complete protocolInfo string for a live HTTP stream
+
+    @param  mime_type MIME type of the stream
+    @param  profile DLNA.ORG_PN profile name. Omitted if empty
+    @retval std::string
+  */
+  inline std::string protocol_info(const std::string& mime_type, const std::string& profile = "")
+  {
+    return "http-get:*:" + mime_type + ":" + content_features(profile);
+  }
+
+  /**
+    @brief  Build the DIDL-Lite metadata describing a live audio stream
+
+    @param  title Title shown by the renderer
+    @param  uri URI of the stream
+    @param  protocol_info protocolInfo of the stream resource
+    @retval std::string
+  */
+  inline std::string didl_lite(const std::string& title, const std::string& uri, const std::string& protocol_info)
+  {
+    std::string didl = R"(<DIDL-Lite xmlns="urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/" xmlns:dc="http://purl.org/dc/elements/1.1/" xmlns:upnp="urn:schemas-upnp-org:metadata-1-0/upnp/">)";
+    didl += R"(<item id="0" parentID="-1" restricted="1">)";
+    didl += "<dc:title>" + UPNP::escape_xml(title) + "</dc:title>";
+    didl += "<upnp:class>" + std::string(AUDIO_BROADCAST_CLASS) + "</upnp:class>";
+    didl += R"(<res protocolInfo=")" + UPNP::escape_xml(protocol_info) + R"(">)" + UPNP::escape_xml(uri) + "</res>";
+    didl += "</item>";
+    didl += "</DIDL-Lite>";
+    return didl;
+  }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,362 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <cmath>
+
+#include "dsp.h"
+#include "metrics.h"
+#include "nvs_interface.h"
+#include "trace.h"
+
+#define TAG "DSP"
+
+static constexpr float SILENCE_BYPASS_MS = 20; // Digital silence after which filter tails are over
+
+static Metrics::Counter processed_count("dsp_processed_blocks_total", "Blocks processed by the DSP chain.");
+static Metrics::Counter limited_count("dsp_limited_blocks_total", "Blocks the limiter reduced gain in.");
+
+// Settings requested by the HTTP task, applied by the capture task at the
+// start of the next block
+static SemaphoreHandle_t settings_mutex;
+static DSP::Settings settings;
+static bool settings_changed = false;
+
+// Allocated when first enabled. Only used from the capture task
+static DSP::Chain* chain = nullptr;
+static DSP::Settings active;
+
+/**
+  @brief  Convert a float to fixed point, rounding to nearest and
+          saturating
+
+  @param  value Value to convert
+  @param  bits Fractional bits
+  @retval int32_t
+*/
+static int32_t quantize(float value, uint8_t bits)
+{
+  float scaled = ldexpf(value, bits);
+  if (scaled >= 2147483647.0f)
+    return INT32_MAX;
+
+  if (scaled <= -2147483648.0f)
+    return INT32_MIN;
+
+  return (int32_t) lroundf(scaled);
+}
+
+/**
+  @brief  Convert a level in dB to a fixed point gain
+
+  @param  db Level in dB
+  @param  bits Fractional bits of the gain
+  @retval int32_t
+*/
+int32_t DSP::gain(float db, uint8_t bits)
+{
+  return quantize(powf(10, db / 20), bits);
+}
+
+/**
+  @brief  Design the coefficients of a filter from the Audio EQ Cookbook
+          (R. Bristow-Johnson). Designed in float when settings or the
+          sample rate change, then quantized to Q4.28
+
+  @param  filter Filter to design
+  @param  sample_rate Sample rate to design for
+  @retval Coefficients
+*/
+DSP::Coefficients DSP::design(const Filter& filter, uint32_t sample_rate)
+{
+  const float A = powf(10, filter.gain_db / 40);
+  // Keep below Nyquist at low rates
+  const float frequency = (filter.frequency < 0.45f * sample_rate) ? filter.frequency : 0.45f * sample_rate;
+  const float w0 = 2 * (float) M_PI * frequency / sample_rate;
+  const float cos_w0 = cosf(w0);
+  const float alpha = sinf(w0) / (2 * filter.q);
+  const float sqrt_A = sqrtf(A);
+
+  float b0, b1, b2, a0, a1, a2;
+  switch (filter.type)
+  {
+    default:
+    case FilterType::Peaking:
+      b0 = 1 + alpha * A;
+      b1 = -2 * cos_w0;
+      b2 = 1 - alpha * A;
+      a0 = 1 + alpha / A;
+      a1 = -2 * cos_w0;
+      a2 = 1 - alpha / A;
+      break;
+
+    case FilterType::LowShelf:
+      b0 = A * ((A + 1) - (A - 1) * cos_w0 + 2 * sqrt_A * alpha);
+      b1 = 2 * A * ((A - 1) - (A + 1) * cos_w0);
+      b2 = A * ((A + 1) - (A - 1) * cos_w0 - 2 * sqrt_A * alpha);
+      a0 = (A + 1) + (A - 1) * cos_w0 + 2 * sqrt_A * alpha;
+      a1 = -2 * ((A - 1) + (A + 1) * cos_w0);
+      a2 = (A + 1) + (A - 1) * cos_w0 - 2 * sqrt_A * alpha;
+      break;
+
+    case FilterType::HighShelf:
+      b0 = A * ((A + 1) + (A - 1) * cos_w0 + 2 * sqrt_A * alpha);
+      b1 = -2 * A * ((A - 1) + (A + 1) * cos_w0);
+      b2 = A * ((A + 1) + (A - 1) * cos_w0 - 2 * sqrt_A * alpha);
+      a0 = (A + 1) - (A - 1) * cos_w0 + 2 * sqrt_A * alpha;
+      a1 = 2 * ((A - 1) - (A + 1) * cos_w0);
+      a2 = (A + 1) - (A - 1) * cos_w0 - 2 * sqrt_A * alpha;
+      break;
+
+    case FilterType::LowPass:
+      b0 = (1 - cos_w0) / 2;
+      b1 = 1 - cos_w0;
+      b2 = (1 - cos_w0) / 2;
+      a0 = 1 + alpha;
+      a1 = -2 * cos_w0;
+      a2 = 1 - alpha;
+      break;
+
+    case FilterType::HighPass:
+      b0 = (1 + cos_w0) / 2;
+      b1 = -(1 + cos_w0);
+      b2 = (1 + cos_w0) / 2;
+      a0 = 1 + alpha;
+      a1 = -2 * cos_w0;
+      a2 = 1 - alpha;
+      break;
+  }
+
+  Coefficients c;
+  c.b0 = quantize(b0 / a0, COEFFICIENT_BITS);
+  c.b1 = quantize(b1 / a0, COEFFICIENT_BITS);
+  c.b2 = quantize(b2 / a0, COEFFICIENT_BITS);
+  c.a1 = quantize(a1 / a0, COEFFICIENT_BITS);
+  c.a2 = quantize(a2 / a0, COEFFICIENT_BITS);
+  return c;
+}
+
+/**
+  @brief  Design the chain for the settings at a sample rate and clear
+          its state
+
+  @param  settings Settings to apply
+  @param  sample_rate Sample rate of the blocks to process
+  @retval none
+*/
+void DSP::Chain::configure(const Settings& settings, uint32_t sample_rate)
+{
+  rate = sample_rate;
+
+  section_count = (settings.section_count < MAX_SECTIONS) ? settings.section_count : MAX_SECTIONS;
+  for (uint8_t i = 0; i < section_count; i++)
+    coefficients[i] = design(settings.sections[i], sample_rate);
+
+  gain = DSP::gain(settings.gain_db, COEFFICIENT_BITS);
+
+  // Smoothing coefficients are 1 - e^(-1 / frames) of their time constant.
+  // Attack settles within the look-ahead
+  const LimiterSettings& l = settings.limiter;
+  const float lookahead = l.lookahead_ms * sample_rate / 1000;
+  const float attack = 1 - expf(-4 / ((lookahead > 1) ? lookahead : 1));
+  const float release = 1 - expf(-1000 / (((l.release_ms > 1) ? l.release_ms : 1) * sample_rate));
+
+  limiter_enabled = l.enabled;
+  limiter.configure(DSP::gain(l.threshold_db, 31 - HEADROOM_BITS), (uint32_t) lookahead, quantize(attack, GAIN_BITS), quantize(release, GAIN_BITS));
+
+  bypass_frames = SILENCE_BYPASS_MS * sample_rate / 1000;
+
+  reset();
+}
+
+/**
+  @brief  Clear the filter and limiter state
+
+  @param  none
+  @retval none
+*/
+void DSP::Chain::reset()
+{
+  memset(state, 0, sizeof(state));
+  limiter.reset();
+  silent_frames = 0;
+}
+
+/**
+  @brief  Run interleaved Q4.27 samples through the EQ, gain and limiter.
+          Blocks of digital silence are left untouched once filter tails
+          are over, so silence stays exact for silence detection
+
+  @param  samples Interleaved samples to process in place
+  @param  frames Number of frames. At most BUFFER_SAMPLE_COUNT
+  @retval bool - Limiter reduced gain
+*/
+bool DSP::Chain::process(int32_t* samples, uint32_t frames)
+{
+  const uint32_t count = frames * I2S::CHANNELS;
+
+  int32_t any = 0;
+  for (uint32_t i = 0; i < count; i++)
+    any |= samples[i];
+
+  if (any != 0)
+    silent_frames = 0;
+  else if (silent_frames >= bypass_frames)
+    return false;
+  else if ((silent_frames += frames) >= bypass_frames)
+  {
+    // Tails are over. Start from rest when audio resumes
+    reset();
+    silent_frames = bypass_frames;
+    return false;
+  }
+
+  for (uint8_t i = 0; i < section_count; i++)
+    biquad<I2S::CHANNELS>(coefficients[i], state[i], samples, frames);
+
+  if (gain != UNITY)
+    apply_gain(gain, samples, count);
+
+  if (!limiter_enabled)
+    return false;
+
+  return limiter.process(samples, frames);
+}
+
+/**
+  @brief  Restore the saved settings
+
+  @param  none
+  @retval none
+*/
+void DSP::init()
+{
+  settings_mutex = xSemaphoreCreateMutex();
+  if (settings_mutex == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to create settings mutex.");
+    return;
+  }
+
+  // Already saved so applied without saving again
+  settings_changed = NVS::get_dsp(settings);
+}
+
+/**
+  @brief  Apply new settings from the next block. Saved to NVS when they
+          differ from the current settings
+
+  @param  settings Settings to apply. Assumed valid
+  @retval none
+*/
+void DSP::configure(const Settings& settings)
+{
+  if (settings_mutex == nullptr)
+    return;
+
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+
+  bool changed = !(::settings == settings);
+  if (changed)
+  {
+    ::settings = settings;
+    settings_changed = true;
+  }
+
+  xSemaphoreGive(settings_mutex);
+
+  if (!changed)
+    return;
+
+  NVS::set_dsp(settings);
+  ESP_LOGI(TAG, "DSP %s. %u EQ sections, %.1f dB gain, limiter %s.", settings.enabled ? "enabled" : "disabled", settings.section_count, settings.gain_db, settings.limiter.enabled ? "on" : "off");
+}
+
+/**
+  @brief  Fetch the requested settings. May not be applied yet
+
+  @param  none
+  @retval Settings
+*/
+DSP::Settings DSP::get_settings()
+{
+  if (settings_mutex == nullptr)
+    return Settings();
+
+  xSemaphoreTake(settings_mutex, portMAX_DELAY);
+  Settings copy = settings;
+  xSemaphoreGive(settings_mutex);
+
+  return copy;
+}
+
+/**
+  @brief  Clear the chain's state after a gap in the captured audio. Must
+          be called from the capture task
+
+  @param  none
+  @retval none
+*/
+void DSP::reset()
+{
+  if (chain != nullptr)
+    chain->reset();
+}
+
+/**
+  @brief  Process a captured block in place. Runs once per block before
+          it is encoded for clients. Must be called from the capture task
+
+  @param  block Block to process
+  @retval none
+*/
+void DSP::process(I2S::block_t& block)
+{
+  // Pick up new settings without waiting on the HTTP task
+  bool changed = false;
+  if (settings_mutex != nullptr && xSemaphoreTake(settings_mutex, 0) == pdTRUE)
+  {
+    if (settings_changed)
+    {
+      active = settings;
+      settings_changed = false;
+      changed = true;
+    }
+
+    xSemaphoreGive(settings_mutex);
+  }
+
+  if (!active.enabled)
+    return;
+
+  if (chain == nullptr)
+  {
+    chain = new DSP::Chain();
+    if (chain == nullptr)
+    {
+      ESP_LOGE(TAG, "Failed to allocate DSP chain.");
+      active.enabled = false;
+      return;
+    }
+
+    changed = true;
+  }
+
+  // Coefficients depend on the rate
+  if (changed || chain->sample_rate() != block.sample_rate)
+    chain->configure(active, block.sample_rate);
+
+  Trace::Scope scope("dsp");
+
+  bool limited = false;
+  if (block.bits_per_sample <= 16)
+    limited = chain->process<I2S::format16_t>(block.data<I2S::format16_t>(), block.frames);
+  else if (block.bits_per_sample == 24)
+    limited = chain->process<Audio::S24Stereo>(block.data<Audio::S24Stereo>(), block.frames);
+  else
+    limited = chain->process<I2S::format32_t>(block.data<I2S::format32_t>(), block.frames);
+
+  processed_count.increment();
+  if (limited)
+    limited_count.increment();
+}
\ No newline at end of file
@@ -0,0 +1,449 @@
+#ifndef __DSP_H__
+#define __DSP_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#include "audio.h"
+#include "i2s_interface.h"
+
+namespace DSP
+{
+  // Samples are processed as Q4.27 so EQ and gain may exceed full scale by
+  // 24 dB before the limiter. Coefficients and gains are Q4.28 and limiter
+  // gains Q1.30
+  constexpr uint8_t HEADROOM_BITS = 4;
+  constexpr uint8_t COEFFICIENT_BITS = 28;
+  constexpr uint8_t GAIN_BITS = 30;
+  constexpr int32_t UNITY = 1 << COEFFICIENT_BITS;
+  constexpr int32_t LIMITER_UNITY = 1 << GAIN_BITS;
+
+  // Limits of the settings. Sections are limited so their coefficients
+  // stay below the Q4.28 limit of 8
+  constexpr size_t MAX_SECTIONS = 8; // Biquad sections of the EQ
+  constexpr float MIN_FREQUENCY = 20;
+  constexpr float MAX_FREQUENCY = 20000;
+  constexpr float MIN_Q = 0.3;
+  constexpr float MAX_Q = 10;
+  constexpr float MAX_SECTION_GAIN_DB = 12;
+  constexpr float MIN_GAIN_DB = -60;
+  constexpr float MAX_GAIN_DB = 18;
+  constexpr float MIN_THRESHOLD_DB = -30;
+  constexpr float MIN_LOOKAHEAD_MS = 0.1;
+  constexpr float MAX_LOOKAHEAD_MS = 5;
+  constexpr float MIN_RELEASE_MS = 1;
+  constexpr float MAX_RELEASE_MS = 1000;
+  constexpr uint32_t MAX_LOOKAHEAD_FRAMES = 480; // 5 ms at 96 kHz
+
+  enum class FilterType : uint8_t
+  {
+    Peaking,
+    LowShelf,
+    HighShelf,
+    LowPass,
+    HighPass,
+  };
+
+  struct Filter
+  {
+    FilterType type;
+    float frequency; // Hz
+    float gain_db; // Peaking and shelves only
+    float q;
+
+    bool operator==(const Filter& other) const
+    {
+      return type == other.type && frequency == other.frequency && gain_db == other.gain_db && q == other.q;
+    }
+  };
+
+  struct LimiterSettings
+  {
+    bool enabled;
+    float threshold_db; // dBFS
+    float lookahead_ms;
+    float release_ms;
+
+    bool operator==(const LimiterSettings& other) const
+    {
+      return enabled == other.enabled && threshold_db == other.threshold_db && lookahead_ms == other.lookahead_ms && release_ms == other.release_ms;
+    }
+  };
+
+  // Plain data so it can be saved to NVS as a blob
+  struct Settings
+  {
+    bool enabled = false;
+    float gain_db = 0;
+    uint8_t section_count = 0;
+    Filter sections[MAX_SECTIONS] = {};
+    LimiterSettings limiter = {false, -1, 2, 50};
+
+    bool operator==(const Settings& other) const
+    {
+      if (enabled != other.enabled || gain_db != other.gain_db || section_count != other.section_count || !(limiter == other.limiter))
+        return false;
+
+      for (uint8_t i = 0; i < section_count && i < MAX_SECTIONS; i++)
+      {
+        if (!(sections[i] == other.sections[i]))
+          return false;
+      }
+
+      return true;
+    }
+  };
+
+  // Direct form I biquad coefficients, normalized so a0 is 1
+  struct Coefficients
+  {
+    int32_t b0, b1, b2, a1, a2;
+  };
+
+  // Past samples of one channel
+  struct BiquadState
+  {
+    int32_t x1, x2, y1, y2;
+    int32_t error; // Bits truncated from the last output
+  };
+
+  /**
+    @brief  Saturate a 64 bit value to 32 bits
+
+    @param  value Value to saturate
+    @retval int32_t
+  */
+  inline int32_t saturate(int64_t value)
+  {
+    if (value > INT32_MAX)
+      return INT32_MAX;
+
+    if (value < INT32_MIN)
+      return INT32_MIN;
+
+    return (int32_t) value;
+  }
+
+  /**
+    @brief  Convert samples to Q4.27 with headroom
+
+    @param  source Interleaved samples in the container of F
+    @param  destination Q4.27 samples to write
+    @param  count Number of samples
+    @retval none
+  */
+  template <typename F>
+  void to_fixed(const typename F::sample_t* source, int32_t* destination, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; i++)
+      destination[i] = Audio::rescale<int32_t>(source[i]) >> HEADROOM_BITS;
+  }
+
+  /**
+    @brief  Convert Q4.27 samples back to the container of F. Samples are
+            rounded to the valid bits of F and saturated at full scale
+
+    @param  source Q4.27 samples
+    @param  destination Interleaved samples to write
+    @param  count Number of samples
+    @retval none
+  */
+  template <typename F>
+  void from_fixed(const int32_t* source, typename F::sample_t* destination, uint32_t count)
+  {
+    typedef typename F::sample_t sample_t;
+
+    // Bits of a Q31 sample below the valid bits of F
+    constexpr uint8_t shift = 32 - F::bits_per_sample;
+    constexpr int64_t round = ((int64_t) 1 << shift) >> 1;
+    constexpr int64_t limit = ((int64_t) 1 << (F::bits_per_sample - 1)) - 1;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      int64_t sample = ((int64_t) source[i] * (1 << HEADROOM_BITS) + round) >> shift;
+      if (sample > limit)
+        sample = limit;
+      else if (sample < -limit - 1)
+        sample = -limit - 1;
+
+      // Left justify in the container
+      destination[i] = (sample_t) (sample * ((int64_t) 1 << (F::container_bits - F::bits_per_sample)));
+    }
+  }
+
+  /**
+    @brief  Filter interleaved Q4.27 samples through one biquad section.
+            A section runs over the whole block before the next so its
+            coefficients and state stay in registers. Bits truncated from
+            each output are fed into the next, which keeps requantization
+            noise out of low frequencies where the poles would amplify it
+
+    @param  c Section coefficients
+    @param  state State of each channel
+    @param  samples Interleaved samples to filter in place
+    @param  frames Number of frames
+    @retval none
+  */
+  template <uint8_t Channels>
+  void biquad(const Coefficients& c, BiquadState (&state)[Channels], int32_t* samples, uint32_t frames)
+  {
+    constexpr int64_t mask = ((int64_t) 1 << COEFFICIENT_BITS) - 1;
+
+    // Channels are independent so filtering them together overlaps their
+    // feedback latency
+    BiquadState s[Channels];
+    for (uint8_t ch = 0; ch < Channels; ch++)
+      s[ch] = state[ch];
+
+    for (uint32_t i = 0; i < frames; i++, samples += Channels)
+    {
+      for (uint8_t ch = 0; ch < Channels; ch++)
+      {
+        const int32_t x = samples[ch];
+
+        int64_t acc = s[ch].error;
+        acc += (int64_t) c.b0 * x;
+        acc += (int64_t) c.b1 * s[ch].x1;
+        acc += (int64_t) c.b2 * s[ch].x2;
+        acc -= (int64_t) c.a1 * s[ch].y1;
+        acc -= (int64_t) c.a2 * s[ch].y2;
+
+        const int32_t y = saturate(acc >> COEFFICIENT_BITS);
+        s[ch].error = acc & mask;
+
+        s[ch].x2 = s[ch].x1;
+        s[ch].x1 = x;
+        s[ch].y2 = s[ch].y1;
+        s[ch].y1 = y;
+        samples[ch] = y;
+      }
+    }
+
+    for (uint8_t ch = 0; ch < Channels; ch++)
+      state[ch] = s[ch];
+  }
+
+  /**
+    @brief  Scale Q4.27 samples by a Q4.28 gain
+
+    @param  gain Q4.28 gain
+    @param  samples Samples to scale in place
+    @param  count Number of samples
+    @retval none
+  */
+  inline void apply_gain(int32_t gain, int32_t* samples, uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; i++)
+      samples[i] = saturate(((int64_t) samples[i] * gain) >> COEFFICIENT_BITS);
+  }
+
+  // Look-ahead peak limiter with linked channels. Samples are delayed by the
+  // look-ahead so gain is reduced before a peak reaches the output, and any
+  // peak the smoothed gain hasn't caught is clipped at the threshold
+  template <uint8_t Channels>
+  class Limiter
+  {
+    public:
+      void configure(int32_t threshold, uint32_t lookahead, int32_t attack, int32_t release);
+      void reset(void);
+      bool process(int32_t* samples, uint32_t frames);
+
+    private:
+      // Peaks awaiting output, in decreasing order
+      struct Peak
+      {
+        uint32_t index;
+        int32_t value;
+      };
+
+      int32_t threshold = INT32_MAX; // Q4.27
+      uint32_t lookahead = 1; // Frames
+      int32_t attack = LIMITER_UNITY; // Q1.30 smoothing coefficients
+      int32_t release = LIMITER_UNITY;
+
+      int32_t gain = LIMITER_UNITY;
+      int32_t target_peak = 0; // Peak the target gain was calculated for
+      int32_t target = LIMITER_UNITY;
+      uint32_t index = 0; // Frames processed
+      uint32_t position = 0; // Oldest frame of the delay line
+
+      int32_t delay[Channels * MAX_LOOKAHEAD_FRAMES];
+      Peak peaks[MAX_LOOKAHEAD_FRAMES + 1];
+      uint32_t peak_head = 0; // Ring of peaks
+      uint32_t peak_count = 0;
+  };
+
+  /**
+    @brief  Configure the limiter and clear its state
+
+    @param  threshold Q4.27 peak threshold
+    @param  lookahead Frames of look-ahead. 1 to MAX_LOOKAHEAD_FRAMES
+    @param  attack Q1.30 per frame attack coefficient
+    @param  release Q1.30 per frame release coefficient
+    @retval none
+  */
+  template <uint8_t Channels>
+  void Limiter<Channels>::configure(int32_t threshold, uint32_t lookahead, int32_t attack, int32_t release)
+  {
+    this->threshold = threshold;
+    this->lookahead = (lookahead < 1) ? 1 : (lookahead < MAX_LOOKAHEAD_FRAMES) ? lookahead : MAX_LOOKAHEAD_FRAMES;
+    this->attack = attack;
+    this->release = release;
+
+    reset();
+  }
+
+  /**
+    @brief  Clear the delay line and restore unity gain
+
+    @param  none
+    @retval none
+  */
+  template <uint8_t Channels>
+  void Limiter<Channels>::reset()
+  {
+    gain = LIMITER_UNITY;
+    target_peak = 0;
+    target = LIMITER_UNITY;
+    index = 0;
+    position = 0;
+    peak_head = 0;
+    peak_count = 0;
+
+    memset(delay, 0, sizeof(delay));
+  }
+
+  /**
+    @brief  Limit interleaved Q4.27 samples in place. Output lags input by
+            the look-ahead
+
+    @param  samples Interleaved samples
+    @param  frames Number of frames
+    @retval bool - Gain was reduced during the block
+  */
+  template <uint8_t Channels>
+  bool Limiter<Channels>::process(int32_t* samples, uint32_t frames)
+  {
+    constexpr uint32_t capacity = MAX_LOOKAHEAD_FRAMES + 1;
+
+    bool limited = false;
+    for (uint32_t i = 0; i < frames; i++, index++)
+    {
+      int32_t* frame = samples + Channels * i;
+
+      // Peak of the incoming frame across channels
+      int32_t peak = 0;
+      for (uint8_t ch = 0; ch < Channels; ch++)
+      {
+        int32_t magnitude = (frame[ch] < 0) ? ~frame[ch] : frame[ch];
+        if (magnitude > peak)
+          peak = magnitude;
+      }
+
+      // Sliding window maximum over the incoming frame and the look-ahead
+      // frames before it, the last of which is output now. Peaks no larger than
+      // the incoming one can never be the maximum again
+      while (peak_count > 0 && peaks[(peak_head + peak_count - 1) % capacity].value <= peak)
+        peak_count--;
+
+      peaks[(peak_head + peak_count) % capacity] = {index, peak};
+      peak_count++;
+
+      if (index - peaks[peak_head].index > lookahead)
+      {
+        peak_head = (peak_head + 1) % capacity;
+        peak_count--;
+      }
+
+      // Gain that brings the window's peak to the threshold. Only divide
+      // when the window's peak changes
+      const int32_t window_peak = peaks[peak_head].value;
+      if (window_peak != target_peak)
+      {
+        target_peak = window_peak;
+        target = (window_peak > threshold) ? (int32_t) (((int64_t) threshold << GAIN_BITS) / window_peak) : LIMITER_UNITY;
+      }
+
+      const int32_t coefficient = (target < gain) ? attack : release;
+      gain += (int32_t) (((int64_t) (target - gain) * coefficient) >> GAIN_BITS);
+      limited |= gain < LIMITER_UNITY;
+
+      // Swap the incoming frame with the delayed one and apply gain to it
+      int32_t* delayed = delay + Channels * position;
+      if (++position == lookahead)
+        position = 0;
+
+      for (uint8_t ch = 0; ch < Channels; ch++)
+      {
+        int32_t sample = (int32_t) (((int64_t) delayed[ch] * gain) >> GAIN_BITS);
+        if (sample > threshold)
+          sample = threshold;
+        else if (sample < -threshold)
+          sample = -threshold;
+
+        delayed[ch] = frame[ch];
+        frame[ch] = sample;
+      }
+    }
+
+    return limited;
+  }
+
+  // Coefficients and state of the whole chain for one capture format
+  class Chain
+  {
+    public:
+      static constexpr uint32_t MAX_SAMPLES = I2S::CHANNELS * I2S::BUFFER_SAMPLE_COUNT;
+
+      void configure(const Settings& settings, uint32_t sample_rate);
+      void reset(void);
+      bool process(int32_t* samples, uint32_t frames);
+
+      template <typename F>
+      bool process(typename F::sample_t* samples, uint32_t frames);
+
+      uint32_t sample_rate(void) const { return rate; }
+
+    private:
+      uint32_t rate = 0;
+      uint8_t section_count = 0;
+      Coefficients coefficients[MAX_SECTIONS];
+      BiquadState state[MAX_SECTIONS][I2S::CHANNELS];
+      int32_t gain = UNITY;
+      bool limiter_enabled = false;
+      uint32_t silent_frames = 0; // Consecutive frames of digital silence
+      uint32_t bypass_frames = UINT32_MAX; // Silence after which the chain is bypassed
+      Limiter<I2S::CHANNELS> limiter;
+      int32_t scratch[MAX_SAMPLES];
+  };
+
+  /**
+    @brief  Process interleaved samples in the container of F in place
+
+    @param  samples Interleaved samples
+    @param  frames Number of frames. At most BUFFER_SAMPLE_COUNT
+    @retval bool - Limiter reduced gain
+  */
+  template <typename F>
+  bool Chain::process(typename F::sample_t* samples, uint32_t frames)
+  {
+    static_assert(F::channels == I2S::CHANNELS, "Chain is built for the capture's channels.");
+
+    to_fixed<F>(samples, scratch, frames * F::channels);
+    bool limited = process(scratch, frames);
+    from_fixed<F>(scratch, samples, frames * F::channels);
+
+    return limited;
+  }
+
+  Coefficients design(const Filter& filter, uint32_t sample_rate);
+  int32_t gain(float db, uint8_t bits);
+
+  void init(void);
+  void configure(const Settings& settings);
+  Settings get_settings(void);
+  void reset(void);
+  void process(I2S::block_t& block);
+}
+
+#endif
\ No newline at end of file
@@ -2,25 +2,1040 @@
 #include "freertos/task.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <queue>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "http.h"
 #include "i2s_interface.h"
 #include "json.h"
+#include "metrics.h"
 #include "mongoose.h"
 #include "ota_interface.h"
+#include "snapcast.h"
 #include "system.h"
+#include "trace.h"
+#include "upnp_control.h"
 #include "wav.h"
 
 #define TAG "HTTP"
 
+/**
+  @brief  Send the WAV header to a new WAV stream client
+  
+  @param  nc Mongoose connection
+  @param  sample_rate Sample rate of the stream
+  @param  channels Channels of the stream
+  @retval none
+*/
+template <typename T>
+static void wav_setup(struct mg_connection* nc, uint32_t sample_rate, uint8_t channels)
+{
+  // Construct and send the WAV header
+  if (channels == 1)
+  {
+    const WAV::Header<Audio::Format<T, 1>> wav_header(sample_rate);
+    mg_send(nc, &wav_header, sizeof(wav_header));
+  }
+  else
+  {
+    const WAV::Header<Audio::Format<T, 2>> wav_header(sample_rate);
+    mg_send(nc, &wav_header, sizeof(wav_header));
+  }
+}
+
+/**
+  @brief  Encode samples as 16 bit. 16 bit captures are copied, wider
+          captures are truncated
+  
+  @param  samples Samples in the capture's container
+  @param  count Number of samples
+  @param  bits_per_sample Valid bits of the capture
+  @param  output Buffer to encode to
+  @retval size_t - Bytes encoded
+*/
+static size_t encode_s16(const void* samples, uint32_t count, uint8_t bits_per_sample, uint8_t* output)
+{
+  typedef Audio::Format<int16_t, 1> s16_t;
+  typedef Audio::Format<int32_t, 1> s32_t;
+
+  if (bits_per_sample <= 16)
+    memcpy(output, samples, count * sizeof(int16_t));
+  else
+    Audio::convert<s32_t, s16_t>((const int32_t*) samples, (int16_t*) output, count);
+
+  return count * sizeof(int16_t);
+}
+
+/**
+  @brief  Encode samples as packed 24 bit. 16 bit captures are padded
+  
+  @param  samples Samples in the capture's container
+  @param  count Number of samples
+  @param  bits_per_sample Valid bits of the capture
+  @param  output 4 byte aligned buffer to encode to
+  @retval size_t - Bytes encoded
+*/
+template <bool BigEndian>
+static size_t encode_p24(const void* samples, uint32_t count, uint8_t bits_per_sample, uint8_t* output)
+{
+  if (bits_per_sample <= 16)
+    Audio::pack24<Audio::Format<int16_t, 1>, BigEndian>((const int16_t*) samples, output, count);
+  else
+    Audio::pack24<Audio::Format<int32_t, 1>, BigEndian>((const int32_t*) samples, output, count);
+
+  return count * 3;
+}
+
+// Streams offered to clients. Equal bitrate streams are preferred in this
+// order. Streams of a single input are never offered to renderers
+static const std::vector<HTTP::StreamConfig> stream_configs =
+{
+  HTTP::StreamConfig("WAV", "/stream.wav", "audio/wav", false, "", 16, encode_s16, wav_setup<int16_t>),
+  HTTP::StreamConfig("PCM", "/stream.pcm", "audio/L16", true, "LPCM", 16, encode_s16),
+  HTTP::StreamConfig("WAV24", "/stream24.wav", "audio/wav", false, "", 24, encode_p24<false>, wav_setup<Audio::int24_t>),
+  HTTP::StreamConfig("PCM24", "/stream24.pcm", "audio/L24", true, "", 24, encode_p24<true>),
+#ifdef CONFIG_I2S_SECOND_INPUT
+  HTTP::StreamConfig("WAV1", "/stream1.wav", "audio/wav", false, "", 16, encode_s16, wav_setup<int16_t>, 1),
+  HTTP::StreamConfig("WAV2", "/stream2.wav", "audio/wav", false, "", 16, encode_s16, wav_setup<int16_t>, 2),
+#endif
+};
+
+// Every stream in every mix, indexed by stream then mix. Guarded by the client mutex
+static std::vector<HTTP::Output> outputs(stream_configs.size() * Audio::MIX_COUNT);
+
 static std::unordered_set<struct mg_connection*> clients;
+static std::unordered_set<struct mg_connection*> pending_clients;
 static SemaphoreHandle_t client_mutex;
 
+// Bitrate and count of admitted clients. Guarded by the client mutex
+static HTTP::Budget budget(HTTP::BUDGET_KBPS * 1000, HTTP::MAX_CLIENTS);
+
+// Receives the oldest block of a full client queue so it can be dropped.
+// Too large for the stack of the system task. Guarded by the client mutex
+static HTTP::EncodedBlock discarded_block;
+
+// Stream requests that never became a new client
+static Metrics::Counter head_count("http_stream_requests_total", "Stream requests by how they were handled.", "type=\"head\"");
+static Metrics::Counter probe_count("http_stream_requests_total", "Stream requests by how they were handled.", "type=\"probe\"");
+static Metrics::Counter handover_count("http_stream_requests_total", "Stream requests by how they were handled.", "type=\"handover\"");
+static Metrics::Counter reject_count("http_stream_requests_total", "Stream requests by how they were handled.", "type=\"rejected\"");
+static Metrics::Counter shed_count("http_stream_shed_clients_total", "Clients closed while on probation because the link couldn't carry them.");
+
+static Metrics::Counter bytes_sent_count("http_stream_bytes_sent_total", "Stream bytes written to client sockets.");
+static Metrics::Counter drop_count("http_stream_dropped_blocks_total", "Sample blocks dropped due to full client queues.");
+static Metrics::Counter mix_count("http_stream_mixed_blocks_total", "Blocks mixed down to mono, once per block per mix with clients.");
+static Metrics::Counter encode_count("http_stream_encoded_blocks_total", "Blocks encoded to a wire format, once per block per output with clients.");
+
+// Sequence number of the newest block queued to clients
+static std::atomic<uint32_t> latest_sequence;
+
+/**
+  @brief  Calculate the client queue length for a profile. Queues hold a
+          send batch plus CLIENT_QUEUE_MS of audio
+  
+  @param  profile Profile to size for
+  @retval UBaseType_t
+*/
+static UBaseType_t client_queue_length(const System::Profile& profile)
+{
+  const uint32_t block_us = profile.block_frames * 1000000ull / I2S::get_sample_rate();
+  return (profile.send_blocks - 1) + (HTTP::CLIENT_QUEUE_MS * 1000 + block_us - 1) / block_us;
+}
+
+/**
+  @brief  Parse the channels requested in a stream query. ?channels=1
+          mixes down to mono and ?channel=left|right selects a channel
+  
+  @param  query Query string of the request
+  @param  mix Returned mix
+  @retval bool - Query is valid
+*/
+static bool parse_mix(const struct mg_str* query, Audio::Mix& mix)
+{
+  mix = Audio::Mix::Stereo;
+
+  char value[8];
+  if (mg_get_http_var(query, "channel", value, sizeof(value)) > 0)
+  {
+    if (strcmp(value, "left") == 0)
+      mix = Audio::Mix::Left;
+    else if (strcmp(value, "right") == 0)
+      mix = Audio::Mix::Right;
+    else
+      return false;
+  }
+  else if (mg_get_http_var(query, "channels", value, sizeof(value)) > 0)
+  {
+    if (strcmp(value, "1") == 0)
+      mix = Audio::Mix::Downmix;
+    else if (strcmp(value, "2") != 0)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief  Calculate the queued block size of a stream for a profile
+  
+  @param  config Stream configuration
+  @param  mix Channels of the stream
+  @param  profile Profile to size for
+  @retval size_t
+*/
+static size_t encoded_block_size(const HTTP::StreamConfig* config, Audio::Mix mix, const System::Profile& profile)
+{
+  return HTTP::EncodedBlock::size(config->encoded_size(profile.block_frames, Audio::channels(mix)));
+}
+
+/**
+  @brief  Calculate the bitrate a client is admitted with
+  
+  @param  client Client to calculate for
+  @retval uint32_t - Bits per second
+*/
+static uint32_t client_bitrate(const HTTP::Client* client)
+{
+  return client->config->bitrate(client->sample_rate, Audio::channels(client->mix));
+}
+
+/**
+  @brief  Admit a new client to the stream budget
+  
+  @param  nc Mongoose connection of the client
+  @param  client Client to admit
+  @retval bool - Client fits the budget
+*/
+static bool admit_client(struct mg_connection* nc, const HTTP::Client* client)
+{
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+  const bool admitted = budget.admit(client_bitrate(client));
+  xSemaphoreGive(client_mutex);
+
+  if (!admitted)
+  {
+    ESP_LOGW(TAG, "%s client %p rejected. Stream budget exhausted.", client->config->name, nc);
+    reject_count.increment();
+  }
+
+  return admitted;
+}
+
+/**
+  @brief  Refuse a stream request beyond the budget. Clients are told when
+          to retry, and stereo requests are pointed at mono when it fits
+  
+  @param  nc Mongoose connection
+  @param  config Stream requested
+  @param  sample_rate Rate of the stream
+  @param  mix Channels requested
+  @retval none
+*/
+static void send_budget_exhausted(struct mg_connection* nc, const HTTP::StreamConfig* config, uint32_t sample_rate, Audio::Mix mix)
+{
+  std::string reason = "Stream budget exhausted.";
+
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+  const bool mono_fits = budget.fits(config->bitrate(sample_rate, 1));
+  xSemaphoreGive(client_mutex);
+
+  if (mix == Audio::Mix::Stereo && mono_fits)
+    reason += " " + std::string(config->path) + "?channels=1 is available.";
+
+  mg_send_head(nc, 503, reason.length(), ("Content-Type: text/plain\r\nRetry-After: " + std::to_string(HTTP::RETRY_AFTER_S)).c_str());
+  mg_send(nc, reason.c_str(), reason.length());
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+  @brief  Subscribe a client to the output of its stream and mix. Client
+          mutex must be held
+  
+  @param  client Client to subscribe
+  @retval bool - Output buffer could be allocated
+*/
+static bool subscribe(HTTP::Client* client)
+{
+  HTTP::Output& output = outputs[(client->config - stream_configs.data()) * Audio::MIX_COUNT + (size_t) client->mix];
+  if (output.block == nullptr)
+  {
+    output.block = new HTTP::EncodedBlock();
+    if (output.block == nullptr)
+      return false;
+
+    ESP_LOGI(TAG, "Encoding %s%s output.", client->config->name, (client->mix == Audio::Mix::Stereo) ? "" : " mono");
+  }
+
+  output.subscribers++;
+  client->output = &output;
+  return true;
+}
+
+/**
+  @brief  Unsubscribe a client from its output. Outputs without
+          subscribers are no longer encoded. Client mutex must be held
+  
+  @param  client Client to unsubscribe
+  @retval none
+*/
+static void unsubscribe(HTTP::Client* client)
+{
+  HTTP::Output* output = client->output;
+  if (output == nullptr)
+    return;
+
+  client->output = nullptr;
+  if (--output->subscribers > 0)
+    return;
+
+  delete output->block;
+  output->block = nullptr;
+}
+
+/**
+  @brief  Derive the samples of a mix from a block. Stereo is the block
+          itself, mono mixes are computed into a shared buffer
+  
+  @param  block Captured block
+  @param  mix Mix to derive
+  @retval const void* - Samples in the block's container
+*/
+static const void* mix_samples(const I2S::block_t& block, Audio::Mix mix)
+{
+  typedef Audio::MonoOf<I2S::format16_t> mono16_t;
+  typedef Audio::MonoOf<I2S::format32_t> mono32_t;
+
+  if (mix == Audio::Mix::Stereo)
+    return block.samples.data();
+
+  // Allocated when a mono output is first encoded. Only used from the capture task
+  static I2S::mono_block_t* mono = nullptr;
+  if (mono == nullptr)
+    mono = new I2S::mono_block_t();
+
+  mix_count.increment();
+
+  if (block.bits_per_sample <= 16)
+    Audio::mix<I2S::format16_t>(block.data<I2S::format16_t>(), mono->data<mono16_t>(), block.frames, mix);
+  else
+    Audio::mix<I2S::format32_t>(block.data<I2S::format32_t>(), mono->data<mono32_t>(), block.frames, mix);
+
+  return mono->samples.data();
+}
+
+/**
+  @brief  Encode the blocks into every output with subscribers. Each mix
+          of each block is derived once and shared by the outputs of that
+          mix. Client mutex must be held
+  
+  @param  blocks Program block then the block of each input. Missing
+                 inputs are nullptr
+  @param  start_time Smoothed time of the blocks' first frame
+  @retval none
+*/
+static void encode_outputs(const std::array<const I2S::block_t*, 3>& blocks, int64_t start_time)
+{
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    if (blocks[i] == nullptr)
+      continue;
+
+    const I2S::block_t& block = *blocks[i];
+    for (size_t m = 0; m < Audio::MIX_COUNT; m++)
+    {
+      const Audio::Mix mix = (Audio::Mix) m;
+      const void* samples = nullptr; // Derived when first needed
+
+      for (size_t s = 0; s < stream_configs.size(); s++)
+      {
+        HTTP::Output& output = outputs[s * Audio::MIX_COUNT + m];
+        if (output.subscribers == 0 || stream_configs[s].input != i)
+          continue;
+
+        if (samples == nullptr)
+          samples = mix_samples(block, mix);
+
+        Trace::Scope scope("encode");
+
+        HTTP::EncodedBlock& encoded = *output.block;
+        encoded.timestamp = block.timestamp;
+        encoded.start_time = start_time;
+        encoded.sequence = block.sequence;
+        encoded.length = stream_configs[s].encode(samples, block.frames * Audio::channels(mix), block.bits_per_sample, encoded.data);
+
+        encode_count.increment();
+      }
+    }
+  }
+}
+
+/**
+  @brief  Check if a streaming client stopped reading, i.e. data has sat
+          unread in its send buffer for CLIENT_STALL_US
+  
+  @param  nc Mongoose connection of the client
+  @param  now Current time
+  @retval bool
+*/
+static bool is_stalled(const struct mg_connection* nc, int64_t now)
+{
+  const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+  return nc->send_mbuf.len > 0 && now - client->last_progress > HTTP::CLIENT_STALL_US;
+}
+
+/**
+  @brief  Find a client a new request from the same remote IP on the same
+          stream at the same rate and mix replaces. Only probes still in
+          their window and clients that stopped reading are replaced, so
+          listeners sharing an address, e.g. behind NAT, stream side by
+          side. Client mutex must be held.
+  
+  @param  nc Mongoose connection of the new request
+  @param  stream_config Stream requested
+  @param  sample_rate Sample rate of the new request
+  @param  mix Channels of the new request
+  @retval struct mg_connection* - nullptr if none is replaced
+*/
+static struct mg_connection* find_replaced_client(const struct mg_connection* nc, const HTTP::StreamConfig* stream_config, uint32_t sample_rate, Audio::Mix mix)
+{
+  auto matches = [&](const struct mg_connection* c)
+  {
+    const HTTP::Client* client = (const HTTP::Client*) c->user_data;
+    return c != nc && client != nullptr && client->transport == HTTP::Transport::Http && client->config == stream_config && client->sample_rate == sample_rate && client->mix == mix && c->sa.sin.sin_addr.s_addr == nc->sa.sin.sin_addr.s_addr;
+  };
+
+  // Streaming clients only once they stopped reading
+  const int64_t now = esp_timer_get_time();
+  for (const auto c : clients)
+  {
+    if (matches(c) && is_stalled(c, now))
+      return c;
+  }
+
+  for (const auto c : pending_clients)
+  {
+    if (matches(c))
+      return c;
+  }
+
+  return nullptr;
+}
+
+/**
+  @brief  Start streaming to a client. Its queue is created for the current
+          capture and it is subscribed to its output
+  
+  @param  nc Mongoose connection of the client
+  @retval none
+*/
+static void start_client(struct mg_connection* nc)
+{
+  HTTP::Client* client = (HTTP::Client*) nc->user_data;
+  if (client == nullptr || client->queue != nullptr)
+    return;
+
+  // Construct a queue for this client holding encoded blocks of the current capture
+  const System::Profile& profile = System::get_profile();
+  client->block_size = encoded_block_size(client->config, client->mix, profile);
+  client->send_blocks = (client->transport == HTTP::Transport::WebSocket) ? 1 : profile.send_blocks;
+  client->queue = xQueueCreate(client_queue_length(profile), client->block_size);
+  if (client->queue == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to create queue for client %p.", nc);
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+
+  client->last_sequence.store(latest_sequence.load(), std::memory_order_relaxed);
+
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+  if (!subscribe(client))
+  {
+    xSemaphoreGive(client_mutex);
+
+    ESP_LOGE(TAG, "Failed to allocate output for client %p.", nc);
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+
+  pending_clients.erase(nc);
+  clients.insert(nc);
+
+  // Notify system of first client
+  if (clients.size() == 1)
+    System::set_active_state();
+
+  xSemaphoreGive(client_mutex);
+}
+
+/**
+  @brief  Close a client whose stream no longer matches the capture.
+          WebSocket clients are told to reconnect
+  
+  @param  nc Mongoose connection of the client
+  @param  reason Reason to log
+  @retval none
+*/
+static void close_client(struct mg_connection* nc, const char* reason)
+{
+  if (nc->flags & MG_F_SEND_AND_CLOSE)
+    return;
+
+  ESP_LOGW(TAG, "Closing client %p. %s", nc, reason);
+
+  // Close with 1012 Service Restart so the player reconnects
+  const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+  if (client->transport == HTTP::Transport::WebSocket)
+    mg_send_websocket_frame(nc, WEBSOCKET_OP_CLOSE, "\x03\xF4", 2);
+
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+  @brief  Measure each streaming client's traffic since the last update
+          and update the budget from it. Client mutex must be held
+  
+  @param  now Current time
+  @retval none
+*/
+static void update_budget(int64_t now)
+{
+  std::vector<HTTP::Budget::Traffic> traffic;
+  traffic.reserve(clients.size());
+
+  for (const auto nc : clients)
+  {
+    HTTP::Client* client = (HTTP::Client*) nc->user_data;
+    const uint64_t bytes_sent = client->bytes_sent.load(std::memory_order_relaxed);
+    const uint32_t drops = client->drops.load(std::memory_order_relaxed);
+
+    // Clients that took nothing in the window aren't reading either
+    HTTP::Budget::Traffic sample;
+    sample.bytes_sent = bytes_sent - client->metered_bytes;
+    sample.drops = drops - client->metered_drops;
+    sample.bitrate = client_bitrate(client);
+    sample.stalled = sample.bytes_sent == 0 || is_stalled(nc, now);
+    traffic.push_back(sample);
+
+    client->metered_bytes = bytes_sent;
+    client->metered_drops = drops;
+  }
+
+  budget.update(now, traffic);
+}
+
+/**
+  @brief  Close the newest client when admitting it overloaded the link.
+          Only clients still on probation are closed, so listeners that
+          were streaming before never lose their share. Client mutex must
+          be held
+  
+  @param  now Current time
+  @retval none
+*/
+static void shed_newest_client(int64_t now)
+{
+  struct mg_connection* newest = nullptr;
+  for (const auto& set : {&clients, &pending_clients})
+  {
+    for (const auto nc : *set)
+    {
+      const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+      if (newest == nullptr || client->admitted > ((const HTTP::Client*) newest->user_data)->admitted)
+        newest = nc;
+    }
+  }
+
+  if (newest == nullptr || now - ((const HTTP::Client*) newest->user_data)->admitted > HTTP::PROBATION_US)
+    return;
+
+  if (!(newest->flags & MG_F_SEND_AND_CLOSE))
+    shed_count.increment();
+
+  close_client(newest, "Link can't carry it within the stream budget.");
+}
+
+/**
+  @brief  Send an encoded block to a WebSocket client as one binary message
+  
+  @param  nc Mongoose connection of the client
+  @param  block Encoded block
+  @retval none
+*/
+static void send_websocket_block(struct mg_connection* nc, const HTTP::EncodedBlock& block)
+{
+  const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+  const uint16_t channels = Audio::channels(client->mix);
+
+  HTTP::WebSocketHeader header;
+  header.timestamp = block.timestamp;
+  header.sequence = block.sequence;
+  header.sample_rate = client->sample_rate;
+  header.channels = channels;
+  header.bits_per_sample = client->config->bits_per_sample;
+  header.frames = block.length / (channels * client->config->bits_per_sample / 8);
+
+  const struct mg_str parts[] = {mg_mk_str_n((const char*) &header, sizeof(header)), mg_mk_str_n((const char*) block.data, block.length)};
+  mg_send_websocket_framev(nc, WEBSOCKET_OP_BINARY, parts, 2);
+}
+
+/**
+  @brief  Send an encoded block to a Snapcast client as a wire chunk
+          stamped with the start of the block
+  
+  @param  nc Mongoose connection of the client
+  @param  block Encoded block
+  @retval none
+*/
+static void send_snapcast_chunk(struct mg_connection* nc, const HTTP::EncodedBlock& block)
+{
+  uint8_t prefix[Snapcast::CHUNK_PREFIX_SIZE];
+  Snapcast::write_chunk_prefix(prefix, esp_timer_get_time(), block.start_time, block.length);
+
+  mg_send(nc, prefix, sizeof(prefix));
+  mg_send(nc, block.data, block.length);
+}
+
+/**
+  @brief  Send each write as soon as it's made instead of holding small
+          writes until the last is acknowledged
+  
+  @param  nc Mongoose connection
+  @retval none
+*/
+static void disable_nagle(struct mg_connection* nc)
+{
+  int enable = 1;
+  setsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/**
+  @brief  Service a streaming client's queue on a poll or send event.
+          Blocks are written once a full batch is queued
+  
+  @param  nc Mongoose connection of the client
+  @param  ev Mongoose event
+  @param  ev_data Event data pointer
+  @retval none
+*/
+static void service_client(struct mg_connection* nc, int ev, void* ev_data)
+{
+  // Get the client from the connection. Pending and closing connections have no queue
+  HTTP::Client* client = (HTTP::Client*) nc->user_data;
+  if (client == nullptr || client->queue == nullptr)
+    return;
+
+  // Track bytes that actually reached the socket
+  if (ev == MG_EV_SEND && *(int*) ev_data > 0)
+  {
+    client->bytes_sent.fetch_add(*(int*) ev_data, std::memory_order_relaxed);
+    client->connection_offset += *(int*) ev_data;
+    client->last_progress = esp_timer_get_time();
+    bytes_sent_count.increment(*(int*) ev_data);
+
+    // Record latency of blocks that were completely written
+    int64_t now = esp_timer_get_time();
+    while (!client->in_flight.empty() && (int32_t) (client->connection_offset - client->in_flight.front().end_offset) >= 0)
+    {
+      client->latency.observe((now - client->in_flight.front().timestamp) / 1000);
+      client->last_sequence.store(client->in_flight.front().sequence, std::memory_order_relaxed);
+      client->in_flight.pop_front();
+    }
+
+    client->send_buffer_bytes.store(nc->send_mbuf.len, std::memory_order_relaxed);
+  }
+
+  // Blocks of a replaced capture configuration are no longer captured
+  if (client->block_size != encoded_block_size(client->config, client->mix, System::get_profile()))
+  {
+    close_client(nc, "Capture configuration changed.");
+    return;
+  }
+
+  // The header told the client a rate that is no longer captured
+  if (client->sample_rate != I2S::get_sample_rate())
+  {
+    close_client(nc, "Sample rate changed.");
+    return;
+  }
+
+  // Hold blocks until a full batch can be written
+  if (uxQueueMessagesWaiting(client->queue) < client->send_blocks)
+    return;
+
+  HTTP::EncodedBlock block;
+  while (xQueueReceive(client->queue, &block, 0) == pdTRUE)
+  {
+    Trace::Scope scope("mg_send");
+    switch (client->transport)
+    {
+      case HTTP::Transport::WebSocket:
+        send_websocket_block(nc, block);
+        break;
+
+      case HTTP::Transport::Snapcast:
+        send_snapcast_chunk(nc, block);
+        break;
+
+      default:
+        mg_send(nc, block.data, block.length);
+        break;
+    }
+
+    // Block ends after everything currently buffered
+    client->in_flight.push_back({client->connection_offset + (uint32_t) nc->send_mbuf.len, block.timestamp, block.sequence});
+  }
+
+  client->send_buffer_bytes.store(nc->send_mbuf.len, std::memory_order_relaxed);
+}
+
+/**
+  @brief  Remove a closed client and delete it
+  
+  @param  nc Mongoose connection of the client
+  @retval none
+*/
+static void remove_client(struct mg_connection* nc)
+{
+  // Ignore HEAD requests and connections that were handed over
+  HTTP::Client* client = (HTTP::Client*) nc->user_data;
+  if (client == nullptr)
+    return;
+
+  char addr[32];
+  mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+
+  // Remove the client
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+  budget.release(client_bitrate(client));
+
+  if (pending_clients.erase(nc))
+  {
+    ESP_LOGI(TAG, "Probe %p (%s) closed.", nc, addr);
+    probe_count.increment();
+  }
+  else if (clients.erase(nc))
+  {
+    ESP_LOGI(TAG, "Client %p (%s) disconnected.", nc, addr);
+    unsubscribe(client);
+
+    // Notify system of last client
+    if (clients.empty())
+      System::set_idle_state();
+  }
+
+  xSemaphoreGive(client_mutex);
+
+  // Delete the client and its queue
+  if (client->queue != nullptr)
+    vQueueDelete(client->queue);
+
+  delete client;
+  nc->user_data = nullptr;
+}
+
+/**
+  @brief  Mongoose event handler to stream audio data to clients
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void httpStreamEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  switch(ev)
+  {
+    case MG_EV_HTTP_REQUEST:
+    {
+      struct http_message* hm = (struct http_message*) ev_data;
+
+      char addr[32];
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+
+      // Grab the stream object from the user_data
+      HTTP::StreamConfig* stream_config = (HTTP::StreamConfig*) user_data;
+      assert(stream_config != nullptr);
+
+      if (nc->user_data != nullptr)
+      {
+        ESP_LOGW(TAG, "Client %p (%s) already exists.", nc, addr);
+        return;
+      }
+
+      Audio::Mix mix;
+      if (!parse_mix(&hm->query_string, mix))
+      {
+        mg_http_send_error(nc, 400, "Invalid channel selection.");
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+      }
+
+      // Describe the stream at the rate currently captured
+      const uint32_t sample_rate = I2S::get_sample_rate();
+      const std::string headers = stream_config->headers(sample_rate, Audio::channels(mix));
+
+      // Answer HEAD requests from the headers alone
+      if (mg_vcmp(&hm->method, "HEAD") == 0)
+      {
+        mg_send_response_line(nc, 200, headers.c_str());
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+
+        ESP_LOGI(TAG, "HEAD %s from %s.", stream_config->name, addr);
+        head_count.increment();
+        return;
+      }
+
+      // Lock the client list
+      xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+      struct mg_connection* previous = find_replaced_client(nc, stream_config, sample_rate, mix);
+      if (previous != nullptr)
+      {
+        // Take over the previous connection's client and queued samples
+        nc->user_data = previous->user_data;
+        previous->user_data = nullptr;
+        previous->flags |= MG_F_CLOSE_IMMEDIATELY;
+
+        // Blocks in the old send buffer never reach the socket
+        HTTP::Client* client = (HTTP::Client*) nc->user_data;
+        client->connection_offset = 0;
+        client->in_flight.clear();
+        client->last_progress = esp_timer_get_time();
+
+        if (clients.erase(previous))
+          clients.insert(nc);
+        else
+        {
+          pending_clients.erase(previous);
+          pending_clients.insert(nc);
+          mg_set_timer(nc, mg_time() + HTTP::CLIENT_PROBE_WINDOW);
+        }
+
+        ESP_LOGI(TAG, "%s client %p (%s) replaces %p.", stream_config->name, nc, addr, previous);
+        handover_count.increment();
+
+        xSemaphoreGive(client_mutex);
+      }
+      else
+      {
+        xSemaphoreGive(client_mutex);
+
+        // Clients already streaming keep their share of the link
+        HTTP::Client* client = new HTTP::Client(stream_config, sample_rate, mix);
+        if (!admit_client(nc, client))
+        {
+          send_budget_exhausted(nc, stream_config, sample_rate, mix);
+          delete client;
+          return;
+        }
+
+        // Hold the client as pending so probes don't activate the system
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        nc->user_data = client;
+        pending_clients.insert(nc);
+        xSemaphoreGive(client_mutex);
+
+        mg_set_timer(nc, mg_time() + HTTP::CLIENT_PROBE_WINDOW);
+
+        // Log time since playback was requested to track renderer start latency
+        ESP_LOGI(TAG, "New %s client %p (%s) %lld ms after play request.", stream_config->name, nc, addr, (esp_timer_get_time() - UpnpControl::get_play_request_time()) / 1000);
+      }
+
+      // Send the HTTP header
+      mg_send_response_line(nc, 200, headers.c_str());
+
+      // Perform additional setup if needed
+      if (stream_config->setup)
+        stream_config->setup(nc, sample_rate, Audio::channels(mix));
+
+      // Reassign event handler for this client
+      nc->handler = httpStreamEventHandler;
+
+      break;
+    }
+
+    case MG_EV_TIMER:
+    {
+      // Client outlived the probe window, start streaming to it
+      start_client(nc);
+      break;
+    }
+
+    case MG_EV_SEND:
+    case MG_EV_POLL:
+    {
+      // Service queues on every poll or send event
+      service_client(nc, ev, ev_data);
+      break;
+    }
+
+    case MG_EV_CLOSE:
+    {
+      remove_client(nc);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+/**
+  @brief  Mongoose event handler to stream audio to browsers over a
+          WebSocket. Clients share the outputs of the 16 bit WAV streams
+          and each block is sent as soon as it's captured
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void websocketEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  switch(ev)
+  {
+    case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST:
+    {
+      struct http_message* hm = (struct http_message*) ev_data;
+
+      Audio::Mix mix;
+      if (!parse_mix(&hm->query_string, mix))
+      {
+        mg_http_send_error(nc, 400, "Invalid channel selection.");
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+      }
+
+      // Browsers don't probe, so stream as soon as the handshake completes
+      HTTP::Client* client = new HTTP::Client(&stream_configs.front(), I2S::get_sample_rate(), mix, HTTP::Transport::WebSocket);
+      if (!admit_client(nc, client))
+      {
+        send_budget_exhausted(nc, client->config, client->sample_rate, mix);
+        delete client;
+        return;
+      }
+
+      nc->user_data = client;
+      break;
+    }
+
+    case MG_EV_WEBSOCKET_HANDSHAKE_DONE:
+    {
+      if (nc->user_data == nullptr)
+        break;
+
+      // Messages are smaller than a segment. Send each without waiting on
+      // the ACK of the last
+      disable_nagle(nc);
+
+      char addr[32];
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+      ESP_LOGI(TAG, "New WebSocket client %p (%s).", nc, addr);
+
+      start_client(nc);
+      break;
+    }
+
+    case MG_EV_SEND:
+    case MG_EV_POLL:
+    {
+      service_client(nc, ev, ev_data);
+      break;
+    }
+
+    case MG_EV_CLOSE:
+    {
+      remove_client(nc);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+#ifdef CONFIG_SNAPCAST_SERVER
+/**
+  @brief  Handle a message from a Snapcast client. A hello starts the
+          stream and time requests are answered at once
+  
+  @param  nc Mongoose connection
+  @param  header Header of the message with the time it was received
+  @param  payload Payload of the message
+  @retval none
+*/
+static void handle_snapcast_message(struct mg_connection* nc, const Snapcast::Header& header, const uint8_t* payload)
+{
+  switch (header.type)
+  {
+    case Snapcast::MessageType::Time:
+    {
+      const std::string reply = Snapcast::time_reply(header, esp_timer_get_time());
+      mg_send(nc, reply.data(), reply.length());
+      break;
+    }
+
+    case Snapcast::MessageType::Hello:
+    {
+      if (nc->user_data != nullptr)
+        break;
+
+      char addr[32];
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+
+      const std::string name = Snapcast::parse_hello(payload, header.size);
+      ESP_LOGI(TAG, "New Snapcast client %p '%s' (%s).", nc, name.c_str(), addr);
+
+      // Chunks are stereo 16 bit, shared with the WAV stream
+      const uint32_t sample_rate = I2S::get_sample_rate();
+      HTTP::Client* client = new HTTP::Client(&stream_configs.front(), sample_rate, Audio::Mix::Stereo, HTTP::Transport::Snapcast);
+      if (!admit_client(nc, client))
+      {
+        // The protocol has no refusal. snapclient reconnects after a pause
+        delete client;
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        break;
+      }
+
+      nc->user_data = client;
+
+      // Time replies carry the clock offset. Don't let them wait on chunks
+      disable_nagle(nc);
+
+      const std::string settings = Snapcast::server_settings(header, esp_timer_get_time(), Snapcast::BUFFER_MS);
+      mg_send(nc, settings.data(), settings.length());
+
+      const std::string codec = Snapcast::codec_header(esp_timer_get_time(), sample_rate);
+      mg_send(nc, codec.data(), codec.length());
+
+      start_client(nc);
+      break;
+    }
+
+    default:
+      // Client info and anything newer aren't needed to stream
+      break;
+  }
+}
+
 /**
-  @brief  Mongoose event handler to stream audio data to clients
+  @brief  Mongoose event handler for Snapcast clients. Speaks the binary
+          stream protocol of snapserver, with PCM chunks timestamped from
+          the capture
   
   @param  nc Mongoose connection
   @param  ev Mongoose event calling the function
@@ -28,100 +1043,46 @@ static SemaphoreHandle_t client_mutex;
   @param  user_data User data pointer
   @retval none
 */
-static void httpStreamEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+static void snapcastEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
 {
   switch(ev)
   {
-    case MG_EV_HTTP_REQUEST:
+    case MG_EV_RECV:
     {
-      char addr[32];
-      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
-
-      // Lock the client list
-      xSemaphoreTake(client_mutex, portMAX_DELAY);
-
-      if (clients.count(nc))
-      {
-        ESP_LOGW(TAG, "Client %p (%s) already exists.", nc, addr);
-        xSemaphoreGive(client_mutex);
-        return;
-      }
+      const int64_t now = esp_timer_get_time();
 
-      // Construct a queue for this client
-      QueueHandle_t queue = xQueueCreate(HTTP::CLIENT_QUEUE_LENGTH, sizeof(I2S::sample_buffer_t));
-      if (queue == nullptr)
+      // Handle every complete message received
+      struct mbuf& io = nc->recv_mbuf;
+      while (io.len >= Snapcast::HEADER_SIZE)
       {
-        ESP_LOGE(TAG, "Failed to create queue for client %p (%s).", nc, addr);
-        xSemaphoreGive(client_mutex);
-        return;
+        Snapcast::Header header = Snapcast::read_header((const uint8_t*) io.buf);
+        if (header.size > Snapcast::MAX_MESSAGE_SIZE)
+        {
+          ESP_LOGW(TAG, "Closing Snapcast client %p. Message too large.", nc);
+          nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+          break;
+        }
+
+        if (io.len < Snapcast::HEADER_SIZE + header.size)
+          break;
+
+        header.received = now;
+        handle_snapcast_message(nc, header, (const uint8_t*) io.buf + Snapcast::HEADER_SIZE);
+        mbuf_remove(&io, Snapcast::HEADER_SIZE + header.size);
       }
-
-      nc->user_data = queue;
-      clients.insert(nc);
-
-      // Notify system of first client
-      if (clients.size() == 1)
-        System::set_active_state();
-
-      xSemaphoreGive(client_mutex);
-
-      // Grab the stream object from the user_data
-      HTTP::StreamConfig* stream_config = (HTTP::StreamConfig*) user_data;
-      assert(stream_config != nullptr);
-
-      ESP_LOGI(TAG, "New %s client %p (%s).", stream_config->name, nc, addr);
-
-      // Send the HTTP header
-      mg_send_response_line(nc, 200, stream_config->headers);
-
-      // Perform additional setup if needed
-      if (stream_config->setup)
-        stream_config->setup(nc);
-
-      // Reassign event handler for this client
-      nc->handler = httpStreamEventHandler;
-
       break;
     }
 
     case MG_EV_SEND:
     case MG_EV_POLL:
     {
-      // Service queues on every poll or send event
-
-      // Get queue handle from the connection
-      QueueHandle_t queue = (QueueHandle_t) nc->user_data;
-      assert(queue != nullptr);
-  
-      I2S::sample_buffer_t samples;
-      while (xQueueReceive(queue, samples.data(), 0) == pdTRUE)
-        mg_send(nc, samples.data(), sizeof(samples));
-
+      service_client(nc, ev, ev_data);
       break;
     }
 
     case MG_EV_CLOSE:
     {
-      char addr[32];
-      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
-      ESP_LOGI(TAG, "Client %p (%s) disconnected.", nc, addr);
-
-      // Delete the clients queue
-      if (nc->user_data != nullptr)
-        vQueueDelete((QueueHandle_t) nc->user_data);
-      else
-        ESP_LOGE(TAG, "No queue for client %p (%s).", nc, addr);
-
-      // Remove the client
-      xSemaphoreTake(client_mutex, portMAX_DELAY);
-      clients.erase(nc);
-      
-      // Notify system of last client
-      if (clients.empty())
-        System::set_idle_state();
-
-      xSemaphoreGive(client_mutex);
-
+      remove_client(nc);
       break;
     }
 
@@ -129,6 +1090,7 @@ static void httpStreamEventHandler(struct mg_connection* nc, int ev, void* ev_da
       break;
   }
 }
+#endif
 
 /**
   @brief  Generic Mongoose event handler for the HTTP server
@@ -202,6 +1164,256 @@ static void httpEventHandler(struct mg_connection* nc, int ev, void* ev_data, vo
   }
 }
 
+/**
+  @brief  Remove the port from a Host header. The colons of a bracketed
+          IPv6 address are part of the host, so only a colon after the
+          closing bracket starts the port
+  
+  @param  host Host header value
+  @retval std::string - Host without the port
+*/
+static std::string strip_port(const std::string& host)
+{
+  const size_t end = (host.compare(0, 1, "[") == 0) ? host.find(']') : 0;
+  if (end == std::string::npos)
+    return host;
+
+  return host.substr(0, host.find(':', end));
+}
+
+/**
+  @brief  Mongoose event handler for requests belonging to the other
+          port. The client's host is kept and its port replaced. 307
+          keeps the method and body of API posts
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data Port to redirect to
+  @retval none
+*/
+static void redirectEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  if (ev != MG_EV_HTTP_REQUEST)
+    return;
+
+  struct http_message *hm = (struct http_message *) ev_data;
+  const int port = (int) (intptr_t) user_data;
+
+  std::string host;
+  const struct mg_str* host_header = mg_get_http_header(hm, "Host");
+  if (host_header != nullptr)
+    host.assign(host_header->p, host_header->len);
+  else
+  {
+    // Old clients without a Host header get the address they connected
+    // to. IPv6 addresses are bracketed as in a URL
+    char addr[48];
+    mg_conn_addr_to_str(nc, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP);
+    host = (strchr(addr, ':') != nullptr) ? "[" + std::string(addr) + "]" : std::string(addr);
+  }
+
+  std::string location = "http://" + strip_port(host);
+  if (port != 80)
+    location += ":" + std::to_string(port);
+
+  location.append(hm->uri.p, hm->uri.len);
+  if (hm->query_string.len > 0)
+    location += "?" + std::string(hm->query_string.p, hm->query_string.len);
+
+  mg_http_send_redirect(nc, 307, mg_mk_str(location.c_str()), mg_mk_str(NULL));
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+  @brief  Mongoose event handler for the browser player page
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void listenEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  extern const uint8_t listen_html[] asm("_binary_listen_html_start");
+  extern const uint8_t listen_html_end[] asm("_binary_listen_html_end");
+  const uint32_t listen_html_len = listen_html_end - listen_html;
+
+  if (ev != MG_EV_HTTP_REQUEST)
+    return;
+
+  mg_send_head(nc, 200, listen_html_len, "Content-Type: text/html");
+  mg_send(nc, listen_html, listen_html_len);
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+  @brief  Label the stream of a client in metrics
+  
+  @param  client Client to label
+  @retval const char*
+*/
+static const char* transport_label(const HTTP::Client* client)
+{
+  switch (client->transport)
+  {
+    case HTTP::Transport::WebSocket:
+      return "WS";
+
+    case HTTP::Transport::Snapcast:
+      return "SNAPCAST";
+
+    default:
+      return client->config->name;
+  }
+}
+
+// Numbers of a client copied out under the client mutex, so the client
+// list isn't held while they're formatted
+struct ClientSample
+{
+  char address[32];
+  const char* stream; // Static label of the stream
+  uint64_t bytes_sent;
+  uint32_t drops;
+  uint32_t queued_blocks;
+  size_t send_buffer_bytes;
+  uint32_t blocks_behind;
+  Metrics::Histogram::Snapshot latency;
+};
+
+/**
+  @brief  Render per-client stream metrics. Takes the client mutex only
+          while the numbers are copied
+  
+  @param  output String to append to
+  @retval none
+*/
+static void render_client_metrics(std::string& output)
+{
+  if (client_mutex == nullptr)
+    return;
+
+  // Reserved before locking so copying rarely allocates
+  std::vector<ClientSample> samples;
+  samples.reserve(HTTP::MAX_CLIENTS);
+
+  // Clients belong to the stream task. The mutex keeps them from being
+  // removed while their counters are read
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+  for (const auto nc : clients)
+  {
+    const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+
+    samples.emplace_back();
+    ClientSample& sample = samples.back();
+    mg_sock_addr_to_str(&nc->sa, sample.address, sizeof(sample.address), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+    sample.stream = transport_label(client);
+    sample.bytes_sent = client->bytes_sent.load(std::memory_order_relaxed);
+    sample.drops = client->drops.load(std::memory_order_relaxed);
+    sample.queued_blocks = uxQueueMessagesWaiting(client->queue);
+    sample.send_buffer_bytes = client->send_buffer_bytes.load(std::memory_order_relaxed);
+    sample.blocks_behind = latest_sequence.load() - client->last_sequence.load(std::memory_order_relaxed);
+    sample.latency = client->latency.snapshot();
+  }
+
+  xSemaphoreGive(client_mutex);
+
+  // Build labels for each client once
+  std::vector<std::string> labels;
+  labels.reserve(samples.size());
+  for (const ClientSample& sample : samples)
+    labels.push_back("client=\"" + std::string(sample.address) + "\",stream=\"" + sample.stream + "\"");
+
+  Metrics::render_header(output, "http_client_bytes_sent_total", "counter", "Stream bytes written to each client's socket.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::render_sample(output, "http_client_bytes_sent_total", labels[i].c_str(), samples[i].bytes_sent);
+
+  Metrics::render_header(output, "http_client_dropped_blocks_total", "counter", "Sample blocks dropped for each client.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::render_sample(output, "http_client_dropped_blocks_total", labels[i].c_str(), samples[i].drops);
+
+  Metrics::render_header(output, "http_client_queued_blocks", "gauge", "Sample blocks waiting in each client's queue.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::render_sample(output, "http_client_queued_blocks", labels[i].c_str(), samples[i].queued_blocks);
+
+  Metrics::render_header(output, "http_client_send_buffer_bytes", "gauge", "Bytes waiting in each client's send buffer.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::render_sample(output, "http_client_send_buffer_bytes", labels[i].c_str(), samples[i].send_buffer_bytes);
+
+  // Blocks captured but not yet written to the socket, wherever they wait
+  Metrics::render_header(output, "http_client_blocks_behind", "gauge", "Blocks between the newest capture and the last block written to each client's socket.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::render_sample(output, "http_client_blocks_behind", labels[i].c_str(), samples[i].blocks_behind);
+
+  Metrics::render_header(output, "http_client_latency_ms", "histogram", "Time from capture until each client's samples were written to the socket.");
+  for (size_t i = 0; i < samples.size(); i++)
+    Metrics::Histogram::render(output, "http_client_latency_ms", labels[i].c_str(), samples[i].latency);
+}
+
+/**
+  @brief  Mongoose event handler for the Prometheus metrics endpoint
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void metricsEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  if (ev != MG_EV_HTTP_REQUEST)
+    return;
+
+  std::string metrics = Metrics::render();
+  I2S::render_metrics(metrics);
+
+  render_client_metrics(metrics);
+
+  mg_send_head(nc, 200, metrics.length(), "Content-Type: text/plain; version=0.0.4");
+  mg_send(nc, metrics.c_str(), metrics.length());
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+  @brief  Mongoose event handler for the trace endpoint. Tracing is
+          toggled with ?enable=1 or ?enable=0, otherwise the captured
+          events are returned in Chrome trace event format
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void traceEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  if (ev != MG_EV_HTTP_REQUEST)
+    return;
+
+  struct http_message *hm = (struct http_message *) ev_data;
+
+  char enable[2];
+  if (mg_get_http_var(&hm->query_string, "enable", enable, sizeof(enable)) > 0)
+  {
+    bool enabled = Trace::enable(enable[0] == '1');
+
+    const char* reply = enabled ? "Tracing enabled." : "Tracing disabled.";
+    mg_send_head(nc, 200, strlen(reply), "Content-Type: text/plain");
+    mg_send(nc, reply, strlen(reply));
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+    return;
+  }
+
+  std::string trace = Trace::render();
+
+  mg_send_head(nc, 200, trace.length(), "Content-Type: application/json");
+  mg_send(nc, trace.c_str(), trace.length());
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
 /**
   @brief  Mongoose event handler for the OTA firmware update
   
@@ -380,14 +1592,16 @@ static void otaEventHandler(struct mg_connection* nc, int ev, void* ev_data, voi
 }
 
 /**
-  @brief  Main task function of the HTTP server
+  @brief  Main task function of the streaming server. Streams are kept
+          on their own manager, polled by a high priority task, so page,
+          JSON and OTA requests of the control server can't delay sends
   
   @param  pvParameters
   @retval none
 */
-void HTTP::task(void* pvParameters)
+void HTTP::stream_task(void* pvParameters)
 {
-  ESP_LOGI(TAG, "Starting HTTP server.");
+  ESP_LOGI(TAG, "Starting stream server.");
 
   client_mutex = xSemaphoreCreateMutex();
   if (client_mutex == nullptr)
@@ -400,8 +1614,8 @@ void HTTP::task(void* pvParameters)
   struct mg_mgr manager;
   mg_mgr_init(&manager, NULL);
 
-  // Connect bind to an address and specify the event handler
-  struct mg_connection* connection = mg_bind(&manager, "80", httpEventHandler, nullptr);
+  // Anything that isn't a stream is sent to the control server
+  struct mg_connection* connection = mg_bind(&manager, std::to_string(HTTP::PORT).c_str(), redirectEventHandler, (void*) (intptr_t) HTTP::CONTROL_PORT);
   if (connection == NULL)
   {
     ESP_LOGE(TAG, "Failed to bind port.");
@@ -413,28 +1627,98 @@ void HTTP::task(void* pvParameters)
   // Enable HTTP on the connection
   mg_set_protocol_http_websocket(connection);
 
+  // Add separate end points for each stream
+  for (const StreamConfig& config : stream_configs)
+    mg_register_http_endpoint(connection, config.path, httpStreamEventHandler, (void*) &config);
+
+  // Low latency browser playback. The page is served beside its stream
+  // so it connects back to the port it came from
+  mg_register_http_endpoint(connection, "/stream.ws", websocketEventHandler, nullptr);
+  mg_register_http_endpoint(connection, "/listen", listenEventHandler, nullptr);
+
+#ifdef CONFIG_SNAPCAST_SERVER
+  // Snapcast clients connect to their own port
+  if (mg_bind(&manager, std::to_string(Snapcast::PORT).c_str(), snapcastEventHandler, nullptr) == NULL)
+    ESP_LOGE(TAG, "Failed to bind Snapcast port.");
+#endif
+
+  // Loop waiting for events
+  // Poll at least once per send period so batches go out as soon as they fill
+  int64_t budget_update = 0;
+  while(1)
+  {
+    Trace::Scope scope("HTTP stream poll");
+    mg_mgr_poll(&manager, std::max<uint32_t>(std::min<uint32_t>(System::get_profile().send_period_ms(), 10), 1));
+
+    // Measure what the link delivered to admitted clients
+    const int64_t now = esp_timer_get_time();
+    if (now - budget_update >= HTTP::Budget::WINDOW_US)
+    {
+      xSemaphoreTake(client_mutex, portMAX_DELAY);
+      update_budget(now);
+      if (budget.overcommitted())
+        shed_newest_client(now);
+      xSemaphoreGive(client_mutex);
+
+      budget_update = now;
+    }
+  }
+
+  // Free the manager if we ever exit
+  mg_mgr_free(&manager);
+
+  vTaskDelete(NULL);
+}
+
+/**
+  @brief  Main task function of the control server, which serves the web
+          interface, JSON, metrics, traces and OTA updates
+  
+  @param  pvParameters
+  @retval none
+*/
+void HTTP::control_task(void* pvParameters)
+{
+  ESP_LOGI(TAG, "Starting control server.");
+
+  // Create and init the event manager
+  struct mg_mgr manager;
+  mg_mgr_init(&manager, NULL);
+
+  // Connect bind to an address and specify the event handler
+  struct mg_connection* connection = mg_bind(&manager, std::to_string(HTTP::CONTROL_PORT).c_str(), httpEventHandler, nullptr);
+  if (connection == NULL)
+  {
+    ESP_LOGE(TAG, "Failed to bind control port.");
+    mg_mgr_free(&manager);
+    vTaskDelete(NULL);
+    return;
+  }
+
+  // Enable HTTP on the connection
+  mg_set_protocol_http_websocket(connection);
+
   // Special handler for OTA page
   mg_register_http_endpoint(connection, "/ota", otaEventHandler, nullptr);
 
-  // Construct the PCM stream object
-  StreamConfig pcm("PCM", "Content-Type: audio/L16;rate=48000;channels=2\r\nAccept-Ranges: none\r\nCache-Control: no-cache,no-store,must-revalidate,max-age=0\r\n");
+  // Prometheus metrics
+  mg_register_http_endpoint(connection, "/metrics", metricsEventHandler, nullptr);
 
-  // Construct the WAV stream object
-  StreamConfig wav("WAV", "Content-Type: audio/wav\r\nAccept-Ranges: none\r\nCache-Control: no-cache,no-store,must-revalidate,max-age=0\r\n");
-  wav.setup = [](struct mg_connection* nc)
-  {
-    // Construct and send the WAV header
-    WAV::Header wav_header(48000);
-    mg_send(nc, &wav_header, sizeof(wav_header));
-  };
+  // Chrome trace export
+  mg_register_http_endpoint(connection, "/trace.json", traceEventHandler, nullptr);
+
+  // Streams and the player asked for here are sent to the stream server
+  for (const StreamConfig& config : stream_configs)
+    mg_register_http_endpoint(connection, config.path, redirectEventHandler, (void*) (intptr_t) HTTP::PORT);
 
-  // Add separate end points for raw PCM and WAV stream
-  mg_register_http_endpoint(connection, "/stream.pcm", httpStreamEventHandler, &pcm);
-  mg_register_http_endpoint(connection, "/stream.wav", httpStreamEventHandler, &wav);
+  mg_register_http_endpoint(connection, "/listen", redirectEventHandler, (void*) (intptr_t) HTTP::PORT);
 
   // Loop waiting for events
   while(1)
-    mg_mgr_poll(&manager, 10);
+  {
+    Trace::Scope scope("HTTP control poll");
+    mg_mgr_poll(&manager, 1000);
+  }
 
   // Free the manager if we ever exit
   mg_mgr_free(&manager);
@@ -442,14 +1726,85 @@ void HTTP::task(void* pvParameters)
   vTaskDelete(NULL);
 }
 
+/**
+  @brief  Fetch the streams offered by the server
+  
+  @param  none
+  @retval const std::vector<StreamConfig>&
+*/
+const std::vector<HTTP::StreamConfig>& HTTP::get_stream_configs()
+{
+  return stream_configs;
+}
+
+/**
+  @brief  Check if each address has a client streaming over plain HTTP,
+          as renderers do. Browsers and other listeners on other
+          addresses don't count
+  
+  @param  addresses IP addresses of the renderers
+  @retval bool
+*/
+bool HTTP::has_clients_from(const std::vector<std::string>& addresses)
+{
+  if (client_mutex == nullptr)
+    return false;
+
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+
+  size_t found = 0;
+  for (const std::string& address : addresses)
+  {
+    for (const auto nc : clients)
+    {
+      if (((const HTTP::Client*) nc->user_data)->transport != HTTP::Transport::Http)
+        continue;
+
+      char addr[32];
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP);
+      if (address == addr)
+      {
+        found++;
+        break;
+      }
+    }
+  }
+
+  xSemaphoreGive(client_mutex);
+
+  return found == addresses.size();
+}
+
+/**
+  @brief  Fetch the usage of the stream budget
+  
+  @param  none
+  @retval Budget - Copy taken under the client mutex
+*/
+HTTP::Budget HTTP::get_budget()
+{
+  if (client_mutex == nullptr)
+    return budget;
+
+  xSemaphoreTake(client_mutex, portMAX_DELAY);
+  const HTTP::Budget copy = budget;
+  xSemaphoreGive(client_mutex);
+
+  return copy;
+}
+
 /**
   @brief  Queue sample data for transmission to clients
   
-  @param  samples Buffer to enqueue
+  @param  block Program block to enqueue
+  @param  first Block of the first input alone, or nullptr without a second input
+  @param  second Block of the second input aligned to the first, or nullptr
   @retval none
 */
-void HTTP::queue_samples(const I2S::sample_buffer_t& samples)
+void HTTP::queue_samples(const I2S::block_t& block, const I2S::block_t* first, const I2S::block_t* second)
 {
+  Trace::Scope scope("HTTP::queue_samples");
+
   // Lock the client list
   if (client_mutex == nullptr || xSemaphoreTake(client_mutex, pdMS_TO_TICKS(200)) != pdTRUE)
   {
@@ -457,25 +1812,43 @@ void HTTP::queue_samples(const I2S::sample_buffer_t& samples)
     return;
   }
 
+  latest_sequence = block.sequence;
+
+  // Every Snapcast client is sent the same start times so they play in sync
+  static Snapcast::Timeline timeline;
+  const int64_t start_time = timeline.update(block.timestamp, block.frames, block.gap_frames, block.sample_rate);
+
+  // Encode once per output however many clients share it
+  encode_outputs({{&block, first, second}}, start_time);
+
   for (const auto nc : clients)
   {
-    // Get queue handle from the connection
-    QueueHandle_t queue = (QueueHandle_t) nc->user_data;
+    // Get queue handle from the client
+    QueueHandle_t queue = ((HTTP::Client*) nc->user_data)->queue;
     assert(queue != nullptr);
 
-    // Attempt to queue the sample data
-    if (xQueueSendToBack(queue, samples.data(), pdMS_TO_TICKS(50)) == pdTRUE)
+    // Queues are sized for one block size and streams have one rate.
+    // Clients left over from a capture change are closed by the HTTP task
+    const HTTP::Client* client = (const HTTP::Client*) nc->user_data;
+    const HTTP::EncodedBlock& encoded = *client->output->block;
+    if (client->block_size != HTTP::EncodedBlock::size(encoded.length) || client->sample_rate != block.sample_rate)
+      continue;
+
+    // Attempt to queue the encoded data
+    if (xQueueSendToBack(queue, &encoded, pdMS_TO_TICKS(50)) == pdTRUE)
       continue;
     
     ESP_LOGW(TAG, "Client %p queue overflow.", nc);
 
+    ((HTTP::Client*) nc->user_data)->drops.fetch_add(1, std::memory_order_relaxed);
+    drop_count.increment();
+
     // Free up space in the queue
-    I2S::sample_buffer_t dummy;
-    if (xQueueReceive(queue, dummy.data(), 0) != pdTRUE)
+    if (xQueueReceive(queue, &discarded_block, 0) != pdTRUE)
       ESP_LOGE(TAG, "Failed to pop from full queue.");
 
     // Queue without blocking this time
-    if (xQueueSendToBack(queue, samples.data(), 0) != pdTRUE)
+    if (xQueueSendToBack(queue, &encoded, 0) != pdTRUE)
       ESP_LOGE(TAG, "Failed to queue samples for %p.", nc);
   }
 
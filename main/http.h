@@ -1,25 +1,178 @@
 #ifndef __HTTP_H__
 #define __HTTP_H__
 
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
 #include "mongoose.h"
+#include "budget.h"
+#include "dlna.h"
 #include "i2s_interface.h"
+#include "metrics.h"
 
 namespace HTTP
 {
-  constexpr int CLIENT_QUEUE_LENGTH = 3;
+  constexpr int PORT = CONFIG_HTTP_PORT; // Streams
+  constexpr int CONTROL_PORT = CONFIG_HTTP_CONTROL_PORT; // Web interface, JSON, metrics and OTA
+  constexpr int CLIENT_QUEUE_MS = 30; // Audio each client may fall behind beyond a send batch
+  constexpr double CLIENT_PROBE_WINDOW = 0.25; // Seconds a client must stay connected before streaming starts
+  constexpr int64_t CLIENT_STALL_US = 2000000; // A client whose socket took nothing for this long has stopped reading
+  constexpr uint32_t BUDGET_KBPS = CONFIG_STREAM_BUDGET_KBPS; // Total bitrate of admitted stream clients
+  constexpr uint32_t MAX_CLIENTS = CONFIG_STREAM_MAX_CLIENTS;
+  constexpr int RETRY_AFTER_S = 10; // Retry-After of requests beyond the budget
+  constexpr int64_t PROBATION_US = 10000000; // Newly admitted clients are closed again if the link can't carry them
 
-  // Object to represent a stream configuration
+  // Object to represent a stream configuration. The sample rate follows
+  // the source and mono variants are requested with ?channels=1 or
+  // ?channel=left|right, so anything describing a stream is built per
+  // rate and channel count
   struct StreamConfig
   {
+    // Encode samples held in the capture's container to the wire format.
+    // Samples of every channel are encoded alike so channels aren't needed
+    typedef size_t (*encoder_t)(const void* samples, uint32_t count, uint8_t bits_per_sample, uint8_t* output);
+
     const char* const name;
-    const char* const headers;
-    void (*setup)(struct mg_connection* nc) = nullptr;
+    const char* const path;
+    const char* const media_type; // MIME type without parameters
+    const bool rate_parameters; // Rate and channels are MIME parameters e.g. audio/L16;rate=48000;channels=2
+    const std::string dlna_profile;
+    const uint8_t bits_per_sample; // Bits of each sample on the wire. Whole bytes
+    const encoder_t encode;
+    void (*const setup)(struct mg_connection* nc, uint32_t sample_rate, uint8_t channels);
+    const uint8_t input; // 0 for the program, else the capture input streamed on its own
+
+    StreamConfig(const char* name, const char* path, const char* media_type, bool rate_parameters, const std::string& dlna_profile, uint8_t bits_per_sample, encoder_t encode, void (*setup)(struct mg_connection* nc, uint32_t sample_rate, uint8_t channels) = nullptr, uint8_t input = 0)
+      : name(name), path(path), media_type(media_type), rate_parameters(rate_parameters), dlna_profile(dlna_profile), bits_per_sample(bits_per_sample), encode(encode), setup(setup), input(input) {}
+
+    uint32_t bitrate(uint32_t sample_rate, uint8_t channels) const
+    {
+      return sample_rate * channels * bits_per_sample;
+    }
+
+    size_t encoded_size(uint32_t frames, uint8_t channels) const
+    {
+      return frames * channels * bits_per_sample / 8;
+    }
+
+    std::string mime_type(uint32_t sample_rate, uint8_t channels) const
+    {
+      if (!rate_parameters)
+        return media_type;
+
+      return std::string(media_type) + ";rate=" + std::to_string(sample_rate) + ";channels=" + std::to_string(channels);
+    }
+
+    std::string headers(uint32_t sample_rate, uint8_t channels) const
+    {
+      std::string headers = "Content-Type: " + mime_type(sample_rate, channels) + "\r\n";
+      headers += "Accept-Ranges: none\r\n";
+      headers += "Cache-Control: no-cache,no-store,must-revalidate,max-age=0\r\n";
+
+      // Advertise a live stream so DLNA renderers don't probe or buffer it like a file
+      headers += "transferMode.dlna.org: Streaming\r\n";
+      headers += "contentFeatures.dlna.org: " + DLNA::content_features(dlna_profile) + "\r\n";
+      return headers;
+    }
+  };
+
+  // Block encoded in a stream's wire format. Queues of shorter blocks copy
+  // only the leading part
+  struct EncodedBlock
+  {
+    static constexpr size_t MAX_LENGTH = I2S::CHANNELS * I2S::BUFFER_SAMPLE_COUNT * 3; // 24 bit stereo
+
+    int64_t timestamp; // Capture time of the block
+    int64_t start_time; // Time of the block's first frame on a timeline smoothed across blocks
+    uint32_t sequence;
+    uint32_t length; // Bytes of data that are valid
+    alignas(4) uint8_t data[MAX_LENGTH];
+
+    static constexpr size_t size(size_t length)
+    {
+      return offsetof(EncodedBlock, data) + length;
+    }
+  };
+
+  // A stream format and mix with streaming clients. Every captured block
+  // is encoded once into the output's block, then queued to each client
+  struct Output
+  {
+    uint32_t subscribers = 0;
+    EncodedBlock* block = nullptr; // Allocated while there are subscribers
+  };
+
+  // Header of each binary WebSocket message, followed by the block's
+  // samples as interleaved 16 bit. All fields are little endian
+  struct WebSocketHeader
+  {
+    int64_t timestamp; // Capture time of the block in microseconds
+    uint32_t sequence;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint32_t frames;
+  };
+
+  static_assert(sizeof(WebSocketHeader) == 24, "WebSocket header must not be padded");
+
+  // Block handed to mongoose but not yet written to the socket
+  struct InFlightBlock
+  {
+    uint32_t end_offset; // Connection offset of the block's last byte
+    int64_t timestamp;
+    uint32_t sequence;
+  };
+
+  // How blocks are framed on a client's connection
+  enum class Transport : uint8_t
+  {
+    Http, // Raw samples following the response headers
+    WebSocket, // A binary message per block, sent as soon as it's captured
+    Snapcast, // A timestamped wire chunk per block
+  };
+
+  // Object to represent a connected stream client
+  struct Client
+  {
+    const StreamConfig* const config;
+    const uint32_t sample_rate; // Rate given in the stream's header
+    const Audio::Mix mix;
+    const Transport transport;
+    Output* output = nullptr; // Output the client is subscribed to while streaming
+    QueueHandle_t queue = nullptr;
+    size_t block_size = 0; // Bytes of each queued block. Fixed when streaming starts
+    uint32_t send_blocks = 1; // Blocks written to the socket together
+    std::atomic<uint64_t> bytes_sent{0}; // Written by the stream task, read by metrics
+    std::atomic<uint32_t> drops{0}; // Written by the capture task, read by metrics
+    const int64_t admitted = esp_timer_get_time();
+    int64_t last_progress = esp_timer_get_time(); // Last time bytes reached the socket
+    uint64_t metered_bytes = 0; // Totals at the last budget update
+    uint32_t metered_drops = 0;
+
+    // Capture to socket latency tracking
+    uint32_t connection_offset = 0; // Bytes written to the socket of the current connection
+    std::deque<InFlightBlock> in_flight;
+    std::atomic<uint32_t> last_sequence{0}; // Written by the stream task, read by metrics
+    std::atomic<uint32_t> send_buffer_bytes{0};
+    Metrics::Histogram latency;
 
-    StreamConfig(const char* name, const char* headers) : name(name), headers(headers) {}
+    Client(const StreamConfig* config, uint32_t sample_rate, Audio::Mix mix, Transport transport = Transport::Http) : config(config), sample_rate(sample_rate), mix(mix), transport(transport),
+      latency("http_client_latency_ms", "Time from capture until each client's samples were written to the socket.", {5, 10, 20, 30, 50, 75, 100, 150, 200, 300, 500}, nullptr, false) {}
   };
 
-  void task(void* pvParameters);
-  void queue_samples(const I2S::sample_buffer_t& samples);
+  void stream_task(void* pvParameters);
+  void control_task(void* pvParameters);
+  const std::vector<StreamConfig>& get_stream_configs();
+  Budget get_budget();
+  bool has_clients_from(const std::vector<std::string>& addresses);
+  void queue_samples(const I2S::block_t& block, const I2S::block_t* first = nullptr, const I2S::block_t* second = nullptr);
 }
 
 #endif
\ No newline at end of file
@@ -2,44 +2,281 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "driver/i2s.h"
 #include "driver/gpio.h"
 #include "esp_task_wdt.h"
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 
+#include <algorithm>
+#include <atomic>
+
+#include "aligner.h"
 #include "i2s_interface.h"
+#include "metrics.h"
+#include "rate_detector.h"
+#include "trace.h"
 
 #define TAG "I2S"
 
+// Sequence number of the next captured block
+static uint32_t sequence = 0;
+
+// Driver events. An RX_DONE is posted for every DMA buffer filled. Holds
+// the 100 buffers of the smallest blocks filled between idle reads
+static constexpr int EVENT_QUEUE_LENGTH = 128;
+static QueueHandle_t event_queue = nullptr;
+
+// Rate the driver is configured for, and the detector of the source's rate.
+// The detector is only accessed from the reading task
+static std::atomic<uint32_t> sample_rate = {I2S::SAMPLE_FREQUENCTY};
+static I2S::RateDetector rate_detector;
+
+// Current DMA configuration. Every DMA buffer is read as one block
+static struct
+{
+  uint32_t block_frames = I2S::BUFFER_SAMPLE_COUNT;
+  uint32_t buffer_count = I2S::BUFFER_COUNT;
+  uint8_t bits_per_sample = I2S::BITS_PER_SAMPLE;
+
+  size_t buffer_bytes() const { return block_frames * I2S::CHANNELS * Audio::container_size(bits_per_sample); }
+
+  // The driver queues one less buffer than it allocates. Any more filled
+  // buffers than this without a read means the oldest were overwritten
+  uint32_t queue_length() const { return buffer_count - 1; }
+} dma;
+
+// Continuity of the captured audio. Only accessed from the reading task
+// except where atomic
+static struct
+{
+  bool enabled = false;
+  int32_t backlog = 0; // DMA buffers filled but not yet read
+  uint64_t bytes_read = 0;
+  uint32_t gap_frames = 0; // Frames lost before the next block
+  bool reset_pending = false;
+  int64_t last_block_time = 0;
+  int32_t last_frame[I2S::CHANNELS] = {};
+  std::atomic<int64_t> last_discontinuity_time = {0};
+  std::atomic<uint32_t> last_reset_lost_frames = {0};
+} continuity;
+
+static Metrics::Counter blocks_read("i2s_blocks_read_total", "Complete sample blocks read from I2S.");
+static Metrics::Counter short_reads("i2s_short_reads_total", "I2S reads that returned less data than requested.");
+static Metrics::Counter resets("i2s_resets_total", "I2S peripheral resets.");
+static Metrics::Counter dma_errors("i2s_dma_errors_total", "DMA errors reported by the I2S driver.");
+static Metrics::Counter event_overflows("i2s_event_queue_overflows_total", "Times the I2S event queue was found full. Overrun counts may be low.");
+static Metrics::Counter overrun_count("i2s_discontinuities_total", "Gaps in the captured audio while streaming, by cause.", "cause=\"overrun\"");
+static Metrics::Counter reset_count("i2s_discontinuities_total", "Gaps in the captured audio while streaming, by cause.", "cause=\"reset\"");
+static Metrics::Counter overrun_frames("i2s_lost_frames_total", "Frames lost in gaps while streaming, by cause.", "cause=\"overrun\"");
+static Metrics::Counter reset_frames("i2s_lost_frames_total", "Frames lost in gaps while streaming, by cause.", "cause=\"reset\"");
+static Metrics::Counter rate_changes("i2s_sample_rate_changes_total", "Times the driver was retuned to a new source sample rate.");
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+// Frames of the second input waiting to line up with the first's blocks.
+// Only accessed from the reading task
+static I2S::Aligner aligner;
+static I2S::Aligner::Stats aligner_counted;
+
+static Metrics::Counter second_dropped("i2s_second_slipped_frames_total", "Frames of the second input dropped or repeated to stay aligned while streaming.", "direction=\"drop\"");
+static Metrics::Counter second_repeated("i2s_second_slipped_frames_total", "Frames of the second input dropped or repeated to stay aligned while streaming.", "direction=\"repeat\"");
+static Metrics::Counter second_resyncs("i2s_second_resyncs_total", "Times the second input jumped back into alignment while streaming.");
+#endif
+
 /**
-  @brief  Initialize the I2S interface
+  @brief  Record a gap in the captured audio. The next block read is
+          marked and concealed
+
+  @param  frames Number of frames lost
+  @retval none
+*/
+static void record_gap(uint32_t frames)
+{
+  continuity.gap_frames += frames;
+  continuity.last_discontinuity_time = esp_timer_get_time();
+}
+
+/**
+  @brief  Collect the DMA buffers filled since the last read and detect
+          any overwritten before they could be read
+
+  @param  none
+  @retval none
+*/
+static void account_dma_filled()
+{
+  if (event_queue == nullptr)
+    return;
+
+  if (uxQueueMessagesWaiting(event_queue) == EVENT_QUEUE_LENGTH)
+  {
+    event_overflows.increment();
+
+    // Buffers filled without an event can't be timed
+    rate_detector.reset();
+  }
+
+  uint32_t filled = 0;
+  i2s_event_t event;
+  while (xQueueReceive(event_queue, &event, 0) == pdTRUE)
+  {
+    if (event.type == I2S_EVENT_RX_DONE)
+      filled++;
+    else if (event.type == I2S_EVENT_DMA_ERROR)
+      dma_errors.increment();
+  }
+
+  if (rate_detector.update(esp_timer_get_time(), filled * dma.block_frames))
+    ESP_LOGI(TAG, "Source sample rate detected as %u Hz.", rate_detector.rate());
+
+  continuity.backlog += filled;
+
+  // Events are posted before their buffer can be read, so a negative
+  // backlog means events were lost
+  continuity.backlog = std::max<int32_t>(continuity.backlog, 0);
+
+  if (continuity.backlog <= (int32_t) dma.queue_length())
+    return;
+
+  uint32_t lost = continuity.backlog - dma.queue_length();
+  continuity.backlog = dma.queue_length();
+
+  // Sub-sampling while idle overruns by design
+  if (!continuity.enabled)
+    return;
+
+  ESP_LOGW(TAG, "DMA overrun. Lost %u buffers.", lost);
+
+  overrun_count.increment();
+  overrun_frames.increment(lost * dma.block_frames);
+  record_gap(lost * dma.block_frames);
+}
+
+/**
+  @brief  Account for DMA buffers taken by a read. A buffer counts as read
+          as soon as the driver takes it off its queue
+
+  @param  bytes Bytes just read from the driver
+  @retval none
+*/
+static void account_dma_read(size_t bytes)
+{
+  const size_t buffer_bytes = dma.buffer_bytes();
+
+  uint64_t taken_before = (continuity.bytes_read + buffer_bytes - 1) / buffer_bytes;
+  continuity.bytes_read += bytes;
+
+  // May go negative until the events of buffers read while waiting are collected
+  continuity.backlog -= (continuity.bytes_read + buffer_bytes - 1) / buffer_bytes - taken_before;
+}
+
+/**
+  @brief  Restart DMA and rate accounting from an empty queue
 
   @param  none
   @retval none
 */
-void I2S::init()
+static void restart_accounting()
+{
+  if (event_queue != nullptr)
+    xQueueReset(event_queue);
+
+  continuity.backlog = 0;
+  continuity.bytes_read = 0;
+  rate_detector.reset();
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+#ifdef CONFIG_I2S_SECOND_SHARED_CLOCK
+  const uint32_t target = 0;
+#else
+  const uint32_t target = dma.block_frames;
+#endif
+  aligner.reset(I2S::CHANNELS * Audio::container_size(dma.bits_per_sample), target);
+#endif
+}
+
+/**
+  @brief  Restart every port together. Ports sharing clocks then fill
+          their DMA buffers with the same frames
+
+  @param  none
+  @retval none
+*/
+static void start_ports()
+{
+  i2s_stop(I2S_NUM_0);
+#ifdef CONFIG_I2S_SECOND_INPUT
+  i2s_stop(I2S_NUM_1);
+#endif
+
+  i2s_start(I2S_NUM_0);
+#ifdef CONFIG_I2S_SECOND_INPUT
+  i2s_start(I2S_NUM_1);
+#endif
+}
+
+/**
+  @brief  Crossfade from the last frame before a gap into the block after
+          it so the gap doesn't click. The fade is limited to one block
+
+  @param  block Block following the gap
+  @retval none
+*/
+template <typename F>
+static void conceal_gap(I2S::block_t& block)
+{
+  typename F::sample_t held[F::channels];
+  for (uint32_t c = 0; c < F::channels; c++)
+    held[c] = continuity.last_frame[c];
+
+  const uint32_t frames = CONFIG_I2S_CONCEALMENT_MS * block.sample_rate / 1000;
+  Audio::crossfade<F>(held, block.data<F>(), std::min(frames, block.frames));
+}
+
+/**
+  @brief  Hold the last frame of a block to conceal a following gap
+
+  @param  block Block just read
+  @retval none
+*/
+template <typename F>
+static void hold_last_frame(const I2S::block_t& block)
+{
+  const typename F::sample_t* frame = block.data<F>() + F::channels * (block.frames - 1);
+  std::copy_n(frame, F::channels, continuity.last_frame);
+}
+
+/**
+  @brief  Install the I2S driver with the current DMA configuration
+
+  @param  none
+  @retval none
+*/
+static void install()
 {
   i2s_config_t config;
   memset(&config, 0, sizeof(i2s_config_t));
 
   config.mode = (i2s_mode_t) (I2S_MODE_SLAVE | I2S_MODE_RX);
-  config.sample_rate = I2S::SAMPLE_FREQUENCTY;
-  config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
-  config.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
+  config.sample_rate = sample_rate.load();
+  config.bits_per_sample = (dma.bits_per_sample <= 16) ? I2S_BITS_PER_SAMPLE_16BIT : I2S_BITS_PER_SAMPLE_32BIT; // Slot width
+  config.channel_format = (I2S::CHANNELS == 2) ? I2S_CHANNEL_FMT_RIGHT_LEFT : I2S_CHANNEL_FMT_ONLY_LEFT;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0)
   config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
 #else
   config.communication_format = (i2s_comm_format_t) (I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB);
 #endif
-  config.dma_buf_count = I2S::BUFFER_COUNT;
-  config.dma_buf_len = I2S::BUFFER_SAMPLE_COUNT;
+  config.dma_buf_count = dma.buffer_count;
+  config.dma_buf_len = dma.block_frames;
   config.use_apll = true; // Use the better lock
   config.fixed_mclk = 0; // Use automatic dividers
   config.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1; // ??
 
-  // Configure the I2S driver
-  i2s_driver_install(I2S_NUM_0, &config, 0, NULL);
+  // Configure the I2S driver. Events are used to detect overruns
+  i2s_driver_install(I2S_NUM_0, &config, EVENT_QUEUE_LENGTH, &event_queue);
 
   i2s_pin_config_t pin_config;
   memset(&pin_config, 0, sizeof(i2s_pin_config_t));
@@ -51,6 +288,140 @@ void I2S::init()
 
   // Enable pins
   i2s_set_pin(I2S_NUM_0, &pin_config);
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  // Same format without events. Its overruns show up as alignment slips
+  i2s_driver_install(I2S_NUM_1, &config, 0, nullptr);
+
+  pin_config.bck_io_num = CONFIG_I2S_SECOND_BCK_GPIO;
+  pin_config.ws_io_num = CONFIG_I2S_SECOND_WS_GPIO;
+  pin_config.data_in_num = CONFIG_I2S_SECOND_DATA_GPIO;
+  i2s_set_pin(I2S_NUM_1, &pin_config);
+
+  // Installing started each port. Line them up
+  start_ports();
+
+#ifdef CONFIG_I2S_SECOND_SHARED_CLOCK
+  ESP_LOGI(TAG, "Second input enabled on shared clocks.");
+#else
+  ESP_LOGI(TAG, "Second input enabled on its own clocks.");
+#endif
+#endif
+
+  ESP_LOGI(TAG, "Capturing %u bit samples at %u Hz in %u frame blocks with %u DMA buffers.", dma.bits_per_sample, sample_rate.load(), dma.block_frames, dma.buffer_count);
+}
+
+/**
+  @brief  Initialize the I2S interface
+
+  @param  block_frames Frames per DMA buffer and block. At most BUFFER_SAMPLE_COUNT
+  @param  buffer_count Number of DMA buffers
+  @param  bits_per_sample Valid bits of each sample. 16, 24 or 32
+  @retval none
+*/
+void I2S::init(uint32_t block_frames, uint32_t buffer_count, uint8_t bits_per_sample)
+{
+  dma.block_frames = std::min<uint32_t>(block_frames, BUFFER_SAMPLE_COUNT);
+  dma.buffer_count = buffer_count;
+  dma.bits_per_sample = bits_per_sample;
+
+  install();
+
+  restart_accounting();
+}
+
+/**
+  @brief  Reinstall the driver with a new DMA configuration. Must be
+          called from the reading task
+
+  @param  block_frames Frames per DMA buffer and block. At most BUFFER_SAMPLE_COUNT
+  @param  buffer_count Number of DMA buffers
+  @param  bits_per_sample Valid bits of each sample. 16, 24 or 32
+  @retval none
+*/
+void I2S::configure(uint32_t block_frames, uint32_t buffer_count, uint8_t bits_per_sample)
+{
+  block_frames = std::min<uint32_t>(block_frames, BUFFER_SAMPLE_COUNT);
+  if (block_frames == dma.block_frames && buffer_count == dma.buffer_count && bits_per_sample == dma.bits_per_sample)
+    return;
+
+  // The event queue is deleted with the driver
+  i2s_driver_uninstall(I2S_NUM_0);
+  event_queue = nullptr;
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  i2s_driver_uninstall(I2S_NUM_1);
+#endif
+
+  dma.block_frames = block_frames;
+  dma.buffer_count = buffer_count;
+  dma.bits_per_sample = bits_per_sample;
+
+  install();
+
+  restart_accounting();
+}
+
+/**
+  @brief  Fetch the number of frames in each block read
+
+  @param  none
+  @retval uint32_t
+*/
+uint32_t I2S::get_block_frames()
+{
+  return dma.block_frames;
+}
+
+/**
+  @brief  Fetch the sample rate the driver is configured for
+
+  @param  none
+  @retval uint32_t
+*/
+uint32_t I2S::get_sample_rate()
+{
+  return sample_rate.load();
+}
+
+/**
+  @brief  Fetch the sample rate measured on the bus. Must be called from
+          the reading task
+
+  @param  none
+  @retval uint32_t - 0 until a rate is confirmed
+*/
+uint32_t I2S::get_detected_sample_rate()
+{
+  return rate_detector.rate();
+}
+
+/**
+  @brief  Retune the driver to a new sample rate. Queued samples are
+          discarded. Must be called from the reading task
+
+  @param  rate Sample rate in Hz
+  @retval none
+*/
+void I2S::set_sample_rate(uint32_t rate)
+{
+  if (rate == sample_rate.load())
+    return;
+
+  rate_changes.increment();
+  ESP_LOGI(TAG, "Changing sample rate from %u to %u Hz.", sample_rate.load(), rate);
+
+  i2s_set_sample_rates(I2S_NUM_0, rate);
+#ifdef CONFIG_I2S_SECOND_INPUT
+  i2s_set_sample_rates(I2S_NUM_1, rate);
+
+  // Each port restarted when retuned. Line them up again
+  start_ports();
+#endif
+  sample_rate = rate;
+
+  flush_rx();
+  restart_accounting();
 }
 
 /**
@@ -63,12 +434,146 @@ void I2S::init()
 */
 size_t I2S::read(sample_t samples[], size_t length, TickType_t wait_ticks)
 {
+  Trace::Scope scope("I2S::read");
+
+  account_dma_filled();
+
   size_t read = 0;
   i2s_read(I2S_NUM_0, samples, length, &read, wait_ticks);
+
+  account_dma_read(read);
+
+  if (read == length)
+    blocks_read.increment();
+  else
+    short_reads.increment();
   
   return read;
 }
 
+/**
+  @brief  Read a complete block from the I2S interface and tag it with a
+          capture timestamp and sequence number. The timestamp is taken
+          when DMA hands over the block, so it marks the arrival of the
+          block's last sample while the reader keeps up with DMA. Blocks
+          following a gap are marked with the frames lost and concealed.
+
+  @param  block Block to store sample data to
+  @param  wait_ticks Number of ticks to wait for data.
+  @retval bool - A complete block was read
+*/
+bool I2S::read(block_t& block, TickType_t wait_ticks)
+{
+  const size_t length = dma.buffer_bytes();
+  if (read(block.samples.data(), length, wait_ticks) != length)
+    return false;
+
+  block.frames = dma.block_frames;
+  block.sample_rate = sample_rate.load();
+  block.bits_per_sample = dma.bits_per_sample;
+  block.timestamp = esp_timer_get_time();
+
+  // Estimate what was lost across a reset from the time since the last block
+  if (continuity.reset_pending)
+  {
+    continuity.reset_pending = false;
+
+    int64_t elapsed_frames = (block.timestamp - continuity.last_block_time) * block.sample_rate / 1000000;
+    uint32_t lost = std::max<int64_t>(elapsed_frames - block.frames, 0);
+
+    ESP_LOGW(TAG, "Lost %u frames to reset.", lost);
+
+    reset_count.increment();
+    reset_frames.increment(lost);
+    continuity.last_reset_lost_frames = lost;
+    record_gap(lost);
+  }
+
+  block.gap_frames = continuity.gap_frames;
+  if (block.gap_frames > 0)
+  {
+    if (CONFIG_I2S_CONCEALMENT_MS > 0)
+    {
+      if (block.bits_per_sample <= 16)
+        conceal_gap<format16_t>(block);
+      else
+        conceal_gap<format32_t>(block);
+    }
+
+    // Skip the sequence numbers of lost blocks so consumers see the gap
+    sequence += (block.gap_frames + block.frames - 1) / block.frames;
+    continuity.gap_frames = 0;
+  }
+
+  block.sequence = sequence++;
+
+  continuity.last_block_time = block.timestamp;
+  if (block.bits_per_sample <= 16)
+    hold_last_frame<format16_t>(block);
+  else
+    hold_last_frame<format32_t>(block);
+
+  return true;
+}
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+/**
+  @brief  Read the block of the second input lining up with a block just
+          read from the first. With shared clocks the matching DMA buffer
+          completes with the first's, so it is waited for briefly.
+          Otherwise frames are held back a block and slipped to follow
+          the second input's clock
+
+  @param  first Block just read from the first input
+  @param  second Block to store the second input's samples to. Tagged
+                 like the first
+  @retval none
+*/
+void I2S::read_second(const block_t& first, block_t& second)
+{
+  Trace::Scope scope("I2S::read_second");
+
+  const size_t frame_size = CHANNELS * Audio::container_size(dma.bits_per_sample);
+  const size_t length = dma.buffer_bytes();
+
+  // Collect every buffer already filled, using the block as scratch
+  size_t read = 0;
+  do
+  {
+    i2s_read(I2S_NUM_1, second.samples.data(), length, &read, 0);
+    aligner.push(second.samples.data(), read / frame_size);
+  } while (read == length);
+
+#ifdef CONFIG_I2S_SECOND_SHARED_CLOCK
+  if (aligner.level() < first.frames)
+  {
+    i2s_read(I2S_NUM_1, second.samples.data(), (first.frames - aligner.level()) * frame_size, &read, 1);
+    aligner.push(second.samples.data(), read / frame_size);
+  }
+#endif
+
+  aligner.pull(second.samples.data(), first.frames);
+
+  second.timestamp = first.timestamp;
+  second.sequence = first.sequence;
+  second.gap_frames = first.gap_frames;
+  second.frames = first.frames;
+  second.sample_rate = first.sample_rate;
+  second.bits_per_sample = first.bits_per_sample;
+
+  // Sub-sampling while idle slips by design
+  const Aligner::Stats& stats = aligner.stats();
+  if (continuity.enabled)
+  {
+    second_dropped.increment(stats.dropped - aligner_counted.dropped);
+    second_repeated.increment(stats.repeated - aligner_counted.repeated);
+    second_resyncs.increment(stats.resyncs - aligner_counted.resyncs);
+  }
+
+  aligner_counted = stats;
+}
+#endif
+
 /**
   @brief  Flush the RX queues by reading all available data
 
@@ -81,9 +586,17 @@ void I2S::flush_rx()
   size_t read = 0;
   do
   {
-    I2S::sample_buffer_t dummy;
-    i2s_read(I2S_NUM_0, dummy.data(), sizeof(dummy), &read, 0);
+    static uint8_t dummy[1024];
+    i2s_read(I2S_NUM_0, dummy, sizeof(dummy), &read, 0);
   } while (read);
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  do
+  {
+    static uint8_t dummy[1024];
+    i2s_read(I2S_NUM_1, dummy, sizeof(dummy), &read, 0);
+  } while (read);
+#endif
 }
 
 /**
@@ -94,10 +607,53 @@ void I2S::flush_rx()
 */
 void I2S::reset()
 {
+  resets.increment();
+
   // Toggle the driver
-  i2s_stop(I2S_NUM_0);
-  i2s_start(I2S_NUM_0);
+  start_ports();
 
   // Flush the RX data
   flush_rx();
+
+  restart_accounting();
+
+  // Losses are measured when the next block arrives
+  continuity.reset_pending = continuity.enabled;
+}
+
+/**
+  @brief  Enable or disable continuity monitoring. Gaps are only counted
+          and concealed while enabled, since idle reads sub-sample
+
+  @param  enable Monitor continuity
+  @retval none
+*/
+void I2S::monitor_continuity(bool enable)
+{
+  continuity.enabled = enable;
+  continuity.gap_frames = 0;
+  continuity.reset_pending = false;
+}
+
+/**
+  @brief  Render continuity gauges in Prometheus text format
+
+  @param  output String to append to
+  @retval none
+*/
+void I2S::render_metrics(std::string& output)
+{
+  Metrics::render_header(output, "i2s_last_reset_lost_frames", "gauge", "Frames lost in the most recent reset while streaming.");
+  Metrics::render_sample(output, "i2s_last_reset_lost_frames", nullptr, continuity.last_reset_lost_frames);
+
+  Metrics::render_header(output, "i2s_sample_rate_hz", "gauge", "Sample rate the driver is configured for.");
+  Metrics::render_sample(output, "i2s_sample_rate_hz", nullptr, sample_rate.load());
+
+  // Omitted until the first gap
+  int64_t last = continuity.last_discontinuity_time;
+  if (last == 0)
+    return;
+
+  Metrics::render_header(output, "i2s_time_since_discontinuity_ms", "gauge", "Time since the last gap in the captured audio while streaming.");
+  Metrics::render_sample(output, "i2s_time_since_discontinuity_ms", nullptr, (esp_timer_get_time() - last) / 1000);
 }
\ No newline at end of file
@@ -3,24 +3,49 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
-#include <array>
+#include <string>
+
+#include "audio.h"
 
 namespace I2S
 {
-  constexpr int SAMPLE_FREQUENCTY = 48e3;
+  constexpr int SAMPLE_FREQUENCTY = 48e3; // Until the source's rate is detected
 
-  // Total buffer space = 3 * 480 * 4 bytes -> 5.76 kB
+  // Default DMA configuration. Total buffer space = 3 * 480 * 4 bytes -> 5.76 kB
+  // Blocks may be configured smaller but never larger than BUFFER_SAMPLE_COUNT
   constexpr int BUFFER_SAMPLE_COUNT = 480;  // Number of samples to make a 10 ms chunk @ 48 kHz
   constexpr int BUFFER_COUNT = 3;  // 3 * 10 ms -> 30 ms of buffering
 
-  typedef int16_t sample_t;
-  typedef std::array<sample_t, 2 * BUFFER_SAMPLE_COUNT> sample_buffer_t;
+  // Captures are 16 bit, or 24 and 32 bit in 32 bit slots
+  constexpr uint8_t CHANNELS = 2;
+  constexpr uint8_t BITS_PER_SAMPLE = 16; // Default capture depth
+
+  typedef Audio::Format<int16_t, CHANNELS> format16_t;
+  typedef Audio::Format<int32_t, CHANNELS> format32_t;
+
+  // Blocks are sized for the widest capture
+  typedef Audio::Block<format32_t, BUFFER_SAMPLE_COUNT> block_t;
+  typedef Audio::Block<Audio::MonoOf<format32_t>, BUFFER_SAMPLE_COUNT> mono_block_t; // One channel of a block
+  typedef block_t::sample_t sample_t;
+  typedef block_t::buffer_t sample_buffer_t;
 
-  void init(void);
+  void init(uint32_t block_frames = BUFFER_SAMPLE_COUNT, uint32_t buffer_count = BUFFER_COUNT, uint8_t bits_per_sample = BITS_PER_SAMPLE);
+  void configure(uint32_t block_frames, uint32_t buffer_count, uint8_t bits_per_sample);
+  uint32_t get_block_frames(void);
+  uint32_t get_sample_rate(void);
+  uint32_t get_detected_sample_rate(void);
+  void set_sample_rate(uint32_t sample_rate);
   size_t read(sample_t* samples, size_t length = sizeof(sample_buffer_t), TickType_t wait_ticks = portMAX_DELAY);
+  bool read(block_t& block, TickType_t wait_ticks = portMAX_DELAY);
+#ifdef CONFIG_I2S_SECOND_INPUT
+  void read_second(const block_t& first, block_t& second);
+#endif
   void flush_rx(void);
   void reset(void);
+  void monitor_continuity(bool enable);
+  void render_metrics(std::string& output);
 }
 
 #endif
\ No newline at end of file
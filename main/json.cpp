@@ -4,24 +4,25 @@
 #include <algorithm>
 
 #include "json.h"
+#include "dsp.h"
+#include "http.h"
+#include "mixer.h"
 #include "nlohmann/json.hpp"
 #include "nvs_interface.h"
+#include "system.h"
 #include "upnp_control.h"
 #include "upnp_renderer.h"
 
 #define TAG "JSON"
 
 /**
-  @brief  Build a JSON string of the known renderers
+  @brief  Build a JSON object of the provided renderers
   
-  @param  none
-  @retval std::string
+  @param  renderers Renderers to serialize
+  @retval nlohmann::json
 */
-std::string JSON::get_renderers()
+static nlohmann::json renderers_object(const UpnpControl::renderer_map_t& renderers)
 {
-  // Get all renders known to UPNP
-  UpnpControl::renderer_map_t renderers = UpnpControl::get_known_renderers();
- 
   nlohmann::json json_renderers = nlohmann::json::object();
 
   // Add an entry for each object
@@ -37,9 +38,227 @@ std::string JSON::get_renderers()
     j["selected"] = r.selected;
   }
 
+  return json_renderers;
+}
+
+// Names of the EQ filter types, indexed by DSP::FilterType
+static const char* const FILTER_TYPES[] = {"peaking", "low_shelf", "high_shelf", "low_pass", "high_pass"};
+
+/**
+  @brief  Build a JSON object of the DSP settings
+  
+  @param  settings Settings to serialize
+  @retval nlohmann::json
+*/
+static nlohmann::json dsp_object(const DSP::Settings& settings)
+{
+  nlohmann::json dsp;
+  dsp["enabled"] = settings.enabled;
+  dsp["gain_db"] = settings.gain_db;
+
+  nlohmann::json eq = nlohmann::json::array();
+  for (uint8_t i = 0; i < settings.section_count && i < DSP::MAX_SECTIONS; i++)
+  {
+    const DSP::Filter& f = settings.sections[i];
+
+    nlohmann::json section;
+    section["type"] = FILTER_TYPES[(size_t) f.type];
+    section["frequency"] = f.frequency;
+    section["gain_db"] = f.gain_db;
+    section["q"] = f.q;
+    eq.push_back(section);
+  }
+  dsp["eq"] = eq;
+
+  nlohmann::json& limiter = dsp["limiter"];
+  limiter["enabled"] = settings.limiter.enabled;
+  limiter["threshold_db"] = settings.limiter.threshold_db;
+  limiter["lookahead_ms"] = settings.limiter.lookahead_ms;
+  limiter["release_ms"] = settings.limiter.release_ms;
+
+  return dsp;
+}
+
+/**
+  @brief  Update a number from a JSON object if the key is present
+  
+  @param  json Object to read
+  @param  key Key of the number
+  @param  min Minimum valid value
+  @param  max Maximum valid value
+  @param  value Number to update
+  @retval bool - Key is absent or holds a number within range
+*/
+static bool parse_number(const nlohmann::json& json, const char* key, float min, float max, float& value)
+{
+  if (!json.contains(key))
+    return true;
+
+  const nlohmann::json& number = json.at(key);
+  if (!number.is_number() || number.get<float>() < min || number.get<float>() > max)
+  {
+    ESP_LOGW(TAG, "DSP '%s' must be a number from %g to %g.", key, min, max);
+    return false;
+  }
+
+  value = number.get<float>();
+  return true;
+}
+
+/**
+  @brief  Update a boolean from a JSON object if the key is present
+  
+  @param  json Object to read
+  @param  key Key of the boolean
+  @param  value Boolean to update
+  @retval bool - Key is absent or holds a boolean
+*/
+static bool parse_bool(const nlohmann::json& json, const char* key, bool& value)
+{
+  if (!json.contains(key))
+    return true;
+
+  if (!json.at(key).is_boolean())
+    return false;
+
+  value = json.at(key).get<bool>();
+  return true;
+}
+
+/**
+  @brief  Parse DSP settings onto the current settings. Omitted keys are
+          left unchanged and an EQ array replaces every section
+  
+  @param  dsp JSON object of the settings
+  @param  settings Settings to update
+  @retval bool - Every present key was valid
+*/
+static bool parse_dsp(const nlohmann::json& dsp, DSP::Settings& settings)
+{
+  if (!dsp.is_object())
+    return false;
+
+  bool valid = parse_bool(dsp, "enabled", settings.enabled);
+  valid &= parse_number(dsp, "gain_db", DSP::MIN_GAIN_DB, DSP::MAX_GAIN_DB, settings.gain_db);
+
+  if (dsp.contains("eq"))
+  {
+    const nlohmann::json& eq = dsp.at("eq");
+    if (!eq.is_array() || eq.size() > DSP::MAX_SECTIONS)
+    {
+      ESP_LOGW(TAG, "DSP 'eq' must be an array of at most %u sections.", DSP::MAX_SECTIONS);
+      return false;
+    }
+
+    settings.section_count = eq.size();
+    for (size_t i = 0; i < eq.size(); i++)
+    {
+      const nlohmann::json& section = eq.at(i);
+      if (!section.is_object() || !section.contains("type") || !section.contains("frequency") || !section.at("type").is_string())
+        return false;
+
+      const std::string type = section.at("type").get<std::string>();
+      const auto name = std::find(std::begin(FILTER_TYPES), std::end(FILTER_TYPES), type);
+      if (name == std::end(FILTER_TYPES))
+      {
+        ESP_LOGW(TAG, "Unknown filter type '%s'.", type.c_str());
+        return false;
+      }
+
+      DSP::Filter& f = settings.sections[i];
+      f.type = (DSP::FilterType) (name - std::begin(FILTER_TYPES));
+      f.gain_db = 0;
+      f.q = 0.707f;
+
+      valid &= parse_number(section, "frequency", DSP::MIN_FREQUENCY, DSP::MAX_FREQUENCY, f.frequency);
+      valid &= parse_number(section, "gain_db", -DSP::MAX_SECTION_GAIN_DB, DSP::MAX_SECTION_GAIN_DB, f.gain_db);
+      valid &= parse_number(section, "q", DSP::MIN_Q, DSP::MAX_Q, f.q);
+    }
+  }
+
+  if (dsp.contains("limiter"))
+  {
+    const nlohmann::json& limiter = dsp.at("limiter");
+    if (!limiter.is_object())
+      return false;
+
+    valid &= parse_bool(limiter, "enabled", settings.limiter.enabled);
+    valid &= parse_number(limiter, "threshold_db", DSP::MIN_THRESHOLD_DB, 0, settings.limiter.threshold_db);
+    valid &= parse_number(limiter, "lookahead_ms", DSP::MIN_LOOKAHEAD_MS, DSP::MAX_LOOKAHEAD_MS, settings.limiter.lookahead_ms);
+    valid &= parse_number(limiter, "release_ms", DSP::MIN_RELEASE_MS, DSP::MAX_RELEASE_MS, settings.limiter.release_ms);
+  }
+
+  return valid;
+}
+
+/**
+  @brief  Build a JSON string of the known renderers and the settings
+  
+  @param  none
+  @retval std::string
+*/
+std::string JSON::get_renderers()
+{
+  // Get all renders known to UPNP
+  nlohmann::json root;
+  root["renderers"] = renderers_object(UpnpControl::get_known_renderers());
+
+  // Add the capture profiles. The selected profile may not be active yet
+  nlohmann::json profiles = nlohmann::json::array();
+  for (const System::Profile& profile : System::PROFILES)
+    profiles.push_back(profile.name);
+
+  root["profiles"] = profiles;
+  root["profile"] = System::get_selected_profile().name;
+  root["active_profile"] = System::get_profile().name;
+
+  // Add the capture depth
+  root["bits_per_sample"] = System::get_selected_bits_per_sample();
+  root["active_bits_per_sample"] = System::get_bits_per_sample();
+
+  // Add the rate detected on the bus
+  root["sample_rate"] = I2S::get_sample_rate();
+  root["mono_source"] = System::is_mono_source();
+
+  // Add the DSP chain
+  root["dsp"] = dsp_object(DSP::get_settings());
+
+  // Add the stream budget and how much of it is reserved
+  const HTTP::Budget budget = HTTP::get_budget();
+  nlohmann::json stream_budget;
+  stream_budget["limit_kbps"] = budget.limit() / 1000;
+  stream_budget["capacity_kbps"] = budget.capacity() / 1000;
+  stream_budget["committed_kbps"] = budget.committed() / 1000;
+  stream_budget["throughput_kbps"] = budget.throughput() / 1000;
+  stream_budget["clients"] = budget.clients();
+  stream_budget["max_clients"] = budget.max_clients();
+  stream_budget["rejected"] = budget.rejections();
+  root["stream_budget"] = stream_budget;
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  // Add how the inputs form the program
+  nlohmann::json mix_modes = nlohmann::json::array();
+  for (const char* mode : Mixer::MODE_NAMES)
+    mix_modes.push_back(mode);
+
+  root["mix_modes"] = mix_modes;
+  root["mix_mode"] = Mixer::MODE_NAMES[(size_t) Mixer::get_mode()];
+#endif
+
+  return root.dump();
+}
+
+/**
+  @brief  Build a JSON string of the provided renderers
+  
+  @param  renderers Renderers to serialize
+  @retval std::string
+*/
+std::string JSON::get_renderers(const UpnpControl::renderer_map_t& renderers)
+{
   // Add renderer object to root
   nlohmann::json root;
-  root["renderers"] = json_renderers;
+  root["renderers"] = renderers_object(renderers);
 
   return root.dump();
 }
@@ -80,5 +299,28 @@ bool JSON::parse_renderers(const std::string& jString)
   // Trigger renderer update in UpnpControl
   UpnpControl::update_selected_renderers();
 
-  return true;
+  // Select the capture profile and depth
+  bool valid = true;
+  if (root.contains("profile") && root["profile"].is_string())
+    valid &= System::set_profile(root["profile"].get<std::string>());
+
+  if (root.contains("bits_per_sample") && root["bits_per_sample"].is_number_unsigned())
+    valid &= System::set_bits_per_sample(root["bits_per_sample"].get<uint8_t>());
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  if (root.contains("mix_mode") && root["mix_mode"].is_string())
+    valid &= Mixer::set_mode(root["mix_mode"].get<std::string>());
+#endif
+
+  // Settings are only applied when all of them are valid
+  if (root.contains("dsp"))
+  {
+    DSP::Settings settings = DSP::get_settings();
+    if (parse_dsp(root["dsp"], settings))
+      DSP::configure(settings);
+    else
+      valid = false;
+  }
+
+  return valid;
 }
@@ -4,6 +4,7 @@
 #include <string>
 
 #include "nlohmann/json.hpp"
+#include "upnp_control.h"
 
 namespace JSON
 {
@@ -27,6 +28,7 @@ namespace JSON
   }
 
   std::string get_renderers();
+  std::string get_renderers(const UpnpControl::renderer_map_t& renderers);
   bool parse_renderers(const std::string& jString);
 }
 
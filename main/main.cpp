@@ -5,7 +5,10 @@
 #include "nvs_flash.h"
 #include "esp_pm.h"
 
+#include "dsp.h"
 #include "http.h"
+#include "metrics.h"
+#include "mixer.h"
 #include "nvs_interface.h"
 #include "system.h"
 #include "upnp_control.h"
@@ -33,6 +36,14 @@ extern "C" void app_main()
   // Initialize our own NVS interface
   NVS::init();
 
+  // Restore the DSP settings
+  DSP::init();
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+  // Restore the input mix mode
+  Mixer::init();
+#endif
+
   // Initialize WiFi and connect to configured network
   WiFi::init_station();
 
@@ -49,12 +60,21 @@ extern "C" void app_main()
   esp_pm_configure(&config);
 #endif
 
-  // Start the HTTP task
-  xTaskCreate(HTTP::task, "HTTPTask", 8192, NULL, 4, NULL);
+  TaskHandle_t task = nullptr;
+
+  // Start the streaming server above the capture so sends are never delayed
+  xTaskCreate(HTTP::stream_task, "HTTPStreamTask", 8192, NULL, 4, &task);
+  Metrics::register_task(task);
+
+  // Start the web interface, JSON and OTA server below everything audio
+  xTaskCreate(HTTP::control_task, "HTTPControlTask", 8192, NULL, 1, &task);
+  Metrics::register_task(task);
 
   // Create a task which moves data from I2S to HTTP server
-  xTaskCreate(System::task, "SystemTask", 4096, NULL, 2, NULL);
+  xTaskCreate(System::task, "SystemTask", 4096, NULL, 2, &task);
+  Metrics::register_task(task);
 
   // Create a task which handles sending UPNP events
-  xTaskCreate(UpnpControl::task, "UpnpTask", 6144, NULL, 1, NULL);
+  xTaskCreate(UpnpControl::task, "UpnpTask", 6144, NULL, 1, &task);
+  Metrics::register_task(task);
 }
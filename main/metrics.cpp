@@ -0,0 +1,228 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+
+#include <cstring>
+#include <string>
+
+#include "metrics.h"
+
+Metrics::Metric* Metrics::Metric::head = nullptr;
+Metrics::Metric* Metrics::Metric::tail = nullptr;
+
+static constexpr size_t MAX_TASKS = 8;
+static TaskHandle_t tasks[MAX_TASKS];
+static std::atomic<size_t> task_count;
+
+/**
+  @brief  Construct a metric and append it to the registry. Metrics are
+          expected to be static so they are never removed
+
+  @param  name Metric name
+  @param  help Description of the metric
+  @param  labels Constant labels e.g. action="Play". May be null
+  @param  registered Append the metric to the registry
+  @retval none
+*/
+Metrics::Metric::Metric(const char* name, const char* help, const char* labels, bool registered) : name(name), help(help), labels(labels)
+{
+  if (!registered)
+    return;
+
+  if (tail == nullptr)
+    head = this;
+  else
+    tail->_next = this;
+
+  tail = this;
+}
+
+/**
+  @brief  Sum the per-core slots of the counter
+
+  @param  none
+  @retval uint64_t
+*/
+uint64_t Metrics::Counter::value() const
+{
+  uint64_t total = 0;
+  for (const auto& slot : slots)
+    total += slot.load();
+
+  return total;
+}
+
+/**
+  @brief  Render the counter in Prometheus text format
+
+  @param  output String to append to
+  @retval none
+*/
+void Metrics::Counter::render(std::string& output) const
+{
+  render_sample(output, name, labels, value());
+}
+
+/**
+  @brief  Construct a histogram with the provided upper bucket bounds
+
+  @param  name Metric name
+  @param  help Description of the metric
+  @param  bounds Ascending upper bounds of each bucket. Truncated to MAX_BUCKETS
+  @param  labels Constant labels e.g. action="Play". May be null
+  @param  registered Append the histogram to the registry
+  @retval none
+*/
+Metrics::Histogram::Histogram(const char* name, const char* help, std::initializer_list<uint32_t> bounds, const char* labels, bool registered) : Metric(name, help, labels, registered)
+{
+  for (uint32_t bound : bounds)
+  {
+    if (bucket_count == MAX_BUCKETS)
+      break;
+
+    this->bounds[bucket_count++] = bound;
+  }
+}
+
+/**
+  @brief  Sum the slots into cumulative bucket counts
+
+  @param  none
+  @retval Snapshot
+*/
+Metrics::Histogram::Snapshot Metrics::Histogram::snapshot() const
+{
+  Snapshot snapshot;
+  snapshot.bucket_count = bucket_count;
+
+  // Prometheus buckets are cumulative
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i <= bucket_count; i++)
+  {
+    for (const Slot& slot : slots)
+      cumulative += slot.counts[i].load(std::memory_order_relaxed);
+
+    if (i < bucket_count)
+      snapshot.bounds[i] = bounds[i];
+
+    snapshot.counts[i] = cumulative;
+  }
+
+  snapshot.sum = 0;
+  for (const Slot& slot : slots)
+    snapshot.sum += slot.sum.load();
+
+  return snapshot;
+}
+
+/**
+  @brief  Render a histogram snapshot in Prometheus text format
+
+  @param  output String to append to
+  @param  name Metric name
+  @param  labels Labels of the samples. May be null
+  @param  snapshot Counts to render
+  @retval none
+*/
+void Metrics::Histogram::render(std::string& output, const char* name, const char* labels, const Snapshot& snapshot)
+{
+  const std::string prefix = (labels != nullptr) ? std::string(labels) + "," : std::string();
+  const std::string bucket_name = std::string(name) + "_bucket";
+
+  for (size_t i = 0; i <= snapshot.bucket_count; i++)
+  {
+    std::string le = (i < snapshot.bucket_count) ? std::to_string(snapshot.bounds[i]) : "+Inf";
+    render_sample(output, bucket_name.c_str(), (prefix + "le=\"" + le + "\"").c_str(), snapshot.counts[i]);
+  }
+
+  render_sample(output, (std::string(name) + "_sum").c_str(), labels, snapshot.sum);
+  render_sample(output, (std::string(name) + "_count").c_str(), labels, snapshot.counts[snapshot.bucket_count]);
+}
+
+/**
+  @brief  Render the HELP and TYPE lines of a metric family
+
+  @param  output String to append to
+  @param  name Metric name
+  @param  type Prometheus metric type
+  @param  help Description of the metric
+  @retval none
+*/
+void Metrics::render_header(std::string& output, const char* name, const char* type, const char* help)
+{
+  output += "# HELP " + std::string(name) + " " + help + "\n";
+  output += "# TYPE " + std::string(name) + " " + type + "\n";
+}
+
+/**
+  @brief  Render a single sample line
+
+  @param  output String to append to
+  @param  name Metric name
+  @param  labels Labels of the sample. May be null
+  @param  value Value of the sample
+  @retval none
+*/
+void Metrics::render_sample(std::string& output, const char* name, const char* labels, uint64_t value)
+{
+  output += name;
+
+  if (labels != nullptr && labels[0] != '\0')
+    output += "{" + std::string(labels) + "}";
+
+  output += " " + std::to_string(value) + "\n";
+}
+
+/**
+  @brief  Register a task to report the stack high water mark of
+
+  @param  task Handle of the task
+  @retval none
+*/
+void Metrics::register_task(TaskHandle_t task)
+{
+  size_t index = task_count.load();
+  if (task == nullptr || index >= MAX_TASKS)
+    return;
+
+  tasks[index] = task;
+  task_count = index + 1;
+}
+
+/**
+  @brief  Render all registered metrics and system gauges in Prometheus
+          text format
+
+  @param  none
+  @retval std::string
+*/
+std::string Metrics::render()
+{
+  std::string output;
+
+  // Metrics sharing a name are registered together and share a header
+  const char* previous = nullptr;
+  for (const Metric* metric = Metric::first(); metric != nullptr; metric = metric->next())
+  {
+    if (previous == nullptr || strcmp(previous, metric->name) != 0)
+      render_header(output, metric->name, metric->type(), metric->help);
+
+    metric->render(output);
+    previous = metric->name;
+  }
+
+  render_header(output, "heap_free_bytes", "gauge", "Current free heap.");
+  render_sample(output, "heap_free_bytes", nullptr, esp_get_free_heap_size());
+
+  render_header(output, "heap_minimum_free_bytes", "gauge", "Lowest free heap since boot.");
+  render_sample(output, "heap_minimum_free_bytes", nullptr, esp_get_minimum_free_heap_size());
+
+  render_header(output, "task_stack_high_water_mark_bytes", "gauge", "Minimum unused stack of each task since it started.");
+  for (size_t i = 0; i < task_count.load(); i++)
+  {
+    std::string labels = "task=\"" + std::string(pcTaskGetTaskName(tasks[i])) + "\"";
+    render_sample(output, "task_stack_high_water_mark_bytes", labels.c_str(), uxTaskGetStackHighWaterMark(tasks[i]));
+  }
+
+  return output;
+}
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+namespace Metrics
+{
+  // Base of all registered metrics. Metrics are rendered in construction order
+  class Metric
+  {
+    public:
+      const char* const name;
+      const char* const help;
+      const char* const labels;
+
+      virtual const char* type(void) const = 0;
+      virtual void render(std::string& output) const = 0;
+
+      static const Metric* first(void) { return head; }
+      const Metric* next(void) const { return _next; }
+
+    protected:
+      Metric(const char* name, const char* help, const char* labels, bool registered = true);
+
+    private:
+      static Metric* head;
+      static Metric* tail;
+      Metric* _next = nullptr;
+  };
+
+  // Histogram counts stay 32 bit atomics, which must be lock free. 64 bit
+  // atomics aren't on Xtensa and ESP-IDF emulates them behind one global
+  // spinlock, so 64 bit totals are guarded by a spinlock of their own
+  static_assert((UINT_MAX == UINT32_MAX) ? ATOMIC_INT_LOCK_FREE == 2 : ATOMIC_LONG_LOCK_FREE == 2, "32 bit atomics must be lock free");
+
+  // 64 bit total of one core's slot. Only that core adds to it, so its
+  // lock is only ever contended by a reader on the other core
+  class Total
+  {
+    public:
+      void add(uint32_t count)
+      {
+        portENTER_CRITICAL(&mux);
+        value += count;
+        portEXIT_CRITICAL(&mux);
+      }
+
+      uint64_t load(void) const
+      {
+        portENTER_CRITICAL(&mux);
+        uint64_t total = value;
+        portEXIT_CRITICAL(&mux);
+
+        return total;
+      }
+
+    private:
+      mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+      uint64_t value = 0;
+  };
+
+  // Monotonic counter split into per-core slots so increments never contend.
+  // 64 bit so byte counts don't wrap
+  class Counter : public Metric
+  {
+    public:
+      Counter(const char* name, const char* help, const char* labels = nullptr) : Metric(name, help, labels) {}
+
+      void increment(uint32_t count = 1)
+      {
+        slots[xPortGetCoreID()].add(count);
+      }
+
+      uint64_t value(void) const;
+
+      const char* type(void) const { return "counter"; }
+      void render(std::string& output) const;
+
+    private:
+      Total slots[portNUM_PROCESSORS];
+  };
+
+  // Fixed bucket histogram split into per-core slots. Unregistered
+  // histograms are rendered by their owner e.g. with per-client labels
+  class Histogram : public Metric
+  {
+    public:
+      static constexpr size_t MAX_BUCKETS = 12;
+
+      Histogram(const char* name, const char* help, std::initializer_list<uint32_t> bounds, const char* labels = nullptr, bool registered = true);
+
+      void observe(uint32_t value)
+      {
+        // Find the first bucket holding the value. Last bucket is +Inf
+        size_t bucket = 0;
+        while (bucket < bucket_count && value > bounds[bucket])
+          bucket++;
+
+        Slot& slot = slots[xPortGetCoreID()];
+        slot.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        slot.sum.add(value);
+      }
+
+      // Cumulative counts of a histogram at one time. Plain data so it can
+      // be copied out under a lock and rendered after releasing it
+      struct Snapshot
+      {
+        size_t bucket_count;
+        uint32_t bounds[MAX_BUCKETS];
+        uint64_t counts[MAX_BUCKETS + 1]; // Cumulative, last is +Inf
+        uint64_t sum;
+      };
+
+      const char* type(void) const { return "histogram"; }
+      void render(std::string& output) const { render(output, labels); }
+      void render(std::string& output, const char* labels) const { render(output, name, labels, snapshot()); }
+
+      Snapshot snapshot(void) const;
+      static void render(std::string& output, const char* name, const char* labels, const Snapshot& snapshot);
+
+    private:
+      struct Slot
+      {
+        std::atomic<uint32_t> counts[MAX_BUCKETS + 1] = {};
+        Total sum; // Widened so sums of large values don't wrap
+      };
+
+      uint32_t bounds[MAX_BUCKETS];
+      size_t bucket_count = 0;
+      Slot slots[portNUM_PROCESSORS];
+  };
+
+  void render_header(std::string& output, const char* name, const char* type, const char* help);
+  void render_sample(std::string& output, const char* name, const char* labels, uint64_t value);
+
+  void register_task(TaskHandle_t task);
+  std::string render(void);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "esp_log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "mixer.h"
+#include "metrics.h"
+#include "nvs_interface.h"
+#include "trace.h"
+
+#define TAG "Mixer"
+
+static std::atomic<Mixer::Mode> mode = {Mixer::DEFAULT_MODE};
+
+// Threshold at 16 bit scale and gain of the ducked input
+static const int32_t duck_threshold = lroundf(INT16_MAX * powf(10, Mixer::DUCK_THRESHOLD_DB / 20));
+static const int32_t duck_gain = lroundf(Audio::GAIN_UNITY * powf(10, Mixer::DUCK_GAIN_DB / 20));
+
+// Ducking state. Only accessed from the capture task
+static struct
+{
+  int32_t gain = Audio::GAIN_UNITY; // Q1.15 gain of the second input
+  uint32_t hold_frames = 0; // Frames left before the second input recovers
+} duck;
+
+// Mixed program. Only accessed from the capture task
+static I2S::block_t program;
+
+static Metrics::Counter mixed_count("mixer_mixed_blocks_total", "Blocks of the two inputs mixed into the program.");
+static Metrics::Counter ducked_count("mixer_ducked_blocks_total", "Mixed blocks with the second input below unity gain.");
+
+/**
+  @brief  Find a mode by name
+
+  @param  name Name of the mode
+  @retval size_t - Index of the mode or MODE_COUNT if unknown
+*/
+static size_t find_mode(const std::string& name)
+{
+  size_t index = 0;
+  for (const char* mode : Mixer::MODE_NAMES)
+  {
+    if (name == mode)
+      break;
+
+    index++;
+  }
+
+  return index;
+}
+
+/**
+  @brief  Mix the samples of both inputs into the program
+
+  @param  mode Sum or Duck
+  @param  first Block of the first input
+  @param  second Block of the second input, aligned to the first
+  @retval none
+*/
+template <typename F>
+static void mix(Mixer::Mode mode, const I2S::block_t& first, const I2S::block_t& second)
+{
+  const typename F::sample_t* a = first.data<F>();
+  const typename F::sample_t* b = second.data<F>();
+  typename F::sample_t* destination = program.data<F>();
+  const uint32_t frames = first.frames;
+
+  if (mode == Mixer::Mode::Sum)
+  {
+    Audio::sum<F>(a, b, destination, frames);
+    return;
+  }
+
+  // Hold off recovery while the first input is audible
+  const typename F::sample_t threshold = (typename F::sample_t) (duck_threshold * (1 << (F::container_bits - 16)));
+  if (Audio::peak<F>(a, frames) > threshold)
+    duck.hold_frames = Mixer::DUCK_HOLD_MS * first.sample_rate / 1000;
+  else
+    duck.hold_frames -= std::min(duck.hold_frames, frames);
+
+  // Duck within this block, recover at a fixed rate
+  int32_t next = (duck.hold_frames > 0) ? duck_gain : Audio::GAIN_UNITY;
+  if (next > duck.gain)
+  {
+    const int32_t step = (uint64_t) (Audio::GAIN_UNITY - duck_gain) * frames * 1000 / ((uint64_t) Mixer::DUCK_RELEASE_MS * first.sample_rate);
+    next = std::min(next, duck.gain + std::max<int32_t>(step, 1));
+  }
+
+  if (duck.gain == Audio::GAIN_UNITY && next == Audio::GAIN_UNITY)
+  {
+    Audio::sum<F>(a, b, destination, frames);
+    return;
+  }
+
+  Audio::sum_ramped<F>(a, b, destination, frames, duck.gain, next);
+  duck.gain = next;
+
+  ducked_count.increment();
+}
+
+/**
+  @brief  Restore the saved mode
+
+  @param  none
+  @retval none
+*/
+void Mixer::init()
+{
+  size_t saved = find_mode(NVS::get_mix_mode());
+  if (saved < MODE_COUNT)
+    mode = (Mode) saved;
+}
+
+/**
+  @brief  Fetch the mode in use
+
+  @param  none
+  @retval Mode
+*/
+Mixer::Mode Mixer::get_mode()
+{
+  return mode.load();
+}
+
+/**
+  @brief  Select and save a mode. Applied from the next block
+
+  @param  name Name of the mode
+  @retval bool - Mode exists
+*/
+bool Mixer::set_mode(const std::string& name)
+{
+  size_t index = find_mode(name);
+  if (index >= MODE_COUNT)
+  {
+    ESP_LOGW(TAG, "Unknown mode '%s'.", name.c_str());
+    return false;
+  }
+
+  if (mode.exchange((Mode) index) == (Mode) index)
+    return true;
+
+  NVS::set_mix_mode(name);
+
+  ESP_LOGI(TAG, "Mode '%s' selected.", name.c_str());
+  return true;
+}
+
+/**
+  @brief  Return the second input to unity gain after a gap in the
+          captured audio. Must be called from the capture task
+
+  @param  none
+  @retval none
+*/
+void Mixer::reset()
+{
+  duck.gain = Audio::GAIN_UNITY;
+  duck.hold_frames = 0;
+}
+
+/**
+  @brief  Form the program from a block of each input. Must be called from
+          the capture task
+
+  @param  first Block of the first input
+  @param  second Block of the second input, aligned to the first
+  @retval I2S::block_t& - Program block. Valid until the next call
+*/
+I2S::block_t& Mixer::process(const I2S::block_t& first, const I2S::block_t& second)
+{
+  Trace::Scope scope("mixer");
+
+  const Mode mode = ::mode.load();
+  if (mode == Mode::Independent)
+  {
+    // Copied so processing the program leaves the first input's stream alone
+    memcpy(&program, &first, I2S::block_t::size(first.frames, first.bits_per_sample));
+    reset();
+    return program;
+  }
+
+  memcpy(&program, &first, I2S::block_t::size(0));
+
+  if (first.bits_per_sample <= 16)
+    mix<I2S::format16_t>(mode, first, second);
+  else
+    mix<I2S::format32_t>(mode, first, second);
+
+  mixed_count.increment();
+  return program;
+}
\ No newline at end of file
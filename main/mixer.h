@@ -0,0 +1,40 @@
+#ifndef __MIXER_H__
+#define __MIXER_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "i2s_interface.h"
+
+namespace Mixer
+{
+  // How the program stream is formed from the two inputs. Each input is
+  // also streamed on its own at /stream1.wav and /stream2.wav
+  enum class Mode : uint8_t
+  {
+    Independent, // Program is the first input
+    Sum, // Inputs summed with saturation
+    Duck, // First input has priority. The second is lowered while it plays
+  };
+
+  constexpr const char* MODE_NAMES[] = {"independent", "sum", "duck"};
+  constexpr size_t MODE_COUNT = sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]);
+  constexpr Mode DEFAULT_MODE = Mode::Independent;
+
+  // Ducking. The second input drops within a block of the first rising
+  // above the threshold, and recovers once the first has been below it
+  // for the hold time
+  constexpr float DUCK_THRESHOLD_DB = -50; // dBFS
+  constexpr float DUCK_GAIN_DB = -20;
+  constexpr uint32_t DUCK_HOLD_MS = 500;
+  constexpr uint32_t DUCK_RELEASE_MS = 250; // From ducked to unity
+
+  void init(void);
+  Mode get_mode(void);
+  bool set_mode(const std::string& name);
+  void reset(void);
+  I2S::block_t& process(const I2S::block_t& first, const I2S::block_t& second);
+}
+
+#endif
\ No newline at end of file
@@ -10,6 +10,7 @@
 #define TAG "NVS"
 
 static NvsHelper nvs_renderers(NVS::RENDERERS_NAMESPACE);
+static NvsHelper nvs_settings(NVS::SETTINGS_NAMESPACE);
 
 /**
   @brief  Callback function for the NVS helper to report errors
@@ -47,6 +48,10 @@ void NVS::init()
     ESP_LOGW(TAG, "Invalid NVS version in namespace '%s'. Erasing.", RENDERERS_NAMESPACE);
     erase_renderers();
   }
+
+  // Open a namespace to hold the settings
+  if (nvs_settings.open(&helper_callback) != ESP_OK)
+    ESP_LOGE(TAG, "Error opening NVS namespace '%s'.", SETTINGS_NAMESPACE);
 }
 
 /**
@@ -117,4 +122,105 @@ std::map<std::string, std::string> NVS::get_renderers()
   }
 
   return renderer_map;
+}
+
+/**
+  @brief  Save the capture profile in NVS
+  
+  @param  profile Name of the profile
+  @retval none
+*/
+void NVS::set_profile(const std::string& profile)
+{
+  nvs_settings.nvs_set<std::string>("profile", profile);
+  nvs_settings.commit();
+}
+
+/**
+  @brief  Fetch the capture profile from NVS
+  
+  @param  none
+  @retval std::string - Empty if none is saved
+*/
+std::string NVS::get_profile()
+{
+  std::string profile;
+  nvs_settings.nvs_get<std::string>("profile", profile);
+
+  return profile;
+}
+
+/**
+  @brief  Save the capture depth in NVS
+  
+  @param  bits_per_sample Valid bits of each sample
+  @retval none
+*/
+void NVS::set_bits_per_sample(uint8_t bits_per_sample)
+{
+  nvs_settings.nvs_set<uint8_t>("bits", bits_per_sample);
+  nvs_settings.commit();
+}
+
+/**
+  @brief  Fetch the capture depth from NVS
+  
+  @param  none
+  @retval uint8_t - 0 if none is saved
+*/
+uint8_t NVS::get_bits_per_sample()
+{
+  uint8_t bits_per_sample = 0;
+  nvs_settings.nvs_get<uint8_t>("bits", bits_per_sample);
+
+  return bits_per_sample;
+}
+
+/**
+  @brief  Save the DSP settings in NVS
+  
+  @param  settings DSP settings
+  @retval none
+*/
+void NVS::set_dsp(const DSP::Settings& settings)
+{
+  nvs_settings.nvs_set<DSP::Settings>("dsp", settings);
+  nvs_settings.commit();
+}
+
+/**
+  @brief  Fetch the DSP settings from NVS
+  
+  @param  settings DSP settings to fill
+  @retval bool - Settings were saved in the current layout
+*/
+bool NVS::get_dsp(DSP::Settings& settings)
+{
+  return nvs_settings.nvs_get<DSP::Settings>("dsp", settings) == ESP_OK;
+}
+
+/**
+  @brief  Save the input mix mode in NVS
+  
+  @param  mode Name of the mode
+  @retval none
+*/
+void NVS::set_mix_mode(const std::string& mode)
+{
+  nvs_settings.nvs_set<std::string>("mix_mode", mode);
+  nvs_settings.commit();
+}
+
+/**
+  @brief  Fetch the input mix mode from NVS
+  
+  @param  none
+  @retval std::string - Empty if none is saved
+*/
+std::string NVS::get_mix_mode()
+{
+  std::string mode;
+  nvs_settings.nvs_get<std::string>("mix_mode", mode);
+
+  return mode;
 }
\ No newline at end of file
@@ -5,9 +5,12 @@
 #include <string>
 #include <map>
 
+#include "dsp.h"
+
 namespace NVS
 {
   constexpr const char* RENDERERS_NAMESPACE = "renderers";
+  constexpr const char* SETTINGS_NAMESPACE = "settings";
 
   constexpr uint8_t NVS_VERSION = 0;
 
@@ -17,6 +20,18 @@ namespace NVS
   
   void set_renderers(const std::map<std::string, std::string>& renderers);
   std::map<std::string, std::string> get_renderers(void);
+
+  void set_profile(const std::string& profile);
+  std::string get_profile(void);
+
+  void set_bits_per_sample(uint8_t bits_per_sample);
+  uint8_t get_bits_per_sample(void);
+
+  void set_dsp(const DSP::Settings& settings);
+  bool get_dsp(DSP::Settings& settings);
+
+  void set_mix_mode(const std::string& mode);
+  std::string get_mix_mode(void);
 }
 
 #endif
\ No newline at end of file
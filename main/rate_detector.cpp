@@ -0,0 +1,83 @@
+#include "rate_detector.h"
+
+constexpr uint32_t I2S::RateDetector::RATES[];
+
+/**
+  @brief  Discard the current window and confirmed rate. Must be called
+          whenever delivered frames may have gone uncounted
+
+  @param  none
+  @retval none
+*/
+void I2S::RateDetector::reset()
+{
+  window_start = -1;
+  window_frames = 0;
+  candidate = 0;
+  confirmations = 0;
+  confirmed = 0;
+}
+
+/**
+  @brief  Account frames delivered by DMA since the last update. Buffers
+          complete at a fixed interval, so however late they are counted
+          the frames counted over a window are within a buffer of the true
+          count. The window is long enough for that to be below tolerance
+
+  @param  timestamp Time in microseconds the frames were counted at
+  @param  frames Frames of the buffers completed since the last update
+  @retval bool - A different rate was confirmed
+*/
+bool I2S::RateDetector::update(int64_t timestamp, uint32_t frames)
+{
+  // Frames before the first timestamp belong to no window
+  if (window_start < 0)
+  {
+    window_start = timestamp;
+    return false;
+  }
+
+  window_frames += frames;
+
+  const int64_t elapsed = timestamp - window_start;
+  if (elapsed < WINDOW_US)
+    return false;
+
+  measured = window_frames * 1000000 / elapsed;
+
+  window_start = timestamp;
+  window_frames = 0;
+
+  // Windows must agree on a standard rate in a row
+  uint32_t rate = nearest_rate(measured);
+  if (rate == 0 || rate != candidate)
+  {
+    candidate = rate;
+    confirmations = (rate != 0) ? 1 : 0;
+    return false;
+  }
+
+  if (++confirmations < CONFIRMATIONS || rate == confirmed)
+    return false;
+
+  confirmed = rate;
+  return true;
+}
+
+/**
+  @brief  Snap a measured rate to the standard rate within tolerance
+
+  @param  measured Measured frames per second
+  @retval uint32_t - Standard rate or 0 if none is close enough
+*/
+uint32_t I2S::RateDetector::nearest_rate(uint32_t measured)
+{
+  for (uint32_t rate : RATES)
+  {
+    uint32_t error = (measured > rate) ? measured - rate : rate - measured;
+    if ((uint64_t) error * 1000 <= (uint64_t) rate * TOLERANCE_PERMILLE)
+      return rate;
+  }
+
+  return 0;
+}
\ No newline at end of file
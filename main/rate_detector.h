@@ -0,0 +1,41 @@
+#ifndef __RATE_DETECTOR_H__
+#define __RATE_DETECTOR_H__
+
+#include <cstdint>
+
+namespace I2S
+{
+  // Measures the LRCLK rate of the bus from the frames DMA delivers over
+  // time. As a slave the peripheral follows the source's clocks whatever
+  // rate the driver was configured for. Free of driver dependencies so it
+  // can be fed synthetic timing on the host
+  class RateDetector
+  {
+    public:
+      static constexpr uint32_t RATES[] = {32000, 44100, 48000, 88200, 96000};
+      static constexpr int64_t WINDOW_US = 1000000; // Measurement window
+      static constexpr uint32_t TOLERANCE_PERMILLE = 20; // Measurements within 2% snap to a rate
+      static constexpr uint32_t CONFIRMATIONS = 2; // Consecutive windows that must agree
+
+      void reset(void);
+      bool update(int64_t timestamp, uint32_t frames);
+
+      // Confirmed rate, 0 until one has been confirmed since the last reset
+      uint32_t rate(void) const { return confirmed; }
+
+      // Rate measured over the last complete window
+      uint32_t measured_rate(void) const { return measured; }
+
+      static uint32_t nearest_rate(uint32_t measured);
+
+    private:
+      int64_t window_start = -1;
+      uint64_t window_frames = 0;
+      uint32_t measured = 0;
+      uint32_t candidate = 0;
+      uint32_t confirmations = 0;
+      uint32_t confirmed = 0;
+  };
+}
+
+#endif
\ No newline at end of file
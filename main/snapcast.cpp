@@ -0,0 +1,317 @@
+#include "esp_log.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "snapcast.h"
+#include "nlohmann/json.hpp"
+#include "wav.h"
+
+#define TAG "Snapcast"
+
+constexpr int64_t Snapcast::Timeline::RESYNC_US;
+constexpr int64_t Snapcast::Timeline::SMOOTHING;
+constexpr int64_t Snapcast::Timeline::MAX_SLEW_US;
+
+/**
+  @brief  Write a value in the protocol's little endian byte order
+
+  @param  output Buffer to write to
+  @param  value Value to write
+  @retval uint8_t* - Position after the value
+*/
+template <typename T>
+static uint8_t* put(uint8_t* output, T value)
+{
+  memcpy(output, &value, sizeof(value));
+  return output + sizeof(value);
+}
+
+/**
+  @brief  Read a value in the protocol's little endian byte order
+
+  @param  input Buffer to read from
+  @param  value Returned value
+  @retval const uint8_t* - Position after the value
+*/
+template <typename T>
+static const uint8_t* get(const uint8_t* input, T& value)
+{
+  memcpy(&value, input, sizeof(value));
+  return input + sizeof(value);
+}
+
+/**
+  @brief  Write a time as the seconds and microseconds of the protocol
+
+  @param  output Buffer to write to
+  @param  time Microseconds
+  @retval uint8_t* - Position after the time
+*/
+static uint8_t* put_time(uint8_t* output, int64_t time)
+{
+  // Microseconds are kept positive so negative times borrow a second
+  int64_t sec = time / 1000000;
+  int64_t usec = time % 1000000;
+  if (usec < 0)
+  {
+    sec--;
+    usec += 1000000;
+  }
+
+  output = put<int32_t>(output, sec);
+  return put<int32_t>(output, usec);
+}
+
+/**
+  @brief  Read a time of the protocol
+
+  @param  input Buffer to read from
+  @param  time Returned microseconds
+  @retval const uint8_t* - Position after the time
+*/
+static const uint8_t* get_time(const uint8_t* input, int64_t& time)
+{
+  int32_t sec = 0;
+  int32_t usec = 0;
+  input = get(input, sec);
+  input = get(input, usec);
+
+  time = (int64_t) sec * 1000000 + usec;
+  return input;
+}
+
+/**
+  @brief  Write a message header
+
+  @param  output Buffer of at least HEADER_SIZE bytes to write to
+  @param  header Header to write
+  @retval uint8_t* - Position after the header
+*/
+static uint8_t* put_header(uint8_t* output, const Snapcast::Header& header)
+{
+  output = put<uint16_t>(output, (uint16_t) header.type);
+  output = put<uint16_t>(output, header.id);
+  output = put<uint16_t>(output, header.refers_to);
+  output = put_time(output, header.sent);
+  output = put_time(output, header.received);
+  return put<uint32_t>(output, header.size);
+}
+
+/**
+  @brief  Build a message whose payload is a length prefixed string, as
+          used for JSON and codec names
+
+  @param  header Header of the message. The size is filled in
+  @param  text String of the payload
+  @retval std::string
+*/
+static std::string string_message(Snapcast::Header header, const std::string& text)
+{
+  header.size = sizeof(uint32_t) + text.length();
+
+  std::string message(Snapcast::HEADER_SIZE + sizeof(uint32_t), '\0');
+  uint8_t* output = put_header((uint8_t*) &message[0], header);
+  put<uint32_t>(output, text.length());
+
+  return message + text;
+}
+
+/**
+  @brief  Predict the capture time of a block's first frame
+
+  @param  timestamp Capture timestamp of the block's last frame
+  @param  frames Frames in the block
+  @param  gap_frames Frames lost before the block
+  @param  sample_rate Sample rate of the block
+  @retval int64_t - Start of the block in microseconds
+*/
+int64_t Snapcast::Timeline::update(int64_t timestamp, uint32_t frames, uint32_t gap_frames, uint32_t sample_rate)
+{
+  const int64_t measured = timestamp - (int64_t) frames * 1000000 / sample_rate;
+
+  // Lost frames still took their time to capture
+  position += gap_frames;
+
+  const int64_t error = (rate == sample_rate) ? measured - (anchor + (int64_t) (position * 1000000 / rate)) : 0;
+  if (rate != sample_rate || error > RESYNC_US || -error > RESYNC_US)
+  {
+    anchor = measured;
+    position = 0;
+    rate = sample_rate;
+    restarts++;
+  }
+  else
+    anchor += std::max(std::min(error / SMOOTHING, MAX_SLEW_US), -MAX_SLEW_US);
+
+  const int64_t start = anchor + (int64_t) (position * 1000000 / rate);
+  position += frames;
+
+  return start;
+}
+
+/**
+  @brief  Read the header at the start of a received message
+
+  @param  input At least HEADER_SIZE bytes of the message
+  @retval Header
+*/
+Snapcast::Header Snapcast::read_header(const uint8_t* input)
+{
+  Header header;
+
+  uint16_t type = 0;
+  input = get(input, type);
+  header.type = (MessageType) type;
+
+  input = get(input, header.id);
+  input = get(input, header.refers_to);
+  input = get_time(input, header.sent);
+  input = get_time(input, header.received);
+  get(input, header.size);
+
+  return header;
+}
+
+/**
+  @brief  Write the header, timestamp and size of a wire chunk. The
+          encoded samples follow
+
+  @param  output Buffer of at least CHUNK_PREFIX_SIZE bytes to write to
+  @param  now Current server time
+  @param  start_time Capture time of the chunk's first frame
+  @param  length Bytes of samples in the chunk
+  @retval size_t - Bytes written
+*/
+size_t Snapcast::write_chunk_prefix(uint8_t* output, int64_t now, int64_t start_time, uint32_t length)
+{
+  Header header;
+  header.type = MessageType::WireChunk;
+  header.sent = now;
+  header.size = 12 + length;
+
+  output = put_header(output, header);
+  output = put_time(output, start_time);
+  put<uint32_t>(output, length);
+
+  return CHUNK_PREFIX_SIZE;
+}
+
+/**
+  @brief  Build the server settings answering a client's hello
+
+  @param  hello Header of the client's hello
+  @param  now Current server time
+  @param  buffer_ms Delay from capture until clients play
+  @retval std::string
+*/
+std::string Snapcast::server_settings(const Header& hello, int64_t now, uint32_t buffer_ms)
+{
+  Header header;
+  header.type = MessageType::ServerSettings;
+  header.refers_to = hello.id;
+  header.sent = now;
+
+  nlohmann::json settings;
+  settings["bufferMs"] = buffer_ms;
+  settings["latency"] = 0;
+  settings["muted"] = false;
+  settings["volume"] = 100;
+
+  return string_message(header, settings.dump());
+}
+
+/**
+  @brief  Build the PCM codec header describing the chunks. Chunks are
+          16 bit stereo and the header is a WAV header
+
+  @param  now Current server time
+  @param  sample_rate Sample rate of the chunks
+  @retval std::string
+*/
+std::string Snapcast::codec_header(int64_t now, uint32_t sample_rate)
+{
+  const WAV::Header<Audio::S16Stereo> wav_header(sample_rate);
+  const char* codec = "pcm";
+
+  Header header;
+  header.type = MessageType::CodecHeader;
+  header.sent = now;
+
+  std::string message = string_message(header, codec);
+
+  // Payload continues with the length prefixed WAV header
+  uint8_t size[sizeof(uint32_t)];
+  put<uint32_t>(size, sizeof(wav_header));
+  message.append((const char*) size, sizeof(size));
+  message.append((const char*) &wav_header, sizeof(wav_header));
+
+  header.size = sizeof(uint32_t) + strlen(codec) + sizeof(size) + sizeof(wav_header);
+  put_header((uint8_t*) &message[0], header);
+
+  return message;
+}
+
+/**
+  @brief  Build the answer to a client's time request. The latency
+          returned is the request's transit measured across both clocks,
+          from which the client finds the server's clock
+
+  @param  request Header of the request with the server's receive time
+  @param  now Current server time
+  @retval std::string
+*/
+std::string Snapcast::time_reply(const Header& request, int64_t now)
+{
+  Header header;
+  header.type = MessageType::Time;
+  header.id = request.id;
+  header.refers_to = request.id;
+  header.sent = now;
+  header.received = request.received;
+  header.size = 8;
+
+  std::string message(HEADER_SIZE + header.size, '\0');
+  uint8_t* output = put_header((uint8_t*) &message[0], header);
+  put_time(output, request.received - request.sent);
+
+  return message;
+}
+
+/**
+  @brief  Find the name of a client from its hello
+
+  @param  payload Payload of the hello
+  @param  length Bytes of payload
+  @retval std::string - Host name and instance, or empty if malformed
+*/
+std::string Snapcast::parse_hello(const uint8_t* payload, size_t length)
+{
+  uint32_t size = 0;
+  if (length < sizeof(size))
+    return std::string();
+
+  get(payload, size);
+  if (size > length - sizeof(size))
+    return std::string();
+
+  const char* text = (const char*) payload + sizeof(size);
+  nlohmann::json hello = nlohmann::json::parse(text, text + size, nullptr, false);
+  if (hello.is_discarded() || !hello.is_object())
+  {
+    ESP_LOGW(TAG, "Malformed hello.");
+    return std::string();
+  }
+
+  // Checked before reading as mismatched types abort without exceptions
+  std::string name = "unknown";
+  auto host = hello.find("HostName");
+  if (host != hello.end() && host->is_string())
+    name = host->get<std::string>();
+
+  auto instance = hello.find("Instance");
+  if (instance != hello.end() && instance->is_number_integer() && instance->get<int>() != 1)
+    name += "#" + std::to_string(instance->get<int>());
+
+  return name;
+}
\ No newline at end of file
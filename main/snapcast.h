@@ -0,0 +1,79 @@
+#ifndef __SNAPCAST_H__
+#define __SNAPCAST_H__
+
+#include "sdkconfig.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Snapcast
+{
+#ifdef CONFIG_SNAPCAST_SERVER
+  constexpr int PORT = CONFIG_SNAPCAST_PORT;
+  constexpr uint32_t BUFFER_MS = CONFIG_SNAPCAST_BUFFER_MS; // Delay from capture until clients play
+#endif
+
+  constexpr size_t HEADER_SIZE = 26; // Base message header
+  constexpr size_t CHUNK_PREFIX_SIZE = HEADER_SIZE + 12; // Header, timestamp and size of a wire chunk
+  constexpr size_t MAX_MESSAGE_SIZE = 4096; // Largest payload accepted from clients
+
+  // Messages of the binary stream protocol
+  enum class MessageType : uint16_t
+  {
+    Base = 0,
+    CodecHeader = 1,
+    WireChunk = 2,
+    ServerSettings = 3,
+    Time = 4,
+    Hello = 5,
+    StreamTags = 6,
+    ClientInfo = 7,
+  };
+
+  // Base header of every message. Times are microseconds on the sender's
+  // clock, or on the receiver's for received once the message is read
+  struct Header
+  {
+    MessageType type = MessageType::Base;
+    uint16_t id = 0;
+    uint16_t refers_to = 0;
+    int64_t sent = 0;
+    int64_t received = 0;
+    uint32_t size = 0; // Bytes of payload following the header
+  };
+
+  // Lays a smooth timeline over the capture timestamps of consecutive
+  // blocks. Timestamps jitter with the capture task's scheduling, but
+  // clients place every chunk by its timestamp, so each block's start is
+  // predicted from the frames before it and only slowly pulled towards
+  // what was measured. This follows drift between the I2S and system
+  // clocks without passing the jitter on. Rate changes and jumps beyond
+  // RESYNC_US restart it
+  class Timeline
+  {
+    public:
+      static constexpr int64_t RESYNC_US = 20000; // Measured starts further out restart the timeline
+      static constexpr int64_t SMOOTHING = 32; // Blocks over which differences are closed
+      static constexpr int64_t MAX_SLEW_US = 20; // Largest correction per block, far beyond clock drift
+
+      int64_t update(int64_t timestamp, uint32_t frames, uint32_t gap_frames, uint32_t sample_rate);
+
+      uint32_t resyncs(void) const { return restarts; }
+
+    private:
+      int64_t anchor = 0; // Start of the first frame since the restart
+      uint64_t position = 0; // Frames since the anchor
+      uint32_t rate = 0;
+      uint32_t restarts = 0;
+  };
+
+  Header read_header(const uint8_t* input);
+  size_t write_chunk_prefix(uint8_t* output, int64_t now, int64_t start_time, uint32_t length);
+  std::string server_settings(const Header& hello, int64_t now, uint32_t buffer_ms);
+  std::string codec_header(int64_t now, uint32_t sample_rate);
+  std::string time_reply(const Header& request, int64_t now);
+  std::string parse_hello(const uint8_t* payload, size_t length);
+}
+
+#endif
\ No newline at end of file
@@ -2,10 +2,16 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+
+#include <atomic>
 
 #include "system.h"
+#include "audio_monitor.h"
+#include "dsp.h"
 #include "http.h"
 #include "i2s_interface.h"
+#include "mixer.h"
 #include "nvs_interface.h"
 #include "upnp_control.h"
 
@@ -13,6 +19,58 @@
 
 static TaskHandle_t task_handle;
 
+// Capture settings in use and those requested. Changes wait until there
+// are no clients since client queues are sized for the captured blocks
+static std::atomic<size_t> profile_index = {System::DEFAULT_PROFILE};
+static std::atomic<size_t> pending_profile_index = {System::DEFAULT_PROFILE};
+static std::atomic<uint8_t> bits_per_sample = {I2S::BITS_PER_SAMPLE};
+static std::atomic<uint8_t> pending_bits_per_sample = {I2S::BITS_PER_SAMPLE};
+
+// Source duplicates one channel into both
+static std::atomic<bool> mono_source = {false};
+
+/**
+  @brief  Find a profile by name
+  
+  @param  name Name of the profile
+  @retval size_t - Index of the profile or PROFILE_COUNT if unknown
+*/
+static size_t find_profile(const std::string& name)
+{
+  size_t index = 0;
+  for (const System::Profile& profile : System::PROFILES)
+  {
+    if (name == profile.name)
+      break;
+
+    index++;
+  }
+
+  return index;
+}
+
+/**
+  @brief  Reconfigure capture for the requested profile and depth. Must be
+          called from the system task while idle
+  
+  @param  none
+  @retval none
+*/
+static void apply_capture()
+{
+  size_t index = pending_profile_index.load();
+  uint8_t bits = pending_bits_per_sample.load();
+  if (index == profile_index.load() && bits == bits_per_sample.load())
+    return;
+
+  const System::Profile& profile = System::PROFILES[index];
+  ESP_LOGI(TAG, "Applying profile '%s' at %u bits.", profile.name, bits);
+
+  I2S::configure(profile.block_frames, profile.buffer_count, bits);
+  profile_index = index;
+  bits_per_sample = bits;
+}
+
 /**
   @brief  Main system task which reads from I2S and updates system state
   
@@ -29,22 +87,29 @@ void System::task(void* pvParameters)
   });
   xTimerStart(state_timer, portMAX_DELAY);
 
-  // Struct to track state of audio
-  struct
-  {
-    int32_t timeout = 0;
-    AudioState state = AudioState::Silent;
-  } audio;
+  // Restore the saved capture settings
+  size_t saved = find_profile(NVS::get_profile());
+  if (saved < PROFILE_COUNT)
+    pending_profile_index = saved;
+
+  uint8_t saved_bits = NVS::get_bits_per_sample();
+  if (saved_bits == 16 || saved_bits == 24 || saved_bits == 32)
+    pending_bits_per_sample = saved_bits;
+
+  apply_capture();
+
+  // Track state of audio
+  AudioMonitor audio;
+  int32_t mono_count = 0;
 
   // System state goes active when there are clients
   State state = State::Idle;
 
   while (true)
   {
-    static I2S::sample_buffer_t samples;
+    static I2S::block_t block;
 
-    size_t read = I2S::read(samples.data(), sizeof(samples), pdMS_TO_TICKS(5000));
-    if (read != sizeof(samples))
+    if (!I2S::read(block, pdMS_TO_TICKS(5000)))
     {
       // I2S read did not return full buffer
       ESP_LOGW(TAG, "Insufficient I2S data. Resetting I2S peripheral.");
@@ -52,9 +117,36 @@ void System::task(void* pvParameters)
       continue;
     }
 
-    // Queue samples to each client when active
+    // Follow the source's sample rate. Clients of the old rate are closed
+    // by the HTTP task and renderers are pointed at streams of the new one
+    uint32_t detected_rate = I2S::get_detected_sample_rate();
+    if (detected_rate != 0 && detected_rate != I2S::get_sample_rate())
+    {
+      I2S::set_sample_rate(detected_rate);
+      UpnpControl::restart();
+      continue;
+    }
+
+#ifdef CONFIG_I2S_SECOND_INPUT
+    static I2S::block_t second;
+    I2S::read_second(block, second);
+
+    // Audio state follows the program formed from both inputs
+    I2S::block_t& program = Mixer::process(block, second);
+#else
+    I2S::block_t& program = block;
+#endif
+
+    // Process and queue samples to each client when active
     if (state == State::Active)
-      HTTP::queue_samples(samples);
+    {
+      DSP::process(program);
+#ifdef CONFIG_I2S_SECOND_INPUT
+      HTTP::queue_samples(program, &block, &second);
+#else
+      HTTP::queue_samples(program);
+#endif
+    }
     else
       vTaskDelay(pdMS_TO_TICKS(250));
     
@@ -66,32 +158,41 @@ void System::task(void* pvParameters)
     if (events & event_update_audio_state)
     {
       // Test audio samples for audio
-      if (samples.front() == 0 && samples.back() == 0)
+      bool silent = Audio::is_silent(program);
+
+      // Sources are mono once enough audible blocks had equal channels, and
+      // stereo as soon as one didn't. Renderers restart to get both channels
+      if (!silent && !Audio::is_mono(program))
       {
-        if (audio.timeout > 0)
-          audio.timeout--;
-        else if (audio.state != AudioState::Silent)
+        mono_count = 0;
+        if (mono_source.exchange(false))
         {
-          ESP_LOGI(TAG, "Audio off.");
-          audio.state = AudioState::Silent;
-
-          UpnpControl::disable();
+          ESP_LOGI(TAG, "Stereo source detected.");
+          UpnpControl::restart();
         }
       }
-      else
+      else if (!silent && mono_count < MONO_DETECT_COUNT && ++mono_count == MONO_DETECT_COUNT)
       {
-        if (audio.timeout < ((audio.state == AudioState::Silent) ? AUDIO_SILENT_TIMEOUT: AUDIO_ACTIVE_TIMEOUT))
-          audio.timeout++;
-        else if (audio.state == AudioState::Silent)
-        {
-          ESP_LOGI(TAG, "Audio On.");
-
-          // Increase timeout in active state
-          audio.state = AudioState::Active;
-          audio.timeout = AUDIO_ACTIVE_TIMEOUT;
+        ESP_LOGI(TAG, "Mono source detected.");
+        mono_source = true;
+      }
 
+      switch (audio.update(silent, esp_timer_get_time(), UpnpControl::renderers_streaming))
+      {
+        case AudioMonitor::Action::Enable:
           UpnpControl::enable();
-        }
+          break;
+
+        case AudioMonitor::Action::Disable:
+          UpnpControl::disable();
+          break;
+
+        case AudioMonitor::Action::Restart:
+          UpnpControl::restart();
+          break;
+
+        case AudioMonitor::Action::None:
+          break;
       }
     }
 
@@ -102,13 +203,21 @@ void System::task(void* pvParameters)
 
       // Reset the I2S interface since we've been sub-sampling in idle
       I2S::reset();
+      I2S::monitor_continuity(true);
+      DSP::reset();
+      Mixer::reset();
     }
 
     if (events & event_set_idle_state)
     {
       ESP_LOGI(TAG, "System Idle.");
       state = State::Idle;
+
+      I2S::monitor_continuity(false);
     }
+
+    if ((events & (event_set_capture | event_set_idle_state)) && state == State::Idle)
+      apply_capture();
   }
 }
 
@@ -132,4 +241,114 @@ void System::set_active_state()
 void System::set_idle_state()
 {
   xTaskNotify(task_handle, event_set_idle_state, eSetBits);
+}
+
+/**
+  @brief  Fetch the capture profile in use
+  
+  @param  none
+  @retval const Profile&
+*/
+const System::Profile& System::get_profile()
+{
+  return PROFILES[profile_index.load()];
+}
+
+/**
+  @brief  Fetch the selected capture profile. May not be applied yet
+  
+  @param  none
+  @retval const Profile&
+*/
+const System::Profile& System::get_selected_profile()
+{
+  return PROFILES[pending_profile_index.load()];
+}
+
+/**
+  @brief  Select and save a capture profile. It is applied immediately
+          when idle, otherwise once the last client disconnects
+  
+  @param  name Name of the profile
+  @retval bool - Profile exists
+*/
+bool System::set_profile(const std::string& name)
+{
+  size_t index = find_profile(name);
+  if (index >= PROFILE_COUNT)
+  {
+    ESP_LOGW(TAG, "Unknown profile '%s'.", name.c_str());
+    return false;
+  }
+
+  if (index == pending_profile_index.exchange(index))
+    return true;
+
+  NVS::set_profile(name);
+
+  ESP_LOGI(TAG, "Profile '%s' selected.", name.c_str());
+  if (task_handle != nullptr)
+    xTaskNotify(task_handle, event_set_capture, eSetBits);
+
+  return true;
+}
+
+/**
+  @brief  Check if the source is mono i.e. both channels carry the same audio
+  
+  @param  none
+  @retval bool
+*/
+bool System::is_mono_source()
+{
+  return mono_source.load();
+}
+
+/**
+  @brief  Fetch the capture depth in use
+  
+  @param  none
+  @retval uint8_t
+*/
+uint8_t System::get_bits_per_sample()
+{
+  return bits_per_sample.load();
+}
+
+/**
+  @brief  Fetch the selected capture depth. May not be applied yet
+  
+  @param  none
+  @retval uint8_t
+*/
+uint8_t System::get_selected_bits_per_sample()
+{
+  return pending_bits_per_sample.load();
+}
+
+/**
+  @brief  Select and save the capture depth. Must match the slot width of
+          the bus, with 24 bit samples in 32 bit slots. Applied like profiles
+  
+  @param  bits_per_sample Valid bits of each sample. 16, 24 or 32
+  @retval bool - Depth is supported
+*/
+bool System::set_bits_per_sample(uint8_t bits_per_sample)
+{
+  if (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32)
+  {
+    ESP_LOGW(TAG, "Unsupported depth %u.", bits_per_sample);
+    return false;
+  }
+
+  if (bits_per_sample == pending_bits_per_sample.exchange(bits_per_sample))
+    return true;
+
+  NVS::set_bits_per_sample(bits_per_sample);
+
+  ESP_LOGI(TAG, "%u bit capture selected.", bits_per_sample);
+  if (task_handle != nullptr)
+    xTaskNotify(task_handle, event_set_capture, eSetBits);
+
+  return true;
 }
\ No newline at end of file
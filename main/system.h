@@ -1,11 +1,44 @@
 #ifndef __SYSTEM_H__
 #define __SYSTEM_H__
 
+#include "sdkconfig.h"
+
+#include <string>
+
+#include "i2s_interface.h"
+
 namespace System
 {
   // Timeouts in 250 ms ticks
   constexpr int AUDIO_SILENT_TIMEOUT = 20; // 5 seconds
   constexpr int AUDIO_ACTIVE_TIMEOUT = 60; // 15 seconds
+  constexpr int AUDIO_STANDBY_TIMEOUT = 4 * CONFIG_WARM_STANDBY_TIMEOUT;
+  constexpr int MONO_DETECT_COUNT = 8; // Audible checks that must all be mono. 2 seconds
+
+  // Capture and send granularity. Smaller blocks cut latency at the cost
+  // of more DMA interrupts, reads and sends per second
+  struct Profile
+  {
+    const char* name;
+    uint32_t block_frames; // Frames per DMA buffer and captured block
+    uint32_t buffer_count; // DMA buffers
+    uint32_t send_blocks; // Blocks written to each client's socket together
+
+    // Audio captured between sends to a client at the current sample rate
+    uint32_t send_period_ms() const
+    {
+      return send_blocks * block_frames * 1000 / I2S::get_sample_rate();
+    }
+  };
+
+  constexpr Profile PROFILES[] =
+  {
+    {"low-latency", 120, 4, 1}, // 2.5 ms blocks, 10 ms of DMA
+    {"balanced", I2S::BUFFER_SAMPLE_COUNT, I2S::BUFFER_COUNT, 1}, // 10 ms blocks, 30 ms of DMA
+    {"high-efficiency", I2S::BUFFER_SAMPLE_COUNT, I2S::BUFFER_COUNT, 4}, // 10 ms blocks sent 40 ms at a time
+  };
+  constexpr size_t PROFILE_COUNT = sizeof(PROFILES) / sizeof(PROFILES[0]);
+  constexpr size_t DEFAULT_PROFILE = 1;
 
   enum class State
   {
@@ -17,6 +50,7 @@ namespace System
   {
     Silent,
     Active,
+    Standby,
   };
 
   typedef enum event_t
@@ -24,11 +58,22 @@ namespace System
     event_update_audio_state = 1 << 0,
     event_set_idle_state     = 1 << 1,
     event_set_active_state   = 1 << 2,
+    event_set_capture        = 1 << 3,
   } event_t;
 
   void set_active_state(void);
   void set_idle_state(void);
 
+  const Profile& get_profile(void);
+  const Profile& get_selected_profile(void);
+  bool set_profile(const std::string& name);
+
+  uint8_t get_bits_per_sample(void);
+  uint8_t get_selected_bits_per_sample(void);
+  bool set_bits_per_sample(uint8_t bits_per_sample);
+
+  bool is_mono_source(void);
+
   void task(void* pvParameters);
 }
 
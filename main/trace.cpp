@@ -0,0 +1,202 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+#define TAG "Trace"
+
+struct Ring
+{
+  std::atomic<uint32_t> head;
+  Trace::Event* events;
+};
+
+std::atomic<bool> Trace::enabled;
+
+static Ring rings[portNUM_PROCESSORS];
+static uint32_t overhead_ns = 0;
+
+/**
+  @brief  Append an event to a ring. Slots are claimed atomically so
+          tasks preempting each other never share a slot
+
+  @param  ring Ring to append to
+  @param  name Event name. Must have static storage duration
+  @param  phase Chrome trace phase of the event
+  @param  id Async event ID
+  @retval none
+*/
+static void append(Ring& ring, const char* name, Trace::Phase phase, uint32_t id)
+{
+  Trace::Event& event = ring.events[ring.head.fetch_add(1, std::memory_order_relaxed) % Trace::RING_LENGTH];
+  event.timestamp = esp_timer_get_time();
+  event.name = name;
+  event.task = xTaskGetCurrentTaskHandle();
+  event.id = id;
+  event.phase = phase;
+}
+
+/**
+  @brief  Append an event to the current core's ring
+
+  @param  name Event name. Must have static storage duration
+  @param  phase Chrome trace phase of the event
+  @param  id Async event ID
+  @retval none
+*/
+void Trace::record(const char* name, Phase phase, uint32_t id)
+{
+  Ring& ring = rings[xPortGetCoreID()];
+  if (ring.events == nullptr)
+    return;
+
+  append(ring, name, phase, id);
+}
+
+/**
+  @brief  Measure the average cost of recording an event. Events go to a
+          private ring so the live rings are left to tasks recording
+
+  @param  none
+  @retval uint32_t - Nanoseconds per event
+*/
+static uint32_t measure_overhead()
+{
+  constexpr uint32_t ITERATIONS = 256;
+
+  Ring ring;
+  ring.head = 0;
+  ring.events = new (std::nothrow) Trace::Event[Trace::RING_LENGTH]();
+  if (ring.events == nullptr)
+    return 0;
+
+  int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < ITERATIONS; i++)
+  {
+    if (Trace::enabled.load(std::memory_order_relaxed) && rings[xPortGetCoreID()].events != nullptr)
+      append(ring, "overhead", Trace::Phase::Begin, 0);
+  }
+  int64_t end = esp_timer_get_time();
+
+  delete[] ring.events;
+
+  return (end - start) * 1000 / ITERATIONS;
+}
+
+/**
+  @brief  Enable or disable tracing. Ring buffers are allocated on first use
+
+  @param  enable Enable tracing
+  @retval bool - Tracing is enabled
+*/
+bool Trace::enable(bool enable)
+{
+  if (!enable)
+  {
+    enabled = false;
+    return false;
+  }
+
+  for (Ring& ring : rings)
+  {
+    if (ring.events != nullptr)
+      continue;
+
+    ring.events = new (std::nothrow) Event[RING_LENGTH]();
+    if (ring.events == nullptr)
+    {
+      ESP_LOGE(TAG, "Failed to allocate trace ring.");
+      return false;
+    }
+  }
+
+  if (!enabled)
+  {
+    enabled = true;
+    overhead_ns = measure_overhead();
+
+    ESP_LOGI(TAG, "Tracing enabled. %u ns per event.", overhead_ns);
+  }
+
+  return true;
+}
+
+/**
+  @brief  Render the contents of the rings in Chrome trace event JSON format
+
+  @param  none
+  @retval std::string
+*/
+std::string Trace::render()
+{
+  const uint32_t now = esp_timer_get_time();
+
+  // Collect events from every ring while tasks keep recording. Slots
+  // claimed during the copy may have been torn, so they're dropped
+  std::vector<Event> events;
+  for (Ring& ring : rings)
+  {
+    if (ring.events == nullptr)
+      continue;
+
+    const uint32_t head = ring.head.load(std::memory_order_acquire);
+    const uint32_t count = std::min<uint32_t>(head, RING_LENGTH);
+    const size_t first = events.size();
+    events.insert(events.end(), ring.events, ring.events + count);
+
+    const uint32_t claimed = std::min<uint32_t>(ring.head.load(std::memory_order_acquire) - head, RING_LENGTH);
+    for (uint32_t i = 0; i < claimed; i++)
+    {
+      const uint32_t slot = (head + i) % RING_LENGTH;
+      if (slot < count)
+        events[first + slot].name = nullptr;
+    }
+
+    events.erase(std::remove_if(events.begin() + first, events.end(), [](const Event& event) { return event.name == nullptr; }), events.end());
+  }
+
+  // Sort oldest first. Age handles timestamp wrap
+  std::sort(events.begin(), events.end(), [now](const Event& a, const Event& b) {
+    return (now - a.timestamp) > (now - b.timestamp);
+  });
+
+  std::string json = "{\"traceEvents\":[";
+
+  // Name each task's track
+  std::vector<TaskHandle_t> tasks;
+  for (const Event& event : events)
+  {
+    if (std::find(tasks.begin(), tasks.end(), event.task) != tasks.end())
+      continue;
+
+    tasks.push_back(event.task);
+
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), R"({"name":"thread_name","ph":"M","pid":0,"tid":%u,"args":{"name":"%s"}},)", (uint32_t) (uintptr_t) event.task, pcTaskGetTaskName(event.task));
+    json += buffer;
+  }
+
+  for (const Event& event : events)
+  {
+    char buffer[160];
+    if (event.phase == Phase::AsyncBegin || event.phase == Phase::AsyncEnd)
+      snprintf(buffer, sizeof(buffer), R"({"name":"%s","cat":"async","ph":"%c","id":"0x%x","ts":%u,"pid":0,"tid":%u},)", event.name, (char) event.phase, event.id, event.timestamp, (uint32_t) (uintptr_t) event.task);
+    else
+      snprintf(buffer, sizeof(buffer), R"({"name":"%s","ph":"%c","ts":%u,"pid":0,"tid":%u},)", event.name, (char) event.phase, event.timestamp, (uint32_t) (uintptr_t) event.task);
+
+    json += buffer;
+  }
+
+  // Remove trailing comma
+  if (json.back() == ',')
+    json.pop_back();
+
+  json += "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"overhead_ns_per_event\":" + std::to_string(overhead_ns) + "}}";
+  return json;
+}
\ No newline at end of file
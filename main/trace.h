@@ -0,0 +1,76 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <atomic>
+#include <string>
+
+namespace Trace
+{
+  constexpr size_t RING_LENGTH = 512; // Events per core. 8 kB per core while enabled
+
+  // Chrome trace event phases
+  enum class Phase : char
+  {
+    Begin = 'B',
+    End = 'E',
+    AsyncBegin = 'b',
+    AsyncEnd = 'e',
+    Instant = 'i',
+  };
+
+  struct Event
+  {
+    uint32_t timestamp; // Microseconds since boot, wraps every ~71 minutes
+    const char* name;   // Must have static storage duration
+    TaskHandle_t task;
+    uint32_t id;        // Async event ID
+    Phase phase;
+  };
+
+  extern std::atomic<bool> enabled;
+
+  void record(const char* name, Phase phase, uint32_t id = 0);
+
+  inline void begin(const char* name)
+  {
+    if (enabled.load(std::memory_order_relaxed))
+      record(name, Phase::Begin);
+  }
+
+  inline void end(const char* name)
+  {
+    if (enabled.load(std::memory_order_relaxed))
+      record(name, Phase::End);
+  }
+
+  inline void async_begin(const char* name, const void* id)
+  {
+    if (enabled.load(std::memory_order_relaxed))
+      record(name, Phase::AsyncBegin, (uint32_t) (uintptr_t) id);
+  }
+
+  inline void async_end(const char* name, const void* id)
+  {
+    if (enabled.load(std::memory_order_relaxed))
+      record(name, Phase::AsyncEnd, (uint32_t) (uintptr_t) id);
+  }
+
+  // Record a begin and end event for the lifetime of the object
+  class Scope
+  {
+    public:
+      Scope(const char* name) : name(name) { begin(name); }
+      ~Scope() { end(name); }
+
+    private:
+      const char* const name;
+  };
+
+  bool enable(bool enable);
+  std::string render(void);
+}
+
+#endif
\ No newline at end of file
@@ -5,6 +5,36 @@
 
 namespace UPNP
 {
+  constexpr const char* AV_TRANSPORT_SERVICE = "urn:schemas-upnp-org:service:AVTransport:1";
+  constexpr const char* CONNECTION_MANAGER_SERVICE = "urn:schemas-upnp-org:service:ConnectionManager:1";
+
+  /**
+    @brief  Escape the XML special characters in a string
+
+    @param  string String to escape
+    @retval std::string
+  */
+  inline std::string escape_xml(const std::string& string)
+  {
+    std::string escaped;
+    escaped.reserve(string.length());
+
+    for (char c : string)
+    {
+      switch (c)
+      {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        case '\'': escaped += "&apos;"; break;
+        default: escaped += c; break;
+      }
+    }
+
+    return escaped;
+  }
+
   class Action
   {
     public:
@@ -13,7 +43,7 @@ namespace UPNP
       std::string headers() const
       {
         std::string headers = R"(Content-Type: text/xml;charset="utf-8")" "\r\n";
-        headers += R"(SOAPAction: "urn:schemas-upnp-org:service:AVTransport:1#)" + this->name + "\"\r\n";
+        headers += "SOAPAction: \"" + this->service + "#" + this->name + "\"\r\n";
 
         return headers;
       }
@@ -31,9 +61,10 @@ namespace UPNP
 
     protected:
       const std::string name;
+      const std::string service;
 
-      Action(const std::string& name) : name(name) {}
-      Action(const char* name) : name(name) {}
+      Action(const std::string& name, const std::string& service = AV_TRANSPORT_SERVICE) : name(name), service(service) {}
+      Action(const char* name, const char* service = AV_TRANSPORT_SERVICE) : name(name), service(service) {}
 
       virtual std::string soap_body() const = 0;
   };
@@ -42,8 +73,9 @@ namespace UPNP
   {
     public:
       std::string uri;
+      std::string metadata;
 
-      SetAvTransportUriAction(const std::string& uri) : Action("SetAVTransportURI"), uri(uri) {}
+      SetAvTransportUriAction(const std::string& uri, const std::string& metadata = "") : Action("SetAVTransportURI"), uri(uri), metadata(metadata) {}
       SetAvTransportUriAction(const char* uri) : Action("SetAVTransportURI"), uri(uri) {}
     
     private:
@@ -51,8 +83,8 @@ namespace UPNP
       {
         std::string body = R"(<u:SetAVTransportURI xmlns:u="urn:schemas-upnp-org:service:AVTransport:1">)";
         body += "<InstanceID>" + std::to_string(this->instance_id) + "</InstanceID>";
-        body += "<CurrentURI>" + this->uri + "</CurrentURI>";
-        body += "<CurrentURIMetaData></CurrentURIMetaData>";
+        body += "<CurrentURI>" + escape_xml(this->uri) + "</CurrentURI>";
+        body += "<CurrentURIMetaData>" + escape_xml(this->metadata) + "</CurrentURIMetaData>";
         body += "</u:SetAVTransportURI>";
         return body;
       }
@@ -90,6 +122,18 @@ namespace UPNP
         return body;
       }
   };
+
+  class GetProtocolInfoAction : public Action
+  {
+    public:
+      GetProtocolInfoAction() : Action("GetProtocolInfo", CONNECTION_MANAGER_SERVICE) {}
+
+    private:
+      std::string soap_body() const
+      {
+        return R"(<u:GetProtocolInfo xmlns:u="urn:schemas-upnp-org:service:ConnectionManager:1"></u:GetProtocolInfo>)";
+      }
+  };
 }
 
 #endif
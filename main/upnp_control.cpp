@@ -1,24 +1,39 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
 #include "lwip/igmp.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <string>
 #include <map>
+#include <vector>
 
+#include "dlna.h"
+#include "http.h"
+#include "i2s_interface.h"
+#include "metrics.h"
 #include "upnp_control.h"
 #include "upnp.h"
 #include "upnp_renderer.h"
 #include "mongoose.h"
 #include "nvs_interface.h"
+#include "system.h"
+#include "trace.h"
 #include "tinyxml2.h"
 
 #define TAG "UPNP"
 
-static QueueHandle_t event_queue;
+// Failed GetProtocolInfo queries before a renderer is left on the fallback stream
+static constexpr uint8_t MAX_PROTOCOL_INFO_FAILURES = 3;
+
+static std::atomic<uint32_t> pending_events;
+static sock_t wakeup_socket = INVALID_SOCKET;
+static std::atomic<int64_t> play_request_time;
 static UpnpControl::renderer_map_t discovered_renderers;
 static SemaphoreHandle_t renderer_mutex;
 
@@ -84,14 +99,15 @@ std::string find_icon_url(const tinyxml2::XMLElement* device)
 }
 
 /**
-  @brief  Find a device's control URL for the AVTransport service
+  @brief  Find a device's control URL for a service
   
   @param  device XML device description
+  @param  type UPNP service type to search for
   @retval std::string
 */
-std::string find_control_url(const tinyxml2::XMLElement* device)
+std::string find_control_url(const tinyxml2::XMLElement* device, const std::string& type)
 {
-  // Grab service list to search for AVTransport
+  // Grab service list to search for the service
   const tinyxml2::XMLElement* service_list = device->FirstChildElement("serviceList");
   if (service_list == nullptr)
   {
@@ -104,9 +120,9 @@ std::string find_control_url(const tinyxml2::XMLElement* device)
   while (service != nullptr)
   {
     const tinyxml2::XMLElement* service_type = service->FirstChildElement("serviceType");
-    if (service_type == nullptr || std::string(service_type->GetText()).compare("urn:schemas-upnp-org:service:AVTransport:1") != 0)
+    if (service_type == nullptr || std::string(service_type->GetText()).compare(type) != 0)
     {
-      // Can't find serviceType element, or not AVTransport service
+      // Can't find serviceType element, or not the requested service
       service = service->NextSiblingElement();
       continue;
     }
@@ -241,12 +257,15 @@ UPNP::Renderer parse_description(const std::string& host, const std::string& des
   }
   
   // Extract the control URL from the AVTransport service
-  std::string control_url = find_control_url(device);
+  std::string control_url = find_control_url(device, UPNP::AV_TRANSPORT_SERVICE);
   if (control_url.empty())
   {
     ESP_LOGE(TAG, "Could not find control URL for AVTransport service.");
     return UPNP::Renderer();
   }
+
+  // ConnectionManager is optional. Without it we can't negotiate a format
+  std::string connection_manager_url = find_control_url(device, UPNP::CONNECTION_MANAGER_SERVICE);
   
   // Attempt to fetch icon URL
   std::string icon_url = find_icon_url(device);
@@ -273,16 +292,266 @@ UPNP::Renderer parse_description(const std::string& host, const std::string& des
   if (icon_url.front() == '/')
     icon_url.erase(icon_url.begin());
 
+  // Remove leading slash
+  if (!connection_manager_url.empty() && connection_manager_url.front() == '/')
+    connection_manager_url.erase(connection_manager_url.begin());
+
   UPNP::Renderer renderer(uuid, name);
 
   // Combine relative urls with base
   renderer.control_url = base_url + "/" + control_url;
   renderer.icon_url = base_url + "/" + icon_url;
 
+  if (!connection_manager_url.empty())
+    renderer.connection_manager_url = base_url + "/" + connection_manager_url;
+
   return renderer;
 }
 }
 
+namespace SOAP
+{
+/**
+  @brief  Recursively search for the first element with a matching name,
+          ignoring any namespace prefix
+  
+  @param  element Element to search the children of
+  @param  name Local name of the element to find
+  @retval tinyxml2::XMLElement*
+*/
+const tinyxml2::XMLElement* find_element_by_name(const tinyxml2::XMLElement* element, const char* name)
+{
+  const tinyxml2::XMLElement* child = element->FirstChildElement();
+  while (child != nullptr)
+  {
+    // Strip the namespace prefix
+    const char* local_name = strchr(child->Name(), ':');
+    local_name = (local_name == nullptr) ? child->Name() : local_name + 1;
+
+    if (strcmp(local_name, name) == 0)
+      return child;
+
+    const tinyxml2::XMLElement* match = find_element_by_name(child, name);
+    if (match != nullptr)
+      return match;
+
+    child = child->NextSiblingElement();
+  }
+
+  return nullptr;
+}
+
+/**
+  @brief  Parse the Sink protocols from a GetProtocolInfo response
+  
+  @param  response SOAP response received from the renderer
+  @retval std::vector<std::string>
+*/
+std::vector<std::string> parse_sink_protocols(const std::string& response)
+{
+  std::vector<std::string> protocols;
+
+  // Build the XML document
+  tinyxml2::XMLDocument xml_document;
+  xml_document.Parse(response.c_str());
+
+  const tinyxml2::XMLElement* root = xml_document.RootElement();
+  if (root == nullptr)
+  {
+    ESP_LOGE(TAG, "Invalid GetProtocolInfo XML. No root element.");
+    return protocols;
+  }
+
+  const tinyxml2::XMLElement* sink = find_element_by_name(root, "Sink");
+  if (sink == nullptr || sink->GetText() == nullptr)
+  {
+    ESP_LOGW(TAG, "No Sink protocols in GetProtocolInfo response.");
+    return protocols;
+  }
+
+  // Split the comma separated list and trim whitespace
+  std::string list(sink->GetText());
+  size_t start = 0;
+  while (start < list.length())
+  {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.length();
+
+    size_t first = list.find_first_not_of(" \t\r\n", start);
+    size_t last = list.find_last_not_of(" \t\r\n", end - 1);
+    if (first != std::string::npos && first < end && last >= first)
+      protocols.push_back(list.substr(first, last - first + 1));
+
+    start = end + 1;
+  }
+
+  return protocols;
+}
+}
+
+namespace Negotiation
+{
+// Stream and channel count chosen for a renderer
+struct Selection
+{
+  const HTTP::StreamConfig& config;
+  uint8_t channels;
+
+  // Mono streams are requested as the downmix, which is exact for mono sources
+  std::string path() const
+  {
+    return std::string(config.path) + ((channels == 1) ? "?channels=1" : "");
+  }
+};
+
+/**
+  @brief  Split a MIME type into its lower case base type and parameters
+  
+  @param  mime_type MIME type e.g. audio/L16;rate=48000;channels=2
+  @param  parameters Map to store parameters in
+  @retval std::string - Base type
+*/
+std::string split_mime_type(const std::string& mime_type, std::map<std::string, std::string>& parameters)
+{
+  size_t end = mime_type.find(';');
+  std::string base = mime_type.substr(0, end);
+  std::transform(base.begin(), base.end(), base.begin(), ::tolower);
+
+  while (end != std::string::npos)
+  {
+    size_t start = end + 1;
+    end = mime_type.find(';', start);
+
+    std::string parameter = mime_type.substr(start, (end == std::string::npos) ? std::string::npos : end - start);
+    size_t equals = parameter.find('=');
+    if (equals == std::string::npos)
+      continue;
+
+    std::string key = parameter.substr(0, equals);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    parameters[key] = parameter.substr(equals + 1);
+  }
+
+  // Normalize the many names of WAV
+  if (base == "audio/x-wav" || base == "audio/wave" || base == "audio/vnd.wave")
+    base = "audio/wav";
+
+  return base;
+}
+
+/**
+  @brief  Check if a renderer Sink protocol can play a stream
+  
+  @param  protocol Sink protocolInfo e.g. http-get:*:audio/wav:*
+  @param  config Stream to check
+  @param  sample_rate Rate the stream would be sent at
+  @param  channel_count Channels the stream would carry
+  @retval bool
+*/
+bool supports(const std::string& protocol, const HTTP::StreamConfig& config, uint32_t sample_rate, uint8_t channel_count)
+{
+  // protocolInfo is <protocol>:<network>:<contentFormat>:<additionalInfo>
+  size_t network = protocol.find(':');
+  size_t format = (network == std::string::npos) ? network : protocol.find(':', network + 1);
+  size_t info = (format == std::string::npos) ? format : protocol.find(':', format + 1);
+  if (info == std::string::npos)
+    return false;
+
+  if (protocol.compare(0, network, "http-get") != 0)
+    return false;
+
+  std::map<std::string, std::string> sink_parameters;
+  std::string sink_type = split_mime_type(protocol.substr(format + 1, info - format - 1), sink_parameters);
+  if (sink_type == "*")
+    return true;
+
+  std::map<std::string, std::string> stream_parameters;
+  if (sink_type != split_mime_type(config.mime_type(sample_rate, channel_count), stream_parameters))
+    return false;
+
+  // Any rate or channels the sink specifies must match the stream
+  auto rate = sink_parameters.find("rate");
+  if (rate != sink_parameters.end() && std::strtoul(rate->second.c_str(), nullptr, 10) != sample_rate)
+    return false;
+
+  auto channels = sink_parameters.find("channels");
+  if (channels != sink_parameters.end() && std::strtoul(channels->second.c_str(), nullptr, 10) != channel_count)
+    return false;
+
+  return true;
+}
+
+/**
+  @brief  Select the lowest bitrate stream supported by a renderer that
+          carries the full capture depth, or the lowest bitrate stream
+          supported at all. Mono sources are offered as mono streams,
+          stereo sources as the downmix only if no stereo stream plays
+  
+  @param  renderer Renderer to select a stream for
+  @retval Selection
+*/
+Selection select_stream(const UPNP::Renderer& renderer)
+{
+  const std::vector<HTTP::StreamConfig>& configs = HTTP::get_stream_configs();
+
+  // Use the default stream if the renderer didn't tell us what it supports
+  if (renderer.sink_protocols.empty())
+    return {configs.front(), 2};
+
+  // Streams carry at most 24 bits
+  const uint8_t depth = std::min<uint8_t>(System::get_bits_per_sample(), 24);
+  const uint32_t sample_rate = I2S::get_sample_rate();
+  const uint8_t min_channels = System::is_mono_source() ? 1 : 2;
+
+  const HTTP::StreamConfig* selected = nullptr;
+  uint8_t selected_channels = 2;
+  for (uint8_t lowest = min_channels; lowest >= 1 && selected == nullptr; lowest--)
+  {
+    for (bool lossless : {true, false})
+    {
+      for (const HTTP::StreamConfig& config : configs)
+      {
+        // Renderers play the program
+        if (config.input != 0)
+          continue;
+
+        for (uint8_t channels = lowest; channels <= 2; channels++)
+        {
+          // Only consider streams cheaper than the current choice
+          if (selected != nullptr && config.bitrate(sample_rate, channels) >= selected->bitrate(sample_rate, selected_channels))
+            continue;
+
+          if (lossless && config.bits_per_sample < depth)
+            continue;
+
+          for (const std::string& protocol : renderer.sink_protocols)
+          {
+            if (supports(protocol, config, sample_rate, channels))
+            {
+              selected = &config;
+              selected_channels = channels;
+              break;
+            }
+          }
+        }
+      }
+
+      if (selected != nullptr)
+        break;
+    }
+  }
+
+  if (selected == nullptr)
+  {
+    ESP_LOGW(TAG, "No supported stream found for '%s'. Using default.", renderer.name.c_str());
+    return {configs.front(), 2};
+  }
+
+  return {*selected, selected_channels};
+}
+}
+
 /**
   @brief  Convert a mg_str to std::string
   
@@ -294,6 +563,214 @@ static inline std::string mg_str_string(const mg_str* s)
   return (s == nullptr) ? std::string() : std::string(s->p, s->len);
 }
 
+// Index of each SOAP action's metrics
+enum ActionMetric
+{
+  SET_AV_TRANSPORT_URI,
+  PLAY,
+  STOP,
+  GET_PROTOCOL_INFO,
+};
+
+static const char* const action_names[] = {"SetAVTransportURI", "Play", "Stop", "GetProtocolInfo"};
+
+static Metrics::Counter action_counts[] =
+{
+  {"upnp_actions_total", "SOAP actions sent.", "action=\"SetAVTransportURI\""},
+  {"upnp_actions_total", "SOAP actions sent.", "action=\"Play\""},
+  {"upnp_actions_total", "SOAP actions sent.", "action=\"Stop\""},
+  {"upnp_actions_total", "SOAP actions sent.", "action=\"GetProtocolInfo\""},
+};
+
+static Metrics::Counter action_failures[] =
+{
+  {"upnp_action_failures_total", "SOAP actions that failed or got no reply.", "action=\"SetAVTransportURI\""},
+  {"upnp_action_failures_total", "SOAP actions that failed or got no reply.", "action=\"Play\""},
+  {"upnp_action_failures_total", "SOAP actions that failed or got no reply.", "action=\"Stop\""},
+  {"upnp_action_failures_total", "SOAP actions that failed or got no reply.", "action=\"GetProtocolInfo\""},
+};
+
+static Metrics::Histogram action_latency[] =
+{
+  {"upnp_action_duration_ms", "Time from sending a SOAP action to its reply.", {10, 25, 50, 100, 250, 500, 1000, 2500, 5000}, "action=\"SetAVTransportURI\""},
+  {"upnp_action_duration_ms", "Time from sending a SOAP action to its reply.", {10, 25, 50, 100, 250, 500, 1000, 2500, 5000}, "action=\"Play\""},
+  {"upnp_action_duration_ms", "Time from sending a SOAP action to its reply.", {10, 25, 50, 100, 250, 500, 1000, 2500, 5000}, "action=\"Stop\""},
+  {"upnp_action_duration_ms", "Time from sending a SOAP action to its reply.", {10, 25, 50, 100, 250, 500, 1000, 2500, 5000}, "action=\"GetProtocolInfo\""},
+};
+
+// Detection to Play latency, from the request that started playback until each renderer acknowledged Play
+static Metrics::Histogram play_latency("upnp_play_latency_ms", "Time from a playback request until a renderer acknowledged Play.", {50, 100, 250, 500, 1000, 2500, 5000, 10000});
+
+static Metrics::Counter ssdp_notify_count("upnp_ssdp_packets_total", "SSDP packets received.", "type=\"notify\"");
+static Metrics::Counter ssdp_response_count("upnp_ssdp_packets_total", "SSDP packets received.", "type=\"search_response\"");
+static Metrics::Counter ssdp_search_count("upnp_ssdp_searches_total", "M-SEARCH bursts sent.");
+static Metrics::Counter description_fetch_count("upnp_description_fetches_total", "Device descriptions requested.");
+
+// Context carried by each outstanding SOAP action
+struct ActionRequest
+{
+  const ActionMetric metric;
+  const std::string data; // Handler specific. e.g. control URL or renderer UUID
+  const int64_t start_time;
+  bool replied;
+};
+
+/**
+  @brief  Send a SOAP action to a renderer. The handler receives an
+          ActionRequest as user_data and must call finish_action on close
+  
+  @param  manager Mongoose manager to send the request from
+  @param  url Control URL of the service
+  @param  action Action to send
+  @param  metric Metrics to record the action in
+  @param  handler Mongoose event handler for the reply
+  @param  data Handler specific data
+  @retval bool - Request was started
+*/
+static bool send_action(struct mg_mgr* manager, const std::string& url, const UPNP::Action& action, ActionMetric metric, mg_event_handler_t handler, const std::string& data = std::string())
+{
+  ActionRequest* request = new ActionRequest{metric, data, esp_timer_get_time(), false};
+
+  action_counts[metric].increment();
+
+  if (mg_connect_http(manager, handler, request, url.c_str(), action.headers().c_str(), action.body().c_str()) == nullptr)
+  {
+    ESP_LOGE(TAG, "Failed to send %s action to %s.", action_names[metric], url.c_str());
+    action_failures[metric].increment();
+    delete request;
+    return false;
+  }
+
+  Trace::async_begin(action_names[metric], request);
+
+  return true;
+}
+
+/**
+  @brief  Record the reply to a SOAP action
+  
+  @param  request Request the reply belongs to
+  @param  hm HTTP reply message
+  @retval bool - Action succeeded
+*/
+static bool complete_action(ActionRequest* request, const struct http_message* hm)
+{
+  request->replied = true;
+  action_latency[request->metric].observe((esp_timer_get_time() - request->start_time) / 1000);
+
+  if (hm->resp_code == 200)
+    return true;
+
+  ESP_LOGE(TAG, "Failed %s action. Code: %d Response: %s.", action_names[request->metric], hm->resp_code, mg_str_string(&hm->resp_status_msg).c_str());
+  action_failures[request->metric].increment();
+  return false;
+}
+
+/**
+  @brief  Free a SOAP action request once its connection closes
+  
+  @param  nc Mongoose connection
+  @param  request Request to free
+  @retval none
+*/
+static void finish_action(struct mg_connection* nc, ActionRequest* request)
+{
+  if (request == nullptr)
+    return;
+
+  if (!request->replied)
+  {
+    ESP_LOGE(TAG, "No reply to %s action.", action_names[request->metric]);
+    action_failures[request->metric].increment();
+  }
+
+  Trace::async_end(action_names[request->metric], request);
+
+  delete request;
+  nc->user_data = nullptr;
+}
+
+/**
+  @brief  Allow the sink protocols of a renderer to be queried again after
+          a query failed or got no reply, up to MAX_PROTOCOL_INFO_FAILURES
+  
+  @param  uuid UUID of the renderer
+  @retval none
+*/
+static void retry_sink_protocols(const std::string& uuid)
+{
+  xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+  auto it = discovered_renderers.find(uuid);
+  if (it != discovered_renderers.end() && it->second.sink_protocols.empty())
+  {
+    it->second.sink_protocol_failures++;
+    it->second.sink_protocols_requested = false;
+
+    if (it->second.sink_protocol_failures >= MAX_PROTOCOL_INFO_FAILURES)
+      ESP_LOGW(TAG, "'%s' gave no sink protocols. Using the fallback stream.", it->second.name.c_str());
+  }
+
+  xSemaphoreGive(renderer_mutex);
+}
+
+/**
+  @brief  Mongoose event handler for GetProtocolInfo responses
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void protocolInfoEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  // Extract the request from the user_data pointer. It holds the renderer UUID
+  ActionRequest* request = (ActionRequest*) user_data;
+
+  switch(ev)
+  {
+    case MG_EV_HTTP_REPLY:
+    {
+      struct http_message* hm = (struct http_message*) ev_data;
+
+      if (!complete_action(request, hm))
+      {
+        retry_sink_protocols(request->data);
+        return;
+      }
+
+      std::vector<std::string> protocols = SOAP::parse_sink_protocols(mg_str_string(&hm->body));
+
+      // Cache the protocols in the renderer
+      xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+      auto it = discovered_renderers.find(request->data);
+      if (it != discovered_renderers.end())
+      {
+        it->second.sink_protocols = protocols;
+
+        ESP_LOGI(TAG, "'%s' supports %d sink protocols. Selected %s stream.", it->second.name.c_str(), protocols.size(), Negotiation::select_stream(it->second).config.name);
+      }
+
+      xSemaphoreGive(renderer_mutex);
+      break;
+    }
+
+    case MG_EV_CLOSE:
+    {
+      // Timed out or closed without a reply
+      if (request != nullptr && !request->replied)
+        retry_sink_protocols(request->data);
+      finish_action(nc, request);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
 /**
   @brief  Mongoose event handler for SSDP description events
   
@@ -313,6 +790,9 @@ static void ssdpDescriptionEventHandler(struct mg_connection* nc, int ev, void*
       mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
       std::string host = std::string(addr);
 
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr), MG_SOCK_STRINGIFY_IP);
+      const std::string address = std::string(addr);
+
       struct http_message* hm = (struct http_message*) ev_data;
       const std::string description = std::string(hm->body.p, hm->body.len);
 
@@ -336,10 +816,20 @@ static void ssdpDescriptionEventHandler(struct mg_connection* nc, int ev, void*
       // Update name, control and icon URLs
       it->second.name = renderer.name;
       it->second.control_url = renderer.control_url;
+      it->second.connection_manager_url = renderer.connection_manager_url;
       it->second.icon_url = renderer.icon_url;
+      it->second.address = address;
+
+      // Query the supported formats until they're known. Failed queries
+      // are retried on later descriptions a few times
+      bool query_protocols = !it->second.sink_protocols_requested && it->second.sink_protocol_failures < MAX_PROTOCOL_INFO_FAILURES && !renderer.connection_manager_url.empty();
+      it->second.sink_protocols_requested |= query_protocols;
 
       xSemaphoreGive(renderer_mutex);
 
+      if (query_protocols && !send_action(nc->mgr, renderer.connection_manager_url, UPNP::GetProtocolInfoAction(), GET_PROTOCOL_INFO, protocolInfoEventHandler, renderer.uuid))
+        retry_sink_protocols(renderer.uuid);
+
       break;
     }
 
@@ -389,6 +879,8 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
       // Ignore anything but NOTIFY messages
       if (mg_vcasecmp(&hm->method, "NOTIFY") != 0)
         return;
+
+      ssdp_notify_count.increment();
       
       // Ignore advertisements not matching our search target
       struct mg_str* NT = mg_get_http_header(hm, "NT");
@@ -443,6 +935,7 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
       }
 
       // Fetch description xml
+      description_fetch_count.increment();
       mg_connect_http(nc->mgr, ssdpDescriptionEventHandler, nullptr, location.c_str(), nullptr, nullptr);
 
       break;
@@ -465,6 +958,8 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
 
       struct http_message* hm = (struct http_message *) ev_data;
 
+      ssdp_response_count.increment();
+
       ESP_LOGD(TAG, "SSDP/HTTP Response: %s", std::string(hm->message.p, hm->body.p).c_str());
       
       // Ignore bad responses
@@ -513,6 +1008,7 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
       }
 
       // Fetch description xml
+      description_fetch_count.increment();
       mg_connect_http(nc->mgr, ssdpDescriptionEventHandler, nullptr, location.c_str(), nullptr, nullptr);
 
       break;
@@ -532,6 +1028,7 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
       mg_set_timer(nc, mg_time() + 360);
 
       ESP_LOGI(TAG, "Sending M-SEARCH.");
+      ssdp_search_count.increment();
 
       // Create a outbound UDP socket
       struct mg_connection* search = mg_connect(nc->mgr, "udp://239.255.255.250:1900", ssdpDiscoveryEventHandler, nullptr);
@@ -559,6 +1056,236 @@ static void ssdpDiscoveryEventHandler(struct mg_connection* nc, int ev, void* ev
   }
 }
 
+/**
+  @brief  Mongoose event handler for the wakeup socket
+  
+  @param  nc Mongoose connection
+  @param  ev Mongoose event calling the function
+  @param  ev_data Event data pointer
+  @param  user_data User data pointer
+  @retval none
+*/
+static void wakeupEventHandler(struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+{
+  // Data only exists to break mg_mgr_poll out of select. Discard it
+  if (ev == MG_EV_RECV)
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+}
+
+/**
+  @brief  Create a loopback UDP socket connected to itself and add it to the
+          manager so other tasks can wake the poll loop immediately
+  
+  @param  manager Mongoose manager to wake
+  @retval bool - Socket was created
+*/
+static bool create_wakeup_socket(struct mg_mgr* manager)
+{
+  sock_t sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == INVALID_SOCKET)
+    return false;
+
+  // Bind to an ephemeral loopback port
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(addr);
+
+  // Connect the socket to itself so a plain send() lands in its own receive buffer
+  if (bind(sock, (struct sockaddr*) &addr, length) != 0 ||
+      getsockname(sock, (struct sockaddr*) &addr, &length) != 0 ||
+      connect(sock, (struct sockaddr*) &addr, length) != 0)
+  {
+    closesocket(sock);
+    return false;
+  }
+
+  if (mg_add_sock(manager, sock, wakeupEventHandler, nullptr) == nullptr)
+  {
+    closesocket(sock);
+    return false;
+  }
+
+  wakeup_socket = sock;
+  return true;
+}
+
+/**
+  @brief  Select the renderers stored in NVS for playback
+  
+  @param  none
+  @retval none
+*/
+static void select_renderers()
+{
+  // Update selected renderers
+  std::map<std::string, std::string> nvs_renderers = NVS::get_renderers();
+
+  // Lock the renderer list
+  xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+  // Deselect all known renderers
+  for (auto& kv : discovered_renderers)
+    kv.second.selected = false;
+
+  // Select all renderers saved in NVS
+  for (const auto& kv : nvs_renderers)
+  {
+    const std::string& uuid = kv.first;
+    const std::string& name = kv.second;
+
+    auto it = discovered_renderers.emplace(uuid, UPNP::Renderer(uuid, name)).first;
+    it->second.selected = true;
+
+    ESP_LOGI(TAG, "Selected '%s' for playback.", it->second.name.c_str());
+  }
+
+  xSemaphoreGive(renderer_mutex);
+}
+
+/**
+  @brief  Start playback on the selected renderers
+  
+  @param  manager Mongoose manager to send requests from
+  @retval none
+*/
+static void send_play_action(struct mg_mgr* manager)
+{
+  // Build URI for the stream
+  esp_netif_ip_info_t info;
+  esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"), &info);
+
+  char buffer[20] = {0};
+  std::string host = "http://" + std::string(esp_ip4addr_ntoa(&info.ip, buffer, sizeof(buffer)));
+  if (HTTP::PORT != 80)
+    host += ":" + std::to_string(HTTP::PORT);
+
+  // Mongoose handler to chain a Play action on success
+  auto event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+  {
+    // Extact the request from the user_data pointer. It holds the renderer control URL
+    ActionRequest* request = (ActionRequest*) user_data;
+
+    if (ev == MG_EV_CLOSE)
+    {
+      finish_action(nc, request);
+      return;
+    }
+
+    if (ev != MG_EV_HTTP_REPLY)
+      return;
+  
+    // Stop on bad response
+    if (!complete_action(request, (struct http_message*) ev_data))
+      return;
+
+    // Mongoose handler for play action
+    auto play_event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+    {
+      ActionRequest* request = (ActionRequest*) user_data;
+
+      if (ev == MG_EV_CLOSE)
+      {
+        finish_action(nc, request);
+        return;
+      }
+
+      if (ev != MG_EV_HTTP_REPLY)
+        return;
+      
+      if (!complete_action(request, (struct http_message*) ev_data))
+        return;
+
+      const int64_t latency_ms = (esp_timer_get_time() - play_request_time) / 1000;
+      play_latency.observe(latency_ms);
+
+      ESP_LOGI(TAG, "Play acknowledged %lld ms after request.", latency_ms);
+    };
+    
+    // Send play action to renderer
+    send_action(nc->mgr, request->data, UPNP::PlayAction(), PLAY, play_event_handler);
+
+    ESP_LOGI(TAG, "Play sent %lld ms after request.", (esp_timer_get_time() - play_request_time) / 1000);
+  };
+
+  xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+  for (const auto& kv : discovered_renderers)
+  {
+    const UPNP::Renderer& r = kv.second;
+    
+    // Ignore non-selected renderers
+    if (r.selected == false)
+      continue;
+    
+    // Send command if we have a valid control URL
+    if (r.control_url.empty())
+    {
+      ESP_LOGW(TAG, "No control URL for '%s'.", r.name.c_str());
+      continue;
+    }
+
+    // Pick the cheapest stream this renderer can play
+    const Negotiation::Selection selection = Negotiation::select_stream(r);
+    std::string uri = host + selection.path();
+
+    // Describe the stream so renderers can start without probing it first
+    std::string metadata = DLNA::didl_lite(CONFIG_LWIP_LOCAL_HOSTNAME, uri, DLNA::protocol_info(selection.config.mime_type(I2S::get_sample_rate(), selection.channels), selection.config.dlna_profile));
+
+    ESP_LOGI(TAG, "Starting %s%s playback on '%s'.", selection.config.name, (selection.channels == 1) ? " mono" : "", r.name.c_str());
+
+    // Construct and send the set URI action. Pass the control URL to chain the Play action
+    send_action(manager, r.control_url, UPNP::SetAvTransportUriAction(uri, metadata), SET_AV_TRANSPORT_URI, event_handler, r.control_url);
+  }
+
+  xSemaphoreGive(renderer_mutex);
+}
+
+/**
+  @brief  Stop playback on the selected renderers
+  
+  @param  manager Mongoose manager to send requests from
+  @retval none
+*/
+static void send_stop_action(struct mg_mgr* manager)
+{
+  // Mongoose handler. Yay lambdas
+  auto event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
+  {
+    ActionRequest* request = (ActionRequest*) user_data;
+
+    if (ev == MG_EV_CLOSE)
+      finish_action(nc, request);
+    else if (ev == MG_EV_HTTP_REPLY)
+      complete_action(request, (struct http_message*) ev_data);
+  };
+
+  xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+  for (const auto& kv : discovered_renderers)
+  {
+    const UPNP::Renderer& r = kv.second;
+
+    // Ignore non-selected renderers
+    if (r.selected == false)
+      continue;
+
+    if (r.control_url.empty())
+    {
+      ESP_LOGW(TAG, "No control URL for '%s'.", r.name.c_str());
+      continue;
+    }
+
+    ESP_LOGI(TAG, "Stopping playback on '%s'.", r.name.c_str());
+
+    // Send stop action to renderer
+    send_action(manager, r.control_url, UPNP::StopAction(), STOP, event_handler);
+  }
+
+  xSemaphoreGive(renderer_mutex);
+}
+
 /**
   @brief  Main task function of the UPNP control system
   
@@ -569,11 +1296,6 @@ void UpnpControl::task(void* pvParameters)
 {
   // Flag to indicate if control is enabled
   bool enabled = false;
-  
-  // Create an event group to run the main loop from
-  event_queue = xQueueCreate(UpnpControl::EVENT_QUEUE_LENGTH, sizeof(UpnpControl::Event));
-  if (event_queue == NULL)
-    ESP_LOGE(TAG, "Failed to create event queue.");
 
   // Create a mutex to lock renderer list access
   renderer_mutex = xSemaphoreCreateMutex();
@@ -584,6 +1306,10 @@ void UpnpControl::task(void* pvParameters)
   struct mg_mgr manager;
   mg_mgr_init(&manager, NULL);
 
+  // Create a socket so queued events can interrupt the poll
+  if (!create_wakeup_socket(&manager))
+    ESP_LOGE(TAG, "Failed to create wakeup socket. Events will be delayed.");
+
   // Bind the SSDP multicast address and port, enable HTTP parsing
   struct mg_connection* ssdp = mg_bind(&manager, "udp://239.255.255.250:1900", ssdpDiscoveryEventHandler, nullptr);
   mg_set_protocol_http_websocket(ssdp);
@@ -602,185 +1328,47 @@ void UpnpControl::task(void* pvParameters)
   // Loop waiting for events
   while(true)
   {
+    Trace::begin("UPnP poll");
     mg_mgr_poll(&manager, 1000);
+    Trace::end("UPnP poll");
 
-    UpnpControl::Event event;
-    if (xQueueReceive(event_queue, &event, 0) != pdTRUE)
+    // Grab and clear all pending events at once
+    uint32_t events = pending_events.exchange(0);
+    if (events == 0)
       continue;
 
-    switch (event)
-    {
-      case Event::Enable:
-        enabled = true;
-        ESP_LOGI(TAG, "Control enabled.");
-        break;
-
-      case Event::Disable:
-        enabled = false;
-        ESP_LOGI(TAG, "Control disabled.");
-        break;
-
-      case Event::UpdateSelectedRenderers:
-      {
-        // Update selected renderers
-        std::map<std::string, std::string> nvs_renderers = NVS::get_renderers();
-
-        // Lock the renderer list
-        xSemaphoreTake(renderer_mutex, portMAX_DELAY);
-
-        // Deselect all known renderers
-        for (auto& kv : discovered_renderers)
-          kv.second.selected = false;
-
-        // Select all renderers saved in NVS
-        for (const auto& kv : nvs_renderers)
-        {
-          const std::string& uuid = kv.first;
-          const std::string& name = kv.second;
-
-          auto it = discovered_renderers.emplace(uuid, UPNP::Renderer(uuid, name)).first;
-          it->second.selected = true;
-
-          ESP_LOGI(TAG, "Selected '%s' for playback.", it->second.name.c_str());
-        }
-
-        xSemaphoreGive(renderer_mutex);
-        break;
-      }
-
-      case Event::SendPlayAction:
-      {
-        if (!enabled)
-          break;
-
-        // Start playback on selected renderers
-
-        // Build URI for the stream
-        esp_netif_ip_info_t info;
-        esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"), &info);
-
-        char buffer[20] = {0};
-        std::string uri = "http://" + std::string(esp_ip4addr_ntoa(&info.ip, buffer, sizeof(buffer))) + "/stream.wav";
-
-        // Mongoose handler to chain a Play action on success
-        auto event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
-        {
-          if (ev != MG_EV_HTTP_REPLY)
-            return;
-        
-          struct http_message* hm = (struct http_message*) ev_data;
-            
-          // Throw error on bad response
-          if (hm->resp_code != 200)
-          {
-            ESP_LOGE(TAG, "Failed SetAvTransportUri action. Code: %d Response: %s.", hm->resp_code, mg_str_string(&hm->resp_status_msg).c_str());
-            return;
-          }
-
-          // Mongoose handler for play action
-          auto play_event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
-          {
-            if (ev != MG_EV_HTTP_REPLY)
-              return;
-            
-            struct http_message* hm = (struct http_message*) ev_data;
-            
-            if (hm->resp_code != 200)
-              ESP_LOGE(TAG, "Failed Play action. Code: %d Response: %s.", hm->resp_code, mg_str_string(&hm->resp_status_msg).c_str());
-          };
-
-          // Extact the renderer control url from the user_data pointer
-          const std::string* url = (const std::string*) user_data;
-          
-          // Send play action to renderer
-          UPNP::PlayAction play;
-          mg_connect_http(nc->mgr, play_event_handler, nullptr, url->c_str(), play.headers().c_str(), play.body().c_str());
-
-          // Free the control url
-          // TODO we could leak memory if we never get a reply
-          // Maybe free this on CLOSE instead
-          delete url;
-        };
-
-        xSemaphoreTake(renderer_mutex, portMAX_DELAY);
-
-        for (const auto& kv : discovered_renderers)
-        {
-          const UPNP::Renderer& r = kv.second;
-          
-          // Ignore non-selected renderers
-          if (r.selected == false)
-            continue;
-          
-          // Send command if we have a valid control URL
-          if (r.control_url.empty())
-          {
-            ESP_LOGW(TAG, "No control URL for '%s'.", r.name.c_str());
-            continue;
-          }
-
-          ESP_LOGI(TAG, "Starting playback on '%s'.", r.name.c_str());
+    // Only the net playback state matters. Queuing collapsed any enable/disable pairs
+    const bool was_enabled = enabled;
+    if (events & event_enable)
+      enabled = true;
+    else if (events & event_disable)
+      enabled = false;
 
-          // Allocate a string on the heap to pass as user_data
-          std::string* url = new std::string(r.control_url);
-
-          // Construct and send the set URI action
-          UPNP::SetAvTransportUriAction setUri(uri);
-          mg_connect_http(&manager, event_handler, url, r.control_url.c_str(), setUri.headers().c_str(), setUri.body().c_str());
-        }
-
-        xSemaphoreGive(renderer_mutex);
-        break;
-      }
+    if (enabled != was_enabled)
+      ESP_LOGI(TAG, "Control %s.", enabled ? "enabled" : "disabled");
 
-      case Event::SendStopAction:
-      {
-        if (!enabled)
-          break;
-
-        // Stop playback on selected renderers
-        
-        // Mongoose handler. Yay lambdas
-        auto event_handler = [](struct mg_connection* nc, int ev, void* ev_data, void* user_data)
-        {
-          if (ev != MG_EV_HTTP_REPLY)
-            return;
-          
-          struct http_message* hm = (struct http_message*) ev_data;
-          
-          if (hm->resp_code != 200)
-            ESP_LOGE(TAG, "Failed Stop action. Code: %d Response: %s.", hm->resp_code, mg_str_string(&hm->resp_status_msg).c_str());
-        };
-
-        xSemaphoreTake(renderer_mutex, portMAX_DELAY);
-
-        for (const auto& kv : discovered_renderers)
-        {
-          const UPNP::Renderer& r = kv.second;
-    
-          // Ignore non-selected renderers
-          if (r.selected == false)
-            continue;
-
-          if (r.control_url.empty())
-          {
-            ESP_LOGW(TAG, "No control URL for '%s'.", r.name.c_str());
-            continue;
-          }
-
-          ESP_LOGI(TAG, "Stopping playback on '%s'.", r.name.c_str());
-
-          // Send stop action to renderer
-          UPNP::StopAction stop;
-          mg_connect_http(&manager, event_handler, nullptr, r.control_url.c_str(), stop.headers().c_str(), stop.body().c_str());
-        }
+    if (events & event_update_selected_renderers)
+    {
+      // Stop the old selection, then restart playback on the new one
+      if (was_enabled)
+        send_stop_action(&manager);
 
-        xSemaphoreGive(renderer_mutex);
-        break;
-      }
+      select_renderers();
 
-      default:
-        break;
+      if (enabled)
+        send_play_action(&manager);
+    }
+    else if (enabled != was_enabled)
+    {
+      if (enabled)
+        send_play_action(&manager);
+      else
+        send_stop_action(&manager);
+    }
+    else if ((events & event_restart) && enabled)
+    {
+      // The old streams are gone. Set the URIs again so renderers reconnect
+      send_play_action(&manager);
     }
   }
 
@@ -791,15 +1379,23 @@ void UpnpControl::task(void* pvParameters)
 }
 
 /**
-  @brief  Queue an event on the UpnpControl queue
+  @brief  Merge an event into the pending events and wake the control task
   
-  @param  event Event to queue
+  @param  set Event bits to set
+  @param  clear Event bits to clear
   @retval none
 */
-static void queue_event(UpnpControl::Event event)
+static void queue_event(uint32_t set, uint32_t clear = 0)
 {
-  if (event_queue != NULL)
-    xQueueSendToBack(event_queue, &event, pdMS_TO_TICKS(10));
+  uint32_t events = pending_events.load();
+  while (!pending_events.compare_exchange_weak(events, (events & ~clear) | set));
+
+  // Only the first event since the last drain needs to wake the task
+  if (events == 0 && wakeup_socket != INVALID_SOCKET)
+  {
+    const uint8_t dummy = 0;
+    send(wakeup_socket, &dummy, sizeof(dummy), MSG_DONTWAIT);
+  }
 }
 
 /**
@@ -810,8 +1406,10 @@ static void queue_event(UpnpControl::Event event)
 */
 void UpnpControl::enable()
 {
-  queue_event(Event::Enable);
-  queue_event(Event::SendPlayAction);
+  play_request_time = esp_timer_get_time();
+
+  // Enable supersedes any pending disable
+  queue_event(event_enable, event_disable);
 }
 
 /**
@@ -822,8 +1420,8 @@ void UpnpControl::enable()
 */
 void UpnpControl::disable()
 {
-  queue_event(Event::SendStopAction);
-  queue_event(Event::Disable);
+  // Disable supersedes any pending enable
+  queue_event(event_disable, event_enable);
 }
 
 /**
@@ -834,14 +1432,24 @@ void UpnpControl::disable()
 */
 void UpnpControl::update_selected_renderers()
 {
-  // Stop existing renderers
-  queue_event(Event::SendStopAction);
+  play_request_time = esp_timer_get_time();
 
-  // Update renderers
-  queue_event(Event::UpdateSelectedRenderers);
+  // Stops existing renderers and resumes playback on the new ones if enabled
+  queue_event(event_update_selected_renderers);
+}
 
-  // Resume playback on new renderers
-  queue_event(Event::SendPlayAction);
+/**
+  @brief  Restart playback on the selected renderers with newly selected
+          streams if control is enabled. Used when the stream format changes
+  
+  @param  none
+  @retval none
+*/
+void UpnpControl::restart()
+{
+  play_request_time = esp_timer_get_time();
+
+  queue_event(event_restart);
 }
 
 /**
@@ -860,4 +1468,41 @@ UpnpControl::renderer_map_t UpnpControl::get_known_renderers()
   xSemaphoreGive(renderer_mutex);
 
   return renderers;
+}
+
+/**
+  @brief  Check if every selected renderer is still streaming from us
+
+  @param  none
+  @retval bool
+*/
+bool UpnpControl::renderers_streaming()
+{
+  if (renderer_mutex == nullptr)
+    return false;
+
+  std::vector<std::string> addresses;
+
+  xSemaphoreTake(renderer_mutex, portMAX_DELAY);
+
+  for (const auto& kv : discovered_renderers)
+  {
+    if (kv.second.selected)
+      addresses.push_back(kv.second.address);
+  }
+
+  xSemaphoreGive(renderer_mutex);
+
+  return HTTP::has_clients_from(addresses);
+}
+
+/**
+  @brief  Fetch the time of the last playback request
+  
+  @param  none
+  @retval int64_t Time in microseconds since boot
+*/
+int64_t UpnpControl::get_play_request_time()
+{
+  return play_request_time;
 }
\ No newline at end of file
@@ -8,27 +8,30 @@
 
 namespace UpnpControl
 {
-  constexpr int EVENT_QUEUE_LENGTH = 5;
-
-  enum class Event
+  typedef enum event_t
   {
-    Enable,
-    Disable,
-    UpdateSelectedRenderers,
-
-    // "Private" events
-    SendPlayAction,
-    SendStopAction,
-  };
+    event_enable                    = 1 << 0,
+    event_disable                   = 1 << 1,
+    event_update_selected_renderers = 1 << 2,
+    event_restart                   = 1 << 3,
+  } event_t;
 
   void task(void* pvParameters);
   void enable();
   void disable();
   void update_selected_renderers();
+  void restart();
 
   typedef std::map<std::string, UPNP::Renderer> renderer_map_t;
 
   renderer_map_t get_known_renderers();
+  bool renderers_streaming();
+  int64_t get_play_request_time();
+}
+
+namespace SSDP
+{
+  UPNP::Renderer parse_description(const std::string& host, const std::string& desc);
 }
 
 #endif
\ No newline at end of file
@@ -1,7 +1,9 @@
 #ifndef __UPNP_RENDERER_H__
 #define __UPNP_RENDERER_H__
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace UPNP
 {
@@ -11,7 +13,12 @@ namespace UPNP
       const std::string uuid;
       std::string name;
       std::string control_url;
+      std::string connection_manager_url;
       std::string icon_url;
+      std::string address; // IP the description was fetched from
+      std::vector<std::string> sink_protocols;
+      bool sink_protocols_requested = false; // A query is outstanding or succeeded
+      uint8_t sink_protocol_failures = 0;
       bool selected = false;
 
       Renderer() {}
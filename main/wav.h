@@ -3,8 +3,66 @@
 
 #include "stdint.h"
 
+#include "audio.h"
+
 namespace WAV
 {
+  constexpr uint16_t WAVE_FORMAT_PCM = 1;
+  constexpr uint16_t WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
+
+  /**
+    @brief  Test if a format must be described with WAVE_FORMAT_EXTENSIBLE.
+            Required for more than 16 bits or padded samples
+
+    @param  none
+    @retval bool
+  */
+  template <typename F>
+  constexpr bool is_extensible()
+  {
+    return F::container_bits > 16 || F::bits_per_sample != F::container_bits;
+  }
+
+  // fmt subchunk of a plain PCM format
+  template <typename F, bool Extensible = is_extensible<F>()>
+  struct Fmt
+  {
+    char fmt[4] = {'f', 'm', 't', ' '};
+    uint32_t subchunk_size = 16;
+    uint16_t audio_format = WAVE_FORMAT_PCM;
+    uint16_t channels = F::channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align = F::frame_size;
+    uint16_t bits_per_sample = F::container_bits;
+
+    constexpr Fmt(uint32_t sample_rate) : sample_rate(sample_rate), byte_rate(sample_rate * F::frame_size) {}
+  };
+
+  // fmt subchunk of a WAVE_FORMAT_EXTENSIBLE format
+  template <typename F>
+  struct Fmt<F, true>
+  {
+    char fmt[4] = {'f', 'm', 't', ' '};
+    uint32_t subchunk_size = 40;
+    uint16_t audio_format = WAVE_FORMAT_EXTENSIBLE;
+    uint16_t channels = F::channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align = F::frame_size;
+    uint16_t bits_per_sample = F::container_bits;
+
+    // Extension
+    uint16_t extension_size = 22;
+    uint16_t valid_bits_per_sample = F::bits_per_sample;
+    uint32_t channel_mask = (F::channels == 1) ? 0x4 : 0x3; // Front center, or front left and right
+    uint8_t sub_format[16] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71}; // KSDATAFORMAT_SUBTYPE_PCM
+
+    constexpr Fmt(uint32_t sample_rate) : sample_rate(sample_rate), byte_rate(sample_rate * F::frame_size) {}
+  };
+
+  // Header of an endless WAV stream of the format
+  template <typename F>
   struct Header
   {
     // RIFF header
@@ -12,30 +70,19 @@ namespace WAV
     uint32_t file_size = UINT32_MAX; // Max it out
     uint8_t format[4] = {'W', 'A', 'V', 'E'};
 
-    // fmt subchunk
-    char fmt[4] = {'f', 'm', 't', ' '};
-    uint32_t subchunk_size = 16; // Fixed to 16
-    uint16_t audio_format = RIFF_FORMAT_LPCM; // 1
-    uint16_t channels = 2;
-    uint32_t sample_rate;
-    uint32_t byte_rate;
-    uint16_t block_align = 4; // Assuming 16 bit PCM
-    uint16_t bits_per_sample = 16;  // Assuming 16 bit PCM
+    Fmt<F> fmt;
 
     // data subchunk
     char data[4] = {'d', 'a', 't', 'a'};
     uint32_t data_size = UINT32_MAX; // Max it out
 
-    Header(uint32_t sample_rate = 48000)
-    {
-      // Update sample rate dependent terms
-      this->sample_rate = sample_rate;
-      this->byte_rate = 4 * sample_rate;
-    }
-
-    private:
-      static constexpr int RIFF_FORMAT_LPCM = 1;
+    constexpr Header(uint32_t sample_rate = 48000) : fmt(sample_rate) {}
   };
+
+  static_assert(sizeof(Header<Audio::S16Stereo>) == 44, "PCM header must be 44 bytes.");
+  static_assert(sizeof(Header<Audio::S24Stereo>) == 68, "Extensible header must be 68 bytes.");
+  static_assert(Header<Audio::S16Stereo>().fmt.byte_rate == 192000, "16 bit stereo is 192 kB/s at 48 kHz.");
+  static_assert(Header<Audio::S24Mono>().fmt.block_align == 4, "24 bit samples are sent in 32 bit containers.");
 }
 
 #endif
\ No newline at end of file